@@ -0,0 +1,33 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include "thread_pool.h"
+
+/**
+ * Accept threads for the thread-pool engine.
+ *
+ * Each acceptor owns one listening socket, waits for it to become readable
+ * and then accepts pending connections in a batch, handing every client
+ * socket to the thread pool. With a single shared listener there is one
+ * acceptor; with one SO_REUSEPORT listener per core there is one acceptor per
+ * listener, and the kernel spreads new connections across them.
+ */
+
+/**
+ * Starts one accept thread per listening socket.
+ *
+ * @param listen_socks The listening sockets; they are made non-blocking.
+ * @param count Number of sockets (and threads).
+ * @param pool Thread pool that serves the accepted connections.
+ * @param pin_cpus Pin acceptor i to the i-th available CPU.
+ * @return 0 on success, -1 on failure.
+ */
+int acceptors_start(const int *listen_socks, int count, ThreadPool *pool, int pin_cpus);
+
+/**
+ * Stops the accept threads and waits for them to exit. The listening
+ * sockets are left open for the caller to close.
+ */
+void acceptors_stop(void);
+
+#endif // ACCEPTOR_H
@@ -1,47 +1,195 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "chunk_list.h"
+#include "http_response.h"
+
 /**
  * Represents a cached HTTP response.
+ *
+ * Entries are immutable once inserted and reference counted: the cache holds
+ * one reference while the entry is indexed and every reader returned by
+ * lookup_cache() holds another. Memory is released when the last reference
+ * is dropped, so an entry evicted mid-send stays valid for its readers.
+ * The one exception is expires_at, which a successful revalidation moves
+ * forward atomically.
  */
 typedef struct {
     char *url;           // Dynamically allocated URL key.
-    char *response;      // Dynamically allocated response data.
-    int response_length; // Length of the response data in bytes.
+    ChunkList response;  // Response data, as filled from the origin.
     double time_taken;   // Time taken (in seconds) to fetch the response.
-    int frequency;       // Frequency count for LFU caching.
+    atomic_int refcount; // References held by the cache and by readers.
+    long lifetime;       // Freshness lifetime (seconds), reused when a 304 carries none.
+    atomic_llong expires_at; // Time at which the entry becomes stale.
+    char *etag;          // ETag validator, or NULL.
+    char *last_modified; // Last-Modified validator, or NULL.
+    int keep_alive;      // The response is delimited, so the client connection can be reused after it.
+    int status;          // Status code of the stored response.
 } CacheEntry;
 
+/**
+ * A snapshot of the memory cache's occupancy.
+ */
+typedef struct {
+    size_t entries;          // Resident entries.
+    size_t bytes;            // Memory charged to them (bodies, keys and bookkeeping).
+    size_t max_bytes;        // The memory budget.
+    size_t max_object_size;  // Largest cacheable response.
+    int shards;              // Independently locked shards.
+    const char *policy;      // Name of the eviction policy.
+    int admission;           // The TinyLFU admission filter is enabled.
+} CacheStats;
+
 /**
  * Initializes the cache system.
+ *
+ * Entries are indexed by a hash table keyed on URL and ordered for eviction
+ * by the policy chosen with set_cache_policy(). The default LFU policy uses
+ * an O(1) structure (a list of frequency buckets), so lookups, hits and
+ * evictions run in constant time regardless of the number of entries.
+ * The cache is split into independently locked shards chosen by URL hash;
+ * lookups take a shard's read lock only, so concurrent hits do not block
+ * each other.
  */
 void init_cache();
 
 /**
- * Looks up a cache entry by URL.
+ * Sets the cache memory budget and the largest cacheable response.
+ * Eviction keeps the resident size (bodies, keys and bookkeeping) within
+ * max_bytes. Should be called before init_cache().
+ *
+ * @param max_bytes Total memory budget (default 64 MB); 0 restores the default.
+ * @param max_object_size Largest response that will be cached (default 4 MB);
+ *                        0 restores the default.
+ */
+void set_cache_limits(size_t max_bytes, size_t max_object_size);
+
+/**
+ * Chooses how entries are evicted once the budget is reached. Should be
+ * called before init_cache().
+ *
+ *   lfu         Least frequently used first (the default).
+ *   gdsf        Greedy-Dual-Size-Frequency weighing frequency by fetch time per
+ *               byte, to save the most origin latency.
+ *   gdsf-hits   GDSF with equal cost per entry, favouring small entries for
+ *               the highest object hit ratio.
+ *   gdsf-bytes  GDSF with cost proportional to size, for the highest byte hit
+ *               ratio (frequency with aging).
+ *
+ * @param name One of the policy names above.
+ * @return 0 on success, -1 if the name is unknown.
+ */
+int set_cache_policy(const char *name);
+
+/**
+ * Enables or disables the TinyLFU admission filter (disabled by default).
+ * Every lookup is counted in a compact frequency sketch that is halved
+ * periodically, together with the eviction policy's own counts. Once the
+ * cache is full, a response is only stored if its URL has been requested
+ * more often than the entry it would evict (weighted by cost per byte
+ * under the GDSF policies). Should be called before init_cache().
+ */
+void set_cache_admission(int enabled);
+
+/**
+ * Returns the largest response size that insert_cache() will accept.
+ * Fills that grow past this should stop buffering and just stream.
+ */
+size_t cache_max_object_size(void);
+
+/**
+ * Looks up a cache entry by URL. Stale entries are returned too, so the
+ * caller can revalidate them; check cache_entry_is_fresh() before serving.
  *
  * @param url The URL to search for.
- * @param entry Pointer to a CacheEntry structure to be filled with the cached data if found.
- *              The caller is responsible for freeing 'entry->url' and 'entry->response' if a cache hit occurs.
+ * @param entry Set to the shared cached entry if found. The caller holds a reference
+ *              and must call release_cache_entry() once done with it.
  * @return 1 if the entry is found, 0 otherwise.
  */
-int lookup_cache(const char *url, CacheEntry *entry);
+int lookup_cache(const char *url, CacheEntry **entry);
 
 /**
- * Inserts a new cache entry.
+ * Drops a reference obtained from lookup_cache().
+ *
+ * @param entry The entry to release; NULL is ignored.
+ */
+void release_cache_entry(CacheEntry *entry);
+
+/**
+ * Returns 1 if the entry can be served without revalidation, 0 if it is stale.
+ */
+int cache_entry_is_fresh(const CacheEntry *entry);
+
+/**
+ * Returns 1 if a stale entry carries a validator (ETag or Last-Modified)
+ * for a conditional request, 0 otherwise.
+ */
+int cache_entry_can_revalidate(const CacheEntry *entry);
+
+/**
+ * Marks an entry fresh again after the origin answered a conditional
+ * request with 304 Not Modified. The new lifetime comes from the 304's
+ * headers if it has one, otherwise the entry's original lifetime is reused.
+ *
+ * @param entry An entry the caller holds a reference to.
+ * @param not_modified The parsed 304 response header.
+ */
+void refresh_cache_entry(CacheEntry *entry, const HttpResponseInfo *not_modified);
+
+/**
+ * Inserts a new cache entry. The response header is parsed first: responses
+ * a shared cache may not store (uncacheable status, no-store, private, or no
+ * freshness lifetime and no validator) are skipped, and the rest are stored
+ * with an expiry computed from Cache-Control, Expires or Last-Modified.
+ *
+ * The entry takes over the chunks the response was filled into instead of
+ * copying them.
  *
  * @param url The URL to cache.
- * @param response The response data to cache.
- * @param response_length The length of the response data.
+ * @param response The response data to cache. Always left empty; chunks
+ *                 that are not stored are freed.
  * @param time_taken The time taken (in seconds) to fetch the response.
  */
-void insert_cache(const char *url, const char *response, int response_length, double time_taken);
+void insert_cache(const char *url, ChunkList *response, double time_taken);
 
 /**
- * Removes any cache entries corresponding to the given URL.
+ * Like insert_cache(), but keeps a known expiry instead of computing one from
+ * the header, for a response moved back from the disk tier.
+ *
+ * @param expires_at Time at which the response becomes stale; 0 computes it.
+ */
+void insert_cache_until(const char *url, ChunkList *response, double time_taken, time_t expires_at);
+
+/**
+ * Removes any cache entries corresponding to the given URL, including a copy
+ * in the disk tier.
  */
 void remove_cache_by_url(const char *url);
 
+/**
+ * Fills in the memory cache's current occupancy.
+ */
+void get_cache_stats(CacheStats *stats);
+
+/**
+ * Calls fn for every entry in the memory cache, with its hit frequency.
+ * Each shard is read-locked while it is visited, so fn must not call back
+ * into the cache.
+ *
+ * @param fn Called once per entry.
+ * @param arg Passed through to fn.
+ */
+void cache_for_each(void (*fn)(const CacheEntry *entry, int frequency, void *arg), void *arg);
+
+/**
+ * Returns the FNV-1a hash of a URL, as used to index the cache tiers.
+ */
+uint64_t hash_url(const char *url);
+
 /**
  * Frees all allocated cache entries and cleans up resources.
  */
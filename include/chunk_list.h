@@ -0,0 +1,125 @@
+#ifndef CHUNK_LIST_H
+#define CHUNK_LIST_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Bytes per chunk. At least RESPONSE_HEAD_MAX, so a response header that can
+// be parsed at all lies within the first chunk.
+#define CHUNK_SIZE 16384
+
+/**
+ * Response bytes stored as a list of fixed-size chunks.
+ *
+ * Appending fills the last chunk and then starts a new one, so growing a
+ * response never moves the bytes already stored: cursors into a list stay
+ * valid while it grows, and a finished list can be handed to the cache as is.
+ * Chunks are allocated from the slab allocator and reference counted, so the
+ * readers of a coalesced fetch can hold on to the chunks of the response the
+ * leader is filling instead of copying them; a chunk is freed once the last
+ * list or reader lets go of it. A zeroed list is empty.
+ */
+typedef struct Chunk {
+    struct Chunk *next;
+    atomic_int refs;      // Lists and flights holding the chunk.
+    size_t length;        // Bytes stored.
+    size_t capacity;      // Bytes allocated for data.
+    char data[];
+} Chunk;
+
+typedef struct {
+    Chunk *head;
+    Chunk *tail;
+    size_t length;        // Bytes stored in all chunks.
+} ChunkList;
+
+/**
+ * A read position within a chunk list. A cursor with no chunk is at the
+ * start of a list that was empty when the cursor was set.
+ */
+typedef struct {
+    const Chunk *chunk;
+    size_t offset;        // Offset within chunk.
+} ChunkCursor;
+
+/**
+ * Appends bytes to the list.
+ *
+ * @return 0 on success, -1 if a chunk could not be allocated (the bytes
+ *         that fitted are kept).
+ */
+int chunk_list_append(ChunkList *list, const char *data, size_t length);
+
+/**
+ * Returns free space at the end of the list for the caller to write into,
+ * allocating a new chunk if the last one is full. The bytes are added with
+ * chunk_list_commit().
+ *
+ * @param space Set to the number of bytes available.
+ * @return The free space, or NULL if a chunk could not be allocated.
+ */
+char *chunk_list_reserve(ChunkList *list, size_t *space);
+
+/**
+ * Adds 'length' bytes written into the space returned by chunk_list_reserve().
+ */
+void chunk_list_commit(ChunkList *list, size_t length);
+
+/**
+ * Moves the bytes of a partly filled last chunk to the smallest slab size
+ * class that holds them, releasing the unused space. Called once a list is
+ * complete, before it is kept for long.
+ */
+void chunk_list_seal(ChunkList *list);
+
+/**
+ * Takes another reference to a chunk.
+ */
+void chunk_ref(Chunk *chunk);
+
+/**
+ * Drops a reference to a chunk, freeing it with the last one.
+ */
+void chunk_unref(Chunk *chunk);
+
+/**
+ * Releases the first chunk of a non-empty list.
+ */
+void chunk_list_drop_head(ChunkList *list);
+
+/**
+ * Releases all chunks and leaves the list empty.
+ */
+void chunk_list_free(ChunkList *list);
+
+/**
+ * Returns the memory held by the list, including chunk bookkeeping.
+ */
+size_t chunk_list_footprint(const ChunkList *list);
+
+/**
+ * Moves the chunks of 'from' to 'to' (which must be empty), leaving 'from' empty.
+ */
+void chunk_list_move(ChunkList *to, ChunkList *from);
+
+/**
+ * Copies bytes from a cursor into a buffer and advances the cursor.
+ *
+ * @return Bytes copied; fewer than 'size' at the end of the stored bytes.
+ */
+size_t chunk_cursor_copy(ChunkCursor *cursor, const ChunkList *list, char *buffer, size_t size);
+
+/**
+ * Describes up to 'max' runs of stored bytes from a cursor, for writev().
+ *
+ * @return Number of entries filled in iov.
+ */
+int chunk_cursor_iov(const ChunkCursor *cursor, const ChunkList *list, struct iovec *iov, int max);
+
+/**
+ * Advances a cursor past 'length' stored bytes.
+ */
+void chunk_cursor_advance(ChunkCursor *cursor, const ChunkList *list, size_t length);
+
+#endif // CHUNK_LIST_H
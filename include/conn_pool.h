@@ -0,0 +1,56 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include "metrics.h"
+
+/**
+ * Pool of idle persistent connections to origin servers, keyed by (host, port).
+ *
+ * Requests are forwarded as HTTP/1.1, and once a response has been read to
+ * its framed end the connection is returned here instead of being closed, so
+ * the next request to the same origin skips the TCP handshake and slow-start.
+ * Idle connections are health-checked before reuse, dropped after an idle
+ * timeout, and capped per origin.
+ */
+
+/**
+ * Sets the pool limits. Should be called before any connection is pooled.
+ *
+ * @param max_idle_per_host Idle connections kept per origin (default 8); 0 disables pooling.
+ * @param idle_timeout Seconds an idle connection is kept (default 30); 0 restores the default.
+ */
+void set_conn_pool_limits(int max_idle_per_host, int idle_timeout);
+
+/**
+ * Takes a healthy idle connection to host:port from the pool.
+ *
+ * @return The socket, or -1 if none is available.
+ */
+int conn_pool_take(const char *host, int port);
+
+/**
+ * Returns a pooled connection to host:port if one is available, otherwise
+ * opens a new blocking connection.
+ *
+ * @param reused Set to 1 if the socket came from the pool. A reused socket
+ *               may still have been closed by the origin in the meantime, so
+ *               callers should retry once on a fresh connection if it fails
+ *               before any response bytes arrive.
+ * @param timing If not NULL, the DNS and connect phases of a new connection
+ *               are marked on it.
+ * @return The connected socket, or -1 on failure.
+ */
+int conn_pool_acquire(const char *host, int port, int *reused, RequestTiming *timing);
+
+/**
+ * Hands a connection back after a complete response. It is kept for reuse
+ * if the pool has room for its origin, and closed otherwise.
+ */
+void conn_pool_release(const char *host, int port, int sock);
+
+/**
+ * Closes all idle connections and frees the pool.
+ */
+void free_conn_pool(void);
+
+#endif // CONN_POOL_H
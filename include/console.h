@@ -5,6 +5,19 @@
 extern "C" {
 #endif
 
+// The block list is the union of the patterns in the block list file and
+// those added with block_url(). A host (or URL) is blocked if any pattern
+// occurs in it, ignoring case. The patterns are compiled into an in-memory
+// Aho-Corasick matcher, rebuilt whenever either set changes.
+
+// Loads the block list file and starts a thread that reloads it whenever it
+// changes (inotify on Linux, mtime polling elsewhere).
+// Returns 0 on success, or -1 if the watcher could not be started.
+int start_block_list_watcher(const char *path);
+
+// Stops the watcher and frees the block list.
+void stop_block_list_watcher(void);
+
 // Adds a URL to the block list.
 // Returns 0 on success or if already blocked, or a negative value on error.
 int block_url(const char *url);
@@ -13,7 +26,13 @@ int block_url(const char *url);
 // Returns 0 on success, or a negative value if the URL was not found.
 int unblock_url(const char *url);
 
-// Checks if a URL is blocked.
+// Calls fn for every pattern on the block list; from_file is 1 for patterns
+// loaded from the block list file and 0 for those added with block_url().
+// The list is locked while it is walked, so fn must not change it.
+void for_each_blocked_url(void (*fn)(const char *pattern, int from_file, void *arg), void *arg);
+
+// Checks if a URL is blocked. Safe to call from any thread; the cost does
+// not depend on the number of patterns.
 // Returns 1 if blocked, 0 if not.
 int is_url_blocked(const char *url);
 
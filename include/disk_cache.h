@@ -0,0 +1,174 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include "chunk_list.h"
+#include "http_response.h"
+
+/**
+ * Second-tier cache on disk, behind the in-memory cache.
+ *
+ * Each object is stored as its own file in the cache directory, with an
+ * in-memory index (URL -> file) ordered LRU for eviction within the disk
+ * budget. Entries evicted from memory are demoted here, and responses too
+ * large for memory are filled straight to disk. Hits are sent to the client
+ * with sendfile(), so the body never passes through userspace.
+ * Stale objects that carry a validator (ETag or Last-Modified) are kept for
+ * the caller to revalidate with a conditional request; other stale objects
+ * are dropped on lookup. The index is not persisted; the directory is
+ * emptied on startup.
+ */
+
+/**
+ * A disk cache hit. The caller owns 'fd' and must close it.
+ */
+typedef struct {
+    int fd;              // Open descriptor for the stored response.
+    size_t length;       // Length of the stored response in bytes.
+    double time_taken;   // Time taken (in seconds) to originally fetch the response.
+    int keep_alive;      // The response is delimited, so the client connection can be reused after it.
+    int status;          // Status code of the stored response.
+    time_t expires_at;   // Time at which the response becomes stale.
+    int stale;           // Past expires_at: revalidate before serving.
+    char etag[MAX_VALIDATOR_SIZE];           // ETag to revalidate with ("" if none).
+    char last_modified[MAX_VALIDATOR_SIZE];  // Last-Modified to revalidate with ("" if none).
+} DiskCacheHit;
+
+/**
+ * A snapshot of the disk tier's occupancy.
+ */
+typedef struct {
+    int enabled;
+    size_t entries;     // Stored objects.
+    size_t bytes;       // Bytes stored.
+    size_t max_bytes;   // The disk budget.
+} DiskCacheStats;
+
+// Opaque handle for a response being written straight to disk.
+typedef struct DiskCacheFill DiskCacheFill;
+
+/**
+ * Enables the disk tier.
+ *
+ * @param dir Directory to store objects in; created if missing.
+ * @param max_bytes Disk budget. Objects larger than 1/8 of it are not stored.
+ * @return 0 on success, -1 on failure (the disk tier stays disabled).
+ */
+int init_disk_cache(const char *dir, size_t max_bytes);
+
+/**
+ * Returns 1 if the disk tier is enabled, 0 otherwise.
+ */
+int disk_cache_enabled(void);
+
+/**
+ * Returns the largest object the disk tier will accept (0 if disabled).
+ */
+size_t disk_cache_max_object_size(void);
+
+/**
+ * Stores a complete response on disk, replacing any previous copy.
+ * Responses that are already stale are only stored if they carry a validator.
+ */
+void disk_cache_store(const char *url, const ChunkList *response, double time_taken, time_t expires_at);
+
+/**
+ * Looks up a response on disk and opens it for sending. A stale response is
+ * returned with hit->stale set if it has a validator, so the caller can
+ * revalidate it (see disk_cache_refresh()); otherwise it is dropped.
+ *
+ * @param url The URL to search for.
+ * @param hit Filled with an open descriptor and metadata on a hit.
+ * @return 1 on a hit, 0 on a miss.
+ */
+int disk_cache_open(const char *url, DiskCacheHit *hit);
+
+/**
+ * Marks a stored response fresh again after the origin answered a
+ * conditional request with 304 Not Modified. The new lifetime comes from the
+ * 304's headers if it has one, otherwise the response's original lifetime
+ * is reused.
+ *
+ * @param url The URL of the stored response.
+ * @param hit The hit being revalidated; its expiry is updated too.
+ * @param not_modified The parsed 304 response header.
+ */
+void disk_cache_refresh(const char *url, DiskCacheHit *hit, const HttpResponseInfo *not_modified);
+
+/**
+ * Moves a disk hit back into the in-memory cache if it fits there, keeping
+ * its expiry, and drops the disk copy. Called after the hit has been served.
+ */
+void disk_cache_promote(const char *url, const DiskCacheHit *hit);
+
+/**
+ * Sends up to 'count' bytes of a stored response to a socket, starting at *offset.
+ * Uses sendfile() where available; works with non-blocking sockets.
+ *
+ * @return Bytes sent (advancing *offset), or -1 on error with errno set.
+ */
+ssize_t disk_cache_sendfile(int sock, int fd, off_t *offset, size_t count);
+
+/**
+ * Sends a complete stored response to a blocking socket.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int disk_cache_send(int sock, const DiskCacheHit *hit);
+
+/**
+ * Removes any stored copy of the given URL.
+ */
+void disk_cache_remove(const char *url);
+
+/**
+ * Starts writing a response straight to disk, seeded with the bytes already buffered.
+ *
+ * @param data The start of the response, including its complete header.
+ * @return A fill handle, or NULL if the disk tier is disabled or the file cannot be created.
+ */
+DiskCacheFill *disk_cache_begin_fill(const char *url, const ChunkList *data);
+
+/**
+ * Appends response bytes to a disk fill.
+ *
+ * @return 0 on success, -1 if the fill failed or outgrew the object limit
+ *         (the fill is then aborted and freed).
+ */
+int disk_cache_fill_write(DiskCacheFill *fill, const char *data, size_t length);
+
+/**
+ * Publishes a completed disk fill and frees the handle.
+ *
+ * @param expires_at Time at which the response becomes stale.
+ */
+void disk_cache_commit_fill(DiskCacheFill *fill, double time_taken, time_t expires_at);
+
+/**
+ * Discards an incomplete disk fill and frees the handle.
+ */
+void disk_cache_abort_fill(DiskCacheFill *fill);
+
+/**
+ * Fills in the disk tier's current occupancy.
+ */
+void get_disk_cache_stats(DiskCacheStats *stats);
+
+/**
+ * Calls fn for every stored object, most recently used first. The index is
+ * locked while it is walked, so fn must not call back into the disk tier.
+ *
+ * @param fn Called with each object's URL, stored length, status and expiry.
+ * @param arg Passed through to fn.
+ */
+void disk_cache_for_each(void (*fn)(const char *url, size_t length, int status, time_t expires_at, void *arg),
+                         void *arg);
+
+/**
+ * Removes all stored objects and frees the disk index.
+ */
+void free_disk_cache(void);
+
+#endif // DISK_CACHE_H
@@ -0,0 +1,52 @@
+#ifndef DNS_H
+#define DNS_H
+
+#include <netinet/in.h>
+
+/**
+ * In-process DNS resolver with a TTL-respecting cache.
+ *
+ * Host names are resolved to IPv4 addresses with a small UDP stub client that
+ * queries one nameserver directly, so each answer comes with its record TTL.
+ * Answers are cached for that long, and names that do not exist are cached
+ * negatively for the SOA minimum TTL, so repeat requests to a host skip
+ * resolution entirely. Concurrent lookups of the same name share one query.
+ * /etc/hosts entries take precedence and are reloaded when the file changes.
+ * If the nameserver cannot be reached, or has no answer for a name without a
+ * dot (which may need a search domain), lookups fall back to getaddrinfo().
+ */
+
+/**
+ * Initializes the resolver.
+ *
+ * @param nameserver "address[:port]" of the nameserver to query, or NULL to
+ *                   use the first IPv4 nameserver in /etc/resolv.conf.
+ * @return 0 on success, -1 if the nameserver is invalid.
+ */
+int init_dns_resolver(const char *nameserver);
+
+/**
+ * Resolves a host name (or dotted-quad address), blocking on a cache miss.
+ *
+ * @param host The host name to resolve.
+ * @param addr Filled with the address on success.
+ * @return 0 on success, -1 if the name cannot be resolved.
+ */
+int dns_resolve(const char *host, struct in_addr *addr);
+
+/**
+ * Looks a host name up in the cache only, without blocking.
+ *
+ * @param host The host name to look up.
+ * @param addr Filled with the address on a positive hit.
+ * @return 1 on a positive hit, -1 if the name is cached as nonexistent, or 0
+ *         if it is not cached (or a lookup is still in progress).
+ */
+int dns_lookup_cached(const char *host, struct in_addr *addr);
+
+/**
+ * Frees the DNS cache.
+ */
+void free_dns_resolver(void);
+
+#endif // DNS_H
@@ -0,0 +1,37 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "thread_pool.h"
+
+/**
+ * Starts the event-driven connection engine.
+ *
+ * Each loop runs on its own thread with its own epoll instance and owns the
+ * client/origin socket pairs it accepts, driving each one as a non-blocking
+ * state machine (parse -> connect -> relay -> cache fill).
+ * Only available on Linux; elsewhere this returns -1.
+ *
+ * @param listen_socks The listening socket of each loop: either the same
+ *                     socket shared by all loops, or one SO_REUSEPORT
+ *                     socket per loop. They are made non-blocking.
+ * @param num_loops Number of event loop threads (typically one per core).
+ * @param offload Thread pool used for blocking work such as DNS lookups.
+ *                If NULL, lookups are done inline on the loop thread.
+ * @param pin_cpus Pin loop i to the i-th available CPU.
+ * @return 0 on success, -1 on failure.
+ */
+int event_loop_start(const int *listen_socks, int num_loops, ThreadPool *offload, int pin_cpus);
+
+/**
+ * Stops all event loop threads and waits for them to exit.
+ * Connections are left open until event_loop_destroy() is called, so the
+ * offload pool can be drained safely in between.
+ */
+void event_loop_stop(void);
+
+/**
+ * Closes any remaining connections and frees all event loop resources.
+ */
+void event_loop_destroy(void);
+
+#endif // EVENT_LOOP_H
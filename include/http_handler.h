@@ -1,44 +1,254 @@
 #ifndef HTTP_HANDLER_H
 #define HTTP_HANDLER_H
 
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "metrics.h"
+#include "http_parser.h"
+
 #define MAX_METHOD_SIZE 16
 #define MAX_URL_SIZE 1024
 #define MAX_HOST_SIZE 256
+#define MAX_CONTENT_TYPE_SIZE 256
+#define MAX_REQUEST_HEAD_SIZE 8192
+
+// Returned by relay_tunnel_splice() when splice() cannot be used for the sockets.
+#define TUNNEL_SPLICE_UNSUPPORTED -2
 
 typedef struct {
     char method[MAX_METHOD_SIZE];
     char url[MAX_URL_SIZE];
     char host[MAX_HOST_SIZE];
     int port;
+    int keep_alive;          // The client allows the connection to carry further requests.
+    long long body_length;   // Content-Length of the request body, or -1 if none was given.
+    int chunked_body;        // The request body uses the chunked coding.
+    char content_type[MAX_CONTENT_TYPE_SIZE];  // Content-Type of the body, or empty.
+    int authorization;       // The request carries an Authorization header.
+    int no_store;            // Cache-Control: no-store; the response must not be stored.
 } HttpRequest;
 
 /**
- * Parses the HTTP request from the given client socket and populates the HttpRequest structure.
+ * A request body being forwarded to the origin as it arrives.
+ */
+typedef struct {
+    int active;              // Body bytes are still expected from the client.
+    long long remaining;     // Content-Length bytes left, unless chunked.
+    int chunked;
+    ChunkedDecoder decoder;
+} RequestBody;
+
+/**
+ * Bytes read from a client connection that have not been consumed yet. With
+ * pipelining this can hold the start of the next request(s) after the
+ * current one. A zeroed buffer is empty and ready for use.
+ */
+typedef struct {
+    char data[MAX_REQUEST_HEAD_SIZE];
+    size_t length;
+    HttpRequestParser parser;  // Scan state of the next header; its slices point into data.
+    RequestBody body;          // Body of the last parsed request, until it is forwarded.
+    int error_status;          // Status to answer a rejected request with, or 0.
+} RequestBuffer;
+
+/**
+ * Per-tunnel relay counters, logged when a CONNECT tunnel closes.
+ */
+typedef struct {
+    unsigned long long bytes_up;    // Bytes relayed client -> server.
+    unsigned long long bytes_down;  // Bytes relayed server -> client.
+    unsigned long long syscalls;    // I/O and readiness syscalls issued by the relay.
+} TunnelStats;
+
+/**
+ * Reads the next request on a client connection. Bytes of pipelined requests
+ * that follow it are kept in 'buffer' for the next call; the request body,
+ * if any, is left for forward_request_body().
  *
  * @param client_sock The client socket file descriptor.
+ * @param buffer Unconsumed bytes carried over from the previous request.
  * @param request Pointer to an HttpRequest structure to populate.
- * @return 0 on success, -1 on failure.
+ * @param idle_timeout Seconds to wait for the request to start, or -1 to wait indefinitely.
+ * @param started_us If not NULL, set to metrics_now_us() once the first byte
+ *                   of the request is available.
+ * @return 1 on success, 0 if the client closed the connection or stayed idle
+ *         before sending a request, -1 on failure. If the request was
+ *         rejected, buffer->error_status is set to the status to answer with.
  */
-int parse_http_request(int client_sock, HttpRequest *request);
+int read_http_request(int client_sock, RequestBuffer *buffer, HttpRequest *request, int idle_timeout,
+                      uint64_t *started_us);
 
 /**
- * Handles an HTTP request (non-CONNECT).
+ * Empties a request buffer.
+ */
+void request_buffer_init(RequestBuffer *buffer);
+
+/**
+ * Parses the request header at the start of the buffer, resuming the scan
+ * where the previous call on the same buffer stopped. On success every
+ * header is available as a slice in buffer->parser until the request is
+ * consumed.
  *
- * @param client_sock The client socket file descriptor.
- * @param request Pointer to the parsed HttpRequest.
- * @return 0 on success, -1 on failure.
+ * A Content-Length that is empty or contradicts an earlier one is rejected:
+ * on a persistent connection the proxy and the origin could otherwise
+ * disagree on where the body ends. A transfer coding other than chunked is
+ * not implemented.
+ *
+ * @param buffer Bytes read so far from the client.
+ * @param request Pointer to an HttpRequest structure to populate, including
+ *                the keep-alive and body framing fields.
+ * @return Length of the header including the blank line, 0 if it is not
+ *         complete yet, -1 if it is malformed or too large (with
+ *         buffer->error_status set to 400) or uses an unsupported
+ *         transfer coding (501).
+ */
+int parse_http_request_head(RequestBuffer *buffer, HttpRequest *request);
+
+/**
+ * Returns the response that answers a rejected request, which also closes
+ * the connection.
+ *
+ * @param status The buffer's error_status.
+ * @param length Set to the length of the response.
+ */
+const char *request_error_response(int status, size_t *length);
+
+/**
+ * Removes a parsed request's header from the front of the buffer. Its body,
+ * if any, follows at the front and is taken with request_body_span().
+ */
+void consume_request(RequestBuffer *buffer, size_t head_length, const HttpRequest *request);
+
+/**
+ * Returns 1 if the request carries a body, which must be forwarded (or the
+ * connection closed) before the next request can be read.
+ */
+int request_has_body(const HttpRequest *request);
+
+/**
+ * Counts the bytes at the front of the buffer that belong to the current
+ * request body, at most 'max', and advances the body's framing past them.
+ * The caller sends them on and removes them with request_buffer_drop().
+ * Bytes after the end of the body (a pipelined request) are not counted.
+ *
+ * @return The number of body bytes, or -1 if the chunked framing is malformed.
  */
-int handle_http(int client_sock, const HttpRequest *request);
+ssize_t request_body_span(RequestBuffer *buffer, size_t max);
+
+/**
+ * Removes 'length' bytes from the front of the buffer.
+ */
+void request_buffer_drop(RequestBuffer *buffer, size_t length);
+
+/**
+ * Sends the current request body to the origin, reading from the client the
+ * part that is not buffered yet. Blocks until the whole body is sent.
+ *
+ * @return 0 on success, -1 if either side failed or the framing is malformed.
+ */
+int forward_request_body(int client_sock, RequestBuffer *buffer, int server_sock);
+
+/**
+ * Sets the limits on persistent client connections.
+ *
+ * @param idle_timeout Seconds a connection may sit idle between requests
+ *                     (default 5); 0 disables client keep-alive.
+ * @param max_requests Requests served on one connection before it is
+ *                     closed (default 100); 0 restores the default.
+ */
+void set_client_keep_alive(int idle_timeout, int max_requests);
+
+/**
+ * Returns the idle timeout of persistent client connections in seconds
+ * (0 when keep-alive is disabled).
+ */
+int client_idle_timeout(void);
+
+/**
+ * Returns 1 if a client connection may wait for another request once the
+ * response to 'request' has been sent, 0 if it should be closed.
+ *
+ * @param request The request just served.
+ * @param response_reusable 1 if the response was delimited and complete, so
+ *                          the client can tell where it ended.
+ * @param served Requests served on the connection so far, including this one.
+ */
+int client_keep_alive(const HttpRequest *request, int response_reusable, int served);
+
+/**
+ * Formats the minimal HTTP/1.1 request forwarded to the origin server.
+ * The connection is left persistent so it can be pooled for reuse. A request
+ * body is announced with its Content-Length or as chunked, together with its
+ * Content-Type; the body itself is sent after the header.
+ * When validators are given the request is made conditional
+ * (If-None-Match / If-Modified-Since) to revalidate a stale cache entry.
+ *
+ * @param buffer Output buffer for the request.
+ * @param size Size of the output buffer.
+ * @param request The parsed client request.
+ * @param etag ETag to send as If-None-Match, or NULL.
+ * @param last_modified Date to send as If-Modified-Since, or NULL.
+ * @return Length of the formatted request, or -1 if it did not fit.
+ */
+int format_origin_request(char *buffer, size_t size, const HttpRequest *request,
+                          const char *etag, const char *last_modified);
 
 /**
  * Handles an HTTPS CONNECT tunnel.
  *
  * @param client_sock The client socket file descriptor.
  * @param request Pointer to the parsed HttpRequest (should contain host and port).
+ * @param timing The request's timing: DNS and connect are marked, and the
+ *               tunnel's lifetime is its transfer phase.
  * @return 0 on success, -1 on failure.
  */
-int handle_https(int client_sock, const HttpRequest *request);
+int handle_https(int client_sock, const HttpRequest *request, RequestTiming *timing);
 
-int connect_to_server(const char *host, int port);
+/**
+ * Relays a tunnel by copying through a userspace buffer until either side closes.
+ *
+ * @param client_sock The client socket file descriptor.
+ * @param server_sock The server socket file descriptor.
+ * @param stats Counters updated as data is relayed.
+ * @return 0 on success, -1 on failure.
+ */
+int relay_tunnel_copy(int client_sock, int server_sock, TunnelStats *stats);
+
+/**
+ * Relays a tunnel with splice() through a pipe per direction, so payload bytes
+ * never enter userspace. Linux only.
+ *
+ * @param client_sock The client socket file descriptor.
+ * @param server_sock The server socket file descriptor.
+ * @param stats Counters updated as data is relayed.
+ * @return 0 on success, -1 on failure, or TUNNEL_SPLICE_UNSUPPORTED if splice()
+ *         is unavailable and nothing has been relayed yet.
+ */
+int relay_tunnel_splice(int client_sock, int server_sock, TunnelStats *stats);
+
+/**
+ * Enables or disables the splice() relay for CONNECT tunnels (enabled by default).
+ */
+void set_tunnel_splice(int enabled);
+
+/**
+ * Opens a blocking TCP connection to host:port.
+ *
+ * @param timing If not NULL, the DNS and connect phases are marked on it.
+ * @return The connected socket, or -1 on failure.
+ */
+int connect_to_server(const char *host, int port, RequestTiming *timing);
+
+/**
+ * Resolves host:port to an IPv4 socket address through the DNS cache
+ * (blocking on a miss).
+ *
+ * @param host The host name or dotted-quad address.
+ * @param port The destination port.
+ * @param addr Filled with the resolved address on success.
+ * @return 0 on success, -1 on failure.
+ */
+int resolve_host(const char *host, int port, struct sockaddr_in *addr);
 
 #endif // HTTP_HANDLER_H
@@ -0,0 +1,92 @@
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+#define MAX_REQUEST_HEADERS 100
+
+/**
+ * A run of bytes inside the receive buffer. Slices are not NUL-terminated
+ * and stay valid only while the bytes they point at are not moved.
+ */
+typedef struct {
+    const char *data;
+    size_t length;
+} HttpSlice;
+
+typedef struct {
+    HttpSlice name;
+    HttpSlice value;   // Without surrounding whitespace.
+} HttpHeader;
+
+/**
+ * Incremental parser for a request header. Each call resumes where the
+ * previous one stopped scanning, so bytes are examined once however the
+ * header is split across reads. A zeroed parser is ready for use.
+ */
+typedef struct {
+    size_t scanned;          // Bytes examined so far.
+    size_t line_start;       // Offset of the line being scanned.
+    int request_line_done;   // The request line has been parsed.
+    HttpSlice method;
+    HttpSlice target;
+    HttpSlice version;
+    HttpHeader headers[MAX_REQUEST_HEADERS];
+    int header_count;
+} HttpRequestParser;
+
+/**
+ * Resets the parser for the next request.
+ */
+void http_parser_init(HttpRequestParser *parser);
+
+/**
+ * Scans request bytes for a complete header. Every call must pass the same
+ * buffer, holding at least the bytes of the previous call.
+ *
+ * @param parser The parser state.
+ * @param data Bytes received so far (need not be NUL-terminated).
+ * @param length Number of bytes in data.
+ * @param max_length Largest header accepted, including the blank line.
+ * @return Length of the header including the blank line, 0 if it is not
+ *         complete yet, -1 if it is malformed or too large.
+ */
+int http_parser_feed(HttpRequestParser *parser, const char *data, size_t length, size_t max_length);
+
+/**
+ * Enables or disables the SSE2 line scanner (enabled by default where SSE2
+ * is available), so the plain loop can be tested and measured against it.
+ */
+void http_parser_set_vector_scan(int enabled);
+
+/**
+ * Returns the value of the first header called 'name' (ignoring case), or
+ * NULL if the request has none.
+ */
+const HttpSlice *http_parser_header(const HttpRequestParser *parser, const char *name);
+
+/**
+ * Returns 1 if the slice contains 'token' (ignoring case), 0 otherwise.
+ */
+int http_slice_contains(const HttpSlice *slice, const char *token);
+
+/**
+ * Follows a body in the chunked transfer coding, to find where it ends.
+ * A zeroed decoder is at the start of a body.
+ */
+typedef struct {
+    int state;               // Position within the chunked coding.
+    long long remaining;     // Bytes left in the current chunk.
+    int done;                // The last chunk and trailer have been seen.
+    int error;               // A chunk size was too large to represent.
+} ChunkedDecoder;
+
+/**
+ * Consumes chunked body bytes, in order.
+ *
+ * @return Number of bytes that belong to the body; fewer than 'length'
+ *         once the body has ended or a malformed chunk size was seen.
+ */
+size_t chunked_decoder_feed(ChunkedDecoder *decoder, const char *data, size_t length);
+
+#endif // HTTP_PARSER_H
@@ -0,0 +1,135 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <stddef.h>
+#include <time.h>
+#include "http_parser.h"
+
+#define MAX_VALIDATOR_SIZE 128
+#define RESPONSE_HEAD_MAX 8192
+
+/**
+ * The parts of an origin response header used for caching and framing.
+ * Times are 0 when the header is absent; an Expires value that cannot be
+ * parsed is recorded as already expired (-1).
+ */
+typedef struct {
+    int status;                    // Status code from the status line.
+    int http_minor;                // 1 for HTTP/1.1, 0 for HTTP/1.0.
+    size_t header_length;          // Bytes up to and including the blank line.
+    long long content_length;      // Content-Length, or -1.
+    int chunked;                   // Transfer-Encoding: chunked.
+    int connection_close;          // Connection: close (or HTTP/1.0 without keep-alive).
+    time_t date;                   // Date header.
+    time_t expires;                // Expires header.
+    time_t last_modified_time;     // Last-Modified header, parsed.
+    long age;                      // Age header in seconds (0 if absent).
+    long max_age;                  // Cache-Control max-age, or -1.
+    long s_maxage;                 // Cache-Control s-maxage, or -1.
+    int no_store;                  // Cache-Control no-store.
+    int no_cache;                  // Cache-Control no-cache: store, but always revalidate.
+    int is_private;                // Cache-Control private: not for a shared cache.
+    int is_public;                 // Cache-Control public.
+    int must_revalidate;           // Cache-Control must-revalidate.
+    int vary_any;                  // Vary: * can never be matched.
+    char etag[MAX_VALIDATOR_SIZE];           // ETag value, verbatim ("" if absent).
+    char last_modified[MAX_VALIDATOR_SIZE];  // Last-Modified value, verbatim ("" if absent).
+} HttpResponseInfo;
+
+/**
+ * Parses the status line and headers at the start of a response.
+ *
+ * @param data Response bytes read so far (need not be NUL-terminated).
+ * @param length Number of bytes in data.
+ * @param info Filled with the parsed header fields.
+ * @return 1 if a complete header was parsed, 0 if more data is needed, -1 if malformed.
+ */
+int parse_http_response_head(const char *data, size_t length, HttpResponseInfo *info);
+
+/**
+ * Returns 1 if a shared cache may store the response, 0 otherwise.
+ * Requires a cacheable status, no no-store/private/Vary: *, and either a
+ * freshness lifetime or a validator to revalidate with.
+ */
+int response_is_storable(const HttpResponseInfo *info);
+
+/**
+ * Returns 1 if a shared cache may store the response to a request that
+ * carried Authorization: it must say public, s-maxage or must-revalidate
+ * (RFC 9111 section 3.5).
+ */
+int response_allows_authorized_storing(const HttpResponseInfo *info);
+
+/**
+ * Returns 1 if the response has an explicit freshness lifetime
+ * (s-maxage, max-age or Expires), 0 otherwise.
+ */
+int response_has_explicit_lifetime(const HttpResponseInfo *info);
+
+/**
+ * Computes how long the response stays fresh, in seconds, from s-maxage,
+ * max-age or Expires, falling back to 10% of the time since Last-Modified
+ * (capped at a day). no-cache always yields 0.
+ */
+long response_freshness_lifetime(const HttpResponseInfo *info);
+
+/**
+ * Computes the time at which a response received at 'now' becomes stale,
+ * accounting for the age it already had when it arrived.
+ */
+time_t response_expiry(const HttpResponseInfo *info, time_t now);
+
+/**
+ * Returns 1 if a complete response with this header leaves the connection
+ * open for another request: its end is marked by Content-Length or chunked
+ * coding (or it has no body), and it does not ask for the connection to close.
+ */
+int response_is_persistent(const HttpResponseInfo *info);
+
+typedef enum {
+    FRAMING_NONE,      // No body (HEAD, 1xx, 204, 304).
+    FRAMING_LENGTH,    // Body of Content-Length bytes.
+    FRAMING_CHUNKED,   // Chunked transfer coding.
+    FRAMING_CLOSE      // Body runs until the origin closes the connection.
+} ResponseFraming;
+
+/**
+ * Follows an origin response as it streams through the proxy, to find where
+ * it ends on a persistent connection. The bytes themselves are not modified.
+ */
+typedef struct {
+    int head_request;              // The request was HEAD: no body follows.
+    char head[RESPONSE_HEAD_MAX];  // Header bytes buffered until complete.
+    size_t head_length;
+    int head_done;
+    HttpResponseInfo info;         // Valid once head_done is set.
+    ResponseFraming framing;
+    long long remaining;           // Bytes left in a Content-Length body.
+    ChunkedDecoder chunked;        // Position within a chunked body.
+    int done;                      // The complete response has been seen.
+    int overrun;                   // Bytes arrived past the end of the response.
+    unsigned long long total;      // Response bytes seen so far.
+} ResponseTracker;
+
+/**
+ * Prepares a tracker for the response to one request.
+ *
+ * @param head_request 1 if the request method was HEAD.
+ */
+void response_tracker_init(ResponseTracker *tracker, int head_request);
+
+/**
+ * Feeds response bytes read from the origin, in order.
+ *
+ * @return 1 once the complete response has been seen, 0 if more is expected.
+ */
+int response_tracker_feed(ResponseTracker *tracker, const char *data, size_t length);
+
+/**
+ * Returns 1 if the origin connection can carry another request once the
+ * response is complete: the message was delimited by length or chunking,
+ * nothing arrived past its end, and the origin did not ask to close.
+ */
+int response_tracker_reusable(const ResponseTracker *tracker);
+
+#endif // HTTP_RESPONSE_H
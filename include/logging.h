@@ -9,7 +9,18 @@ typedef enum {
 } LogLevel;
 
 /**
- * Initializes the logging system.
+ * Log messages are formatted on the calling thread and copied into that
+ * thread's own lock-free ring buffer. A background writer thread drains the
+ * rings in timestamp order, adds the timestamp and level, and writes the
+ * lines in batches, so request threads never take a lock or do I/O to log.
+ * If a thread's ring is full its messages are dropped and counted.
+ */
+
+// The minimum log level to output. Set by init_logging().
+extern LogLevel g_log_level;
+
+/**
+ * Initializes the logging system and starts the writer thread.
  *
  * @param log_file The file path to write logs to. If NULL, logs are printed to stdout.
  * @param level The minimum log level to output.
@@ -17,17 +28,55 @@ typedef enum {
 void init_logging(const char *log_file, LogLevel level);
 
 /**
- * Closes the logging system and frees any resources.
+ * Opens the access log, which gets one JSON object per line for every
+ * finished request. Records go through the same per-thread rings and writer
+ * thread as log messages; the writer adds the "time" field.
+ *
+ * @param access_file The file path to append access records to.
+ * @return 0 on success, -1 if the file cannot be opened.
+ */
+int init_access_log(const char *access_file);
+
+/**
+ * Enables or disables echoing log messages to stdout (enabled by default).
+ *
+ * @param enabled 0 to write to the log file only.
+ */
+void set_log_echo(int enabled);
+
+/**
+ * Writes out all queued messages, stops the writer thread and closes the log file.
  */
 void close_logging();
 
 /**
- * Writes a log message with the given log level.
+ * Queues a log message with the given log level. Use log_message() instead.
  *
  * @param level The log level for the message.
  * @param format printf-style format string.
  * @param ... Arguments for the format string.
  */
-void log_message(LogLevel level, const char *format, ...);
+void log_write(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Queues an access log record. Does nothing unless the access log is open.
+ *
+ * @param format printf-style format producing the record's JSON members
+ *               after "time", without the braces, e.g. "\"status\":%d".
+ * @param ... Arguments for the format string.
+ */
+void access_log_write(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * Writes a log message with the given log level. Messages below the
+ * configured level are skipped without evaluating or formatting the arguments.
+ *
+ * @param level The log level for the message.
+ * @param ... printf-style format string and its arguments.
+ */
+#define log_message(level, ...) \
+    do { \
+        if ((level) >= g_log_level) log_write((level), __VA_ARGS__); \
+    } while (0)
 
 #endif
@@ -1,10 +1,36 @@
 #ifndef MANAGEMENT_CONSOLE_H
 #define MANAGEMENT_CONSOLE_H
 
-/* Starts the admin console thread that polls for commands from a file. */
-void start_admin_console_thread(void);
+/**
+ * Control socket for administrative commands.
+ *
+ * The proxy listens on a Unix-domain stream socket. A client sends one or
+ * more commands, one per line, and gets one line of JSON back per command,
+ * in order, as soon as it is applied; the connection stays open for more.
+ * Every response has "ok" set, and "error" when it is false.
+ *
+ *   block PATTERN    Adds a pattern to the block list and purges matching cache entries.
+ *                    Console patterns are runtime-only: they are not written
+ *                    to block_list.txt and are lost when the proxy exits.
+ *   unblock PATTERN  Removes a pattern added with block.
+ *   list             The block list: {"blocked":[{"pattern":...,"source":"file"|"console"}]}.
+ *   purge URL        Removes a URL from both cache tiers.
+ *   stats            Cache occupancy: {"memory":{...},"disk":{...},"blocked_patterns":N}.
+ *   dump [PREFIX]    Every cached entry whose URL starts with PREFIX, in both tiers.
+ *   quit             Shuts the proxy down.
+ */
 
-/* Stops the admin console thread. */
+/**
+ * Starts the thread serving the control socket.
+ *
+ * @param socket_path Path to create the socket at; an existing socket file is replaced.
+ * @return 0 on success, -1 on failure.
+ */
+int start_admin_console_thread(const char *socket_path);
+
+/**
+ * Stops the control socket thread and removes the socket file.
+ */
 void stop_admin_console_thread(void);
 
-#endif // ADMIN_CONSOLE_H
+#endif // MANAGEMENT_CONSOLE_H
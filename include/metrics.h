@@ -0,0 +1,138 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "thread_pool.h"
+
+/**
+ * Performance counters and request latency histograms.
+ *
+ * Every thread updates its own shard of counters, so recording a metric is a
+ * couple of uncontended memory operations and never takes a lock; shards are
+ * only summed when the metrics are scraped. Latencies go into HDR-style
+ * histograms (four sub-buckets per power of two of microseconds, so any
+ * recorded value is within 25% of its bucket bound), kept separately for
+ * cache hits, misses and CONNECT tunnels, and for each phase of a request
+ * (see RequestTiming). The metrics are served in the Prometheus text format
+ * on a local admin port.
+ */
+
+typedef enum {
+    METRIC_REQUESTS,           // Requests read from clients.
+    METRIC_CACHE_HITS_MEMORY,  // GETs served from the memory cache.
+    METRIC_CACHE_HITS_DISK,    // GETs served from the disk tier.
+    METRIC_CACHE_REVALIDATED,  // Stale entries confirmed by a 304 and served.
+    METRIC_CACHE_MISSES,       // GETs that had to go to the origin.
+    METRIC_CACHE_EVICTIONS,    // Entries evicted from the memory cache.
+    METRIC_CACHE_REJECTED,     // Responses the admission filter kept out of the memory cache.
+    METRIC_COALESCED,          // Misses served by joining another request's fetch.
+    METRIC_BLOCKED,            // Requests refused by the block list.
+    METRIC_SHED_QUEUE_FULL,    // Connections refused with a 503 because the queue was full.
+    METRIC_SHED_QUEUE_WAIT,    // Connections refused with a 503 after waiting past the deadline.
+    METRIC_SHED_RATE_LIMIT,    // Connections refused with a 503 by the per-client rate limit.
+    METRIC_BYTES_RECEIVED,     // Bytes read from origin servers.
+    METRIC_BYTES_SENT,         // Response bytes written to clients.
+    METRIC_ACTIVE_TUNNELS,     // Gauge: open CONNECT tunnels.
+    METRIC_COUNT
+} MetricId;
+
+typedef enum {
+    REQUEST_HIT,      // Served from the cache (including revalidated entries).
+    REQUEST_MISS,     // Fetched from the origin, directly or through a shared fetch.
+    REQUEST_CONNECT,  // CONNECT tunnel established (time to the 200 response).
+    REQUEST_KIND_COUNT
+} RequestKind;
+
+typedef enum {
+    PHASE_QUEUE,     // Waiting in the thread pool queue for a worker.
+    PHASE_PARSE,     // Reading and parsing the request head.
+    PHASE_BLOCK,     // Block list check.
+    PHASE_CACHE,     // Memory and disk cache lookup.
+    PHASE_DNS,       // Resolving the origin host.
+    PHASE_CONNECT,   // TCP connect to the origin.
+    PHASE_TTFB,      // Request sent until the first response byte arrived.
+    PHASE_TRANSFER,  // First response byte until the response was sent.
+    PHASE_COUNT
+} RequestPhase;
+
+/**
+ * Monotonic-clock breakdown of one request into phases. Each call to
+ * request_timing_mark() charges the time since the previous mark to a phase,
+ * so phases a request skips (a cache hit never connects) stay at zero and a
+ * retried phase accumulates.
+ */
+typedef struct {
+    uint64_t started_us;             // When the request started (queued, or its first byte read).
+    uint64_t mark_us;                // End of the last phase marked.
+    uint64_t phase_us[PHASE_COUNT];  // Time spent in each phase.
+    unsigned int phases_seen;        // Bit per phase that has been marked.
+    const char *result;              // How it was served, e.g. "hit" or "miss", for the access log.
+    int status;                      // Status code sent to the client, or 0 if none.
+    unsigned long long bytes;        // Response bytes sent to the client.
+    int complete;                    // The response was sent in full.
+} RequestTiming;
+
+/**
+ * Adds to a counter, or to a gauge (delta may be negative).
+ *
+ * @param id The metric to update.
+ * @param delta The amount to add.
+ */
+void metrics_add(MetricId id, int64_t delta);
+
+/**
+ * Returns the current time in microseconds, for timing a request.
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * Records the latency of a finished request.
+ *
+ * @param kind How the request was served.
+ * @param started_us metrics_now_us() when the request started.
+ */
+void metrics_record_request(RequestKind kind, uint64_t started_us);
+
+/**
+ * Starts timing a request.
+ *
+ * @param timing The timing to reset.
+ * @param started_us metrics_now_us() when the request started.
+ */
+void request_timing_start(RequestTiming *timing, uint64_t started_us);
+
+/**
+ * Ends the current phase: the time since the previous mark is charged to it.
+ *
+ * @param timing The request's timing.
+ * @param phase The phase that just finished.
+ */
+void request_timing_mark(RequestTiming *timing, RequestPhase phase);
+
+/**
+ * Feeds a finished request's phases into the phase histograms and writes its
+ * access log record.
+ *
+ * @param timing The request's timing.
+ * @param client Client address as "ip:port".
+ * @param method The request method.
+ * @param url The request URL.
+ */
+void request_timing_finish(const RequestTiming *timing, const char *client, const char *method,
+                           const char *url);
+
+/**
+ * Starts serving the metrics in Prometheus text format on 127.0.0.1:port.
+ *
+ * @param port The admin port to listen on.
+ * @param pool Thread pool whose queue depth is reported, or NULL.
+ * @return 0 on success, -1 on failure.
+ */
+int start_metrics_server(int port, ThreadPool *pool);
+
+/**
+ * Stops the metrics server and frees all counters.
+ */
+void stop_metrics_server(void);
+
+#endif // METRICS_H
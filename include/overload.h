@@ -0,0 +1,68 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <stdint.h>
+
+/**
+ * Overload protection: shedding connections the proxy cannot serve in time.
+ *
+ * Under a traffic spike it is cheaper to refuse work up front than to let it
+ * queue past any client's timeout. A connection is refused with a small
+ * `503 Service Unavailable` carrying `Retry-After` when the thread pool
+ * queue is full, when it waited in the queue longer than the queue-wait
+ * deadline, or when its client IP has run out of tokens in its token
+ * bucket. Buckets live in a fixed-size table, so a flood of distinct
+ * addresses cannot grow memory; an address that loses its slot to another
+ * starts over with a full bucket.
+ */
+
+#define DEFAULT_RETRY_AFTER 1  // Seconds suggested to clients refused for a full or slow queue.
+
+/**
+ * Sets how long a connection may wait in the thread pool queue before it is
+ * refused instead of served.
+ *
+ * @param wait_ms Deadline in milliseconds; 0 disables it.
+ */
+void set_queue_wait_limit(int wait_ms);
+
+/**
+ * Returns 1 if a connection queued at 'enqueued_us' (metrics_now_us()) has
+ * waited past the queue-wait deadline, 0 otherwise.
+ */
+int queue_wait_exceeded(uint64_t enqueued_us);
+
+/**
+ * Limits how fast each client IP may open connections.
+ *
+ * @param rate Connections per second refilled into each bucket; 0 disables the limit.
+ * @param burst Bucket size: connections allowed back-to-back (at least 1).
+ */
+void set_client_rate_limit(double rate, int burst);
+
+/**
+ * Takes a token from the bucket of a client address.
+ *
+ * @param addr IPv4 address in network byte order.
+ * @return 0 if the connection may proceed, otherwise the seconds until the
+ *         bucket holds a token again (for Retry-After).
+ */
+int client_rate_check(uint32_t addr);
+
+/**
+ * As client_rate_check(), at time 'now' on the metrics_now_us() clock
+ * instead of the current time, so the buckets can be driven by a fixed clock.
+ */
+int client_rate_check_at(uint32_t addr, uint64_t now);
+
+/**
+ * Refuses a connection: sends a 503 with Retry-After without blocking and
+ * closes the socket, draining what the client already sent so the response
+ * is not lost to a reset.
+ *
+ * @param sock The client socket; it is closed.
+ * @param retry_after Seconds for the Retry-After header.
+ */
+void shed_connection(int sock, int retry_after);
+
+#endif // OVERLOAD_H
@@ -6,16 +6,22 @@ extern volatile sig_atomic_t shutdown_requested;
 /**
  * Creates a server socket listening on the specified port.
  * @param port The port number to listen on.
+ * @param backlog Length of the queue of pending connections.
+ * @param reuse_port Set SO_REUSEPORT, so that several sockets can listen on
+ *                   the same port and the kernel spreads connections over them.
  * @return The server socket file descriptor, or -1 on error.
  */
-int create_server_socket(int port);
+int create_server_socket(int port, int backlog, int reuse_port);
 
 /**
- * Accepts an incoming client connection on the server socket.
- * @param server_sock The server socket file descriptor.
- * @return The client socket file descriptor, or -1 on error.
+ * Caps how many threaded workers may wait on idle keep-alive connections at
+ * once. A worker that would exceed it closes its connection after the
+ * response instead, so idle clients cannot hold every worker.
+ *
+ * @param limit Workers allowed to wait; 0 closes every connection once the
+ *              requests already received on it are served.
  */
-int accept_client(int server_sock);
+void set_idle_worker_limit(int limit);
 
 /**
  * Spawns a new thread to handle the client connection.
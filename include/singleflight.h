@@ -0,0 +1,82 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include "chunk_list.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+// Returned by flight_read() when no new bytes are available yet (non-blocking readers only).
+#define FLIGHT_AGAIN -2
+
+/**
+ * Request coalescing for concurrent cache misses.
+ *
+ * The first request to miss on a URL becomes the leader of a flight and
+ * fetches from the origin; requests for the same URL that arrive while the
+ * fetch is in progress attach to it as readers and receive the response
+ * bytes as they stream in, instead of opening their own origin connection.
+ * The leader reads the response into a chunk list (the one it fills the
+ * cache from) and publishes it; the flight takes references to those chunks
+ * rather than copying them. The start of the response is held up to the cache
+ * object limit so that readers can still attach mid-fetch; past that, chunks
+ * every reader has consumed are released and no new readers are accepted.
+ */
+typedef struct Flight Flight;
+typedef struct FlightReader FlightReader;
+
+/**
+ * Attaches to the in-progress fetch of a URL, or starts a new one.
+ *
+ * @param url The URL being fetched.
+ * @param reader Set to a reader if the caller attached to an existing fetch,
+ *               or NULL if the caller is the leader.
+ * @return The flight, or NULL if coalescing is not possible (the caller then
+ *         fetches on its own without leading a flight).
+ */
+Flight *flight_join(const char *url, FlightReader **reader);
+
+/**
+ * Publishes to all readers the bytes the leader has appended to 'list' since
+ * the previous call. The list must be the same one each time; the leader may
+ * release its chunks once published, except the last, which the next bytes
+ * are appended to.
+ */
+void flight_publish(Flight *flight, const ChunkList *list);
+
+/**
+ * Ends the leader's fetch and drops its reference. New requests for the URL
+ * start a fresh flight (or hit the cache) from here on.
+ *
+ * @param success 1 if the whole response was read, 0 if the fetch failed.
+ */
+void flight_finish(Flight *flight, int success);
+
+/**
+ * Registers a callback run whenever new bytes arrive or the fetch ends, for
+ * readers that poll with flight_read(..., 0) instead of blocking. The callback
+ * runs on the leader's thread after the flight is unlocked, once per distinct
+ * (notify, arg) pair, and may still run shortly after the reader has left, so
+ * 'arg' must outlive the reader.
+ */
+void flight_set_notify(FlightReader *reader, void (*notify)(void *arg), void *arg);
+
+/**
+ * Copies the next response bytes for a reader.
+ *
+ * @param wait 1 to block until bytes arrive, 0 to return FLIGHT_AGAIN instead.
+ * @return Bytes copied, 0 once the complete response has been read, -1 if the
+ *         fetch failed or the reader fell too far behind, or FLIGHT_AGAIN.
+ */
+ssize_t flight_read(FlightReader *reader, char *buffer, size_t size, int wait);
+
+/**
+ * Returns the number of bytes a reader has received so far.
+ */
+size_t flight_reader_offset(const FlightReader *reader);
+
+/**
+ * Detaches a reader and frees it.
+ */
+void flight_leave(FlightReader *reader);
+
+#endif // SINGLEFLIGHT_H
@@ -0,0 +1,58 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+#define SLAB_SIZE (256 * 1024)        // Bytes per slab; slabs are aligned to this.
+#define SLAB_MAX_OBJECT (16384 + 64)  // Largest size class: a full body chunk with its header.
+#define SLAB_CLASS_COUNT 17           // Number of size classes.
+
+/**
+ * Size-class slab allocator for long-lived cache memory.
+ *
+ * Requests are rounded up to one of a fixed set of size classes, and each
+ * class carves its objects out of aligned slabs of SLAB_SIZE bytes. Freed
+ * objects go back to their own slab, so memory churned by cache insertions
+ * and evictions is reused for objects of the same size instead of
+ * fragmenting the heap. A slab whose objects have all been freed is returned
+ * to the system, except for one spare per class.
+ */
+
+/**
+ * Occupancy of one size class.
+ */
+typedef struct {
+    size_t object_size;   // Bytes per object in this class.
+    size_t slabs;         // Slabs held, including the spare.
+    size_t objects;       // Object slots in those slabs.
+    size_t in_use;        // Objects allocated.
+} SlabStats;
+
+/**
+ * Allocates an object from the smallest size class that holds 'size' bytes.
+ *
+ * @return The object (not zeroed), or NULL if size exceeds SLAB_MAX_OBJECT
+ *         or memory is exhausted.
+ */
+void *slab_alloc(size_t size);
+
+/**
+ * Returns an object obtained from slab_alloc(). NULL is ignored.
+ */
+void slab_free(void *object);
+
+/**
+ * Returns the size of the class slab_alloc() would use for 'size' bytes,
+ * which is the memory the object really occupies.
+ */
+size_t slab_object_size(size_t size);
+
+/**
+ * Fills 'stats' with the occupancy of each size class, smallest first.
+ *
+ * @param max Number of entries 'stats' can hold.
+ * @return Number of entries filled in.
+ */
+int get_slab_stats(SlabStats *stats, int max);
+
+#endif // SLAB_H
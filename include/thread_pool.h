@@ -1,6 +1,16 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <stddef.h>
+
+/**
+ * Fixed-size pool of worker threads fed by a bounded lock-free queue.
+ * Tasks occupy preallocated queue slots, so enqueueing never allocates or
+ * takes a lock; idle workers park on a futex until work arrives.
+ */
+
+#define DEFAULT_TASK_QUEUE_SIZE 4096  // Client sockets that may wait for a worker.
+
 // Opaque structure representing the thread pool.
 typedef struct thread_pool ThreadPool;
 
@@ -8,24 +18,57 @@ typedef struct thread_pool ThreadPool;
  * Initializes a thread pool with a specified number of threads.
  *
  * @param num_threads The number of worker threads in the pool.
+ * @param queue_size Client sockets that may wait in the queue at once
+ *                   (0 for DEFAULT_TASK_QUEUE_SIZE).
  * @return A pointer to the newly created ThreadPool, or NULL on failure.
  */
-ThreadPool *thread_pool_init(int num_threads);
+ThreadPool *thread_pool_init(int num_threads, int queue_size);
 
 /**
  * Enqueues a client socket to be processed by the thread pool.
  *
  * @param pool Pointer to the thread pool.
  * @param client_sock The client socket file descriptor.
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -1 if queue_size sockets are already waiting (the
+ *         caller keeps the socket).
  */
 int thread_pool_enqueue(ThreadPool *pool, int client_sock);
 
+/**
+ * Submits a generic job to be run by one of the worker threads.
+ * Used to offload blocking work (such as DNS resolution) from the event loops.
+ *
+ * @param pool Pointer to the thread pool.
+ * @param fn The function to run on a worker thread.
+ * @param arg Argument passed to fn.
+ * @return 0 on success, -1 if the queue is full.
+ */
+int thread_pool_submit(ThreadPool *pool, void (*fn)(void *arg), void *arg);
+
+/**
+ * Returns the number of tasks waiting in the queue (approximate while the
+ * pool is busy).
+ *
+ * @param pool Pointer to the thread pool.
+ * @return The queue depth.
+ */
+size_t thread_pool_queue_depth(ThreadPool *pool);
+
 /**
  * Destroys the thread pool and frees all allocated resources.
+ * Tasks still queued are run before the workers exit.
  *
  * @param pool Pointer to the thread pool.
  */
 void thread_pool_destroy(ThreadPool *pool);
 
+/**
+ * Pins the calling thread to one CPU. Threads are spread round-robin over the
+ * CPUs the process is allowed to run on. Only supported on Linux.
+ *
+ * @param index Index of the thread, e.g. of an event loop; wraps around.
+ * @return The CPU the thread was pinned to, or -1 on failure.
+ */
+int pin_thread_to_cpu(int index);
+
 #endif // THREAD_POOL_H
@@ -1,17 +1,30 @@
+import json
+import os
+import socket
+
 from flask import Flask, request, render_template_string
 
 app = Flask(__name__)
 
-# Global block list stored in Python
-BLOCK_LIST = []
+# Control socket of the proxy (its -U option).
+CONTROL_SOCKET = os.environ.get("PROXY_CONTROL_SOCKET", "proxy.sock")
 
-# File name to store blocked URLs (must match what the C code reads)
-BLOCK_LIST_FILE = "block_list.txt"
+def send_commands(*commands):
+    """Sends the commands in one batch and returns one response per command."""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.settimeout(5)
+        sock.connect(CONTROL_SOCKET)
+        sock.sendall("".join(command + "\n" for command in commands).encode())
+        data = b""
+        while data.count(b"\n") < len(commands):
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+    return [json.loads(line) for line in data.decode().splitlines()]
 
-def save_block_list():
-    with open(BLOCK_LIST_FILE, "w") as f:
-        for url in BLOCK_LIST:
-            f.write(url + "\n")
+def send_command(command):
+    return send_commands(command)[0]
 
 # HTML template for the management console.
 HTML_TEMPLATE = """
@@ -37,50 +50,78 @@ HTML_TEMPLATE = """
           <input type="submit" value="Unblock">
         </form>
       </li>
+      <li>
+        <form action="{{ url_for('purge') }}" method="post">
+          Purge URL: <input type="text" name="url">
+          <input type="submit" value="Purge">
+        </form>
+      </li>
     </ul>
+    {% if stats %}
+      <h2>Cache</h2>
+      <p>Memory: {{ stats.memory.entries }} entries, {{ stats.memory.bytes }} of {{ stats.memory.max_bytes }} bytes</p>
+      {% if stats.disk.enabled %}
+        <p>Disk: {{ stats.disk.entries }} entries, {{ stats.disk.bytes }} of {{ stats.disk.max_bytes }} bytes</p>
+      {% endif %}
+    {% endif %}
     {% if block_list %}
       <h2>Blocked URLs</h2>
       <ul>
-        {% for url in block_list %}
-          <li>{{ url }}</li>
+        {% for item in block_list %}
+          <li>{{ item.pattern }} ({{ item.source }})</li>
         {% endfor %}
       </ul>
     {% endif %}
+    {% if entries %}
+      <h2>Cached URLs</h2>
+      <table>
+        <tr><th>Tier</th><th>URL</th><th>Bytes</th><th>Status</th><th>Expires in</th></tr>
+        {% for entry in entries %}
+          <tr>
+            <td>{{ entry.tier }}</td><td>{{ entry.url }}</td><td>{{ entry.bytes }}</td>
+            <td>{{ entry.status }}</td><td>{{ entry.expires_in }}s</td>
+          </tr>
+        {% endfor %}
+      </table>
+    {% endif %}
   </body>
 </html>
 """
 
+def render(message=""):
+    try:
+        listing, stats, dump = send_commands("list", "stats", "dump")
+    except (OSError, ValueError) as e:
+        return render_template_string(HTML_TEMPLATE, message=message or f"Proxy unreachable: {e}",
+                                      block_list=[], stats=None, entries=[])
+    return render_template_string(HTML_TEMPLATE, message=message, block_list=listing["blocked"],
+                                  stats=stats, entries=dump["entries"])
+
+def run_url_command(command, done):
+    url = request.form.get("url", "").strip()
+    if not url:
+        return render("No URL provided.")
+    try:
+        response = send_command(f"{command} {url}")
+    except (OSError, ValueError) as e:
+        return render(f"Proxy unreachable: {e}")
+    return render(f"{done}: {url}" if response["ok"] else f"{url}: {response['error']}")
+
 @app.route("/")
 def index():
-    return render_template_string(HTML_TEMPLATE, message="", block_list=BLOCK_LIST)
+    return render()
 
 @app.route("/block", methods=["POST"])
 def block():
-    url = request.form.get("url", "").strip()
-    if url:
-        if url not in BLOCK_LIST:
-            BLOCK_LIST.append(url)
-            message = f"Blocked URL: {url}"
-        else:
-            message = f"URL already blocked: {url}"
-        save_block_list()
-    else:
-        message = "No URL provided."
-    return render_template_string(HTML_TEMPLATE, message=message, block_list=BLOCK_LIST)
+    return run_url_command("block", "Blocked URL")
 
 @app.route("/unblock", methods=["POST"])
 def unblock():
-    url = request.form.get("url", "").strip()
-    if url:
-        if url in BLOCK_LIST:
-            BLOCK_LIST.remove(url)
-            message = f"Unblocked URL: {url}"
-        else:
-            message = f"URL not in block list: {url}"
-        save_block_list()
-    else:
-        message = "No URL provided."
-    return render_template_string(HTML_TEMPLATE, message=message, block_list=BLOCK_LIST)
+    return run_url_command("unblock", "Unblocked URL")
+
+@app.route("/purge", methods=["POST"])
+def purge():
+    return run_url_command("purge", "Purged URL")
 
 if __name__ == "__main__":
     # Run the management console on port 3000.
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE  // For accept4()
+#include "acceptor.h"
+#include "logging.h"
+#include "metrics.h"
+#include "overload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define ACCEPT_BATCH 64  // Connections accepted per wakeup before polling again.
+
+typedef struct {
+    pthread_t thread;
+    int listen_fd;
+    int index;
+    int started;
+} Acceptor;
+
+static Acceptor *acceptors = NULL;
+static int acceptor_count = 0;
+static ThreadPool *accept_pool = NULL;
+static int pin_acceptors = 0;
+static volatile int acceptors_running = 0;
+static int wake_pipe[2] = { -1, -1 };  // Written once to stop every acceptor.
+
+// Accepts one connection as a blocking, close-on-exec socket.
+static int accept_one(int listen_fd, struct sockaddr_in *addr, socklen_t *addr_len) {
+#ifdef __linux__
+    return accept4(listen_fd, (struct sockaddr *)addr, addr_len, SOCK_CLOEXEC);
+#else
+    // Elsewhere accepted sockets may inherit O_NONBLOCK from the listener.
+    int sock = accept(listen_fd, (struct sockaddr *)addr, addr_len);
+    if (sock >= 0) {
+        int flags = fcntl(sock, F_GETFL, 0);
+        if (flags >= 0) fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+        fcntl(sock, F_SETFD, FD_CLOEXEC);
+    }
+    return sock;
+#endif
+}
+
+// Accepts up to ACCEPT_BATCH pending connections and queues them.
+static void accept_batch(int listen_fd) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_sock = accept_one(listen_fd, &client_addr, &addr_len);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_message(LOG_LEVEL_ERROR, "Failed to accept client connection");
+            }
+            return;
+        }
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        log_message(LOG_LEVEL_INFO, "Accepted connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
+        int retry_after = client_rate_check(client_addr.sin_addr.s_addr);
+        if (retry_after > 0) {
+            log_message(LOG_LEVEL_WARN, "Rate limit exceeded by %s, refusing connection", client_ip);
+            metrics_add(METRIC_SHED_RATE_LIMIT, 1);
+            shed_connection(client_sock, retry_after);
+        } else if (thread_pool_enqueue(accept_pool, client_sock) < 0) {
+            // Queue full: shed the connection rather than block the acceptor.
+            log_message(LOG_LEVEL_WARN, "Thread pool queue is full, refusing connection from %s", client_ip);
+            metrics_add(METRIC_SHED_QUEUE_FULL, 1);
+            shed_connection(client_sock, DEFAULT_RETRY_AFTER);
+        }
+    }
+}
+
+static void *acceptor_thread(void *arg) {
+    Acceptor *acceptor = (Acceptor *)arg;
+    if (pin_acceptors) {
+        int cpu = pin_thread_to_cpu(acceptor->index);
+        if (cpu < 0) log_message(LOG_LEVEL_WARN, "Failed to pin acceptor %d to a CPU", acceptor->index);
+        else log_message(LOG_LEVEL_DEBUG, "Acceptor %d pinned to CPU %d", acceptor->index, cpu);
+    }
+    while (acceptors_running) {
+        struct pollfd pfds[2] = {
+            { .fd = acceptor->listen_fd, .events = POLLIN },
+            { .fd = wake_pipe[0], .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "poll failed in acceptor %d", acceptor->index);
+            break;
+        }
+        if (pfds[1].revents) break;
+        if (pfds[0].revents & POLLIN) accept_batch(acceptor->listen_fd);
+    }
+    return NULL;
+}
+
+int acceptors_start(const int *listen_socks, int count, ThreadPool *pool, int pin_cpus) {
+    if (count < 1 || pool == NULL) return -1;
+    for (int i = 0; i < count; i++) {
+        int flags = fcntl(listen_socks[i], F_GETFL, 0);
+        if (flags < 0 || fcntl(listen_socks[i], F_SETFL, flags | O_NONBLOCK) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to make server socket non-blocking");
+            return -1;
+        }
+    }
+    acceptors = (Acceptor *)calloc(count, sizeof(Acceptor));
+    if (!acceptors) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for acceptors");
+        return -1;
+    }
+    if (pipe(wake_pipe) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to create acceptor wakeup pipe");
+        free(acceptors);
+        acceptors = NULL;
+        return -1;
+    }
+    acceptor_count = count;
+    accept_pool = pool;
+    pin_acceptors = pin_cpus;
+    acceptors_running = 1;
+
+    for (int i = 0; i < count; i++) {
+        acceptors[i].listen_fd = listen_socks[i];
+        acceptors[i].index = i;
+        if (pthread_create(&acceptors[i].thread, NULL, acceptor_thread, &acceptors[i]) != 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to create acceptor thread %d", i);
+            acceptors_stop();
+            return -1;
+        }
+        acceptors[i].started = 1;
+    }
+    log_message(LOG_LEVEL_INFO, "Started %d acceptor(s)", count);
+    return 0;
+}
+
+void acceptors_stop(void) {
+    if (!acceptors) return;
+    acceptors_running = 0;
+    if (write(wake_pipe[1], "x", 1) < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to wake acceptors");
+    }
+    for (int i = 0; i < acceptor_count; i++) {
+        if (acceptors[i].started) pthread_join(acceptors[i].thread, NULL);
+    }
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    wake_pipe[0] = wake_pipe[1] = -1;
+    free(acceptors);
+    acceptors = NULL;
+    acceptor_count = 0;
+}
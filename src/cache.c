@@ -1,123 +1,843 @@
 #include "cache.h"
 #include "logging.h"
 #include "console.h"  // To use is_url_blocked()
+#include "disk_cache.h"
+#include "metrics.h"
+#include "slab.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 
-#define MAX_CACHE_ENTRIES 100
+#define DEFAULT_CACHE_MAX_BYTES (64UL * 1024 * 1024)
+#define DEFAULT_CACHE_MAX_OBJECT_SIZE (4UL * 1024 * 1024)
+#define INITIAL_HASH_BUCKETS 64
+#define MAX_CACHE_SHARDS 16  // Must be a power of two.
+#define SKETCH_DEPTH 4
+#define SKETCH_BYTES_PER_COLUMN 512   // One sketch column per 512 bytes of shard budget...
+#define SKETCH_MIN_WIDTH 256
+#define SKETCH_MAX_WIDTH 65536        // ...up to 16 bits of the hash per row.
+#define SKETCH_COUNTER_MAX 15
+#define SKETCH_SAMPLE_FACTOR 10       // Counters are halved after 10 accesses per resident entry...
+#define SKETCH_MIN_SAMPLE 32          // ...counting at least this many entries.
 
-// Global array to hold cache entries and a count of entries.
-static CacheEntry *cache_entries[MAX_CACHE_ENTRIES];
-static int cache_count = 0;
-static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+typedef struct FreqBucket FreqBucket;
+typedef struct EvictionPolicy EvictionPolicy;
+
+// Index record for a stored entry. It is indexed by URL in its shard's hash
+// table and ordered by the eviction policy: linked into the LFU bucket
+// matching its frequency, or placed in the GDSF priority heap. The node holds
+// the mutable bookkeeping; the shared CacheEntry itself is never modified.
+typedef struct CacheNode {
+    CacheEntry *entry;
+    size_t charge;                // Bytes counted against the shard budget.
+    int frequency;                // Hits so far, including the insert.
+    atomic_int pending_hits;      // Hits recorded under the read lock, not yet applied.
+    uint64_t hash;
+    struct CacheNode *hash_next;  // Next node in the same hash chain.
+    FreqBucket *bucket;           // LFU: bucket for frequency.
+    struct CacheNode *prev;       // LFU: neighbours within the frequency bucket.
+    struct CacheNode *next;
+    double priority;              // GDSF: the node's H value.
+    size_t heap_index;            // GDSF: position in the shard's heap.
+} CacheNode;
+
+// All entries sharing one frequency, most recently used at the head. Buckets
+// are kept in ascending frequency order, so the LFU victim is always the tail
+// of the first bucket.
+struct FreqBucket {
+    int frequency;
+    CacheNode *head;
+    CacheNode *tail;
+    FreqBucket *prev;
+    FreqBucket *next;
+};
+
+// An independently locked slice of the cache. Lookups only take the read
+// lock, so hits on the same shard do not block each other; they record the
+// hit in the node, and it is applied to the LFU order lazily, when the node
+// comes up for eviction.
+typedef struct {
+    pthread_rwlock_t lock;
+    CacheNode **hash_table;
+    size_t hash_size;             // Number of hash chains (always a power of two).
+    int count;
+    size_t bytes;                 // Memory charged to resident entries.
+    size_t max_bytes;             // This shard's share of the cache budget.
+    FreqBucket *lfu_head;         // LFU: lowest-frequency bucket.
+    CacheNode **heap;             // GDSF: min-heap on priority.
+    size_t heap_size;
+    size_t heap_capacity;
+    double inflation;             // GDSF: L, the priority of the last victim.
+    atomic_uchar *sketch;         // TinyLFU: SKETCH_DEPTH rows of sketch_width access counters.
+    size_t sketch_width;          // Always a power of two.
+    atomic_uint sketch_additions; // Accesses counted since the counters were last halved.
+} CacheShard;
+
+// How a shard orders its entries for eviction. Every hook runs under the
+// shard's write lock.
+struct EvictionPolicy {
+    const char *name;
+    int (*add)(CacheShard *shard, CacheNode *node);          // A new node, with frequency 1.
+    void (*remove)(CacheShard *shard, CacheNode *node);
+    void (*update)(CacheShard *shard, CacheNode *node, int hits);  // Hits, or a new charge if 0.
+    CacheNode *(*victim)(CacheShard *shard);                 // Next node to evict, or NULL.
+    void (*evicted)(CacheShard *shard, CacheNode *victim);   // The victim is about to be removed.
+    void (*age)(CacheShard *shard);                          // Halve every node's frequency.
+    double (*cost)(const CacheNode *node);                   // GDSF: cost of fetching the entry again.
+};
+
+// An entry evicted under a shard lock, waiting to be written to the disk tier
+// once the lock is dropped.
+typedef struct Demotion {
+    CacheEntry *entry;
+    struct Demotion *next;
+} Demotion;
+
+static CacheShard shards[MAX_CACHE_SHARDS];
+static int shard_count = 0;
+static size_t cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+static size_t cache_max_object = DEFAULT_CACHE_MAX_OBJECT_SIZE;
+static const EvictionPolicy *policy;  // The active policy, one of eviction_policies below.
+static int admission_enabled = 0;
+
+// FNV-1a hash of the URL.
+uint64_t hash_url(const char *url) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *p = (const unsigned char *)url; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// The high bits pick the shard; the low bits pick the chain within it.
+static CacheShard *shard_for(uint64_t hash) {
+    return &shards[(hash >> 32) & (uint64_t)(shard_count - 1)];
+}
+
+static CacheNode *find_node(CacheShard *shard, const char *url, uint64_t hash) {
+    if (!shard->hash_table) return NULL;
+    CacheNode *node = shard->hash_table[hash & (shard->hash_size - 1)];
+    while (node) {
+        if (node->hash == hash && strcmp(node->entry->url, url) == 0) {
+            return node;
+        }
+        node = node->hash_next;
+    }
+    return NULL;
+}
+
+// Doubles the hash table once the load factor passes 1, keeping chains short.
+static void grow_hash_table(CacheShard *shard) {
+    size_t new_size = shard->hash_size ? shard->hash_size * 2 : INITIAL_HASH_BUCKETS;
+    CacheNode **new_table = (CacheNode **)calloc(new_size, sizeof(CacheNode *));
+    if (!new_table) {
+        log_message(LOG_LEVEL_WARN, "Failed to grow cache hash table to %zu buckets", new_size);
+        return;
+    }
+    for (size_t i = 0; i < shard->hash_size; i++) {
+        CacheNode *node = shard->hash_table[i];
+        while (node) {
+            CacheNode *next = node->hash_next;
+            size_t index = node->hash & (new_size - 1);
+            node->hash_next = new_table[index];
+            new_table[index] = node;
+            node = next;
+        }
+    }
+    free(shard->hash_table);
+    shard->hash_table = new_table;
+    shard->hash_size = new_size;
+}
+
+static void hash_insert(CacheShard *shard, CacheNode *node) {
+    if ((size_t)shard->count >= shard->hash_size) {
+        grow_hash_table(shard);
+    }
+    size_t index = node->hash & (shard->hash_size - 1);
+    node->hash_next = shard->hash_table[index];
+    shard->hash_table[index] = node;
+}
+
+static void hash_remove(CacheShard *shard, CacheNode *node) {
+    CacheNode **link = &shard->hash_table[node->hash & (shard->hash_size - 1)];
+    while (*link) {
+        if (*link == node) {
+            *link = node->hash_next;
+            return;
+        }
+        link = &(*link)->hash_next;
+    }
+}
+
+// Creates an empty bucket for 'frequency' right after 'after' (or at the front if NULL).
+static FreqBucket *bucket_create(CacheShard *shard, int frequency, FreqBucket *after) {
+    FreqBucket *bucket = (FreqBucket *)slab_alloc(sizeof(FreqBucket));
+    if (!bucket) return NULL;
+    memset(bucket, 0, sizeof(*bucket));
+    bucket->frequency = frequency;
+    bucket->prev = after;
+    bucket->next = after ? after->next : shard->lfu_head;
+    if (bucket->next) bucket->next->prev = bucket;
+    if (after) after->next = bucket;
+    else shard->lfu_head = bucket;
+    return bucket;
+}
+
+static void bucket_push(FreqBucket *bucket, CacheNode *node) {
+    node->bucket = bucket;
+    node->prev = NULL;
+    node->next = bucket->head;
+    if (bucket->head) bucket->head->prev = node;
+    bucket->head = node;
+    if (!bucket->tail) bucket->tail = node;
+}
+
+// Unlinks a node from its bucket, releasing the bucket if it becomes empty.
+static void bucket_unlink(CacheShard *shard, CacheNode *node) {
+    FreqBucket *bucket = node->bucket;
+    if (node->prev) node->prev->next = node->next;
+    else bucket->head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else bucket->tail = node->prev;
+    node->prev = node->next = NULL;
+    node->bucket = NULL;
+
+    if (!bucket->head) {
+        if (bucket->prev) bucket->prev->next = bucket->next;
+        else shard->lfu_head = bucket->next;
+        if (bucket->next) bucket->next->prev = bucket->prev;
+        slab_free(bucket);
+    }
+}
+
+// Moves a node forward by 'hits' frequency steps. The walk only passes
+// buckets whose frequency lies between the old and new count, so its cost
+// is bounded by the number of hits being applied.
+static void lfu_promote(CacheShard *shard, CacheNode *node, int hits) {
+    int frequency = node->frequency + hits;
+    FreqBucket *after = node->bucket;
+    while (after->next && after->next->frequency <= frequency) {
+        after = after->next;
+    }
+    FreqBucket *target = after;
+    if (target->frequency != frequency) {
+        target = bucket_create(shard, frequency, after);
+        if (!target) {
+            return;  // Keep the old position; only ordering precision is lost.
+        }
+    }
+    node->frequency = frequency;
+    bucket_unlink(shard, node);
+    bucket_push(target, node);
+}
+
+// Links a freshly inserted node (frequency 1) into the LFU structure.
+static int lfu_add(CacheShard *shard, CacheNode *node) {
+    FreqBucket *bucket = shard->lfu_head;
+    if (!bucket || bucket->frequency != 1) {
+        bucket = bucket_create(shard, 1, NULL);
+        if (!bucket) return -1;
+    }
+    bucket_push(bucket, node);
+    return 0;
+}
+
+static void lfu_remove(CacheShard *shard, CacheNode *node) {
+    bucket_unlink(shard, node);
+}
+
+static void lfu_update(CacheShard *shard, CacheNode *node, int hits) {
+    if (hits > 0) lfu_promote(shard, node, hits);
+}
+
+// The least frequently used node is the tail of the first bucket.
+static CacheNode *lfu_victim(CacheShard *shard) {
+    return shard->lfu_head ? shard->lfu_head->tail : NULL;
+}
+
+// Halves every frequency, rounding up. Buckets that end up with the same
+// frequency are merged, the formerly more frequent nodes on the MRU side.
+static void lfu_age(CacheShard *shard) {
+    for (FreqBucket *bucket = shard->lfu_head; bucket;) {
+        FreqBucket *next = bucket->next;
+        int frequency = bucket->frequency - bucket->frequency / 2;
+        FreqBucket *target = (bucket->prev && bucket->prev->frequency == frequency) ? bucket->prev : bucket;
+        for (CacheNode *node = bucket->head; node; node = node->next) {
+            node->frequency = frequency;
+            node->bucket = target;
+        }
+        bucket->frequency = frequency;
+        if (target != bucket) {
+            bucket->tail->next = target->head;
+            target->head->prev = bucket->tail;
+            target->head = bucket->head;
+            target->next = next;
+            if (next) next->prev = target;
+            slab_free(bucket);
+        }
+        bucket = next;
+    }
+}
+
+// Greedy-Dual-Size-Frequency: H = L + frequency * cost / size. The node with
+// the lowest H is evicted and its H becomes the shard's L, so entries that
+// stop being hit age out as L catches up with them.
+static double gdsf_priority(const CacheShard *shard, const CacheNode *node) {
+    return shard->inflation + node->frequency * policy->cost(node) / (double)node->charge;
+}
+
+static void heap_place(CacheShard *shard, CacheNode *node, size_t index) {
+    shard->heap[index] = node;
+    node->heap_index = index;
+}
+
+static void heap_sift_up(CacheShard *shard, CacheNode *node) {
+    size_t index = node->heap_index;
+    while (index > 0) {
+        CacheNode *parent = shard->heap[(index - 1) / 2];
+        if (parent->priority <= node->priority) break;
+        heap_place(shard, parent, index);
+        index = (index - 1) / 2;
+    }
+    heap_place(shard, node, index);
+}
+
+static void heap_sift_down(CacheShard *shard, CacheNode *node) {
+    size_t index = node->heap_index;
+    for (;;) {
+        size_t child = index * 2 + 1;
+        if (child >= shard->heap_size) break;
+        if (child + 1 < shard->heap_size && shard->heap[child + 1]->priority < shard->heap[child]->priority) {
+            child++;
+        }
+        if (shard->heap[child]->priority >= node->priority) break;
+        heap_place(shard, shard->heap[child], index);
+        index = child;
+    }
+    heap_place(shard, node, index);
+}
+
+static int gdsf_add(CacheShard *shard, CacheNode *node) {
+    if (shard->heap_size == shard->heap_capacity) {
+        size_t capacity = shard->heap_capacity ? shard->heap_capacity * 2 : INITIAL_HASH_BUCKETS;
+        CacheNode **heap = (CacheNode **)realloc(shard->heap, capacity * sizeof(CacheNode *));
+        if (!heap) return -1;
+        shard->heap = heap;
+        shard->heap_capacity = capacity;
+    }
+    node->priority = gdsf_priority(shard, node);
+    node->heap_index = shard->heap_size++;
+    heap_sift_up(shard, node);
+    return 0;
+}
+
+static void gdsf_remove(CacheShard *shard, CacheNode *node) {
+    CacheNode *last = shard->heap[--shard->heap_size];
+    if (last == node) return;
+    last->heap_index = node->heap_index;
+    shard->heap[last->heap_index] = last;
+    heap_sift_up(shard, last);
+    heap_sift_down(shard, last);
+}
+
+static void gdsf_update(CacheShard *shard, CacheNode *node, int hits) {
+    node->frequency += hits;
+    node->priority = gdsf_priority(shard, node);
+    heap_sift_up(shard, node);
+    heap_sift_down(shard, node);
+}
+
+static CacheNode *gdsf_victim(CacheShard *shard) {
+    return shard->heap_size ? shard->heap[0] : NULL;
+}
+
+static void gdsf_evicted(CacheShard *shard, CacheNode *victim) {
+    shard->inflation = victim->priority;
+}
+
+// Halves every frequency, rounding up, and rebuilds the heap.
+static void gdsf_age(CacheShard *shard) {
+    for (size_t i = 0; i < shard->heap_size; i++) {
+        CacheNode *node = shard->heap[i];
+        node->frequency -= node->frequency / 2;
+        node->priority = gdsf_priority(shard, node);
+    }
+    for (size_t i = shard->heap_size / 2; i-- > 0;) {
+        heap_sift_down(shard, shard->heap[i]);
+    }
+}
+
+// Fetch time saved by a hit; instant fetches still count for a millisecond.
+static double cost_latency(const CacheNode *node) {
+    return node->entry->time_taken > 0.001 ? node->entry->time_taken : 0.001;
+}
+
+// Every hit is worth the same, favouring many small entries (object hit ratio).
+static double cost_hits(const CacheNode *node) {
+    (void)node;
+    return 1.0;
+}
+
+// A hit is worth its size, so H reduces to L + frequency (byte hit ratio).
+static double cost_bytes(const CacheNode *node) {
+    return (double)node->charge;
+}
+
+static const EvictionPolicy eviction_policies[] = {
+    { "lfu", lfu_add, lfu_remove, lfu_update, lfu_victim, NULL, lfu_age, NULL },
+    { "gdsf", gdsf_add, gdsf_remove, gdsf_update, gdsf_victim, gdsf_evicted, gdsf_age, cost_latency },
+    { "gdsf-hits", gdsf_add, gdsf_remove, gdsf_update, gdsf_victim, gdsf_evicted, gdsf_age, cost_hits },
+    { "gdsf-bytes", gdsf_add, gdsf_remove, gdsf_update, gdsf_victim, gdsf_evicted, gdsf_age, cost_bytes },
+};
+// Chosen with set_cache_policy(); LFU by default.
+static const EvictionPolicy *policy = &eviction_policies[0];
+
+// TinyLFU admission: a count-min sketch of recent accesses per shard. Each
+// row is indexed by a different 16 bits of the mixed URL hash, and a URL's
+// estimate is its smallest counter. Counters are updated with relaxed atomics
+// under the read lock, so concurrent increments may occasionally be lost.
+static atomic_uchar *sketch_counter(const CacheShard *shard, uint64_t mixed, int row) {
+    return &shard->sketch[row * shard->sketch_width + ((mixed >> (row * 16)) & (shard->sketch_width - 1))];
+}
+
+static uint64_t sketch_mix(uint64_t hash) {
+    return hash * 0x9E3779B97F4A7C15ULL;
+}
+
+static void sketch_record(CacheShard *shard, uint64_t hash) {
+    if (!shard->sketch) return;
+    uint64_t mixed = sketch_mix(hash);
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        atomic_uchar *counter = sketch_counter(shard, mixed, row);
+        unsigned char value = atomic_load_explicit(counter, memory_order_relaxed);
+        if (value < SKETCH_COUNTER_MAX) atomic_store_explicit(counter, value + 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&shard->sketch_additions, 1, memory_order_relaxed);
+}
+
+static int sketch_estimate(const CacheShard *shard, uint64_t hash) {
+    uint64_t mixed = sketch_mix(hash);
+    int estimate = SKETCH_COUNTER_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int value = atomic_load_explicit(sketch_counter(shard, mixed, row), memory_order_relaxed);
+        if (value < estimate) estimate = value;
+    }
+    return estimate;
+}
+
+// How much keeping a node is worth: its estimated frequency, weighted like
+// the GDSF priority by the policy's cost per byte.
+static double admission_value(const CacheShard *shard, const CacheNode *node) {
+    double estimate = sketch_estimate(shard, node->hash);
+    return policy->cost ? estimate * policy->cost(node) / (double)node->charge : estimate;
+}
+
+// Once enough accesses have been counted, halves the sketch and the policy's
+// frequencies, so popularity that is not renewed fades away. Must hold the
+// write lock.
+static void age_shard(CacheShard *shard) {
+    unsigned int additions = atomic_load_explicit(&shard->sketch_additions, memory_order_relaxed);
+    int entries = shard->count > SKETCH_MIN_SAMPLE ? shard->count : SKETCH_MIN_SAMPLE;
+    if (!shard->sketch || additions < (unsigned int)(SKETCH_SAMPLE_FACTOR * entries)) return;
+    for (size_t i = 0; i < SKETCH_DEPTH * shard->sketch_width; i++) {
+        unsigned char value = atomic_load_explicit(&shard->sketch[i], memory_order_relaxed);
+        atomic_store_explicit(&shard->sketch[i], value >> 1, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&shard->sketch_additions, additions / 2, memory_order_relaxed);
+    policy->age(shard);
+    log_message(LOG_LEVEL_DEBUG, "Aged cache access frequencies after %u accesses", additions);
+}
+
+// Bytes needed for an entry with its URL and validators (NULL if absent) stored after it.
+static size_t entry_size(const char *url, const char *etag, const char *last_modified) {
+    size_t size = sizeof(CacheEntry) + strlen(url) + 1;
+    if (etag) size += strlen(etag) + 1;
+    if (last_modified) size += strlen(last_modified) + 1;
+    return size;
+}
+
+// Copies a string into the entry's allocation and moves past it.
+static char *pack_string(char **space, const char *text) {
+    size_t size = strlen(text) + 1;
+    char *copy = (char *)memcpy(*space, text, size);
+    *space += size;
+    return copy;
+}
+
+// An expires_at of 0 computes the expiry from the header.
+static CacheEntry *entry_create(const char *url, double time_taken, const HttpResponseInfo *info,
+                                time_t expires_at) {
+    // The entry, its URL and its validators share one slab object.
+    const char *etag = info->etag[0] ? info->etag : NULL;
+    const char *last_modified = info->last_modified[0] ? info->last_modified : NULL;
+    CacheEntry *entry = (CacheEntry *)slab_alloc(entry_size(url, etag, last_modified));
+    if (!entry) return NULL;
+    memset(entry, 0, sizeof(*entry));
+    char *space = (char *)(entry + 1);
+    entry->url = pack_string(&space, url);
+    if (etag) entry->etag = pack_string(&space, etag);
+    if (last_modified) entry->last_modified = pack_string(&space, last_modified);
+    entry->time_taken = time_taken;
+    entry->lifetime = response_freshness_lifetime(info);
+    entry->keep_alive = response_is_persistent(info);
+    entry->status = info->status;
+    if (!expires_at) expires_at = response_expiry(info, time(NULL));
+    atomic_init(&entry->expires_at, (long long)expires_at);
+    atomic_init(&entry->refcount, 1);  // The cache's own reference.
+    return entry;
+}
+
+void release_cache_entry(CacheEntry *entry) {
+    if (!entry) return;
+    if (atomic_fetch_sub_explicit(&entry->refcount, 1, memory_order_acq_rel) == 1) {
+        chunk_list_free(&entry->response);
+        slab_free(entry);
+    }
+}
+
+int cache_entry_is_fresh(const CacheEntry *entry) {
+    return time(NULL) < atomic_load_explicit(&entry->expires_at, memory_order_relaxed);
+}
+
+int cache_entry_can_revalidate(const CacheEntry *entry) {
+    return entry->etag != NULL || entry->last_modified != NULL;
+}
+
+void refresh_cache_entry(CacheEntry *entry, const HttpResponseInfo *not_modified) {
+    time_t now = time(NULL);
+    time_t expires_at = response_has_explicit_lifetime(not_modified)
+                            ? response_expiry(not_modified, now)
+                            : now + entry->lifetime;
+    atomic_store_explicit(&entry->expires_at, (long long)expires_at, memory_order_relaxed);
+    log_message(LOG_LEVEL_INFO, "Revalidated cache entry for URL: %s (fresh for %lld seconds)",
+                entry->url, (long long)(expires_at - now));
+}
+
+static void node_free(CacheNode *node) {
+    release_cache_entry(node->entry);
+    slab_free(node);
+}
+
+// Resident memory of an entry: the slab objects of its body chunks, the
+// entry with its key and validators, and its node.
+static size_t entry_charge(const CacheEntry *entry) {
+    return chunk_list_footprint(&entry->response) +
+           slab_object_size(entry_size(entry->url, entry->etag, entry->last_modified)) +
+           slab_object_size(sizeof(CacheNode));
+}
+
+static void remove_node(CacheShard *shard, CacheNode *node) {
+    hash_remove(shard, node);
+    policy->remove(shard, node);
+    shard->count--;
+    shard->bytes -= node->charge;
+    node_free(node);
+}
+
+// Evicts the policy's victims until 'needed' more bytes fit in the shard
+// budget. Hits recorded by readers are folded in first, so a candidate that
+// was read since the last write moves up instead of being evicted.
+// When the disk tier is enabled, victims are queued on 'demoted' (holding a
+// reference) so demote_entries() can write them out after the unlock.
+// Must hold the write lock.
+static void evict_entries(CacheShard *shard, size_t needed, Demotion **demoted) {
+    CacheNode *victim;
+    while (shard->bytes + needed > shard->max_bytes && (victim = policy->victim(shard))) {
+        int pending = atomic_exchange_explicit(&victim->pending_hits, 0, memory_order_relaxed);
+        if (pending > 0) {
+            policy->update(shard, victim, pending);
+            continue;
+        }
+        log_message(LOG_LEVEL_INFO, "Cache full. Removing %s victim for URL: %s (frequency %d, %zu bytes)",
+                    policy->name, victim->entry->url, victim->frequency, victim->charge);
+        if (policy->evicted) policy->evicted(shard, victim);
+        if (disk_cache_enabled() && (size_t)victim->entry->response.length <= disk_cache_max_object_size()) {
+            Demotion *demotion = (Demotion *)malloc(sizeof(Demotion));
+            if (demotion) {
+                atomic_fetch_add_explicit(&victim->entry->refcount, 1, memory_order_relaxed);
+                demotion->entry = victim->entry;
+                demotion->next = *demoted;
+                *demoted = demotion;
+            }
+        }
+        remove_node(shard, victim);
+        metrics_add(METRIC_CACHE_EVICTIONS, 1);
+    }
+}
+
+// Writes evicted entries to the disk tier. Called without any shard lock held.
+static void demote_entries(Demotion *demoted) {
+    while (demoted) {
+        Demotion *next = demoted->next;
+        CacheEntry *entry = demoted->entry;
+        disk_cache_store(entry->url, &entry->response, entry->time_taken,
+                         (time_t)atomic_load_explicit(&entry->expires_at, memory_order_relaxed));
+        release_cache_entry(entry);
+        free(demoted);
+        demoted = next;
+    }
+}
 
 void init_cache() {
-    pthread_mutex_lock(&cache_mutex);
-    cache_count = 0;
-    for (int i = 0; i < MAX_CACHE_ENTRIES; i++) {
-        cache_entries[i] = NULL;
-    }
-    pthread_mutex_unlock(&cache_mutex);
-    log_message(LOG_LEVEL_INFO, "Cache initialized");
-}
-
-int lookup_cache(const char *url, CacheEntry *entry) {
-    pthread_mutex_lock(&cache_mutex);
-    for (int i = 0; i < cache_count; i++) {
-        if (strcmp(cache_entries[i]->url, url) == 0) {
-            // Increment frequency on cache hit.
-            cache_entries[i]->frequency++;
-            // Copy data into provided entry.
-            entry->url = strdup(cache_entries[i]->url);
-            entry->response = (char *)malloc(cache_entries[i]->response_length);
-            memcpy(entry->response, cache_entries[i]->response, cache_entries[i]->response_length);
-            entry->response_length = cache_entries[i]->response_length;
-            entry->time_taken = cache_entries[i]->time_taken;
-            entry->frequency = cache_entries[i]->frequency;
-            pthread_mutex_unlock(&cache_mutex);
-            log_message(LOG_LEVEL_DEBUG, "Cache hit for URL: %s (frequency now %d)", url, entry->frequency);
-            return 1;
+    if (cache_max_object > cache_max_bytes) {
+        cache_max_object = cache_max_bytes;
+    }
+    // Use up to MAX_CACHE_SHARDS shards, as long as every shard's share of the
+    // budget can still hold the largest cacheable object.
+    shard_count = 1;
+    while (shard_count * 2 <= MAX_CACHE_SHARDS && cache_max_bytes / (shard_count * 2) >= cache_max_object) {
+        shard_count *= 2;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        CacheShard *shard = &shards[i];
+        memset(shard, 0, sizeof(*shard));
+        pthread_rwlock_init(&shard->lock, NULL);
+        shard->max_bytes = cache_max_bytes / shard_count;
+        grow_hash_table(shard);
+        if (admission_enabled) {
+            size_t width = SKETCH_MIN_WIDTH;
+            while (width < SKETCH_MAX_WIDTH && width * SKETCH_BYTES_PER_COLUMN < shard->max_bytes) width *= 2;
+            shard->sketch = (atomic_uchar *)calloc(SKETCH_DEPTH * width, sizeof(atomic_uchar));
+            shard->sketch_width = shard->sketch ? width : 0;
+            if (!shard->sketch) log_message(LOG_LEVEL_WARN, "Failed to allocate cache admission sketch");
         }
     }
-    pthread_mutex_unlock(&cache_mutex);
+    log_message(LOG_LEVEL_INFO, "Cache initialized (%zu byte budget in %d shards, max object %zu bytes, %s eviction%s)",
+                cache_max_bytes, shard_count, cache_max_object, policy->name,
+                admission_enabled ? ", TinyLFU admission" : "");
+}
+
+void set_cache_limits(size_t max_bytes, size_t max_object_size) {
+    cache_max_bytes = max_bytes > 0 ? max_bytes : DEFAULT_CACHE_MAX_BYTES;
+    cache_max_object = max_object_size > 0 ? max_object_size : DEFAULT_CACHE_MAX_OBJECT_SIZE;
+}
+
+int set_cache_policy(const char *name) {
+    for (size_t i = 0; i < sizeof(eviction_policies) / sizeof(eviction_policies[0]); i++) {
+        if (strcmp(eviction_policies[i].name, name) == 0) {
+            policy = &eviction_policies[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void set_cache_admission(int enabled) {
+    admission_enabled = enabled;
+}
+
+size_t cache_max_object_size(void) {
+    return cache_max_object;
+}
+
+int lookup_cache(const char *url, CacheEntry **entry) {
+    uint64_t hash = hash_url(url);
+    CacheShard *shard = shard_for(hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    // Misses count too: a URL asked for repeatedly earns its admission.
+    sketch_record(shard, hash);
+    CacheNode *node = find_node(shard, url, hash);
+    if (node) {
+        // Record the hit; it reaches the LFU order when the node comes up for eviction.
+        int frequency = node->frequency + 1 +
+                        atomic_fetch_add_explicit(&node->pending_hits, 1, memory_order_relaxed);
+        // Hand out a reference instead of copying the body.
+        atomic_fetch_add_explicit(&node->entry->refcount, 1, memory_order_relaxed);
+        *entry = node->entry;
+        pthread_rwlock_unlock(&shard->lock);
+        log_message(LOG_LEVEL_DEBUG, "Cache hit for URL: %s (frequency now %d)", url, frequency);
+        return 1;
+    }
+    pthread_rwlock_unlock(&shard->lock);
     log_message(LOG_LEVEL_DEBUG, "Cache miss for URL: %s", url);
     return 0;
 }
 
-void insert_cache(const char *url, const char *response, int response_length, double time_taken) {
+void insert_cache(const char *url, ChunkList *response, double time_taken) {
+    insert_cache_until(url, response, time_taken, 0);
+}
+
+void insert_cache_until(const char *url, ChunkList *response, double time_taken, time_t expires_at) {
     // Check if the URL is blocked. If so, do not cache it.
     if (is_url_blocked(url)) {
         log_message(LOG_LEVEL_INFO, "Not caching blocked URL: %s", url);
+        chunk_list_free(response);
         return;
     }
-    
-    pthread_mutex_lock(&cache_mutex);
-    // If the cache is full, remove the LFU entry.
-    if (cache_count >= MAX_CACHE_ENTRIES) {
-        int lfu_index = 0;
-        for (int i = 1; i < cache_count; i++) {
-            if (cache_entries[i]->frequency < cache_entries[lfu_index]->frequency) {
-                lfu_index = i;
-            }
+
+    if (response->length > cache_max_object) {
+        log_message(LOG_LEVEL_DEBUG, "Not caching %s: %zu bytes exceeds the %zu byte object limit",
+                    url, response->length, cache_max_object);
+        chunk_list_free(response);
+        return;
+    }
+
+    // Only store what a shared cache is allowed to. A parseable header always
+    // lies within the first chunk.
+    HttpResponseInfo info;
+    if (!response->head ||
+        parse_http_response_head(response->head->data, response->head->length, &info) != 1 ||
+        !response_is_storable(&info)) {
+        log_message(LOG_LEVEL_DEBUG, "Not caching %s: response is not storable (status %d)",
+                    url, response->head ? info.status : 0);
+        chunk_list_free(response);
+        return;
+    }
+
+    // Build the immutable entry outside the lock, around the filled chunks.
+    CacheEntry *entry = entry_create(url, time_taken, &info, expires_at);
+    if (!entry) {
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed for cache entry: %s", url);
+        chunk_list_free(response);
+        return;
+    }
+    chunk_list_seal(response);
+    chunk_list_move(&entry->response, response);
+    uint64_t hash = hash_url(url);
+    CacheShard *shard = shard_for(hash);
+    Demotion *demoted = NULL;
+
+    pthread_rwlock_wrlock(&shard->lock);
+    age_shard(shard);
+    CacheNode *existing = find_node(shard, url, hash);
+    size_t charge = entry_charge(entry);
+    if (existing) {
+        // Swap in the new response but keep its frequency. Readers of the old
+        // entry keep their reference until they release it.
+        CacheEntry *old = existing->entry;
+        existing->entry = entry;
+        shard->bytes = shard->bytes - existing->charge + charge;
+        existing->charge = charge;
+        policy->update(shard, existing, 0);
+        evict_entries(shard, 0, &demoted);
+        pthread_rwlock_unlock(&shard->lock);
+        release_cache_entry(old);
+        demote_entries(demoted);
+        log_message(LOG_LEVEL_INFO, "Updated cache entry for URL: %s", url);
+        return;
+    }
+
+    if (!shard->hash_table) {
+        grow_hash_table(shard);
+        if (!shard->hash_table) {
+            pthread_rwlock_unlock(&shard->lock);
+            release_cache_entry(entry);
+            return;
         }
-        log_message(LOG_LEVEL_INFO, "Cache full. Removing LFU entry for URL: %s (frequency %d)",
-                    cache_entries[lfu_index]->url, cache_entries[lfu_index]->frequency);
-        free(cache_entries[lfu_index]->url);
-        free(cache_entries[lfu_index]->response);
-        free(cache_entries[lfu_index]);
-        // Shift entries left.
-        for (int i = lfu_index + 1; i < cache_count; i++) {
-            cache_entries[i - 1] = cache_entries[i];
+    }
+
+    // Admit the entry only if it has been asked for more often than the
+    // entry it would displace first.
+    if (shard->sketch && shard->bytes + charge > shard->max_bytes) {
+        CacheNode *victim = policy->victim(shard);
+        CacheNode candidate = { .entry = entry, .charge = charge, .hash = hash };
+        if (victim && admission_value(shard, &candidate) <= admission_value(shard, victim)) {
+            pthread_rwlock_unlock(&shard->lock);
+            log_message(LOG_LEVEL_DEBUG, "Not caching %s: admission filter prefers %s", url, victim->entry->url);
+            metrics_add(METRIC_CACHE_REJECTED, 1);
+            release_cache_entry(entry);
+            return;
         }
-        cache_count--;
     }
+
+    // Make room within the shard's byte budget.
+    evict_entries(shard, charge, &demoted);
+
     // Create a new cache entry.
-    CacheEntry *new_entry = (CacheEntry *)malloc(sizeof(CacheEntry));
-    new_entry->url = strdup(url);
-    new_entry->response = (char *)malloc(response_length);
-    memcpy(new_entry->response, response, response_length);
-    new_entry->response_length = response_length;
-    new_entry->time_taken = time_taken;
-    new_entry->frequency = 1;  // Initialize frequency to 1.
-    cache_entries[cache_count++] = new_entry;
-    pthread_mutex_unlock(&cache_mutex);
+    CacheNode *node = (CacheNode *)slab_alloc(sizeof(CacheNode));
+    if (!node) {
+        pthread_rwlock_unlock(&shard->lock);
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed for cache entry: %s", url);
+        release_cache_entry(entry);
+        demote_entries(demoted);
+        return;
+    }
+    memset(node, 0, sizeof(*node));
+    node->entry = entry;
+    node->charge = charge;
+    node->frequency = 1;  // Initialize frequency to 1.
+    atomic_init(&node->pending_hits, 0);
+    node->hash = hash;
+    if (policy->add(shard, node) < 0) {
+        pthread_rwlock_unlock(&shard->lock);
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed for cache entry: %s", url);
+        node_free(node);
+        demote_entries(demoted);
+        return;
+    }
+    hash_insert(shard, node);
+    shard->count++;
+    shard->bytes += charge;
+    pthread_rwlock_unlock(&shard->lock);
+    demote_entries(demoted);
     log_message(LOG_LEVEL_INFO, "Inserted cache entry for URL: %s", url);
 }
 
 void remove_cache_by_url(const char *url) {
-    pthread_mutex_lock(&cache_mutex);
-    int i = 0;
-    while (i < cache_count) {
-        if (strcmp(cache_entries[i]->url, url) == 0) {
-            free(cache_entries[i]->url);
-            free(cache_entries[i]->response);
-            free(cache_entries[i]);
-            // Shift remaining entries left.
-            for (int j = i; j < cache_count - 1; j++) {
-                cache_entries[j] = cache_entries[j + 1];
+    uint64_t hash = hash_url(url);
+    CacheShard *shard = shard_for(hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    CacheNode *node = find_node(shard, url, hash);
+    if (node) {
+        remove_node(shard, node);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    disk_cache_remove(url);
+    log_message(LOG_LEVEL_INFO, "Removed cache entries for URL: %s", url);
+}
+
+void get_cache_stats(CacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->max_bytes = cache_max_bytes;
+    stats->max_object_size = cache_max_object;
+    stats->shards = shard_count;
+    stats->policy = policy->name;
+    stats->admission = admission_enabled;
+    for (int i = 0; i < shard_count; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        stats->entries += shard->count;
+        stats->bytes += shard->bytes;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+void cache_for_each(void (*fn)(const CacheEntry *entry, int frequency, void *arg), void *arg) {
+    for (int i = 0; i < shard_count; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (size_t j = 0; j < shard->hash_size; j++) {
+            for (CacheNode *node = shard->hash_table[j]; node; node = node->hash_next) {
+                int pending = atomic_load_explicit(&node->pending_hits, memory_order_relaxed);
+                fn(node->entry, node->frequency + pending, arg);
             }
-            cache_count--;
-            // Do not increment i, new entry is now at index i.
-        } else {
-            i++;
         }
+        pthread_rwlock_unlock(&shard->lock);
     }
-    pthread_mutex_unlock(&cache_mutex);
-    log_message(LOG_LEVEL_INFO, "Removed cache entries for URL: %s", url);
 }
 
 void free_cache() {
-    pthread_mutex_lock(&cache_mutex);
-    for (int i = 0; i < cache_count; i++) {
-        if (cache_entries[i]) {
-            free(cache_entries[i]->url);
-            free(cache_entries[i]->response);
-            free(cache_entries[i]);
-            cache_entries[i] = NULL;
+    for (int i = 0; i < shard_count; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        CacheNode *node;
+        while ((node = policy->victim(shard))) {
+            remove_node(shard, node);
         }
+        free(shard->hash_table);
+        free(shard->heap);
+        shard->heap = NULL;
+        free(shard->sketch);
+        shard->sketch = NULL;
+        shard->sketch_width = 0;
+        shard->heap_size = shard->heap_capacity = 0;
+        shard->hash_table = NULL;
+        shard->hash_size = 0;
+        shard->count = 0;
+        shard->bytes = 0;
+        pthread_rwlock_unlock(&shard->lock);
     }
-    cache_count = 0;
-    pthread_mutex_unlock(&cache_mutex);
     log_message(LOG_LEVEL_INFO, "Cache cleared");
 }
@@ -0,0 +1,167 @@
+#include "chunk_list.h"
+#include "slab.h"
+#include <string.h>
+
+_Static_assert(sizeof(Chunk) + CHUNK_SIZE <= SLAB_MAX_OBJECT, "a full chunk must fit the largest slab class");
+
+static Chunk *add_chunk(ChunkList *list) {
+    Chunk *chunk = (Chunk *)slab_alloc(sizeof(Chunk) + CHUNK_SIZE);
+    if (!chunk) return NULL;
+    chunk->next = NULL;
+    atomic_init(&chunk->refs, 1);
+    chunk->length = 0;
+    chunk->capacity = CHUNK_SIZE;
+    if (list->tail) {
+        list->tail->next = chunk;
+    } else {
+        list->head = chunk;
+    }
+    list->tail = chunk;
+    return chunk;
+}
+
+int chunk_list_append(ChunkList *list, const char *data, size_t length) {
+    while (length > 0) {
+        size_t space;
+        char *dest = chunk_list_reserve(list, &space);
+        if (!dest) return -1;
+        size_t n = length < space ? length : space;
+        memcpy(dest, data, n);
+        chunk_list_commit(list, n);
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+char *chunk_list_reserve(ChunkList *list, size_t *space) {
+    Chunk *chunk = list->tail;
+    if (!chunk || chunk->length == chunk->capacity) {
+        chunk = add_chunk(list);
+        if (!chunk) return NULL;
+    }
+    *space = chunk->capacity - chunk->length;
+    return chunk->data + chunk->length;
+}
+
+void chunk_list_commit(ChunkList *list, size_t length) {
+    list->tail->length += length;
+    list->length += length;
+}
+
+void chunk_list_seal(ChunkList *list) {
+    Chunk *tail = list->tail;
+    if (!tail || slab_object_size(sizeof(Chunk) + tail->length) == slab_object_size(sizeof(Chunk) + tail->capacity)) {
+        return;
+    }
+    // Move the last chunk's bytes to the smallest size class that holds them.
+    Chunk *shrunk = (Chunk *)slab_alloc(sizeof(Chunk) + tail->length);
+    if (!shrunk) return;
+    shrunk->next = NULL;
+    atomic_init(&shrunk->refs, 1);
+    shrunk->length = shrunk->capacity = tail->length;
+    memcpy(shrunk->data, tail->data, tail->length);
+    if (list->head == tail) {
+        list->head = shrunk;
+    } else {
+        Chunk *prev = list->head;
+        while (prev->next != tail) prev = prev->next;
+        prev->next = shrunk;
+    }
+    list->tail = shrunk;
+    chunk_unref(tail);  // A flight reader may still hold the original.
+}
+
+void chunk_ref(Chunk *chunk) {
+    atomic_fetch_add_explicit(&chunk->refs, 1, memory_order_relaxed);
+}
+
+void chunk_unref(Chunk *chunk) {
+    if (atomic_fetch_sub_explicit(&chunk->refs, 1, memory_order_acq_rel) == 1) slab_free(chunk);
+}
+
+void chunk_list_drop_head(ChunkList *list) {
+    Chunk *head = list->head;
+    list->head = head->next;
+    if (!list->head) list->tail = NULL;
+    list->length -= head->length;
+    chunk_unref(head);
+}
+
+void chunk_list_free(ChunkList *list) {
+    Chunk *chunk = list->head;
+    while (chunk) {
+        Chunk *next = chunk->next;
+        chunk_unref(chunk);
+        chunk = next;
+    }
+    list->head = list->tail = NULL;
+    list->length = 0;
+}
+
+size_t chunk_list_footprint(const ChunkList *list) {
+    size_t bytes = 0;
+    for (const Chunk *chunk = list->head; chunk; chunk = chunk->next) {
+        bytes += slab_object_size(sizeof(Chunk) + chunk->capacity);
+    }
+    return bytes;
+}
+
+void chunk_list_move(ChunkList *to, ChunkList *from) {
+    *to = *from;
+    from->head = from->tail = NULL;
+    from->length = 0;
+}
+
+// Moves a cursor sitting at the end of a chunk on to the next one, if any.
+static void cursor_settle(ChunkCursor *cursor, const ChunkList *list) {
+    if (!cursor->chunk) {
+        cursor->chunk = list->head;
+        cursor->offset = 0;
+    }
+    while (cursor->chunk && cursor->offset == cursor->chunk->length && cursor->chunk->next) {
+        cursor->chunk = cursor->chunk->next;
+        cursor->offset = 0;
+    }
+}
+
+size_t chunk_cursor_copy(ChunkCursor *cursor, const ChunkList *list, char *buffer, size_t size) {
+    size_t copied = 0;
+    while (copied < size) {
+        cursor_settle(cursor, list);
+        if (!cursor->chunk || cursor->offset == cursor->chunk->length) break;
+        size_t n = cursor->chunk->length - cursor->offset;
+        if (n > size - copied) n = size - copied;
+        memcpy(buffer + copied, cursor->chunk->data + cursor->offset, n);
+        cursor->offset += n;
+        copied += n;
+    }
+    return copied;
+}
+
+int chunk_cursor_iov(const ChunkCursor *cursor, const ChunkList *list, struct iovec *iov, int max) {
+    ChunkCursor position = *cursor;
+    cursor_settle(&position, list);
+    int count = 0;
+    const Chunk *chunk = position.chunk;
+    size_t offset = position.offset;
+    for (; chunk && count < max; chunk = chunk->next, offset = 0) {
+        if (offset == chunk->length) continue;
+        iov[count].iov_base = (void *)(chunk->data + offset);
+        iov[count].iov_len = chunk->length - offset;
+        count++;
+    }
+    return count;
+}
+
+void chunk_cursor_advance(ChunkCursor *cursor, const ChunkList *list, size_t length) {
+    while (length > 0) {
+        cursor_settle(cursor, list);
+        if (!cursor->chunk) return;
+        size_t n = cursor->chunk->length - cursor->offset;
+        if (n > length) n = length;
+        if (n == 0) return;
+        cursor->offset += n;
+        length -= n;
+    }
+}
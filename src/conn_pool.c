@@ -0,0 +1,162 @@
+#include "conn_pool.h"
+#include "cache.h"  // For hash_url()
+#include "http_handler.h"
+#include "logging.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define DEFAULT_POOL_MAX_IDLE_PER_HOST 8
+#define DEFAULT_POOL_IDLE_TIMEOUT 30
+#define POOL_BUCKETS 256
+
+typedef struct {
+    int sock;
+    time_t idle_since;
+} IdleConnection;
+
+// Idle connections to one origin, most recently used last.
+typedef struct PoolHost {
+    char host[MAX_HOST_SIZE];
+    int port;
+    uint64_t hash;
+    IdleConnection *idle;
+    int count;
+    struct PoolHost *next;
+} PoolHost;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PoolHost *pool_table[POOL_BUCKETS];
+static int max_idle_per_host = DEFAULT_POOL_MAX_IDLE_PER_HOST;
+static int idle_timeout = DEFAULT_POOL_IDLE_TIMEOUT;
+
+void set_conn_pool_limits(int max_idle, int timeout) {
+    max_idle_per_host = max_idle >= 0 ? max_idle : DEFAULT_POOL_MAX_IDLE_PER_HOST;
+    idle_timeout = timeout > 0 ? timeout : DEFAULT_POOL_IDLE_TIMEOUT;
+}
+
+static uint64_t origin_hash(const char *host, int port) {
+    char key[MAX_HOST_SIZE + 8];
+    snprintf(key, sizeof(key), "%s:%d", host, port);
+    return hash_url(key);
+}
+
+// Must hold pool_mutex.
+static PoolHost *find_host(const char *host, int port, int create) {
+    uint64_t hash = origin_hash(host, port);
+    PoolHost **link = &pool_table[hash % POOL_BUCKETS];
+    for (PoolHost *entry = *link; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->port == port && strcmp(entry->host, host) == 0) return entry;
+    }
+    if (!create) return NULL;
+    PoolHost *entry = (PoolHost *)calloc(1, sizeof(PoolHost));
+    if (!entry) return NULL;
+    entry->idle = (IdleConnection *)calloc(max_idle_per_host, sizeof(IdleConnection));
+    if (!entry->idle) {
+        free(entry);
+        return NULL;
+    }
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->port = port;
+    entry->hash = hash;
+    entry->next = *link;
+    *link = entry;
+    return entry;
+}
+
+// Closes connections that have been idle too long. They are the oldest, at
+// the front. Must hold pool_mutex.
+static void expire_idle(PoolHost *entry, time_t now) {
+    int expired = 0;
+    while (expired < entry->count && now - entry->idle[expired].idle_since >= idle_timeout) {
+        close(entry->idle[expired].sock);
+        expired++;
+    }
+    if (expired == 0) return;
+    memmove(entry->idle, entry->idle + expired, (entry->count - expired) * sizeof(IdleConnection));
+    entry->count -= expired;
+}
+
+// An idle connection should have nothing to read: EOF means the origin
+// closed it, and unexpected data means it is out of sync.
+static int connection_is_healthy(int sock) {
+    char c;
+    ssize_t n = recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int conn_pool_take(const char *host, int port) {
+    if (max_idle_per_host == 0) return -1;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&pool_mutex);
+    PoolHost *entry = find_host(host, port, 0);
+    if (entry) expire_idle(entry, now);
+    while (entry && entry->count > 0) {
+        int sock = entry->idle[--entry->count].sock;
+        if (connection_is_healthy(sock)) {
+            pthread_mutex_unlock(&pool_mutex);
+            log_message(LOG_LEVEL_DEBUG, "Reusing pooled connection to %s:%d", host, port);
+            return sock;
+        }
+        close(sock);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return -1;
+}
+
+int conn_pool_acquire(const char *host, int port, int *reused, RequestTiming *timing) {
+    int sock = conn_pool_take(host, port);
+    *reused = (sock >= 0);
+    if (sock >= 0) return sock;
+    return connect_to_server(host, port, timing);
+}
+
+void conn_pool_release(const char *host, int port, int sock) {
+    if (max_idle_per_host == 0) {
+        close(sock);
+        return;
+    }
+    time_t now = time(NULL);
+    pthread_mutex_lock(&pool_mutex);
+    PoolHost *entry = find_host(host, port, 1);
+    if (!entry) {
+        pthread_mutex_unlock(&pool_mutex);
+        close(sock);
+        return;
+    }
+    expire_idle(entry, now);
+    if (entry->count == max_idle_per_host) {
+        // Full: drop the oldest to keep the warmest connections.
+        close(entry->idle[0].sock);
+        memmove(entry->idle, entry->idle + 1, (entry->count - 1) * sizeof(IdleConnection));
+        entry->count--;
+    }
+    entry->idle[entry->count].sock = sock;
+    entry->idle[entry->count].idle_since = now;
+    entry->count++;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void free_conn_pool(void) {
+    pthread_mutex_lock(&pool_mutex);
+    for (int i = 0; i < POOL_BUCKETS; i++) {
+        PoolHost *entry = pool_table[i];
+        while (entry) {
+            PoolHost *next = entry->next;
+            for (int j = 0; j < entry->count; j++) {
+                close(entry->idle[j].sock);
+            }
+            free(entry->idle);
+            free(entry);
+            entry = next;
+        }
+        pool_table[i] = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -1,9 +1,22 @@
 #include "console.h"
 #include "logging.h"
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+#define MAX_BLOCK_PATTERN 256
+#define BLOCK_LIST_CHECK_INTERVAL_MS 1000  // Stop-flag checks, and mtime polling without inotify.
 
 // Structure for a blocked URL in a singly linked list.
 typedef struct BlockedURL {
@@ -11,9 +24,323 @@ typedef struct BlockedURL {
     struct BlockedURL *next;
 } BlockedURL;
 
+/**
+ * Aho-Corasick automaton over every blocked pattern, so one pass over a host
+ * finds whether any pattern occurs in it, however long the list is. State 0
+ * is the root; its transitions are a direct table, the other states keep
+ * their children in sibling lists. Matching is case-insensitive.
+ */
+typedef struct {
+    int state_count;
+    int root_next[256];     // Root transitions, 0 where absent.
+    unsigned char *edge;    // Byte on the edge into each state.
+    int *first_child;
+    int *next_sibling;
+    int *fail;              // Longest proper suffix that is also a trie path.
+    unsigned char *match;   // A pattern ends here or somewhere on the fail chain.
+} BlockMatcher;
+
+// Patterns added through block_url(), on top of those in the file.
 static BlockedURL *blocked_list = NULL;
+// Patterns from the block list file as last loaded.
+static char **file_patterns = NULL;
+static int file_pattern_count = 0;
+// Serializes changes to the pattern sets and rebuilds of the matcher.
 static pthread_mutex_t block_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// The compiled matcher is immutable; rebuilds swap in a new one.
+static pthread_rwlock_t matcher_lock = PTHREAD_RWLOCK_INITIALIZER;
+static BlockMatcher *matcher = NULL;
+
+static char *block_list_path = NULL;
+static pthread_t watcher_thread;
+static volatile int watcher_running = 0;
+static int watcher_wake[2] = { -1, -1 };  // Written to stop the watcher promptly.
+
+static int matcher_child(const BlockMatcher *m, int state, unsigned char c) {
+    if (state == 0) return m->root_next[c];
+    for (int child = m->first_child[state]; child; child = m->next_sibling[child]) {
+        if (m->edge[child] == c) return child;
+    }
+    return 0;
+}
+
+static void matcher_free(BlockMatcher *m) {
+    if (!m) return;
+    free(m->edge);
+    free(m->first_child);
+    free(m->next_sibling);
+    free(m->fail);
+    free(m->match);
+    free(m);
+}
+
+static BlockMatcher *matcher_build(char **patterns, int count) {
+    size_t states = 1;
+    for (int i = 0; i < count; i++) states += strlen(patterns[i]);
+
+    BlockMatcher *m = (BlockMatcher *)calloc(1, sizeof(BlockMatcher));
+    if (!m) return NULL;
+    m->edge = (unsigned char *)calloc(states, 1);
+    m->first_child = (int *)calloc(states, sizeof(int));
+    m->next_sibling = (int *)calloc(states, sizeof(int));
+    m->fail = (int *)calloc(states, sizeof(int));
+    m->match = (unsigned char *)calloc(states, 1);
+    if (!m->edge || !m->first_child || !m->next_sibling || !m->fail || !m->match) {
+        matcher_free(m);
+        return NULL;
+    }
+    m->state_count = 1;
+
+    // Build the trie of all patterns.
+    for (int i = 0; i < count; i++) {
+        int state = 0;
+        for (const unsigned char *p = (const unsigned char *)patterns[i]; *p; p++) {
+            unsigned char c = (unsigned char)tolower(*p);
+            int next = matcher_child(m, state, c);
+            if (!next) {
+                next = m->state_count++;
+                m->edge[next] = c;
+                if (state == 0) {
+                    m->root_next[c] = next;
+                } else {
+                    m->next_sibling[next] = m->first_child[state];
+                    m->first_child[state] = next;
+                }
+            }
+            state = next;
+        }
+        if (state != 0) m->match[state] = 1;
+    }
+
+    // Breadth-first pass to set the fail links; a state matches if anything on its fail chain does.
+    int *queue = (int *)malloc(m->state_count * sizeof(int));
+    if (!queue) {
+        matcher_free(m);
+        return NULL;
+    }
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (m->root_next[c]) queue[tail++] = m->root_next[c];
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        for (int child = m->first_child[state]; child; child = m->next_sibling[child]) {
+            int f = m->fail[state];
+            int next;
+            while ((next = matcher_child(m, f, m->edge[child])) == 0 && f != 0) f = m->fail[f];
+            m->fail[child] = next;
+            m->match[child] |= m->match[next];
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+    return m;
+}
+
+static int matcher_matches(const BlockMatcher *m, const char *text) {
+    int state = 0;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        unsigned char c = (unsigned char)tolower(*p);
+        int next;
+        while ((next = matcher_child(m, state, c)) == 0 && state != 0) state = m->fail[state];
+        state = next;
+        if (m->match[state]) return 1;
+    }
+    return 0;
+}
+
+// Compiles the file and in-memory patterns and swaps the result in. Must hold block_mutex.
+static void rebuild_matcher(void) {
+    int count = file_pattern_count;
+    for (BlockedURL *curr = blocked_list; curr; curr = curr->next) count++;
+    char **patterns = (char **)malloc((count > 0 ? count : 1) * sizeof(char *));
+    if (!patterns) {
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed while compiling the block list");
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < file_pattern_count; i++) patterns[n++] = file_patterns[i];
+    for (BlockedURL *curr = blocked_list; curr; curr = curr->next) patterns[n++] = curr->url;
+    BlockMatcher *compiled = matcher_build(patterns, n);
+    free(patterns);
+    if (!compiled) {
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed while compiling the block list");
+        return;
+    }
+
+    pthread_rwlock_wrlock(&matcher_lock);
+    BlockMatcher *old = matcher;
+    matcher = compiled;
+    pthread_rwlock_unlock(&matcher_lock);
+    matcher_free(old);
+    log_message(LOG_LEVEL_DEBUG, "Block list compiled: %d patterns, %d states", n, compiled->state_count);
+}
+
+static void free_file_patterns(char **patterns, int count) {
+    for (int i = 0; i < count; i++) free(patterns[i]);
+    free(patterns);
+}
+
+// Reads the block list file (one pattern per line) and recompiles the matcher.
+static void load_block_list(void) {
+    char **patterns = NULL;
+    int count = 0;
+    int capacity = 0;
+    FILE *fp = fopen(block_list_path, "r");
+    if (fp) {
+        char line[MAX_BLOCK_PATTERN];
+        while (fgets(line, sizeof(line), fp)) {
+            // Remove any newline characters.
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0') continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                char **grown = (char **)realloc(patterns, capacity * sizeof(char *));
+                if (!grown) break;
+                patterns = grown;
+            }
+            if (!(patterns[count] = strdup(line))) break;
+            count++;
+        }
+        fclose(fp);
+    }
+    // A missing file means no patterns from it.
+
+    pthread_mutex_lock(&block_mutex);
+    free_file_patterns(file_patterns, file_pattern_count);
+    file_patterns = patterns;
+    file_pattern_count = count;
+    rebuild_matcher();
+    pthread_mutex_unlock(&block_mutex);
+    log_message(LOG_LEVEL_INFO, "Loaded %d block list patterns from %s", count, block_list_path);
+}
+
+static void file_signature(const char *path, struct stat *st) {
+    if (stat(path, st) < 0) memset(st, 0, sizeof(*st));
+}
+
+static int signature_changed(const struct stat *a, const struct stat *b) {
+    return a->st_mtime != b->st_mtime || a->st_size != b->st_size || a->st_ino != b->st_ino;
+}
+
+/**
+ * Reloads the block list whenever the file changes. On Linux the file's
+ * directory is watched with inotify (which also sees editors that replace
+ * the file by renaming); elsewhere, or if inotify is unavailable, the
+ * file's mtime is polled once a second.
+ */
+static void *block_list_watcher(void *arg) {
+    (void)arg;
+    struct stat last;
+    file_signature(block_list_path, &last);
+    int notify_fd = -1;
+    const char *name = strrchr(block_list_path, '/');
+    name = name ? name + 1 : block_list_path;
+#ifdef __linux__
+    char dir[1024];
+    if (name == block_list_path) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(name - block_list_path), block_list_path);
+    }
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd >= 0 &&
+        inotify_add_watch(notify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM) < 0) {
+        close(notify_fd);
+        notify_fd = -1;
+    }
+    if (notify_fd < 0) {
+        log_message(LOG_LEVEL_WARN, "inotify unavailable, polling %s for changes", block_list_path);
+    }
+#endif
+
+    while (watcher_running) {
+        int changed = 0;
+        struct pollfd pfds[2] = {
+            { .fd = watcher_wake[0], .events = POLLIN },
+            { .fd = notify_fd, .events = POLLIN },
+        };
+#ifdef __linux__
+        if (notify_fd >= 0) {
+            if (poll(pfds, 2, BLOCK_LIST_CHECK_INTERVAL_MS) > 0 && (pfds[1].revents & POLLIN)) {
+                char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+                ssize_t length;
+                while ((length = read(notify_fd, events, sizeof(events))) > 0) {
+                    for (char *p = events; p < events + length;) {
+                        struct inotify_event *event = (struct inotify_event *)p;
+                        if (event->len > 0 && strcmp(event->name, name) == 0) changed = 1;
+                        p += sizeof(struct inotify_event) + event->len;
+                    }
+                }
+            }
+        } else
+#endif
+        {
+            if (poll(pfds, 1, BLOCK_LIST_CHECK_INTERVAL_MS) > 0) continue;
+            struct stat now;
+            file_signature(block_list_path, &now);
+            changed = signature_changed(&last, &now);
+            last = now;
+        }
+        if (changed) {
+            load_block_list();
+        }
+    }
+    if (notify_fd >= 0) close(notify_fd);
+    return NULL;
+}
+
+int start_block_list_watcher(const char *path) {
+    block_list_path = strdup(path);
+    if (!block_list_path) return -1;
+    load_block_list();
+    if (pipe(watcher_wake) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to start block list watcher; changes to %s need a restart", path);
+        return -1;
+    }
+    watcher_running = 1;
+    if (pthread_create(&watcher_thread, NULL, block_list_watcher, NULL) != 0) {
+        watcher_running = 0;
+        close(watcher_wake[0]);
+        close(watcher_wake[1]);
+        watcher_wake[0] = watcher_wake[1] = -1;
+        log_message(LOG_LEVEL_ERROR, "Failed to start block list watcher; changes to %s need a restart", path);
+        return -1;
+    }
+    return 0;
+}
+
+void stop_block_list_watcher(void) {
+    if (watcher_running) {
+        watcher_running = 0;
+        if (write(watcher_wake[1], "x", 1) < 0) {
+            // The watcher still notices the flag within a second.
+        }
+        pthread_join(watcher_thread, NULL);
+        close(watcher_wake[0]);
+        close(watcher_wake[1]);
+        watcher_wake[0] = watcher_wake[1] = -1;
+    }
+    pthread_mutex_lock(&block_mutex);
+    free_file_patterns(file_patterns, file_pattern_count);
+    file_patterns = NULL;
+    file_pattern_count = 0;
+    while (blocked_list) {
+        BlockedURL *next = blocked_list->next;
+        free(blocked_list->url);
+        free(blocked_list);
+        blocked_list = next;
+    }
+    pthread_mutex_unlock(&block_mutex);
+    pthread_rwlock_wrlock(&matcher_lock);
+    matcher_free(matcher);
+    matcher = NULL;
+    pthread_rwlock_unlock(&matcher_lock);
+    free(block_list_path);
+    block_list_path = NULL;
+}
+
 int block_url(const char *url) {
     pthread_mutex_lock(&block_mutex);
     // Check if URL is already blocked.
@@ -32,8 +359,14 @@ int block_url(const char *url) {
         return -1;
     }
     new_node->url = strdup(url);
+    if (!new_node->url) {
+        free(new_node);
+        pthread_mutex_unlock(&block_mutex);
+        return -1;
+    }
     new_node->next = blocked_list;
     blocked_list = new_node;
+    rebuild_matcher();
     pthread_mutex_unlock(&block_mutex);
     log_message(LOG_LEVEL_INFO, "Blocked URL: %s", url);
     return 0;
@@ -51,6 +384,7 @@ int unblock_url(const char *url) {
                 blocked_list = curr->next;
             free(curr->url);
             free(curr);
+            rebuild_matcher();
             pthread_mutex_unlock(&block_mutex);
             log_message(LOG_LEVEL_INFO, "Unblocked URL: %s", url);
             return 0;
@@ -63,22 +397,16 @@ int unblock_url(const char *url) {
     return -1;
 }
 
+void for_each_blocked_url(void (*fn)(const char *pattern, int from_file, void *arg), void *arg) {
+    pthread_mutex_lock(&block_mutex);
+    for (int i = 0; i < file_pattern_count; i++) fn(file_patterns[i], 1, arg);
+    for (BlockedURL *curr = blocked_list; curr; curr = curr->next) fn(curr->url, 0, arg);
+    pthread_mutex_unlock(&block_mutex);
+}
+
 int is_url_blocked(const char *host) {
-    FILE *fp = fopen("block_list.txt", "r");
-    if (!fp) {
-        // If the file doesn't exist, assume no URLs are blocked.
-        return 0;
-    }
-    char blocked_url[256];
-    int blocked = 0;
-    while (fgets(blocked_url, sizeof(blocked_url), fp)) {
-        // Remove any newline characters.
-        blocked_url[strcspn(blocked_url, "\n")] = '\0';
-        if (strlen(blocked_url) > 0 && strstr(host, blocked_url) != NULL) {
-            blocked = 1;
-            break;
-        }
-    }
-    fclose(fp);
+    pthread_rwlock_rdlock(&matcher_lock);
+    int blocked = matcher && matcher_matches(matcher, host);
+    pthread_rwlock_unlock(&matcher_lock);
     return blocked;
-}
\ No newline at end of file
+}
@@ -0,0 +1,419 @@
+#include "disk_cache.h"
+#include "cache.h"
+#include "logging.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define DISK_INDEX_BUCKETS 4096
+
+// Index record for one object stored on disk.
+typedef struct DiskItem {
+    char *url;
+    uint64_t hash;
+    unsigned long long file_id;  // File name within the cache directory.
+    size_t length;
+    double time_taken;
+    time_t expires_at;
+    long lifetime;               // Freshness lifetime, reused when a 304 carries none.
+    char *etag;                  // Validators, or NULL.
+    char *last_modified;
+    int keep_alive;              // The stored response is delimited.
+    int status;                  // Status code of the stored response.
+    struct DiskItem *hash_next;
+    struct DiskItem *lru_prev;   // Most recently used at the head.
+    struct DiskItem *lru_next;
+} DiskItem;
+
+struct DiskCacheFill {
+    char *url;
+    int fd;
+    unsigned long long file_id;
+    size_t length;
+    long lifetime;
+    char *etag;
+    char *last_modified;
+    int keep_alive;
+    int status;
+};
+
+static char *disk_dir = NULL;
+static size_t disk_max_bytes = 0;
+static size_t disk_bytes = 0;
+static unsigned long long next_file_id = 1;
+static DiskItem *disk_index[DISK_INDEX_BUCKETS];
+static DiskItem *lru_head = NULL;
+static DiskItem *lru_tail = NULL;
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void file_path(char *path, size_t size, unsigned long long file_id) {
+    snprintf(path, size, "%s/%016llx", disk_dir, file_id);
+}
+
+static int write_file_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+static DiskItem *find_item(const char *url, uint64_t hash) {
+    DiskItem *item = disk_index[hash % DISK_INDEX_BUCKETS];
+    while (item) {
+        if (item->hash == hash && strcmp(item->url, url) == 0) return item;
+        item = item->hash_next;
+    }
+    return NULL;
+}
+
+static void lru_unlink(DiskItem *item) {
+    if (item->lru_prev) item->lru_prev->lru_next = item->lru_next;
+    else lru_head = item->lru_next;
+    if (item->lru_next) item->lru_next->lru_prev = item->lru_prev;
+    else lru_tail = item->lru_prev;
+    item->lru_prev = item->lru_next = NULL;
+}
+
+static void lru_push(DiskItem *item) {
+    item->lru_prev = NULL;
+    item->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = item;
+    lru_head = item;
+    if (!lru_tail) lru_tail = item;
+}
+
+// Drops an item from the index and unlinks its file. Open descriptors held
+// by readers stay valid until they are closed. Must hold disk_mutex.
+static void remove_item(DiskItem *item) {
+    DiskItem **link = &disk_index[item->hash % DISK_INDEX_BUCKETS];
+    while (*link && *link != item) link = &(*link)->hash_next;
+    if (*link) *link = item->hash_next;
+    lru_unlink(item);
+    disk_bytes -= item->length;
+
+    char path[PATH_MAX];
+    file_path(path, sizeof(path), item->file_id);
+    unlink(path);
+    free(item->url);
+    free(item->etag);
+    free(item->last_modified);
+    free(item);
+}
+
+// Indexes a file that has been fully written, evicting LRU objects to stay
+// within the disk budget. The item takes over the fill's strings.
+static void publish_file(DiskCacheFill *fill, double time_taken, time_t expires_at) {
+    const char *url = fill->url;
+    size_t length = fill->length;
+    DiskItem *item = (DiskItem *)calloc(1, sizeof(DiskItem));
+    if (!item) {
+        char path[PATH_MAX];
+        file_path(path, sizeof(path), fill->file_id);
+        unlink(path);
+        return;
+    }
+    item->url = fill->url;
+    item->etag = fill->etag;
+    item->last_modified = fill->last_modified;
+    fill->url = fill->etag = fill->last_modified = NULL;
+    item->hash = hash_url(url);
+    item->file_id = fill->file_id;
+    item->length = length;
+    item->time_taken = time_taken;
+    item->expires_at = expires_at;
+    item->lifetime = fill->lifetime;
+    item->keep_alive = fill->keep_alive;
+    item->status = fill->status;
+
+    pthread_mutex_lock(&disk_mutex);
+    DiskItem *existing = find_item(url, item->hash);
+    if (existing) remove_item(existing);
+    while (lru_tail && disk_bytes + length > disk_max_bytes) {
+        log_message(LOG_LEVEL_DEBUG, "Disk cache full. Removing LRU entry for URL: %s", lru_tail->url);
+        remove_item(lru_tail);
+    }
+    size_t bucket = item->hash % DISK_INDEX_BUCKETS;
+    item->hash_next = disk_index[bucket];
+    disk_index[bucket] = item;
+    lru_push(item);
+    disk_bytes += length;
+    pthread_mutex_unlock(&disk_mutex);
+    log_message(LOG_LEVEL_INFO, "Stored %zu bytes on disk for URL: %s", length, url);
+}
+
+static int create_file(unsigned long long *file_id) {
+    pthread_mutex_lock(&disk_mutex);
+    *file_id = next_file_id++;
+    pthread_mutex_unlock(&disk_mutex);
+    char path[PATH_MAX];
+    file_path(path, sizeof(path), *file_id);
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+}
+
+// Removes files left behind by a previous run; the index is not persisted.
+static void clear_directory(void) {
+    DIR *dir = opendir(disk_dir);
+    if (!dir) return;
+    struct dirent *de;
+    char path[PATH_MAX];
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", disk_dir, de->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+int init_disk_cache(const char *dir, size_t max_bytes) {
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        log_message(LOG_LEVEL_ERROR, "Failed to create disk cache directory %s", dir);
+        return -1;
+    }
+    disk_dir = strdup(dir);
+    if (!disk_dir) return -1;
+    disk_max_bytes = max_bytes;
+    clear_directory();
+    log_message(LOG_LEVEL_INFO, "Disk cache initialized in %s (%zu byte budget)", dir, max_bytes);
+    return 0;
+}
+
+int disk_cache_enabled(void) {
+    return disk_dir != NULL;
+}
+
+size_t disk_cache_max_object_size(void) {
+    return disk_dir ? disk_max_bytes / 8 : 0;
+}
+
+void disk_cache_store(const char *url, const ChunkList *response, double time_taken, time_t expires_at) {
+    if (!disk_dir || response->length > disk_cache_max_object_size()) return;
+    // A stale response is only worth keeping if it can be revalidated.
+    HttpResponseInfo info;
+    if (expires_at <= time(NULL) &&
+        (!response->head || parse_http_response_head(response->head->data, response->head->length, &info) != 1 ||
+         (!info.etag[0] && !info.last_modified[0]))) {
+        return;
+    }
+    DiskCacheFill *fill = disk_cache_begin_fill(url, response);
+    if (fill) {
+        disk_cache_commit_fill(fill, time_taken, expires_at);
+    }
+}
+
+int disk_cache_open(const char *url, DiskCacheHit *hit) {
+    if (!disk_dir) return 0;
+    uint64_t hash = hash_url(url);
+    pthread_mutex_lock(&disk_mutex);
+    DiskItem *item = find_item(url, hash);
+    int stale = item && item->expires_at <= time(NULL);
+    if (stale && !item->etag && !item->last_modified) {
+        log_message(LOG_LEVEL_DEBUG, "Dropping stale disk cache entry for URL: %s", url);
+        remove_item(item);
+        item = NULL;
+    }
+    if (!item) {
+        pthread_mutex_unlock(&disk_mutex);
+        return 0;
+    }
+    // Open under the lock so eviction cannot unlink the file first.
+    char path[PATH_MAX];
+    file_path(path, sizeof(path), item->file_id);
+    hit->fd = open(path, O_RDONLY);
+    hit->length = item->length;
+    hit->time_taken = item->time_taken;
+    hit->keep_alive = item->keep_alive;
+    hit->status = item->status;
+    hit->expires_at = item->expires_at;
+    hit->stale = stale;
+    snprintf(hit->etag, sizeof(hit->etag), "%s", item->etag ? item->etag : "");
+    snprintf(hit->last_modified, sizeof(hit->last_modified), "%s", item->last_modified ? item->last_modified : "");
+    if (hit->fd >= 0) {
+        lru_unlink(item);
+        lru_push(item);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    if (hit->fd < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to open disk cache file for URL: %s", url);
+        return 0;
+    }
+    log_message(LOG_LEVEL_DEBUG, "Disk cache %s for URL: %s", stale ? "stale hit" : "hit", url);
+    return 1;
+}
+
+void disk_cache_refresh(const char *url, DiskCacheHit *hit, const HttpResponseInfo *not_modified) {
+    uint64_t hash = hash_url(url);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&disk_mutex);
+    DiskItem *item = find_item(url, hash);
+    if (item) {
+        item->expires_at = response_has_explicit_lifetime(not_modified)
+                               ? response_expiry(not_modified, now)
+                               : now + item->lifetime;
+        hit->expires_at = item->expires_at;
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    hit->stale = 0;
+    if (item) {
+        log_message(LOG_LEVEL_INFO, "Revalidated disk cache entry for URL: %s (fresh for %lld seconds)",
+                    url, (long long)(hit->expires_at - now));
+    }
+}
+
+void disk_cache_promote(const char *url, const DiskCacheHit *hit) {
+    if (hit->length > cache_max_object_size()) return;
+    // Read straight into the chunks the memory cache will keep.
+    ChunkList data = { 0 };
+    while (data.length < hit->length) {
+        size_t space;
+        char *dest = chunk_list_reserve(&data, &space);
+        if (!dest) break;
+        if (space > hit->length - data.length) space = hit->length - data.length;
+        ssize_t n = pread(hit->fd, dest, space, (off_t)data.length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        chunk_list_commit(&data, n);
+    }
+    if (data.length == hit->length) {
+        disk_cache_remove(url);
+        insert_cache_until(url, &data, hit->time_taken, hit->expires_at);
+    }
+    chunk_list_free(&data);
+}
+
+ssize_t disk_cache_sendfile(int sock, int fd, off_t *offset, size_t count) {
+#ifdef __linux__
+    return sendfile(sock, fd, offset, count);
+#else
+    // Portable fallback: copy through a small userspace buffer.
+    char buffer[16384];
+    size_t chunk = count < sizeof(buffer) ? count : sizeof(buffer);
+    ssize_t n = pread(fd, buffer, chunk, *offset);
+    if (n <= 0) return n;
+    ssize_t written = write(sock, buffer, n);
+    if (written > 0) *offset += written;
+    return written;
+#endif
+}
+
+int disk_cache_send(int sock, const DiskCacheHit *hit) {
+    off_t offset = 0;
+    while ((size_t)offset < hit->length) {
+        ssize_t n = disk_cache_sendfile(sock, hit->fd, &offset, hit->length - (size_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+    }
+    return 0;
+}
+
+void disk_cache_remove(const char *url) {
+    if (!disk_dir) return;
+    uint64_t hash = hash_url(url);
+    pthread_mutex_lock(&disk_mutex);
+    DiskItem *item = find_item(url, hash);
+    if (item) remove_item(item);
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+DiskCacheFill *disk_cache_begin_fill(const char *url, const ChunkList *data) {
+    if (!disk_dir || data->length > disk_cache_max_object_size()) return NULL;
+    DiskCacheFill *fill = (DiskCacheFill *)calloc(1, sizeof(DiskCacheFill));
+    if (!fill) return NULL;
+    fill->url = strdup(url);
+    fill->fd = create_file(&fill->file_id);
+    if (!fill->url || fill->fd < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to create disk cache file for URL: %s", url);
+        disk_cache_abort_fill(fill);
+        return NULL;
+    }
+    // The fill always starts with the complete response header, in the first chunk.
+    HttpResponseInfo info;
+    if (data->head && parse_http_response_head(data->head->data, data->head->length, &info) == 1) {
+        fill->keep_alive = response_is_persistent(&info);
+        fill->status = info.status;
+        fill->lifetime = response_freshness_lifetime(&info);
+        if (info.etag[0]) fill->etag = strdup(info.etag);
+        if (info.last_modified[0]) fill->last_modified = strdup(info.last_modified);
+    }
+    for (const Chunk *chunk = data->head; chunk; chunk = chunk->next) {
+        if (disk_cache_fill_write(fill, chunk->data, chunk->length) < 0) return NULL;
+    }
+    return fill;
+}
+
+int disk_cache_fill_write(DiskCacheFill *fill, const char *data, size_t length) {
+    if (fill->length + length > disk_cache_max_object_size() ||
+        write_file_all(fill->fd, data, length) < 0) {
+        disk_cache_abort_fill(fill);
+        return -1;
+    }
+    fill->length += length;
+    return 0;
+}
+
+void disk_cache_commit_fill(DiskCacheFill *fill, double time_taken, time_t expires_at) {
+    close(fill->fd);
+    publish_file(fill, time_taken, expires_at);
+    free(fill->url);
+    free(fill->etag);
+    free(fill->last_modified);
+    free(fill);
+}
+
+void disk_cache_abort_fill(DiskCacheFill *fill) {
+    if (fill->fd >= 0) {
+        char path[PATH_MAX];
+        close(fill->fd);
+        file_path(path, sizeof(path), fill->file_id);
+        unlink(path);
+    }
+    free(fill->url);
+    free(fill->etag);
+    free(fill->last_modified);
+    free(fill);
+}
+
+void get_disk_cache_stats(DiskCacheStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&disk_mutex);
+    stats->enabled = disk_dir != NULL;
+    stats->bytes = disk_bytes;
+    stats->max_bytes = disk_max_bytes;
+    for (DiskItem *item = lru_head; item; item = item->lru_next) stats->entries++;
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+void disk_cache_for_each(void (*fn)(const char *url, size_t length, int status, time_t expires_at, void *arg),
+                         void *arg) {
+    pthread_mutex_lock(&disk_mutex);
+    for (DiskItem *item = lru_head; item; item = item->lru_next) {
+        fn(item->url, item->length, item->status, item->expires_at, arg);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+}
+
+void free_disk_cache(void) {
+    if (!disk_dir) return;
+    pthread_mutex_lock(&disk_mutex);
+    while (lru_head) {
+        remove_item(lru_head);
+    }
+    pthread_mutex_unlock(&disk_mutex);
+    free(disk_dir);
+    disk_dir = NULL;
+    log_message(LOG_LEVEL_INFO, "Disk cache cleared");
+}
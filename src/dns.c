@@ -0,0 +1,470 @@
+#include "dns.h"
+#include "cache.h"  // For hash_url()
+#include "http_handler.h"
+#include "logging.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define DNS_PORT 53
+#define DNS_BUCKETS 256
+#define DNS_CACHE_MAX 4096            // Cached names, including negative entries.
+#define DNS_QUERY_TIMEOUT_MS 1000
+#define DNS_QUERY_ATTEMPTS 2
+#define DNS_MAX_TTL (24L * 60 * 60)
+#define DNS_NEGATIVE_TTL 30           // When the answer carries no SOA.
+#define DNS_MAX_NEGATIVE_TTL 300
+#define DNS_FALLBACK_TTL 60           // getaddrinfo() answers carry no TTL.
+#define DNS_MESSAGE_SIZE 512
+#define DNS_HOSTS_FILE "/etc/hosts"
+#define DNS_HOSTS_CHECK_INTERVAL 5    // Seconds between checks of /etc/hosts for changes.
+
+#define DNS_TYPE_A 1
+#define DNS_TYPE_SOA 6
+#define DNS_CLASS_IN 1
+#define DNS_RCODE_NXDOMAIN 3
+
+typedef enum {
+    DNS_PENDING,    // A lookup is in progress; others wait for it.
+    DNS_POSITIVE,
+    DNS_NEGATIVE
+} DnsState;
+
+typedef struct DnsEntry {
+    char host[MAX_HOST_SIZE];
+    uint64_t hash;
+    DnsState state;
+    struct in_addr addr;
+    time_t expires_at;        // 0 for /etc/hosts entries, which last until the file changes.
+    int from_hosts;
+    struct DnsEntry *next;
+} DnsEntry;
+
+// Outcome of one query to the nameserver.
+typedef enum {
+    QUERY_FOUND,
+    QUERY_NO_SUCH_NAME,       // NXDOMAIN, or no A record.
+    QUERY_FAILED              // Unreachable, timed out, truncated or SERVFAIL.
+} QueryResult;
+
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_cond = PTHREAD_COND_INITIALIZER;
+static DnsEntry *dns_table[DNS_BUCKETS];
+static int dns_count = 0;
+static struct sockaddr_in nameserver_addr;
+static int have_nameserver = 0;
+static time_t hosts_mtime = 0;
+static time_t hosts_checked_at = 0;
+
+// Must hold dns_mutex.
+static DnsEntry *find_entry(const char *host, uint64_t hash) {
+    for (DnsEntry *entry = dns_table[hash % DNS_BUCKETS]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->host, host) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Must hold dns_mutex.
+static void remove_entry(DnsEntry *entry) {
+    DnsEntry **link = &dns_table[entry->hash % DNS_BUCKETS];
+    while (*link != entry) link = &(*link)->next;
+    *link = entry->next;
+    dns_count--;
+    free(entry);
+}
+
+// Drops expired answers to make room. Must hold dns_mutex.
+static void purge_expired(time_t now) {
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        DnsEntry *entry = dns_table[i];
+        while (entry) {
+            DnsEntry *next = entry->next;
+            if (entry->state != DNS_PENDING && entry->expires_at != 0 && entry->expires_at <= now) {
+                remove_entry(entry);
+            }
+            entry = next;
+        }
+    }
+}
+
+// Must hold dns_mutex. Returns NULL if the cache is full.
+static DnsEntry *add_entry(const char *host, uint64_t hash, time_t now) {
+    if (dns_count >= DNS_CACHE_MAX) purge_expired(now);
+    if (dns_count >= DNS_CACHE_MAX) return NULL;
+    DnsEntry *entry = (DnsEntry *)calloc(1, sizeof(DnsEntry));
+    if (!entry) return NULL;
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->hash = hash;
+    entry->next = dns_table[hash % DNS_BUCKETS];
+    dns_table[hash % DNS_BUCKETS] = entry;
+    dns_count++;
+    return entry;
+}
+
+// Loads the IPv4 entries of /etc/hosts, replacing those of an earlier load
+// and any DNS answers for the same names. Must hold dns_mutex.
+static void load_hosts_file(void) {
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        DnsEntry *entry = dns_table[i];
+        while (entry) {
+            DnsEntry *next = entry->next;
+            if (entry->from_hosts) remove_entry(entry);
+            entry = next;
+        }
+    }
+    FILE *file = fopen(DNS_HOSTS_FILE, "r");
+    if (!file) return;
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *save;
+        char *address = strtok_r(line, " \t\r\n", &save);
+        struct in_addr addr;
+        if (!address || inet_pton(AF_INET, address, &addr) != 1) continue;
+        char *name;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            uint64_t hash = hash_url(name);
+            DnsEntry *entry = find_entry(name, hash);
+            // The first mapping wins; a lookup in progress fills its own entry.
+            if (entry && (entry->from_hosts || entry->state == DNS_PENDING)) continue;
+            if (!entry) entry = add_entry(name, hash, 0);
+            if (!entry) break;
+            entry->state = DNS_POSITIVE;
+            entry->addr = addr;
+            entry->expires_at = 0;
+            entry->from_hosts = 1;
+        }
+    }
+    fclose(file);
+}
+
+// Reloads /etc/hosts if it changed, looking at most every
+// DNS_HOSTS_CHECK_INTERVAL seconds. Must hold dns_mutex.
+static void check_hosts_file(time_t now) {
+    if (now - hosts_checked_at < DNS_HOSTS_CHECK_INTERVAL) return;
+    hosts_checked_at = now;
+    struct stat st;
+    time_t mtime = stat(DNS_HOSTS_FILE, &st) == 0 ? st.st_mtime : 0;
+    if (mtime == hosts_mtime) return;
+    hosts_mtime = mtime;
+    load_hosts_file();
+    log_message(LOG_LEVEL_INFO, "Reloaded %s", DNS_HOSTS_FILE);
+}
+
+// Parses "address[:port]" into addr.
+static int parse_nameserver(const char *spec, struct sockaddr_in *addr) {
+    char host[64];
+    int port = DNS_PORT;
+    snprintf(host, sizeof(host), "%s", spec);
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return (port > 0 && port < 65536 && inet_pton(AF_INET, host, &addr->sin_addr) == 1) ? 0 : -1;
+}
+
+// Finds the first IPv4 nameserver in /etc/resolv.conf.
+static int read_resolv_conf(struct sockaddr_in *addr) {
+    FILE *file = fopen("/etc/resolv.conf", "r");
+    if (!file) return -1;
+    char line[256];
+    int found = -1;
+    while (found < 0 && fgets(line, sizeof(line), file)) {
+        char address[64];
+        if (sscanf(line, "nameserver %63s", address) == 1) {
+            found = parse_nameserver(address, addr);
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+int init_dns_resolver(const char *nameserver) {
+    pthread_mutex_lock(&dns_mutex);
+    struct stat st;
+    hosts_mtime = stat(DNS_HOSTS_FILE, &st) == 0 ? st.st_mtime : 0;
+    hosts_checked_at = time(NULL);
+    load_hosts_file();
+    pthread_mutex_unlock(&dns_mutex);
+
+    if (nameserver) {
+        if (parse_nameserver(nameserver, &nameserver_addr) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Invalid nameserver address: %s", nameserver);
+            return -1;
+        }
+        have_nameserver = 1;
+    } else {
+        have_nameserver = (read_resolv_conf(&nameserver_addr) == 0);
+    }
+    if (have_nameserver) {
+        char address[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &nameserver_addr.sin_addr, address, sizeof(address));
+        log_message(LOG_LEVEL_INFO, "DNS resolver using nameserver %s:%d", address, ntohs(nameserver_addr.sin_port));
+    } else {
+        log_message(LOG_LEVEL_WARN, "No nameserver configured, resolving with getaddrinfo()");
+    }
+    return 0;
+}
+
+static uint16_t read_u16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t read_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Builds a recursive query for the A record of host. Returns its length, or -1.
+static int build_query(unsigned char *msg, size_t size, const char *host, uint16_t id) {
+    size_t host_length = strlen(host);
+    if (host_length == 0 || host_length > 253 || 12 + host_length + 2 + 4 > size) return -1;
+    memset(msg, 0, 12);
+    msg[0] = id >> 8;
+    msg[1] = id & 0xff;
+    msg[2] = 0x01;  // RD: recursion desired.
+    msg[5] = 1;     // QDCOUNT
+    size_t offset = 12;
+    const char *label = host;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t length = dot ? (size_t)(dot - label) : strlen(label);
+        if (length == 0 || length > 63) return -1;
+        msg[offset++] = (unsigned char)length;
+        memcpy(msg + offset, label, length);
+        offset += length;
+        label += length;
+        if (*label == '.') label++;
+    }
+    msg[offset++] = 0;
+    msg[offset++] = 0;
+    msg[offset++] = DNS_TYPE_A;
+    msg[offset++] = 0;
+    msg[offset++] = DNS_CLASS_IN;
+    return (int)offset;
+}
+
+// Advances past a (possibly compressed) name. Returns -1 if it runs off the message.
+static int skip_name(const unsigned char *msg, size_t length, size_t *offset) {
+    while (*offset < length) {
+        unsigned char c = msg[*offset];
+        if ((c & 0xc0) == 0xc0) {
+            *offset += 2;
+            return *offset <= length ? 0 : -1;
+        }
+        *offset += 1;
+        if (c == 0) return 0;
+        *offset += c;
+    }
+    return -1;
+}
+
+/**
+ * Parses the answer to our query. The first A record is taken (after any
+ * CNAME chain), with the smallest TTL along the chain. Without one, the TTL
+ * for negative caching comes from the SOA in the authority section.
+ */
+static QueryResult parse_answer(const unsigned char *msg, size_t length, uint16_t id,
+                                struct in_addr *addr, long *ttl) {
+    if (length < 12 || read_u16(msg) != id || !(msg[2] & 0x80)) return QUERY_FAILED;
+    if (msg[2] & 0x02) return QUERY_FAILED;  // Truncated.
+    int rcode = msg[3] & 0x0f;
+    if (rcode != 0 && rcode != DNS_RCODE_NXDOMAIN) return QUERY_FAILED;
+    int questions = read_u16(msg + 4);
+    int answers = read_u16(msg + 6);
+    int authorities = read_u16(msg + 8);
+
+    size_t offset = 12;
+    for (int i = 0; i < questions; i++) {
+        if (skip_name(msg, length, &offset) < 0) return QUERY_FAILED;
+        offset += 4;
+    }
+    long min_ttl = DNS_MAX_TTL;
+    for (int i = 0; i < answers + authorities; i++) {
+        if (skip_name(msg, length, &offset) < 0 || offset + 10 > length) return QUERY_FAILED;
+        int type = read_u16(msg + offset);
+        long record_ttl = (long)(read_u32(msg + offset + 4) & 0x7fffffff);
+        size_t rdlength = read_u16(msg + offset + 8);
+        offset += 10;
+        if (offset + rdlength > length) return QUERY_FAILED;
+        if (i < answers) {
+            if (record_ttl < min_ttl) min_ttl = record_ttl;
+            if (type == DNS_TYPE_A && rdlength == 4 && rcode == 0) {
+                memcpy(&addr->s_addr, msg + offset, 4);
+                *ttl = min_ttl;
+                return QUERY_FOUND;
+            }
+        } else if (type == DNS_TYPE_SOA) {
+            // MNAME and RNAME, then five 32-bit fields ending with MINIMUM.
+            size_t field = offset;
+            if (skip_name(msg, length, &field) < 0 || skip_name(msg, length, &field) < 0 ||
+                field + 20 > offset + rdlength) {
+                return QUERY_FAILED;
+            }
+            long minimum = (long)read_u32(msg + field + 16);
+            *ttl = minimum < record_ttl ? minimum : record_ttl;
+            if (*ttl > DNS_MAX_NEGATIVE_TTL) *ttl = DNS_MAX_NEGATIVE_TTL;
+            return QUERY_NO_SUCH_NAME;
+        }
+        offset += rdlength;
+    }
+    *ttl = DNS_NEGATIVE_TTL;
+    return QUERY_NO_SUCH_NAME;
+}
+
+// Sends an A query to the nameserver over UDP and waits for the matching answer.
+static QueryResult query_nameserver(const char *host, struct in_addr *addr, long *ttl) {
+    unsigned char query[DNS_MESSAGE_SIZE];
+    unsigned char answer[DNS_MESSAGE_SIZE];
+    uint16_t id;
+    if (getentropy(&id, sizeof(id)) < 0) id = (uint16_t)(time(NULL) ^ (uintptr_t)&id);
+    int query_length = build_query(query, sizeof(query), host, id);
+    if (query_length < 0) return QUERY_NO_SUCH_NAME;
+
+    // A connected socket only receives datagrams from the nameserver.
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) return QUERY_FAILED;
+    if (connect(sock, (struct sockaddr *)&nameserver_addr, sizeof(nameserver_addr)) < 0) {
+        close(sock);
+        return QUERY_FAILED;
+    }
+    QueryResult result = QUERY_FAILED;
+    for (int attempt = 0; attempt < DNS_QUERY_ATTEMPTS && result == QUERY_FAILED; attempt++) {
+        if (send(sock, query, query_length, 0) != query_length) break;
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int ready;
+        while ((ready = poll(&pfd, 1, DNS_QUERY_TIMEOUT_MS)) > 0) {
+            ssize_t n = recv(sock, answer, sizeof(answer), 0);
+            if (n < 0) break;  // e.g. ECONNREFUSED: nothing listening.
+            result = parse_answer(answer, (size_t)n, id, addr, ttl);
+            // A reply that is not ours is ignored; keep waiting for the real one.
+            if (result != QUERY_FAILED || (n >= 2 && read_u16(answer) == id)) break;
+        }
+        if (ready > 0 && result == QUERY_FAILED) break;
+    }
+    close(sock);
+    return result;
+}
+
+// Resolves with the system resolver when the nameserver cannot be used.
+static QueryResult query_system(const char *host, struct in_addr *addr, long *ttl) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host, NULL, &hints, &res);
+    if (status == EAI_NONAME) {
+        *ttl = DNS_NEGATIVE_TTL;
+        return QUERY_NO_SUCH_NAME;
+    }
+    if (status != 0) {
+        log_message(LOG_LEVEL_ERROR, "getaddrinfo error for host %s: %s", host, gai_strerror(status));
+        return QUERY_FAILED;
+    }
+    *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    *ttl = DNS_FALLBACK_TTL;
+    freeaddrinfo(res);
+    return QUERY_FOUND;
+}
+
+int dns_lookup_cached(const char *host, struct in_addr *addr) {
+    if (inet_pton(AF_INET, host, addr) == 1) return 1;
+    uint64_t hash = hash_url(host);
+    time_t now = time(NULL);
+    int result = 0;
+    pthread_mutex_lock(&dns_mutex);
+    check_hosts_file(now);
+    DnsEntry *entry = find_entry(host, hash);
+    if (entry && entry->state != DNS_PENDING && (entry->expires_at == 0 || entry->expires_at > now)) {
+        if (entry->state == DNS_POSITIVE) {
+            *addr = entry->addr;
+            result = 1;
+        } else {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&dns_mutex);
+    return result;
+}
+
+int dns_resolve(const char *host, struct in_addr *addr) {
+    if (inet_pton(AF_INET, host, addr) == 1) return 0;
+    uint64_t hash = hash_url(host);
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&dns_mutex);
+    check_hosts_file(now);
+    DnsEntry *entry;
+    for (;;) {
+        entry = find_entry(host, hash);
+        if (!entry || entry->state != DNS_PENDING) break;
+        pthread_cond_wait(&dns_cond, &dns_mutex);
+    }
+    if (entry && (entry->expires_at == 0 || entry->expires_at > now)) {
+        int result = (entry->state == DNS_POSITIVE) ? 0 : -1;
+        if (result == 0) *addr = entry->addr;
+        pthread_mutex_unlock(&dns_mutex);
+        if (result < 0) log_message(LOG_LEVEL_DEBUG, "Cached negative DNS answer for %s", host);
+        return result;
+    }
+    // Claim the lookup so concurrent callers wait for this one.
+    if (!entry) entry = add_entry(host, hash, now);
+    if (entry) entry->state = DNS_PENDING;
+    pthread_mutex_unlock(&dns_mutex);
+
+    long ttl = 0;
+    QueryResult result = have_nameserver ? query_nameserver(host, addr, &ttl) : QUERY_FAILED;
+    // A single-label name is usually meant relative to a search domain,
+    // which only the system resolver applies.
+    if (result == QUERY_FAILED || (result == QUERY_NO_SUCH_NAME && !strchr(host, '.'))) {
+        result = query_system(host, addr, &ttl);
+    }
+    if (result == QUERY_FOUND) {
+        log_message(LOG_LEVEL_DEBUG, "Resolved %s (TTL %ld s)", host, ttl);
+    } else if (result == QUERY_NO_SUCH_NAME) {
+        log_message(LOG_LEVEL_ERROR, "Host %s does not exist", host);
+    }
+
+    pthread_mutex_lock(&dns_mutex);
+    if (entry) {
+        if (result == QUERY_FAILED || ttl <= 0) {
+            remove_entry(entry);  // Nothing to cache; the next caller tries again.
+        } else {
+            entry->state = (result == QUERY_FOUND) ? DNS_POSITIVE : DNS_NEGATIVE;
+            entry->addr = *addr;
+            entry->expires_at = time(NULL) + ttl;
+        }
+        pthread_cond_broadcast(&dns_cond);
+    }
+    pthread_mutex_unlock(&dns_mutex);
+    return result == QUERY_FOUND ? 0 : -1;
+}
+
+void free_dns_resolver(void) {
+    pthread_mutex_lock(&dns_mutex);
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        DnsEntry *entry = dns_table[i];
+        while (entry) {
+            DnsEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        dns_table[i] = NULL;
+    }
+    dns_count = 0;
+    pthread_mutex_unlock(&dns_mutex);
+}
@@ -0,0 +1,1323 @@
+#define _GNU_SOURCE  // For accept4()
+#include "event_loop.h"
+#include "logging.h"
+#include "http_handler.h"
+#include "cache.h"
+#include "disk_cache.h"
+#include "http_response.h"
+#include "singleflight.h"
+#include "conn_pool.h"
+#include "dns.h"
+#include "metrics.h"
+#include "console.h"  // For is_url_blocked()
+#include "overload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define MAX_EVENTS 64
+#define RELAY_BUFFER_SIZE 16384
+#define CONN_FREELIST_MAX 64   // Closed connections each loop keeps for reuse.
+#define ACCEPT_BATCH 64  // Connections accepted per wakeup before serving other events.
+
+static const char BLOCK_RESPONSE[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 13\r\n\r\nAccess Denied";
+static const char CONNECT_ESTABLISHED[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+
+typedef struct Connection Connection;
+typedef struct EventLoop EventLoop;
+
+typedef enum {
+    ENDPOINT_LISTEN,
+    ENDPOINT_WAKE,
+    ENDPOINT_CLIENT,
+    ENDPOINT_ORIGIN
+} EndpointType;
+
+// What each registered epoll event points back to.
+typedef struct {
+    EndpointType type;
+    Connection *conn;
+} Endpoint;
+
+typedef enum {
+    CONN_READ_REQUEST,   // Reading the request header from the client.
+    CONN_RESOLVING,      // Waiting for the offload pool to resolve the origin.
+    CONN_CONNECTING,     // Non-blocking connect to the origin in progress.
+    CONN_REVALIDATE,     // Waiting for the origin's answer to a conditional request.
+    CONN_FOLLOW,         // Relaying a response another connection is fetching.
+    CONN_RELAY,          // Moving bytes between client and origin.
+    CONN_WRITE_RESPONSE  // Writing a complete local response (cache hit, 403).
+} ConnState;
+
+// Bytes read from one side and waiting to be written to the other.
+typedef struct {
+    char data[RELAY_BUFFER_SIZE];
+    size_t head;
+    size_t tail;
+} RelayBuffer;
+
+// One socket of a proxied connection. With edge-triggered epoll the
+// readable/writable flags are set by events and cleared on EAGAIN.
+typedef struct {
+    int fd;
+    int readable;
+    int writable;
+    int eof;
+    Endpoint endpoint;
+} Side;
+
+struct Connection {
+    EventLoop *loop;
+    ConnState state;
+    int dead;                // Closed during this epoll batch; freed afterwards.
+    Side client;
+    Side origin;
+    HttpRequest request;
+    int is_tunnel;
+    RequestBuffer request_buf;  // Unparsed client bytes, possibly pipelined requests.
+    int requests_served;
+    time_t idle_since;       // When the connection started waiting for its next request.
+    char client_name[INET_ADDRSTRLEN + 8];  // "ip:port", for the access log.
+    RequestTiming timing;    // Phases of the current request; started_us is 0 until its first byte.
+    int request_kind;        // RequestKind of the current request, or -1 if not timed.
+    RelayBuffer upstream;    // client -> origin
+    RelayBuffer downstream;  // origin -> client
+    // A complete response written straight to the client.
+    const char *response;
+    CacheEntry *cached;      // Held while a cache hit is being sent from its chunks.
+    ChunkCursor cached_cursor;
+    size_t response_len;
+    size_t response_off;
+    int response_keep_alive; // The local response is delimited.
+    DiskCacheHit disk_hit;   // Disk tier hit sent with sendfile(), or a stale one to revalidate; fd -1 if unused.
+    CacheEntry *stale;       // Stale entry being revalidated with the origin.
+    Flight *flight;          // Set while leading a coalesced fetch.
+    FlightReader *reader;    // Set while following another connection's fetch.
+    // Origin response accumulated for insertion into the cache.
+    int filling;
+    ChunkList fill;
+    DiskCacheFill *disk_fill;  // Set once a response outgrows memory and spills to disk.
+    time_t disk_expires;
+    ResponseTracker tracker;  // Finds the end of the origin response.
+    int origin_reused;        // The origin socket came from the keep-alive pool.
+    struct sockaddr_in origin_addr;
+    int resolve_status;
+    uint64_t fetch_started;  // metrics_now_us() when the origin fetch started.
+    Connection *next_resolved;
+    Connection *prev_follower;
+    Connection *next_follower;
+    Connection *prev;
+    Connection *next;
+};
+
+struct EventLoop {
+    pthread_t thread;
+    int index;
+    int pin_cpu;              // Pin the loop thread to a CPU.
+    int epfd;
+    int wake_fd;
+    int listen_fd;
+    Endpoint listen_endpoint;
+    Endpoint wake_endpoint;
+    ThreadPool *offload;
+    pthread_mutex_t resolved_mutex;
+    Connection *resolved;     // Lookups completed on the offload pool.
+    Connection *followers;    // Connections in CONN_FOLLOW, polled on each wakeup.
+    Connection *connections;  // All live connections owned by this loop.
+    Connection *graveyard;    // Connections closed during the current batch.
+    Connection *free_connections;  // Freed connections kept for reuse, with their buffers.
+    int free_count;
+    time_t last_idle_check;   // Last sweep for idle persistent connections.
+};
+
+static EventLoop *loops = NULL;
+static int loop_count = 0;
+static volatile int loops_running = 0;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int watch_side(Connection *conn, Side *side) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &side->endpoint;
+    return epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, side->fd, &ev);
+}
+
+static Connection *conn_new(EventLoop *loop, int client_fd, const char *client_name) {
+    // Reuse a connection this loop freed earlier, so accepting under churn
+    // does not allocate (and fragment the heap with) its relay buffers.
+    Connection *conn = loop->free_connections;
+    if (conn) {
+        loop->free_connections = conn->next;
+        loop->free_count--;
+        memset(conn, 0, sizeof(*conn));
+    } else {
+        conn = (Connection *)calloc(1, sizeof(Connection));
+    }
+    if (!conn) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for connection");
+        return NULL;
+    }
+    conn->loop = loop;
+    snprintf(conn->client_name, sizeof(conn->client_name), "%s", client_name);
+    conn->state = CONN_READ_REQUEST;
+    conn->client.fd = client_fd;
+    conn->client.endpoint.type = ENDPOINT_CLIENT;
+    conn->client.endpoint.conn = conn;
+    conn->origin.fd = -1;
+    conn->disk_hit.fd = -1;
+    conn->origin.endpoint.type = ENDPOINT_ORIGIN;
+    conn->origin.endpoint.conn = conn;
+    if (watch_side(conn, &conn->client) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to register client socket %d with epoll", client_fd);
+        conn->next = loop->free_connections;
+        loop->free_connections = conn;
+        loop->free_count++;
+        return NULL;
+    }
+    conn->next = loop->connections;
+    if (loop->connections) loop->connections->prev = conn;
+    loop->connections = conn;
+    return conn;
+}
+
+static void conn_free(Connection *conn) {
+    release_cache_entry(conn->cached);
+    release_cache_entry(conn->stale);
+    if (conn->disk_hit.fd >= 0) close(conn->disk_hit.fd);
+    if (conn->disk_fill) disk_cache_abort_fill(conn->disk_fill);
+    chunk_list_free(&conn->fill);
+    EventLoop *loop = conn->loop;
+    if (loop->free_count < CONN_FREELIST_MAX) {
+        conn->next = loop->free_connections;
+        loop->free_connections = conn;
+        loop->free_count++;
+    } else {
+        free(conn);
+    }
+}
+
+// Wakes the loop when a followed fetch has new bytes. Runs on the leader's thread.
+static void wake_follower_loop(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to wake event loop for a shared fetch");
+    }
+}
+
+static void start_following(Connection *conn, FlightReader *reader) {
+    EventLoop *loop = conn->loop;
+    conn->reader = reader;
+    conn->next_follower = loop->followers;
+    if (loop->followers) loop->followers->prev_follower = conn;
+    loop->followers = conn;
+    flight_set_notify(reader, wake_follower_loop, loop);
+    response_tracker_init(&conn->tracker, 0);
+    conn->state = CONN_FOLLOW;
+}
+
+static void stop_following(Connection *conn) {
+    EventLoop *loop = conn->loop;
+    if (!conn->reader) return;
+    if (conn->prev_follower) conn->prev_follower->next_follower = conn->next_follower;
+    else loop->followers = conn->next_follower;
+    if (conn->next_follower) conn->next_follower->prev_follower = conn->prev_follower;
+    conn->prev_follower = conn->next_follower = NULL;
+    flight_leave(conn->reader);
+    conn->reader = NULL;
+}
+
+// Closes both sockets and moves the connection to the graveyard. Memory is
+// released after the current epoll batch, since later events in the same
+// batch may still point at this connection.
+static void conn_close(Connection *conn) {
+    EventLoop *loop = conn->loop;
+    if (conn->dead) return;
+    conn->dead = 1;
+    if (conn->timing.started_us && conn->state != CONN_READ_REQUEST) {
+        // A tunnel ends here; anything else was cut short.
+        int tunnel = conn->is_tunnel && conn->state == CONN_RELAY;
+        request_timing_mark(&conn->timing, PHASE_TRANSFER);
+        conn->timing.complete = tunnel;
+        request_timing_finish(&conn->timing, conn->client_name, conn->request.method, conn->request.url);
+    }
+    stop_following(conn);
+    if (conn->flight) {
+        // Readers that have not received anything yet fetch on their own.
+        flight_finish(conn->flight, 0);
+        conn->flight = NULL;
+    }
+    if (conn->is_tunnel && conn->state == CONN_RELAY) {
+        metrics_add(METRIC_ACTIVE_TUNNELS, -1);
+    }
+    if (conn->origin.fd >= 0) close(conn->origin.fd);
+    close(conn->client.fd);
+    log_message(LOG_LEVEL_INFO, "Closed connection on socket %d", conn->client.fd);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    conn->next = loop->graveyard;
+    loop->graveyard = conn;
+}
+
+static void reap_connections(EventLoop *loop) {
+    while (loop->graveyard) {
+        Connection *conn = loop->graveyard;
+        loop->graveyard = conn->next;
+        conn_free(conn);
+    }
+}
+
+// Moves a response that outgrew memory to the disk tier, seeded with the bytes buffered so far.
+static void fill_spill_to_disk(Connection *conn) {
+    HttpResponseInfo info;
+    if (!disk_cache_enabled() || !conn->fill.head ||
+        parse_http_response_head(conn->fill.head->data, conn->fill.head->length, &info) != 1 ||
+        !response_is_storable(&info)) {
+        return;
+    }
+    conn->disk_expires = response_expiry(&info, time(NULL));
+    if (conn->disk_expires > time(NULL) || info.etag[0] || info.last_modified[0]) {
+        conn->disk_fill = disk_cache_begin_fill(conn->request.url, &conn->fill);
+    }
+}
+
+// Appends bytes read from the origin to the cache fill chunks. Once the
+// response outgrows the cache object limit it is spilled to the disk tier if
+// enabled; otherwise filling stops (but relaying continues). When leading a
+// flight the chunks are published to its readers, which share them.
+static void fill_append(Connection *conn, const char *data, size_t len) {
+    if (conn->disk_fill && disk_cache_fill_write(conn->disk_fill, data, len) < 0) {
+        conn->disk_fill = NULL;  // Aborted by the disk tier.
+    }
+    if (conn->filling && conn->fill.length + len > cache_max_object_size()) {
+        fill_spill_to_disk(conn);
+        if (conn->disk_fill && disk_cache_fill_write(conn->disk_fill, data, len) < 0) {
+            conn->disk_fill = NULL;
+        }
+        if (!conn->disk_fill) {
+            log_message(LOG_LEVEL_DEBUG, "Response for %s exceeds the cache object limit, not caching", conn->request.url);
+        }
+        conn->filling = 0;
+    }
+    if (!conn->filling && !conn->flight) {
+        chunk_list_free(&conn->fill);
+        return;
+    }
+    if (chunk_list_append(&conn->fill, data, len) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed during response accumulation");
+        chunk_list_free(&conn->fill);
+        conn->filling = 0;
+        if (conn->flight) flight_finish(conn->flight, 0);
+        conn->flight = NULL;
+        return;
+    }
+    if (conn->flight) {
+        flight_publish(conn->flight, &conn->fill);
+        // Once not caching, published chunks are left to the readers; the
+        // last one takes the next bytes.
+        while (!conn->filling && conn->fill.head != conn->fill.tail) chunk_list_drop_head(&conn->fill);
+    }
+}
+
+// Stores a response that was read to its end; a truncated one is discarded,
+// as is one to a request with credentials that the response does not allow
+// a shared cache to keep.
+static void fill_finish(Connection *conn, int complete) {
+    double time_taken = (metrics_now_us() - conn->fetch_started) / 1e6;
+    log_message(LOG_LEVEL_INFO, "HTTP request to %s completed in %.3f seconds", conn->request.url, time_taken);
+    int storable = complete && (!conn->request.authorization ||
+                                response_allows_authorized_storing(&conn->tracker.info));
+    if (conn->filling && storable) {
+        insert_cache(conn->request.url, &conn->fill, time_taken);
+    }
+    conn->filling = 0;
+    if (conn->disk_fill && storable) {
+        disk_cache_commit_fill(conn->disk_fill, time_taken, conn->disk_expires);
+    } else if (conn->disk_fill) {
+        disk_cache_abort_fill(conn->disk_fill);
+    }
+    conn->disk_fill = NULL;
+    // End the flight after inserting, so later requests find the response in the cache.
+    if (conn->flight) {
+        flight_finish(conn->flight, complete);
+        conn->flight = NULL;
+    }
+}
+
+static int buffer_append(RelayBuffer *buf, const char *data, size_t len) {
+    if (len > sizeof(buf->data) - buf->tail) return -1;
+    memcpy(buf->data + buf->tail, data, len);
+    buf->tail += len;
+    return 0;
+}
+
+/**
+ * Moves bytes from src to dst through buf until one side would block.
+ * If read_src is 0 only the bytes already buffered are flushed. With 'fill'
+ * set the bytes are an origin response: they are tracked to its framed end
+ * and accumulated for the cache.
+ * Returns 0 when waiting for readiness, -1 on a socket error.
+ */
+static int pump(Connection *conn, Side *src, RelayBuffer *buf, Side *dst, int read_src, int fill) {
+    for (;;) {
+        if (buf->tail > buf->head) {
+            if (!dst->writable) return 0;
+            ssize_t n = send(dst->fd, buf->data + buf->head, buf->tail - buf->head, MSG_NOSIGNAL);
+            if (n > 0) {
+                if (dst == &conn->client) {
+                    metrics_add(METRIC_BYTES_SENT, n);
+                    conn->timing.bytes += n;
+                }
+                buf->head += n;
+                if (buf->head == buf->tail) buf->head = buf->tail = 0;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                dst->writable = 0;
+                return 0;
+            }
+            return -1;
+        }
+        if (!read_src || src->eof || !src->readable) return 0;
+        if (fill && conn->tracker.done) return 0;  // Nothing more belongs to this response.
+        ssize_t n = read(src->fd, buf->data, sizeof(buf->data));
+        if (n > 0) {
+            buf->tail = n;
+            if (src == &conn->origin) metrics_add(METRIC_BYTES_RECEIVED, n);
+            if (fill) {
+                if (conn->tracker.total == 0) request_timing_mark(&conn->timing, PHASE_TTFB);
+                response_tracker_feed(&conn->tracker, buf->data, n);
+                fill_append(conn, buf->data, n);
+            }
+            continue;
+        }
+        if (n == 0) {
+            src->eof = 1;
+            return 0;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            src->readable = 0;
+            return 0;
+        }
+        return -1;
+    }
+}
+
+// Sends 'data', or the chunks of 'cached' if it is not NULL.
+static void set_response(Connection *conn, const char *data, size_t len, CacheEntry *cached, int keep_alive) {
+    conn->response = data;
+    conn->response_len = len;
+    conn->response_off = 0;
+    conn->cached = cached;
+    conn->cached_cursor.chunk = NULL;
+    conn->cached_cursor.offset = 0;
+    conn->response_keep_alive = keep_alive;
+    conn->state = CONN_WRITE_RESPONSE;
+}
+
+// Answers a request the parser rejected, then closes the connection.
+// Returns 1 once the answer is queued.
+static int reject_request(Connection *conn) {
+    size_t length;
+    const char *response = request_error_response(conn->request_buf.error_status, &length);
+    if (!conn->timing.started_us) request_timing_start(&conn->timing, metrics_now_us());
+    conn->request_kind = -1;
+    conn->timing.result = "rejected";
+    conn->timing.status = conn->request_buf.error_status;
+    set_response(conn, response, length, NULL, 0);
+    return 1;
+}
+
+/**
+ * Reads the next request header from the client. Its body and any pipelined
+ * requests after it stay buffered; the body is forwarded while relaying.
+ * Returns 1 once a request is parsed or rejected, 0 if more data is needed,
+ * -1 on error.
+ */
+static int read_request(Connection *conn) {
+    RequestBuffer *buf = &conn->request_buf;
+    for (;;) {
+        // The request's clock starts at its first byte.
+        if (!conn->timing.started_us && buf->length > 0) request_timing_start(&conn->timing, metrics_now_us());
+        int head_length = parse_http_request_head(buf, &conn->request);
+        if (head_length < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to parse HTTP request on socket %d", conn->client.fd);
+            return reject_request(conn);
+        }
+        if (head_length > 0) {
+            consume_request(buf, head_length, &conn->request);
+            return 1;
+        }
+        if (!conn->client.readable) return 0;
+        ssize_t n = read(conn->client.fd, buf->data + buf->length, sizeof(buf->data) - buf->length);
+        if (n > 0) {
+            buf->length += n;
+            continue;
+        }
+        if (n == 0) {
+            if (buf->length > 0)
+                log_message(LOG_LEVEL_ERROR, "Client closed socket %d mid-request", conn->client.fd);
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->client.readable = 0;
+            return 0;
+        }
+        log_message(LOG_LEVEL_ERROR, "Failed to read from client socket");
+        return -1;
+    }
+}
+
+// The request is revalidating a stale cache entry or disk object with the origin.
+static int revalidating(const Connection *conn) {
+    return conn->stale || (conn->disk_hit.fd >= 0 && conn->disk_hit.stale);
+}
+
+static int begin_connect(Connection *conn) {
+    request_timing_mark(&conn->timing, PHASE_DNS);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to create origin socket");
+        return -1;
+    }
+    conn->origin.fd = fd;
+    int rc = connect(fd, (struct sockaddr *)&conn->origin_addr, sizeof(conn->origin_addr));
+    if (rc < 0 && errno != EINPROGRESS) {
+        log_message(LOG_LEVEL_ERROR, "Failed to connect to %s:%d", conn->request.host, conn->request.port);
+        return -1;
+    }
+    if (watch_side(conn, &conn->origin) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to register origin socket with epoll");
+        return -1;
+    }
+    conn->origin.writable = (rc == 0);
+    conn->state = CONN_CONNECTING;
+    return 0;
+}
+
+// Runs on an offload pool thread.
+static void resolve_job(void *arg) {
+    Connection *conn = (Connection *)arg;
+    EventLoop *loop = conn->loop;
+    conn->resolve_status = resolve_host(conn->request.host, conn->request.port, &conn->origin_addr);
+
+    pthread_mutex_lock(&loop->resolved_mutex);
+    conn->next_resolved = loop->resolved;
+    loop->resolved = conn;
+    pthread_mutex_unlock(&loop->resolved_mutex);
+
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to wake event loop after DNS lookup");
+    }
+}
+
+static int start_resolve(Connection *conn) {
+    // Hosts in the DNS cache connect straight away, without a trip to the offload pool.
+    int cached = dns_lookup_cached(conn->request.host, &conn->origin_addr.sin_addr);
+    if (cached < 0) {
+        log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", conn->request.host, conn->request.port);
+        return -1;
+    }
+    if (cached > 0) {
+        conn->origin_addr.sin_family = AF_INET;
+        conn->origin_addr.sin_port = htons(conn->request.port);
+        return begin_connect(conn);
+    }
+    conn->state = CONN_RESOLVING;
+    if (conn->loop->offload && thread_pool_submit(conn->loop->offload, resolve_job, conn) == 0) {
+        return 0;
+    }
+    // No offload pool: resolve inline on the loop thread.
+    if (resolve_host(conn->request.host, conn->request.port, &conn->origin_addr) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", conn->request.host, conn->request.port);
+        return -1;
+    }
+    return begin_connect(conn);
+}
+
+// Starts talking to the origin, on a pooled keep-alive connection if one is
+// idle. A request body is consumed as it is sent and could not be sent again
+// after a retry, so it goes over a fresh connection.
+static int start_origin(Connection *conn) {
+    int fresh = conn->is_tunnel || request_has_body(&conn->request);
+    int fd = fresh ? -1 : conn_pool_take(conn->request.host, conn->request.port);
+    if (fd < 0) {
+        return start_resolve(conn);
+    }
+    conn->origin.fd = fd;
+    conn->origin_reused = 1;
+    if (set_nonblocking(fd) < 0 || watch_side(conn, &conn->origin) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to register origin socket with epoll");
+        return -1;
+    }
+    conn->origin.writable = 1;
+    conn->state = CONN_CONNECTING;
+    return 0;
+}
+
+// Returns a finished origin connection to the keep-alive pool.
+static void release_origin(Connection *conn) {
+    epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->origin.fd, NULL);
+    conn_pool_release(conn->request.host, conn->request.port, conn->origin.fd);
+    conn->origin.fd = -1;
+}
+
+// A pooled connection the origin had already closed: send the request again
+// on a fresh one. Returns 1 once restarted, -1 on failure.
+static int retry_origin(Connection *conn) {
+    log_message(LOG_LEVEL_DEBUG, "Pooled connection to %s:%d was closed, retrying",
+                conn->request.host, conn->request.port);
+    close(conn->origin.fd);
+    conn->origin.fd = -1;
+    conn->origin.readable = conn->origin.writable = conn->origin.eof = 0;
+    conn->origin_reused = 0;
+    conn->upstream.head = conn->upstream.tail = 0;
+    conn->downstream.head = conn->downstream.tail = 0;
+    return start_resolve(conn) < 0 ? -1 : 1;
+}
+
+/**
+ * Ends the current request. If the client may send another one, the
+ * connection is reset to read it; it may already be buffered.
+ * Returns 1 to carry on with the next request, -1 to close the connection.
+ */
+static int finish_request(Connection *conn, int reusable) {
+    if (conn->request_kind >= 0) metrics_record_request((RequestKind)conn->request_kind, conn->timing.started_us);
+    request_timing_mark(&conn->timing, PHASE_TRANSFER);
+    request_timing_finish(&conn->timing, conn->client_name, conn->request.method, conn->request.url);
+    conn->timing.started_us = 0;
+    conn->requests_served++;
+    // A body that was not forwarded (the request was answered locally, or
+    // the origin answered early) is not read past: the connection closes.
+    if (conn->request_buf.body.active) reusable = 0;
+    if (!client_keep_alive(&conn->request, reusable, conn->requests_served)) return -1;
+    release_cache_entry(conn->cached);
+    conn->cached = NULL;
+    conn->response = NULL;
+    conn->response_len = conn->response_off = 0;
+    if (conn->disk_hit.fd >= 0) {
+        close(conn->disk_hit.fd);
+        conn->disk_hit.fd = -1;
+    }
+    stop_following(conn);
+    if (conn->origin.fd >= 0) {
+        close(conn->origin.fd);
+        conn->origin.fd = -1;
+    }
+    conn->origin.readable = conn->origin.writable = conn->origin.eof = 0;
+    conn->origin_reused = 0;
+    conn->is_tunnel = 0;
+    chunk_list_free(&conn->fill);
+    conn->filling = 0;
+    conn->upstream.head = conn->upstream.tail = 0;
+    conn->downstream.head = conn->downstream.tail = 0;
+    conn->idle_since = time(NULL);
+    conn->state = CONN_READ_REQUEST;
+    return 1;
+}
+
+// Parses the buffered request and decides how to serve it.
+static int dispatch_request(Connection *conn) {
+    HttpRequest *req = &conn->request;
+    metrics_add(METRIC_REQUESTS, 1);
+    request_timing_mark(&conn->timing, PHASE_PARSE);
+    conn->request_kind = REQUEST_MISS;
+
+    // Check if the requested host is blocked.
+    int blocked = is_url_blocked(req->host);
+    request_timing_mark(&conn->timing, PHASE_BLOCK);
+    if (blocked) {
+        remove_cache_by_url(req->host);
+        log_message(LOG_LEVEL_INFO, "Blocked URL: %s", req->host);
+        metrics_add(METRIC_BLOCKED, 1);
+        conn->request_kind = -1;
+        conn->timing.result = "blocked";
+        conn->timing.status = 403;
+        set_response(conn, BLOCK_RESPONSE, sizeof(BLOCK_RESPONSE) - 1, NULL, 1);
+        return 0;
+    }
+
+    conn->is_tunnel = (strcmp(req->method, "CONNECT") == 0);
+    if (conn->is_tunnel) conn->request_kind = REQUEST_CONNECT;
+    // Requests with a body are never served from or stored in the cache.
+    int cacheable = strcmp(req->method, "GET") == 0 && !request_has_body(req);
+    conn->timing.result = conn->is_tunnel ? "tunnel" : cacheable ? "miss" : "pass";
+    if (cacheable) {
+        CacheEntry *cached;
+        if (lookup_cache(req->url, &cached)) {
+            if (cache_entry_is_fresh(cached)) {
+                request_timing_mark(&conn->timing, PHASE_CACHE);
+                log_message(LOG_LEVEL_INFO, "Serving cached content for %s", req->url);
+                metrics_add(METRIC_CACHE_HITS_MEMORY, 1);
+                conn->request_kind = REQUEST_HIT;
+                conn->timing.result = "hit";
+                conn->timing.status = cached->status;
+                set_response(conn, NULL, cached->response.length, cached, cached->keep_alive);
+                return 0;
+            }
+            // Keep a stale entry with a validator to revalidate with the origin.
+            if (cache_entry_can_revalidate(cached)) {
+                conn->stale = cached;
+            } else {
+                release_cache_entry(cached);
+            }
+        }
+        int disk_found = !conn->stale && disk_cache_open(req->url, &conn->disk_hit);
+        request_timing_mark(&conn->timing, PHASE_CACHE);
+        if (disk_found && !conn->disk_hit.stale) {
+            log_message(LOG_LEVEL_INFO, "Serving cached content from disk for %s", req->url);
+            metrics_add(METRIC_CACHE_HITS_DISK, 1);
+            conn->request_kind = REQUEST_HIT;
+            conn->timing.result = "disk_hit";
+            conn->timing.status = conn->disk_hit.status;
+            set_response(conn, NULL, conn->disk_hit.length, NULL, conn->disk_hit.keep_alive);
+            return 0;
+        }
+
+        // Coalesce concurrent misses: the first request fetches, the rest share its response.
+        if (!revalidating(conn)) {
+            metrics_add(METRIC_CACHE_MISSES, 1);
+            FlightReader *reader;
+            conn->flight = flight_join(req->url, &reader);
+            if (reader) {
+                conn->flight = NULL;
+                metrics_add(METRIC_COALESCED, 1);
+                conn->timing.result = "coalesced";
+                start_following(conn, reader);
+                return 0;
+            }
+        }
+    }
+
+    conn->fetch_started = metrics_now_us();
+    return start_origin(conn);
+}
+
+static int finish_connect(Connection *conn) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->origin.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", conn->request.host, conn->request.port);
+        return -1;
+    }
+    request_timing_mark(&conn->timing, PHASE_CONNECT);
+
+    if (conn->is_tunnel) {
+        // Inform the client that the connection is established.
+        buffer_append(&conn->downstream, CONNECT_ESTABLISHED, sizeof(CONNECT_ESTABLISHED) - 1);
+        metrics_record_request(REQUEST_CONNECT, conn->timing.started_us);
+        conn->timing.status = 200;
+        metrics_add(METRIC_ACTIVE_TUNNELS, 1);
+        conn->request_kind = -1;
+    } else {
+        // Forward a minimal HTTP/1.1 request, conditional when revalidating.
+        char forward_buffer[4096];
+        const DiskCacheHit *hit = &conn->disk_hit;
+        const char *etag = conn->stale ? conn->stale->etag : revalidating(conn) && hit->etag[0] ? hit->etag : NULL;
+        const char *last_modified = conn->stale ? conn->stale->last_modified
+                                    : revalidating(conn) && hit->last_modified[0] ? hit->last_modified : NULL;
+        int n = format_origin_request(forward_buffer, sizeof(forward_buffer), &conn->request, etag, last_modified);
+        if (n < 0 || buffer_append(&conn->upstream, forward_buffer, n) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to send request to server");
+            return -1;
+        }
+        conn->filling = strcmp(conn->request.method, "GET") == 0 && !request_has_body(&conn->request) &&
+                        !conn->request.no_store;
+        response_tracker_init(&conn->tracker, strcmp(conn->request.method, "HEAD") == 0);
+    }
+    conn->state = revalidating(conn) ? CONN_REVALIDATE : CONN_RELAY;
+    return 0;
+}
+
+/**
+ * Sends the conditional request and reads the origin's answer into the
+ * downstream buffer, without passing it on, until its header is complete.
+ * On 304 Not Modified the stale entry is refreshed and served; otherwise the
+ * buffered bytes are relayed as a normal response.
+ * Returns 1 once decided, 0 when waiting for readiness, -1 on error.
+ */
+static int revalidate(Connection *conn) {
+    RelayBuffer *buf = &conn->downstream;
+    ResponseTracker *tracker = &conn->tracker;
+    int rc = pump(conn, &conn->client, &conn->upstream, &conn->origin, 0, 0);
+    while (rc == 0 && !tracker->head_done && !conn->origin.eof && buf->tail < sizeof(buf->data)) {
+        if (!conn->origin.readable) return 0;
+        ssize_t n = read(conn->origin.fd, buf->data + buf->tail, sizeof(buf->data) - buf->tail);
+        if (n > 0) {
+            metrics_add(METRIC_BYTES_RECEIVED, n);
+            if (tracker->total == 0) request_timing_mark(&conn->timing, PHASE_TTFB);
+            response_tracker_feed(tracker, buf->data + buf->tail, n);
+            buf->tail += n;
+            continue;
+        }
+        if (n == 0) {
+            conn->origin.eof = 1;
+            break;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->origin.readable = 0;
+            return 0;
+        }
+        log_message(LOG_LEVEL_ERROR, "Failed to read from origin for %s", conn->request.url);
+        rc = -1;
+    }
+    if (conn->origin_reused && tracker->total == 0 && (rc < 0 || conn->origin.eof)) {
+        return retry_origin(conn);
+    }
+    if (rc < 0) return -1;
+
+    CacheEntry *stale = conn->stale;
+    conn->stale = NULL;
+    if (tracker->head_done && tracker->info.status == 304) {
+        if (response_tracker_reusable(tracker)) {
+            release_origin(conn);
+        } else {
+            close(conn->origin.fd);
+            conn->origin.fd = -1;
+        }
+        buf->head = buf->tail = 0;
+        log_message(LOG_LEVEL_INFO, "Serving revalidated cached content for %s", conn->request.url);
+        metrics_add(METRIC_CACHE_REVALIDATED, 1);
+        conn->request_kind = REQUEST_HIT;
+        conn->timing.result = "revalidated";
+        if (stale) {
+            refresh_cache_entry(stale, &tracker->info);
+            conn->timing.status = stale->status;
+            set_response(conn, NULL, stale->response.length, stale, stale->keep_alive);
+        } else {
+            // Sent from the file like a disk hit, then promoted.
+            disk_cache_refresh(conn->request.url, &conn->disk_hit, &tracker->info);
+            conn->timing.status = conn->disk_hit.status;
+            set_response(conn, NULL, conn->disk_hit.length, NULL, conn->disk_hit.keep_alive);
+        }
+        return 1;
+    }
+    release_cache_entry(stale);
+    if (conn->disk_hit.fd >= 0) {
+        // The new response replaces the stale copy.
+        close(conn->disk_hit.fd);
+        conn->disk_hit.fd = -1;
+        disk_cache_remove(conn->request.url);
+    }
+    metrics_add(METRIC_CACHE_MISSES, 1);
+    fill_append(conn, buf->data, buf->tail);
+    conn->state = CONN_RELAY;
+    return 1;
+}
+
+/**
+ * Moves the request body from the client into the upstream buffer, behind
+ * the forwarded header, as the origin takes it. Bytes after the body stay
+ * buffered as the next request.
+ * Returns 0 when done or waiting for readiness, -1 on error.
+ */
+static int forward_body(Connection *conn) {
+    RequestBuffer *buf = &conn->request_buf;
+    RelayBuffer *upstream = &conn->upstream;
+    while (buf->body.active) {
+        if (pump(conn, &conn->client, upstream, &conn->origin, 0, 0) < 0) return -1;
+        if (upstream->tail > upstream->head) return 0;  // Waiting for the origin to drain.
+        if (buf->length > 0) {
+            ssize_t n = request_body_span(buf, sizeof(upstream->data));
+            if (n < 0) return -1;
+            buffer_append(upstream, buf->data, n);
+            request_buffer_drop(buf, n);
+            continue;
+        }
+        if (!conn->client.readable) return 0;
+        ssize_t n = read(conn->client.fd, buf->data, sizeof(buf->data));
+        if (n > 0) {
+            buf->length = n;
+            continue;
+        }
+        if (n == 0) {
+            log_message(LOG_LEVEL_ERROR, "Client closed socket %d mid-request", conn->client.fd);
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->client.readable = 0;
+            return 0;
+        }
+        log_message(LOG_LEVEL_ERROR, "Failed to read request body from client socket");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Relays between client and origin. A plain HTTP response ends at its framed
+ * length (or when the origin closes, if it has none), after which the origin
+ * connection goes back to the keep-alive pool.
+ * Returns 1 after restarting on a fresh origin connection or moving on to the
+ * client's next request, 0 when waiting, -1 to close the connection.
+ */
+static int relay(Connection *conn) {
+    // Client -> origin carries the forwarded request and its body, plus tunnel traffic.
+    int rc = conn->is_tunnel ? 0 : forward_body(conn);
+    if (rc == 0) rc = pump(conn, &conn->client, &conn->upstream, &conn->origin, conn->is_tunnel, 0);
+    // Origin -> client carries the response, accumulated for the cache.
+    if (rc == 0) rc = pump(conn, &conn->origin, &conn->downstream, &conn->client, 1, !conn->is_tunnel);
+
+    if (conn->is_tunnel) {
+        if (rc < 0) return -1;
+        int downstream_empty = (conn->downstream.tail == conn->downstream.head);
+        int upstream_empty = (conn->upstream.tail == conn->upstream.head);
+        if ((conn->client.eof && upstream_empty) || (conn->origin.eof && downstream_empty)) return -1;
+        return 0;
+    }
+
+    ResponseTracker *tracker = &conn->tracker;
+    if (conn->origin_reused && tracker->total == 0 && (rc < 0 || conn->origin.eof)) {
+        return retry_origin(conn);
+    }
+    if (rc < 0) {
+        fill_finish(conn, 0);
+        return -1;
+    }
+    int downstream_empty = (conn->downstream.tail == conn->downstream.head);
+    if ((tracker->done || conn->origin.eof) && downstream_empty) {
+        int complete = tracker->done || (tracker->head_done && tracker->framing == FRAMING_CLOSE);
+        int reusable = tracker->done && response_tracker_reusable(tracker);
+        fill_finish(conn, complete);
+        // An origin that ignored the body would read it as the next request,
+        // so a connection that carried one is not pooled.
+        if (reusable && !request_has_body(&conn->request)) {
+            release_origin(conn);
+        }
+        conn->timing.status = tracker->head_done ? tracker->info.status : 0;
+        conn->timing.complete = complete;
+        return finish_request(conn, reusable);
+    }
+    return 0;
+}
+
+// A disk hit being copied back into memory on the offload pool.
+typedef struct {
+    char *url;
+    DiskCacheHit hit;
+} PromoteJob;
+
+static void promote_job(void *arg) {
+    PromoteJob *job = (PromoteJob *)arg;
+    disk_cache_promote(job->url, &job->hit);
+    close(job->hit.fd);
+    free(job->url);
+    free(job);
+}
+
+// Hands a fully sent disk hit over for promotion into the memory cache. The
+// file is read back on the offload pool so the loop never blocks on disk.
+static void promote_disk_hit(Connection *conn) {
+    PromoteJob *job = (PromoteJob *)malloc(sizeof(PromoteJob));
+    if (!job || !(job->url = strdup(conn->request.url))) {
+        free(job);
+        return;
+    }
+    job->hit = conn->disk_hit;
+    if (!conn->loop->offload || thread_pool_submit(conn->loop->offload, promote_job, job) < 0) {
+        // No offload pool: leave the object on disk.
+        free(job->url);
+        free(job);
+        return;
+    }
+    conn->disk_hit.fd = -1;  // Now owned by the job.
+}
+
+static int write_response(Connection *conn) {
+    while (conn->response_off < conn->response_len) {
+        if (!conn->client.writable) return 0;
+        ssize_t n;
+        if (conn->disk_hit.fd >= 0) {
+            off_t offset = (off_t)conn->response_off;
+            n = disk_cache_sendfile(conn->client.fd, conn->disk_hit.fd, &offset,
+                                    conn->response_len - conn->response_off);
+        } else if (conn->cached) {
+            struct iovec iov[16];
+            struct msghdr msg = { 0 };
+            msg.msg_iov = iov;
+            msg.msg_iovlen = chunk_cursor_iov(&conn->cached_cursor, &conn->cached->response, iov, 16);
+            n = sendmsg(conn->client.fd, &msg, MSG_NOSIGNAL);
+            if (n > 0) chunk_cursor_advance(&conn->cached_cursor, &conn->cached->response, n);
+        } else {
+            n = send(conn->client.fd, conn->response + conn->response_off,
+                     conn->response_len - conn->response_off, MSG_NOSIGNAL);
+        }
+        if (n > 0) {
+            conn->response_off += n;
+            metrics_add(METRIC_BYTES_SENT, n);
+            conn->timing.bytes += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn->client.writable = 0;
+            return 0;
+        }
+        log_message(LOG_LEVEL_ERROR, "Failed to send response to client");
+        return -1;
+    }
+    if (conn->disk_hit.fd >= 0) {
+        promote_disk_hit(conn);
+    }
+    conn->timing.complete = 1;
+    return finish_request(conn, conn->response_keep_alive);
+}
+
+/**
+ * Relays bytes from the followed fetch to the client as they arrive.
+ * If the fetch fails before anything was relayed, the connection falls back
+ * to fetching on its own.
+ * Returns 1 after falling back, 0 when waiting, -1 to close the connection.
+ */
+static int follow_flight(Connection *conn) {
+    RelayBuffer *buf = &conn->downstream;
+    for (;;) {
+        if (pump(conn, &conn->origin, buf, &conn->client, 0, 0) < 0) return -1;
+        if (buf->tail > buf->head) return 0;  // Waiting for the client to drain.
+        ssize_t n = flight_read(conn->reader, buf->data, sizeof(buf->data), 0);
+        if (n > 0) {
+            buf->tail = n;
+            if (conn->tracker.total == 0) request_timing_mark(&conn->timing, PHASE_TTFB);
+            response_tracker_feed(&conn->tracker, buf->data, n);
+            continue;
+        }
+        if (n == FLIGHT_AGAIN) return 0;
+        if (n == 0) {
+            conn->timing.status = conn->tracker.head_done ? conn->tracker.info.status : 0;
+            conn->timing.complete = 1;
+            return finish_request(conn, response_tracker_reusable(&conn->tracker));
+        }
+        int relayed = flight_reader_offset(conn->reader) > 0;
+        log_message(LOG_LEVEL_WARN, "Shared fetch of %s failed%s", conn->request.url,
+                    relayed ? "" : ", fetching directly");
+        stop_following(conn);
+        if (relayed) return -1;
+        conn->timing.result = "miss";
+        conn->fetch_started = metrics_now_us();
+        if (start_origin(conn) < 0) return -1;
+        return 1;
+    }
+}
+
+/**
+ * Advances the connection state machine as far as readiness allows.
+ * Returns 0 to keep the connection open, -1 to close it.
+ */
+static int conn_progress(Connection *conn) {
+    for (;;) {
+        switch (conn->state) {
+            case CONN_READ_REQUEST: {
+                int rc = read_request(conn);
+                if (rc <= 0) return rc;
+                // A rejected request is answered without being dispatched.
+                if (conn->state == CONN_READ_REQUEST && dispatch_request(conn) < 0) return -1;
+                break;
+            }
+            case CONN_RESOLVING:
+                return 0;
+            case CONN_CONNECTING:
+                if (!conn->origin.writable) return 0;
+                if (finish_connect(conn) < 0) return -1;
+                break;
+            case CONN_REVALIDATE: {
+                int rc = revalidate(conn);
+                if (rc <= 0) return rc;
+                break;
+            }
+            case CONN_FOLLOW: {
+                int rc = follow_flight(conn);
+                if (rc <= 0) return rc;
+                break;
+            }
+            case CONN_RELAY: {
+                int rc = relay(conn);
+                if (rc <= 0) return rc;
+                break;
+            }
+            case CONN_WRITE_RESPONSE: {
+                int rc = write_response(conn);
+                if (rc <= 0) return rc;
+                break;
+            }
+        }
+    }
+}
+
+static void handle_connection_event(Endpoint *endpoint, uint32_t events) {
+    Connection *conn = endpoint->conn;
+    if (conn->dead) return;
+    Side *side = (endpoint->type == ENDPOINT_CLIENT) ? &conn->client : &conn->origin;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) side->readable = 1;
+    if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) side->writable = 1;
+    if (conn_progress(conn) < 0) conn_close(conn);
+}
+
+// The listener is level-triggered, so connections left over after a batch
+// are picked up on the next epoll_wait.
+static void accept_connections(EventLoop *loop) {
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_sock = accept4(loop->listen_fd, (struct sockaddr *)&client_addr, &addr_len,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_message(LOG_LEVEL_ERROR, "Failed to accept client connection");
+            }
+            return;
+        }
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        log_message(LOG_LEVEL_INFO, "Accepted connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
+        int retry_after = client_rate_check(client_addr.sin_addr.s_addr);
+        if (retry_after > 0) {
+            log_message(LOG_LEVEL_WARN, "Rate limit exceeded by %s, refusing connection", client_ip);
+            metrics_add(METRIC_SHED_RATE_LIMIT, 1);
+            shed_connection(client_sock, retry_after);
+            continue;
+        }
+        char client_name[INET_ADDRSTRLEN + 8];
+        snprintf(client_name, sizeof(client_name), "%s:%d", client_ip, ntohs(client_addr.sin_port));
+
+        Connection *conn = conn_new(loop, client_sock, client_name);
+        if (!conn) {
+            close(client_sock);
+        }
+    }
+}
+
+// Handles wakeups from other threads: finished DNS lookups and new bytes for
+// connections following a shared fetch.
+static void drain_wakeups(EventLoop *loop) {
+    uint64_t count;
+    while (read(loop->wake_fd, &count, sizeof(count)) > 0) {
+    }
+
+    pthread_mutex_lock(&loop->resolved_mutex);
+    Connection *conn = loop->resolved;
+    loop->resolved = NULL;
+    pthread_mutex_unlock(&loop->resolved_mutex);
+
+    while (conn) {
+        Connection *next = conn->next_resolved;
+        if (conn->resolve_status < 0) {
+            log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", conn->request.host, conn->request.port);
+            conn_close(conn);
+        } else if (begin_connect(conn) < 0 || conn_progress(conn) < 0) {
+            conn_close(conn);
+        }
+        conn = next;
+    }
+
+    conn = loop->followers;
+    while (conn) {
+        Connection *next = conn->next_follower;
+        if (conn_progress(conn) < 0) conn_close(conn);
+        conn = next;
+    }
+}
+
+// Closes persistent client connections that have waited too long for their next request.
+static void close_idle_connections(EventLoop *loop, time_t now) {
+    int timeout = client_idle_timeout();
+    Connection *conn = loop->connections;
+    while (conn) {
+        Connection *next = conn->next;
+        if (conn->state == CONN_READ_REQUEST && conn->requests_served > 0 &&
+            conn->request_buf.length == 0 &&
+            now - conn->idle_since >= timeout) {
+            log_message(LOG_LEVEL_DEBUG, "Closing idle client connection on socket %d", conn->client.fd);
+            conn_close(conn);
+        }
+        conn = next;
+    }
+}
+
+static void *event_loop_thread(void *arg) {
+    EventLoop *loop = (EventLoop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    if (loop->pin_cpu) {
+        int cpu = pin_thread_to_cpu(loop->index);
+        if (cpu < 0) log_message(LOG_LEVEL_WARN, "Failed to pin event loop %d to a CPU", loop->index);
+        else log_message(LOG_LEVEL_DEBUG, "Event loop %d pinned to CPU %d", loop->index, cpu);
+    }
+    while (loops_running) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "epoll_wait failed in event loop");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Endpoint *endpoint = (Endpoint *)events[i].data.ptr;
+            switch (endpoint->type) {
+                case ENDPOINT_LISTEN:
+                    accept_connections(loop);
+                    break;
+                case ENDPOINT_WAKE:
+                    drain_wakeups(loop);
+                    break;
+                default:
+                    handle_connection_event(endpoint, events[i].events);
+                    break;
+            }
+        }
+        time_t now = time(NULL);
+        if (now != loop->last_idle_check) {
+            loop->last_idle_check = now;
+            close_idle_connections(loop, now);
+        }
+        reap_connections(loop);
+    }
+    return NULL;
+}
+
+static int init_loop(EventLoop *loop, int server_sock, ThreadPool *offload) {
+    loop->listen_fd = server_sock;
+    loop->offload = offload;
+    loop->listen_endpoint.type = ENDPOINT_LISTEN;
+    loop->wake_endpoint.type = ENDPOINT_WAKE;
+    pthread_mutex_init(&loop->resolved_mutex, NULL);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epfd < 0 || loop->wake_fd < 0) return -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // EPOLLEXCLUSIVE wakes only one of the loops sharing the listener (it is
+    // a no-op when each loop has its own SO_REUSEPORT listener).
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &loop->listen_endpoint;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, server_sock, &ev) < 0) return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->wake_endpoint;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wake_fd, &ev) < 0) return -1;
+    return 0;
+}
+
+int event_loop_start(const int *listen_socks, int num_loops, ThreadPool *offload, int pin_cpus) {
+    if (num_loops < 1) return -1;
+    for (int i = 0; i < num_loops; i++) {
+        if (set_nonblocking(listen_socks[i]) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to make server socket non-blocking");
+            return -1;
+        }
+    }
+
+    loops = (EventLoop *)calloc(num_loops, sizeof(EventLoop));
+    if (!loops) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for event loops");
+        return -1;
+    }
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].epfd = -1;
+        loops[i].wake_fd = -1;
+    }
+    loop_count = num_loops;
+    loops_running = 1;
+
+    for (int i = 0; i < num_loops; i++) {
+        loops[i].index = i;
+        loops[i].pin_cpu = pin_cpus;
+        if (init_loop(&loops[i], listen_socks[i], offload) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to initialize event loop %d", i);
+            loop_count = i + 1;
+            event_loop_stop();
+            event_loop_destroy();
+            return -1;
+        }
+        if (pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]) != 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to create event loop thread %d", i);
+            loop_count = i + 1;
+            event_loop_stop();
+            event_loop_destroy();
+            return -1;
+        }
+    }
+    log_message(LOG_LEVEL_INFO, "Started %d event loop(s)", num_loops);
+    return 0;
+}
+
+void event_loop_stop(void) {
+    if (!loops) return;
+    loops_running = 0;
+    for (int i = 0; i < loop_count; i++) {
+        if (!loops[i].thread) continue;
+        uint64_t one = 1;
+        if (write(loops[i].wake_fd, &one, sizeof(one)) < 0) {
+            log_message(LOG_LEVEL_WARN, "Failed to wake event loop %d", i);
+        }
+        pthread_join(loops[i].thread, NULL);
+        loops[i].thread = 0;
+    }
+    log_message(LOG_LEVEL_INFO, "Event loops stopped");
+}
+
+void event_loop_destroy(void) {
+    if (!loops) return;
+    for (int i = 0; i < loop_count; i++) {
+        EventLoop *loop = &loops[i];
+        while (loop->connections) {
+            conn_close(loop->connections);
+        }
+        reap_connections(loop);
+        while (loop->free_connections) {
+            Connection *conn = loop->free_connections;
+            loop->free_connections = conn->next;
+            free(conn);
+        }
+        if (loop->epfd >= 0) close(loop->epfd);
+        if (loop->wake_fd >= 0) close(loop->wake_fd);
+        pthread_mutex_destroy(&loop->resolved_mutex);
+    }
+    free(loops);
+    loops = NULL;
+    loop_count = 0;
+}
+
+#else
+
+int event_loop_start(const int *listen_socks, int num_loops, ThreadPool *offload, int pin_cpus) {
+    (void)listen_socks;
+    (void)num_loops;
+    (void)offload;
+    (void)pin_cpus;
+    log_message(LOG_LEVEL_ERROR, "Event-driven mode requires epoll and is only available on Linux");
+    return -1;
+}
+
+void event_loop_stop(void) {
+}
+
+void event_loop_destroy(void) {
+}
+
+#endif
@@ -1,21 +1,46 @@
+#define _GNU_SOURCE  // For splice() and F_SETPIPE_SZ
 #include "http_handler.h"
 #include "logging.h"
+#include "dns.h"
+#include "metrics.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 
-// Helper function: Write all bytes from buffer to sock.
-static ssize_t write_all(int sock, const void *buffer, size_t length) {
+#define TUNNEL_BUFFER_SIZE 4096
+#define SPLICE_PIPE_SIZE (256 * 1024)
+#define DEFAULT_CLIENT_IDLE_TIMEOUT 5
+#define DEFAULT_CLIENT_MAX_REQUESTS 100
+
+static const char BAD_REQUEST_RESPONSE[] =
+    "HTTP/1.1 400 Bad Request\r\nContent-Length: 11\r\nConnection: close\r\n\r\nBad Request";
+static const char NOT_IMPLEMENTED_RESPONSE[] =
+    "HTTP/1.1 501 Not Implemented\r\nContent-Length: 15\r\nConnection: close\r\n\r\nNot Implemented";
+
+// Whether CONNECT tunnels try the splice() relay before the copy loop.
+static int tunnel_splice_enabled = 1;
+
+// Limits on persistent client connections.
+static int keep_alive_idle_timeout = DEFAULT_CLIENT_IDLE_TIMEOUT;
+static int keep_alive_max_requests = DEFAULT_CLIENT_MAX_REQUESTS;
+
+// Helper function: Write all bytes from buffer to sock, counting write() calls if requested.
+static ssize_t write_all_counted(int sock, const void *buffer, size_t length, unsigned long long *syscalls) {
     size_t total_written = 0;
     const char *buf = (const char *)buffer;
     while (total_written < length) {
         ssize_t written = write(sock, buf + total_written, length - total_written);
+        if (syscalls) (*syscalls)++;
         if (written <= 0) {
             return -1;
         }
@@ -24,34 +49,54 @@ static ssize_t write_all(int sock, const void *buffer, size_t length) {
     return total_written;
 }
 
+// Helper function: Write all bytes from buffer to sock.
+static ssize_t write_all(int sock, const void *buffer, size_t length) {
+    return write_all_counted(sock, buffer, length, NULL);
+}
 
-int connect_to_server(const char *host, int port) {
-    struct addrinfo hints, *res, *p;
-    char port_str[6];
-    snprintf(port_str, sizeof(port_str), "%d", port);
+void set_tunnel_splice(int enabled) {
+    tunnel_splice_enabled = enabled;
+}
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;        // IPv4 (or use AF_UNSPEC for IPv4 & IPv6)
-    hints.ai_socktype = SOCK_STREAM;    // TCP
+void set_client_keep_alive(int idle_timeout, int max_requests) {
+    keep_alive_idle_timeout = idle_timeout >= 0 ? idle_timeout : DEFAULT_CLIENT_IDLE_TIMEOUT;
+    keep_alive_max_requests = max_requests > 0 ? max_requests : DEFAULT_CLIENT_MAX_REQUESTS;
+}
+
+int client_idle_timeout(void) {
+    return keep_alive_idle_timeout;
+}
+
+int client_keep_alive(const HttpRequest *request, int response_reusable, int served) {
+    return keep_alive_idle_timeout > 0 && request->keep_alive && response_reusable &&
+           served < keep_alive_max_requests;
+}
 
-    int status = getaddrinfo(host, port_str, &hints, &res);
-    if (status != 0) {
-        log_message(LOG_LEVEL_ERROR, "getaddrinfo error for host %s: %s", host, gai_strerror(status));
+
+int resolve_host(const char *host, int port, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    if (dns_resolve(host, &addr->sin_addr) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to resolve host %s", host);
         return -1;
     }
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    return 0;
+}
 
-    int sock = -1;
-    for (p = res; p != NULL; p = p->ai_next) {
-        sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-        if (sock < 0)
-            continue;
-        if (connect(sock, p->ai_addr, p->ai_addrlen) == 0)
-            break;
+int connect_to_server(const char *host, int port, RequestTiming *timing) {
+    struct sockaddr_in addr;
+    int resolved = resolve_host(host, port, &addr);
+    if (timing) request_timing_mark(timing, PHASE_DNS);
+    if (resolved < 0) {
+        return -1;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         close(sock);
         sock = -1;
     }
-    freeaddrinfo(res);
-
+    if (timing) request_timing_mark(timing, PHASE_CONNECT);
     if (sock < 0) {
         log_message(LOG_LEVEL_ERROR, "Failed to connect to %s:%d", host, port);
     }
@@ -59,39 +104,101 @@ int connect_to_server(const char *host, int port) {
 }
 
 /**
- * Reads data from the client socket and parses the HTTP request.
- * For CONNECT methods, it expects the URL to be in the form "host:port".
- * For other methods, it extracts the host from an absolute URL.
+ * Reads from the client until the buffer holds a complete request header.
+ * The body stays to be forwarded by the caller.
  */
-int parse_http_request(int client_sock, HttpRequest *request) {
-    char buffer[4096];
-    int bytes_read = read(client_sock, buffer, sizeof(buffer) - 1);
-    if (bytes_read <= 0) {
-        log_message(LOG_LEVEL_ERROR, "Failed to read from client socket");
+int read_http_request(int client_sock, RequestBuffer *buffer, HttpRequest *request, int idle_timeout,
+                      uint64_t *started_us) {
+    int head_length;
+    if (started_us && buffer->length > 0) *started_us = metrics_now_us();
+    while ((head_length = parse_http_request_head(buffer, request)) == 0) {
+        if (buffer->length == 0 && idle_timeout >= 0) {
+            // Between requests on a persistent connection: wait at most idle_timeout.
+            struct pollfd pfd = { .fd = client_sock, .events = POLLIN };
+            int ready = poll(&pfd, 1, idle_timeout * 1000);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) return 0;
+        }
+        ssize_t bytes_read = read(client_sock, buffer->data + buffer->length,
+                                  sizeof(buffer->data) - buffer->length);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read == 0 && buffer->length == 0) return 0;
+        if (bytes_read <= 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to read from client socket");
+            return -1;
+        }
+        if (started_us && buffer->length == 0) *started_us = metrics_now_us();
+        buffer->length += bytes_read;
+    }
+    if (head_length < 0) {
         return -1;
     }
-    buffer[bytes_read] = '\0';
+    consume_request(buffer, head_length, request);
+    return 1;
+}
 
-    // Log the raw request at DEBUG level.
-    log_message(LOG_LEVEL_DEBUG, "Raw request: %s", buffer);
+int forward_request_body(int client_sock, RequestBuffer *buffer, int server_sock) {
+    // Body bytes are read into the buffer, so that a pipelined request
+    // following a chunked body stays buffered.
+    while (buffer->body.active) {
+        if (buffer->length == 0) {
+            ssize_t bytes_read = read(client_sock, buffer->data, sizeof(buffer->data));
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read <= 0) {
+                log_message(LOG_LEVEL_ERROR, "Failed to read request body from client socket");
+                return -1;
+            }
+            buffer->length = bytes_read;
+        }
+        ssize_t length = request_body_span(buffer, buffer->length);
+        if (length < 0) return -1;
+        if (write_all(server_sock, buffer->data, length) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to send request body to server");
+            return -1;
+        }
+        request_buffer_drop(buffer, length);
+    }
+    return 0;
+}
 
-    // Parse the request line: METHOD URL HTTP/1.x
-    if (sscanf(buffer, "%15s %1023s", request->method, request->url) != 2) {
-        log_message(LOG_LEVEL_ERROR, "Failed to parse request line");
+void request_buffer_init(RequestBuffer *buffer) {
+    buffer->length = 0;
+    buffer->error_status = 0;
+    http_parser_init(&buffer->parser);
+    memset(&buffer->body, 0, sizeof(buffer->body));
+}
+
+// Copies a slice into a fixed-size field. Returns -1 if it does not fit.
+static int copy_slice(char *field, size_t size, const HttpSlice *slice) {
+    if (slice->length >= size) return -1;
+    memcpy(field, slice->data, slice->length);
+    field[slice->length] = '\0';
+    return 0;
+}
+
+/**
+ * Fills the request line fields of an HttpRequest.
+ * For CONNECT methods, it expects the URL to be in the form "host:port".
+ * For other methods, it extracts the host from an absolute URL.
+ */
+static int fill_request_target(const HttpRequestParser *parser, HttpRequest *request) {
+    if (copy_slice(request->method, sizeof(request->method), &parser->method) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Request method exceeds %d bytes", MAX_METHOD_SIZE - 1);
+        return -1;
+    }
+    if (copy_slice(request->url, sizeof(request->url), &parser->target) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Request URL exceeds %d bytes", MAX_URL_SIZE - 1);
         return -1;
     }
 
     // If the request is a CONNECT (HTTPS), the URL is "host:port".
     if (strcmp(request->method, "CONNECT") == 0) {
         char *colon = strchr(request->url, ':');
-        if (colon) {
-            *colon = '\0';
-            strncpy(request->host, request->url, MAX_HOST_SIZE);
-            request->port = atoi(colon + 1);
-        } else {
-            strncpy(request->host, request->url, MAX_HOST_SIZE);
-            request->port = 443; // default for HTTPS
-        }
+        size_t host_len = colon ? (size_t)(colon - request->url) : strlen(request->url);
+        if (host_len >= MAX_HOST_SIZE) host_len = MAX_HOST_SIZE - 1;
+        memcpy(request->host, request->url, host_len);
+        request->host[host_len] = '\0';
+        request->port = colon ? atoi(colon + 1) : 443; // default for HTTPS
     } else {
         // For other methods, assume the URL is absolute (e.g., http://host/path).
         char *host_start = strstr(request->url, "://");
@@ -109,94 +216,357 @@ int parse_http_request(int client_sock, HttpRequest *request) {
         request->host[host_len] = '\0';
         request->port = 80; // default for HTTP
     }
-
-    log_message(LOG_LEVEL_DEBUG, "Parsed Request - Method: %s, URL: %s, Host: %s, Port: %d",
-                request->method, request->url, request->host, request->port);
     return 0;
 }
 
-/**
- * Forwards a non-CONNECT (HTTP) request to the destination server and relays the response.
- */
-int handle_http(int client_sock, const HttpRequest *request) {
-    int server_sock = connect_to_server(request->host, request->port);
-    if (server_sock < 0) {
-        log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", request->host, request->port);
+// Returns 1 if the name slice equals 'name', ignoring case.
+static int header_is(const HttpSlice *name, const char *expected) {
+    size_t length = strlen(expected);
+    return name->length == length && strncasecmp(name->data, expected, length) == 0;
+}
+
+int parse_http_request_head(RequestBuffer *buffer, HttpRequest *request) {
+    HttpRequestParser *parser = &buffer->parser;
+    int head_length = http_parser_feed(parser, buffer->data, buffer->length, MAX_REQUEST_HEAD_SIZE);
+    if (head_length < 0) {
+        request->method[0] = request->url[0] = '\0';
+        buffer->error_status = 400;
+    }
+    if (head_length <= 0) {
+        return head_length;
+    }
+    // Log the raw request at DEBUG level.
+    log_message(LOG_LEVEL_DEBUG, "Raw request: %.*s", head_length, buffer->data);
+    buffer->error_status = 400;  // Until the header is accepted.
+    if (fill_request_target(parser, request) < 0) {
         return -1;
     }
 
-    // Forward a minimal HTTP/1.0 request.
-    char forward_buffer[4096];
-    snprintf(forward_buffer, sizeof(forward_buffer),
-             "%s %s HTTP/1.0\r\nHost: %s\r\n\r\n",
-             request->method, request->url, request->host);
-    if (write_all(server_sock, forward_buffer, strlen(forward_buffer)) < 0) {
-        log_message(LOG_LEVEL_ERROR, "Failed to send request to server");
-        close(server_sock);
+    // HTTP/1.1 connections persist unless closed; HTTP/1.0 ones only on request.
+    const HttpSlice *version = &parser->version;
+    int http_minor = version->length == 8 && strncmp(version->data, "HTTP/1.", 7) == 0 && version->data[7] >= '1';
+    int close_requested = 0;
+    int keep_alive_requested = 0;
+    int content_length_seen = 0;
+    int transfer_encoding = 0;
+    request->body_length = -1;
+    request->chunked_body = 0;
+    request->content_type[0] = '\0';
+    request->authorization = 0;
+    request->no_store = 0;
+    for (int i = 0; i < parser->header_count; i++) {
+        const HttpHeader *header = &parser->headers[i];
+        if (header_is(&header->name, "Connection") || header_is(&header->name, "Proxy-Connection")) {
+            if (http_slice_contains(&header->value, "close")) close_requested = 1;
+            if (http_slice_contains(&header->value, "keep-alive")) keep_alive_requested = 1;
+        } else if (header_is(&header->name, "Content-Length")) {
+            long long length = 0;
+            if (header->value.length == 0) {
+                log_message(LOG_LEVEL_ERROR, "Empty Content-Length in request");
+                return -1;
+            }
+            for (size_t j = 0; j < header->value.length; j++) {
+                char c = header->value.data[j];
+                if (c < '0' || c > '9' || length > (LLONG_MAX - 9) / 10) {
+                    log_message(LOG_LEVEL_ERROR, "Invalid Content-Length in request");
+                    return -1;
+                }
+                length = length * 10 + (c - '0');
+            }
+            if (content_length_seen && length != request->body_length) {
+                log_message(LOG_LEVEL_ERROR, "Conflicting Content-Length values in request");
+                return -1;
+            }
+            content_length_seen = 1;
+            request->body_length = length;
+        } else if (header_is(&header->name, "Transfer-Encoding")) {
+            // Only a body that is just chunked can be forwarded as it is.
+            transfer_encoding = 1;
+            if (header_is(&header->value, "chunked")) request->chunked_body = 1;
+        } else if (header_is(&header->name, "Content-Type")) {
+            if (copy_slice(request->content_type, sizeof(request->content_type), &header->value) < 0) {
+                log_message(LOG_LEVEL_ERROR, "Request Content-Type exceeds %d bytes", MAX_CONTENT_TYPE_SIZE - 1);
+                return -1;
+            }
+        } else if (header_is(&header->name, "Authorization")) {
+            request->authorization = 1;
+        } else if (header_is(&header->name, "Cache-Control")) {
+            if (http_slice_contains(&header->value, "no-store")) request->no_store = 1;
+        }
+    }
+    request->keep_alive = !close_requested && (http_minor || keep_alive_requested);
+    if (transfer_encoding && !request->chunked_body) {
+        log_message(LOG_LEVEL_ERROR, "Unsupported Transfer-Encoding in request");
+        buffer->error_status = 501;
         return -1;
     }
+    if (request->chunked_body) {
+        // The chunked coding overrides any Content-Length.
+        request->body_length = -1;
+    }
 
-    // Relay the response from the server back to the client.
-    char buffer[4096];
-    int bytes;
-    while ((bytes = read(server_sock, buffer, sizeof(buffer))) > 0) {
-        if (write_all(client_sock, buffer, bytes) < 0) {
-            log_message(LOG_LEVEL_ERROR, "Failed to send response to client");
-            break;
-        }
+    log_message(LOG_LEVEL_DEBUG, "Parsed Request - Method: %s, URL: %s, Host: %s, Port: %d, Headers: %d",
+                request->method, request->url, request->host, request->port, parser->header_count);
+    buffer->error_status = 0;
+    return head_length;
+}
+
+const char *request_error_response(int status, size_t *length) {
+    if (status == 501) {
+        *length = sizeof(NOT_IMPLEMENTED_RESPONSE) - 1;
+        return NOT_IMPLEMENTED_RESPONSE;
     }
+    *length = sizeof(BAD_REQUEST_RESPONSE) - 1;
+    return BAD_REQUEST_RESPONSE;
+}
 
-    close(server_sock);
-    return 0;
+int request_has_body(const HttpRequest *request) {
+    return request->chunked_body || request->body_length > 0;
 }
 
-/**
- * Handles an HTTPS CONNECT request by establishing a tunnel between the client and the destination server.
- */
-int handle_https(int client_sock, const HttpRequest *request) {
-    int server_sock = connect_to_server(request->host, request->port);
-    if (server_sock < 0) {
-        log_message(LOG_LEVEL_ERROR, "Unable to connect to HTTPS server %s:%d", request->host, request->port);
-        return -1;
+ssize_t request_body_span(RequestBuffer *buffer, size_t max) {
+    RequestBody *body = &buffer->body;
+    size_t length = buffer->length < max ? buffer->length : max;
+    size_t used;
+    if (!body->active) return 0;
+    if (body->chunked) {
+        used = chunked_decoder_feed(&body->decoder, buffer->data, length);
+        if (body->decoder.error) {
+            log_message(LOG_LEVEL_ERROR, "Malformed chunked request body");
+            return -1;
+        }
+        body->active = !body->decoder.done;
+    } else {
+        used = body->remaining < (long long)length ? (size_t)body->remaining : length;
+        body->remaining -= used;
+        body->active = body->remaining > 0;
     }
+    return (ssize_t)used;
+}
 
-    // Inform the client that the connection is established.
-    const char *conn_established = "HTTP/1.1 200 Connection Established\r\n\r\n";
-    if (write_all(client_sock, conn_established, strlen(conn_established)) < 0) {
-        log_message(LOG_LEVEL_ERROR, "Failed to send connection established message to client");
-        close(server_sock);
-        return -1;
+void request_buffer_drop(RequestBuffer *buffer, size_t length) {
+    memmove(buffer->data, buffer->data + length, buffer->length - length);
+    buffer->length -= length;
+}
+
+void consume_request(RequestBuffer *buffer, size_t head_length, const HttpRequest *request) {
+    request_buffer_drop(buffer, head_length);
+    http_parser_init(&buffer->parser);
+    RequestBody *body = &buffer->body;
+    memset(body, 0, sizeof(*body));
+    body->chunked = request->chunked_body;
+    body->remaining = request->body_length > 0 ? request->body_length : 0;
+    body->active = request_has_body(request);
+}
+
+int format_origin_request(char *buffer, size_t size, const HttpRequest *request,
+                          const char *etag, const char *last_modified) {
+    // The body keeps the framing it arrived with.
+    char framing[64] = "";
+    if (request->chunked_body) {
+        snprintf(framing, sizeof(framing), "Transfer-Encoding: chunked\r\n");
+    } else if (request->body_length >= 0) {
+        snprintf(framing, sizeof(framing), "Content-Length: %lld\r\n", request->body_length);
     }
+    int has_type = request->content_type[0] != '\0';
+    int n = snprintf(buffer, size, "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s%s%s%s%s%s%s%s%s\r\n",
+                     request->method, request->url, request->host, framing,
+                     has_type ? "Content-Type: " : "", has_type ? request->content_type : "", has_type ? "\r\n" : "",
+                     etag ? "If-None-Match: " : "", etag ? etag : "", etag ? "\r\n" : "",
+                     last_modified ? "If-Modified-Since: " : "", last_modified ? last_modified : "",
+                     last_modified ? "\r\n" : "");
+    return (n < 0 || (size_t)n >= size) ? -1 : n;
+}
 
-    // Set up a loop to tunnel data between the client and server.
+/**
+ * Tunnels data between client and server through a userspace buffer,
+ * waiting for either side with select().
+ */
+int relay_tunnel_copy(int client_sock, int server_sock, TunnelStats *stats) {
     fd_set readfds;
     int maxfd = (client_sock > server_sock) ? client_sock : server_sock;
-    char buffer[4096];
+    char buffer[TUNNEL_BUFFER_SIZE];
     int n;
     while (1) {
         FD_ZERO(&readfds);
         FD_SET(client_sock, &readfds);
         FD_SET(server_sock, &readfds);
 
+        stats->syscalls++;
         if (select(maxfd + 1, &readfds, NULL, NULL, NULL) < 0) {
             log_message(LOG_LEVEL_ERROR, "Select error in HTTPS tunnel");
-            break;
+            return -1;
         }
         if (FD_ISSET(client_sock, &readfds)) {
             n = read(client_sock, buffer, sizeof(buffer));
+            stats->syscalls++;
             if (n <= 0)
                 break;
-            if (write_all(server_sock, buffer, n) < 0)
+            if (write_all_counted(server_sock, buffer, n, &stats->syscalls) < 0)
                 break;
+            stats->bytes_up += n;
         }
         if (FD_ISSET(server_sock, &readfds)) {
             n = read(server_sock, buffer, sizeof(buffer));
+            stats->syscalls++;
             if (n <= 0)
                 break;
-            if (write_all(client_sock, buffer, n) < 0)
+            if (write_all_counted(client_sock, buffer, n, &stats->syscalls) < 0)
+                break;
+            stats->bytes_down += n;
+        }
+    }
+    return 0;
+}
+
+#ifdef __linux__
+/**
+ * Moves whatever is readable on 'from' into the pipe and then drains the pipe
+ * into 'to', so the payload never enters userspace.
+ * Returns 1 if data was moved (or none was ready), 0 on EOF, -1 on error,
+ * or TUNNEL_SPLICE_UNSUPPORTED if the kernel refuses to splice these sockets.
+ */
+static int splice_once(int from, int pipe_fds[2], int to, unsigned long long *bytes, TunnelStats *stats) {
+    ssize_t n = splice(from, NULL, pipe_fds[1], NULL, SPLICE_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    stats->syscalls++;
+    if (n == 0)
+        return 0;
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 1;
+        if (errno == EINVAL || errno == ENOSYS)
+            return TUNNEL_SPLICE_UNSUPPORTED;
+        return -1;
+    }
+    size_t pending = (size_t)n;
+    while (pending > 0) {
+        ssize_t written = splice(pipe_fds[0], NULL, to, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+        stats->syscalls++;
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        pending -= written;
+    }
+    *bytes += n;
+    return 1;
+}
+
+/**
+ * Tunnels data between client and server with one pipe per direction and
+ * splice(), so bytes move kernel-to-kernel in pipe-sized chunks.
+ */
+int relay_tunnel_splice(int client_sock, int server_sock, TunnelStats *stats) {
+    int up[2], down[2];
+    if (pipe2(up, O_CLOEXEC) < 0)
+        return TUNNEL_SPLICE_UNSUPPORTED;
+    if (pipe2(down, O_CLOEXEC) < 0) {
+        close(up[0]);
+        close(up[1]);
+        return TUNNEL_SPLICE_UNSUPPORTED;
+    }
+    // Larger pipes mean fewer splice() calls; the default is 64 KB.
+    fcntl(up[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    fcntl(down[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    struct pollfd fds[2];
+    fds[0].fd = client_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = server_sock;
+    fds[1].events = POLLIN;
+
+    int rc = 0;
+    while (rc == 0) {
+        stats->syscalls++;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_message(LOG_LEVEL_ERROR, "Poll error in HTTPS tunnel");
+            rc = -1;
+            break;
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int moved = splice_once(client_sock, up, server_sock, &stats->bytes_up, stats);
+            if (moved <= 0) {
+                rc = moved < 0 ? moved : 1;
+                break;
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int moved = splice_once(server_sock, down, client_sock, &stats->bytes_down, stats);
+            if (moved <= 0) {
+                rc = moved < 0 ? moved : 1;
                 break;
+            }
         }
     }
+    close(up[0]);
+    close(up[1]);
+    close(down[0]);
+    close(down[1]);
+
+    // Only fall back to the copy loop if nothing has been relayed yet.
+    if (rc == TUNNEL_SPLICE_UNSUPPORTED && (stats->bytes_up || stats->bytes_down)) {
+        log_message(LOG_LEVEL_ERROR, "splice() failed mid-tunnel");
+        return -1;
+    }
+    if (rc == TUNNEL_SPLICE_UNSUPPORTED) {
+        log_message(LOG_LEVEL_WARN, "splice() not supported for tunnel sockets, falling back to copy relay");
+    }
+    return rc == 1 ? 0 : rc;
+}
+#else
+int relay_tunnel_splice(int client_sock, int server_sock, TunnelStats *stats) {
+    (void)client_sock;
+    (void)server_sock;
+    (void)stats;
+    return TUNNEL_SPLICE_UNSUPPORTED;
+}
+#endif
+
+/**
+ * Handles an HTTPS CONNECT request by establishing a tunnel between the client and the destination server.
+ */
+int handle_https(int client_sock, const HttpRequest *request, RequestTiming *timing) {
+    timing->result = "tunnel";
+    int server_sock = connect_to_server(request->host, request->port, timing);
+    if (server_sock < 0) {
+        log_message(LOG_LEVEL_ERROR, "Unable to connect to HTTPS server %s:%d", request->host, request->port);
+        return -1;
+    }
+
+    // Inform the client that the connection is established.
+    const char *conn_established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    if (write_all(client_sock, conn_established, strlen(conn_established)) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to send connection established message to client");
+        close(server_sock);
+        return -1;
+    }
+    metrics_record_request(REQUEST_CONNECT, timing->started_us);
+    metrics_add(METRIC_ACTIVE_TUNNELS, 1);
+    timing->status = 200;
+
+    TunnelStats stats;
+    memset(&stats, 0, sizeof(stats));
+    const char *mode = "copy";
+    int rc = TUNNEL_SPLICE_UNSUPPORTED;
+    if (tunnel_splice_enabled) {
+        mode = "splice";
+        rc = relay_tunnel_splice(client_sock, server_sock, &stats);
+    }
+    if (rc == TUNNEL_SPLICE_UNSUPPORTED) {
+        mode = "copy";
+        relay_tunnel_copy(client_sock, server_sock, &stats);
+    }
+    log_message(LOG_LEVEL_INFO, "Tunnel to %s:%d closed (%s relay): %llu bytes client->server, "
+                "%llu bytes server->client, %llu syscalls",
+                request->host, request->port, mode, stats.bytes_up, stats.bytes_down, stats.syscalls);
+    metrics_add(METRIC_ACTIVE_TUNNELS, -1);
+    metrics_add(METRIC_BYTES_RECEIVED, stats.bytes_down);
+    metrics_add(METRIC_BYTES_SENT, stats.bytes_down);
+    request_timing_mark(timing, PHASE_TRANSFER);
+    timing->bytes = strlen(conn_established) + stats.bytes_down;
+    timing->complete = 1;
     close(server_sock);
     return 0;
 }
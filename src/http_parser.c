@@ -0,0 +1,246 @@
+#include "http_parser.h"
+#include "logging.h"
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int vector_scan = 1;
+
+void http_parser_set_vector_scan(int enabled) {
+    vector_scan = enabled;
+}
+
+/**
+ * Finds the end of the line starting the scan at 'from'. Bytes a header may
+ * not contain (control characters other than tab, DEL, and a CR that is not
+ * followed by LF) are reported as errors in the same pass.
+ *
+ * @param pos Set to the offset of the line's LF when found, otherwise to the
+ *            offset the next scan should resume at.
+ * @return 1 if a line end was found, 0 if more data is needed, -1 if an
+ *         invalid byte was found.
+ */
+static int find_line_end(const char *data, size_t from, size_t length, size_t *pos) {
+    size_t i = from;
+#ifdef __SSE2__
+    // Sixteen bytes per step: anything below 0x20 other than tab, or DEL,
+    // stops the vector loop and is classified below.
+    const __m128i below_space = _mm_set1_epi8(0x1f);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i zero = _mm_setzero_si128();
+    while (vector_scan && i + 16 <= length) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        // Unsigned v <= 0x1f: the saturating subtraction leaves zero.
+        __m128i control = _mm_cmpeq_epi8(_mm_subs_epu8(v, below_space), zero);
+        __m128i stop = _mm_or_si128(_mm_andnot_si128(_mm_cmpeq_epi8(v, tab), control),
+                                    _mm_cmpeq_epi8(v, del));
+        int mask = _mm_movemask_epi8(stop);
+        if (mask) {
+            i += __builtin_ctz(mask);
+            break;
+        }
+        i += 16;
+    }
+#endif
+    for (; i < length; i++) {
+        unsigned char c = (unsigned char)data[i];
+        if (c >= 0x20 && c != 0x7f) continue;
+        if (c == '\t') continue;
+        if (c == '\n') {
+            *pos = i;
+            return 1;
+        }
+        if (c == '\r') {
+            if (i + 1 == length) break;  // The LF may arrive with the next read.
+            if (data[i + 1] == '\n') {
+                *pos = i + 1;
+                return 1;
+            }
+        }
+        return -1;
+    }
+    *pos = i;
+    return 0;
+}
+
+// Splits "METHOD TARGET VERSION" into slices.
+static int parse_request_line(HttpRequestParser *parser, const char *line, size_t length) {
+    const char *end = line + length;
+    const char *p = line;
+    HttpSlice *parts[3] = { &parser->method, &parser->target, &parser->version };
+    for (int i = 0; i < 3; i++) {
+        while (p < end && *p == ' ') p++;
+        const char *part_end = (i < 2) ? memchr(p, ' ', end - p) : NULL;
+        if (!part_end) part_end = end;
+        parts[i]->data = p;
+        parts[i]->length = part_end - p;
+        p = part_end;
+    }
+    // The version may be missing (HTTP/0.9 style); method and target may not.
+    if (parser->method.length == 0 || parser->target.length == 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to parse request line");
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_header_line(HttpRequestParser *parser, const char *line, size_t length) {
+    if (line[0] == ' ' || line[0] == '\t') {
+        log_message(LOG_LEVEL_ERROR, "Rejecting obsolete folded header line");
+        return -1;
+    }
+    const char *colon = memchr(line, ':', length);
+    if (!colon) {
+        return 0;  // Not a header field; ignored as before.
+    }
+    size_t name_length = colon - line;
+    if (name_length == 0 || memchr(line, ' ', name_length) || memchr(line, '\t', name_length)) {
+        log_message(LOG_LEVEL_ERROR, "Malformed header name in request");
+        return -1;
+    }
+    if (parser->header_count == MAX_REQUEST_HEADERS) {
+        log_message(LOG_LEVEL_ERROR, "Request has more than %d headers", MAX_REQUEST_HEADERS);
+        return -1;
+    }
+    const char *value = colon + 1;
+    const char *end = line + length;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    HttpHeader *header = &parser->headers[parser->header_count++];
+    header->name.data = line;
+    header->name.length = name_length;
+    header->value.data = value;
+    header->value.length = end - value;
+    return 0;
+}
+
+void http_parser_init(HttpRequestParser *parser) {
+    parser->scanned = 0;
+    parser->line_start = 0;
+    parser->request_line_done = 0;
+    parser->header_count = 0;
+}
+
+int http_parser_feed(HttpRequestParser *parser, const char *data, size_t length, size_t max_length) {
+    size_t limit = length < max_length ? length : max_length;
+    for (;;) {
+        size_t end;
+        int found = find_line_end(data, parser->scanned, limit, &end);
+        if (found < 0) {
+            log_message(LOG_LEVEL_ERROR, "Invalid byte in request header");
+            return -1;
+        }
+        if (found == 0) {
+            parser->scanned = end;
+            if (length >= max_length) {
+                log_message(LOG_LEVEL_ERROR, "Request header exceeds %zu bytes", max_length);
+                return -1;
+            }
+            return 0;
+        }
+        const char *line = data + parser->line_start;
+        size_t line_length = end - parser->line_start;
+        if (line_length > 0 && line[line_length - 1] == '\r') line_length--;
+        parser->scanned = parser->line_start = end + 1;
+
+        if (!parser->request_line_done) {
+            // Empty lines before the request line are ignored.
+            if (line_length == 0) continue;
+            if (parse_request_line(parser, line, line_length) < 0) return -1;
+            parser->request_line_done = 1;
+        } else if (line_length == 0) {
+            return (int)(end + 1);
+        } else if (parse_header_line(parser, line, line_length) < 0) {
+            return -1;
+        }
+    }
+}
+
+const HttpSlice *http_parser_header(const HttpRequestParser *parser, const char *name) {
+    size_t name_length = strlen(name);
+    for (int i = 0; i < parser->header_count; i++) {
+        const HttpHeader *header = &parser->headers[i];
+        if (header->name.length == name_length && strncasecmp(header->name.data, name, name_length) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+int http_slice_contains(const HttpSlice *slice, const char *token) {
+    size_t token_length = strlen(token);
+    for (size_t i = 0; i + token_length <= slice->length; i++) {
+        if (strncasecmp(slice->data + i, token, token_length) == 0) return 1;
+    }
+    return 0;
+}
+
+// Positions within the chunked transfer coding.
+enum {
+    CHUNK_SIZE,          // Reading the hex chunk size.
+    CHUNK_EXTENSION,     // Skipping a chunk extension up to the line end.
+    CHUNK_DATA,          // Inside chunk data.
+    CHUNK_DATA_END,      // Expecting the CRLF after chunk data.
+    CHUNK_TRAILER,       // At the start of a trailer line (an empty one ends the message).
+    CHUNK_TRAILER_LINE   // Inside a trailer field line.
+};
+
+size_t chunked_decoder_feed(ChunkedDecoder *decoder, const char *data, size_t length) {
+    size_t i = 0;
+    while (i < length && !decoder->done && !decoder->error) {
+        char c = data[i];
+        switch (decoder->state) {
+            case CHUNK_SIZE:
+                if (isxdigit((unsigned char)c)) {
+                    if (decoder->remaining > (LLONG_MAX >> 4)) {
+                        decoder->error = 1;
+                        return i;
+                    }
+                    int digit = isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10);
+                    decoder->remaining = decoder->remaining * 16 + digit;
+                } else if (c == '\n') {
+                    decoder->state = decoder->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                } else if (c != '\r') {
+                    decoder->state = CHUNK_EXTENSION;
+                }
+                i++;
+                break;
+            case CHUNK_EXTENSION:
+                if (c == '\n') {
+                    decoder->state = decoder->remaining > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                i++;
+                break;
+            case CHUNK_DATA: {
+                size_t take = length - i;
+                if ((long long)take > decoder->remaining) take = (size_t)decoder->remaining;
+                decoder->remaining -= take;
+                i += take;
+                if (decoder->remaining == 0) decoder->state = CHUNK_DATA_END;
+                break;
+            }
+            case CHUNK_DATA_END:
+                if (c == '\n') decoder->state = CHUNK_SIZE;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\n') {
+                    decoder->done = 1;
+                } else if (c != '\r') {
+                    decoder->state = CHUNK_TRAILER_LINE;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') decoder->state = CHUNK_TRAILER;
+                i++;
+                break;
+        }
+    }
+    return i;
+}
@@ -0,0 +1,263 @@
+#define _GNU_SOURCE  // For strptime(), timegm() and memmem()
+#include "http_response.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define HEURISTIC_FRESHNESS_MAX (24L * 60 * 60)
+
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns 0 if invalid.
+static time_t parse_http_date(const char *value) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end) return 0;
+    return timegm(&tm);
+}
+
+// Copies a header value into a fixed buffer, trimming surrounding whitespace.
+static void copy_value(char *dst, size_t size, const char *value, size_t length) {
+    while (length > 0 && isspace((unsigned char)*value)) {
+        value++;
+        length--;
+    }
+    while (length > 0 && isspace((unsigned char)value[length - 1])) {
+        length--;
+    }
+    if (length >= size) length = size - 1;
+    memcpy(dst, value, length);
+    dst[length] = '\0';
+}
+
+// Applies each comma-separated Cache-Control directive.
+static void parse_cache_control(const char *value, HttpResponseInfo *info) {
+    const char *p = value;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *start = p;
+        while (*p && *p != ',') p++;
+        size_t length = p - start;
+        if (length >= 8 && strncasecmp(start, "max-age=", 8) == 0) {
+            info->max_age = strtol(start + 8, NULL, 10);
+        } else if (length >= 9 && strncasecmp(start, "s-maxage=", 9) == 0) {
+            info->s_maxage = strtol(start + 9, NULL, 10);
+        } else if (length >= 8 && strncasecmp(start, "no-store", 8) == 0) {
+            info->no_store = 1;
+        } else if (length >= 8 && strncasecmp(start, "no-cache", 8) == 0) {
+            info->no_cache = 1;
+        } else if (length >= 7 && strncasecmp(start, "private", 7) == 0) {
+            info->is_private = 1;
+        } else if (length >= 6 && strncasecmp(start, "public", 6) == 0) {
+            info->is_public = 1;
+        } else if (length >= 15 && strncasecmp(start, "must-revalidate", 15) == 0) {
+            info->must_revalidate = 1;
+        }
+    }
+}
+
+int parse_http_response_head(const char *data, size_t length, HttpResponseInfo *info) {
+    memset(info, 0, sizeof(*info));
+    info->max_age = -1;
+    info->s_maxage = -1;
+    info->content_length = -1;
+
+    const char *end = memmem(data, length, "\r\n\r\n", 4);
+    if (!end) return 0;
+    info->header_length = (end - data) + 4;
+
+    // Status line: HTTP/1.x NNN reason
+    if (length < 12 || strncmp(data, "HTTP/", 5) != 0) return -1;
+    const char *space = memchr(data, ' ', end - data);
+    if (!space || !isdigit((unsigned char)space[1])) return -1;
+    info->status = atoi(space + 1);
+    info->http_minor = (data[5] == '1' && data[6] == '.' && data[7] >= '1') ? 1 : 0;
+    int keep_alive = 0;
+
+    const char *line = memmem(data, end - data + 2, "\r\n", 2) + 2;
+    char value[1024];
+    while (line < end + 2) {
+        const char *line_end = memmem(line, end + 2 - line, "\r\n", 2);
+        const char *colon = memchr(line, ':', line_end - line);
+        if (colon) {
+            size_t name_length = colon - line;
+            copy_value(value, sizeof(value), colon + 1, line_end - colon - 1);
+            if (name_length == 13 && strncasecmp(line, "Cache-Control", 13) == 0) {
+                parse_cache_control(value, info);
+            } else if (name_length == 6 && strncasecmp(line, "Pragma", 6) == 0) {
+                if (strcasestr(value, "no-cache")) info->no_cache = 1;
+            } else if (name_length == 7 && strncasecmp(line, "Expires", 7) == 0) {
+                info->expires = parse_http_date(value);
+                if (info->expires == 0) info->expires = -1;  // Invalid means already expired.
+            } else if (name_length == 4 && strncasecmp(line, "Date", 4) == 0) {
+                info->date = parse_http_date(value);
+            } else if (name_length == 3 && strncasecmp(line, "Age", 3) == 0) {
+                info->age = strtol(value, NULL, 10);
+            } else if (name_length == 4 && strncasecmp(line, "ETag", 4) == 0) {
+                copy_value(info->etag, sizeof(info->etag), value, strlen(value));
+            } else if (name_length == 13 && strncasecmp(line, "Last-Modified", 13) == 0) {
+                copy_value(info->last_modified, sizeof(info->last_modified), value, strlen(value));
+                info->last_modified_time = parse_http_date(value);
+            } else if (name_length == 4 && strncasecmp(line, "Vary", 4) == 0) {
+                if (strchr(value, '*')) info->vary_any = 1;
+            } else if (name_length == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+                info->content_length = strtoll(value, NULL, 10);
+            } else if (name_length == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0) {
+                if (strcasestr(value, "chunked")) info->chunked = 1;
+            } else if (name_length == 10 && strncasecmp(line, "Connection", 10) == 0) {
+                if (strcasestr(value, "close")) info->connection_close = 1;
+                if (strcasestr(value, "keep-alive")) keep_alive = 1;
+            }
+        }
+        line = line_end + 2;
+    }
+    if (info->http_minor == 0 && !keep_alive) {
+        info->connection_close = 1;
+    }
+    return 1;
+}
+
+int response_is_persistent(const HttpResponseInfo *info) {
+    if (info->connection_close) return 0;
+    int bodyless = (info->status >= 100 && info->status < 200) || info->status == 204 || info->status == 304;
+    return bodyless || info->chunked || info->content_length >= 0;
+}
+
+// Statuses a cache may store by default (RFC 9110, section 15.1). Partial
+// content (206) is left out since ranges are never reassembled.
+static int status_is_cacheable(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+int response_has_explicit_lifetime(const HttpResponseInfo *info) {
+    return info->s_maxage >= 0 || info->max_age >= 0 || info->expires != 0;
+}
+
+int response_is_storable(const HttpResponseInfo *info) {
+    if (!status_is_cacheable(info->status)) return 0;
+    if (info->no_store || info->is_private || info->vary_any) return 0;
+    return response_freshness_lifetime(info) > 0 || info->etag[0] || info->last_modified[0];
+}
+
+int response_allows_authorized_storing(const HttpResponseInfo *info) {
+    return info->is_public || info->s_maxage >= 0 || info->must_revalidate;
+}
+
+long response_freshness_lifetime(const HttpResponseInfo *info) {
+    if (info->no_cache) return 0;
+    if (info->s_maxage >= 0) return info->s_maxage;
+    if (info->max_age >= 0) return info->max_age;
+    if (info->expires != 0) {
+        if (info->expires < 0) return 0;
+        time_t base = info->date ? info->date : time(NULL);
+        return info->expires > base ? (long)(info->expires - base) : 0;
+    }
+    if (info->last_modified_time) {
+        time_t base = info->date ? info->date : time(NULL);
+        long lifetime = base > info->last_modified_time ? (long)(base - info->last_modified_time) / 10 : 0;
+        return lifetime < HEURISTIC_FRESHNESS_MAX ? lifetime : HEURISTIC_FRESHNESS_MAX;
+    }
+    return 0;
+}
+
+time_t response_expiry(const HttpResponseInfo *info, time_t now) {
+    // Age on arrival: the larger of the Age header and the apparent age from Date.
+    long age = info->age > 0 ? info->age : 0;
+    if (info->date && now > info->date && (long)(now - info->date) > age) {
+        age = (long)(now - info->date);
+    }
+    return now + response_freshness_lifetime(info) - age;
+}
+
+void response_tracker_init(ResponseTracker *tracker, int head_request) {
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->head_request = head_request;
+}
+
+static void choose_framing(ResponseTracker *tracker) {
+    const HttpResponseInfo *info = &tracker->info;
+    if (tracker->head_request || info->status == 204 || info->status == 304 ||
+        (info->status >= 100 && info->status < 200)) {
+        tracker->framing = FRAMING_NONE;
+    } else if (info->chunked) {
+        tracker->framing = FRAMING_CHUNKED;
+    } else if (info->content_length >= 0) {
+        tracker->framing = FRAMING_LENGTH;
+        tracker->remaining = info->content_length;
+    } else {
+        tracker->framing = FRAMING_CLOSE;
+    }
+    if (tracker->framing == FRAMING_NONE || (tracker->framing == FRAMING_LENGTH && tracker->remaining == 0)) {
+        tracker->done = 1;
+    }
+}
+
+int response_tracker_feed(ResponseTracker *tracker, const char *data, size_t length) {
+    tracker->total += length;
+    while (length > 0) {
+        if (tracker->done) {
+            tracker->overrun = 1;
+            break;
+        }
+        if (!tracker->head_done) {
+            // Buffer header bytes until the blank line; anything after it is body.
+            size_t room = sizeof(tracker->head) - tracker->head_length;
+            size_t take = length < room ? length : room;
+            memcpy(tracker->head + tracker->head_length, data, take);
+            size_t previous = tracker->head_length;
+            tracker->head_length += take;
+            int rc = parse_http_response_head(tracker->head, tracker->head_length, &tracker->info);
+            if (rc == 0 && tracker->head_length < sizeof(tracker->head)) {
+                return 0;
+            }
+            if (rc != 1) {
+                // Oversized or malformed header: relay until the origin closes.
+                tracker->head_done = 1;
+                tracker->framing = FRAMING_CLOSE;
+                tracker->info.connection_close = 1;
+                return 0;
+            }
+            size_t used = tracker->info.header_length - previous;
+            data += used;
+            length -= used;
+            if (tracker->info.status >= 100 && tracker->info.status < 200 && tracker->info.status != 101) {
+                // Interim response; the final one follows on the same connection.
+                tracker->head_length = 0;
+                continue;
+            }
+            tracker->head_done = 1;
+            choose_framing(tracker);
+            continue;
+        }
+        size_t used = length;
+        if (tracker->framing == FRAMING_LENGTH) {
+            if ((long long)used > tracker->remaining) used = (size_t)tracker->remaining;
+            tracker->remaining -= used;
+            if (tracker->remaining == 0) tracker->done = 1;
+        } else if (tracker->framing == FRAMING_CHUNKED) {
+            used = chunked_decoder_feed(&tracker->chunked, data, length);
+            if (tracker->chunked.done) {
+                tracker->done = 1;
+            } else if (tracker->chunked.error) {
+                // Unusable chunk size: relay until the origin closes.
+                tracker->framing = FRAMING_CLOSE;
+                tracker->info.connection_close = 1;
+                used = length;
+            }
+        }
+        data += used;
+        length -= used;
+    }
+    return tracker->done;
+}
+
+int response_tracker_reusable(const ResponseTracker *tracker) {
+    return tracker->done && !tracker->overrun && tracker->framing != FRAMING_CLOSE &&
+           !tracker->info.connection_close && tracker->info.status != 101;
+}
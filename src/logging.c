@@ -2,13 +2,73 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
 
+#define LOG_RING_SIZE (256 * 1024)     // Bytes per thread; must be a power of two.
+#define LOG_RECORD_ALIGN 32            // Record alignment; at least sizeof(LogRecord).
+#define LOG_MAX_MESSAGE 16384          // Longer messages are truncated.
+#define LOG_BATCH_SIZE (64 * 1024)     // Formatted bytes written per write call.
+#define LOG_FLUSH_INTERVAL_MS 50       // How long the writer sleeps when idle.
+#define ACCESS_RECORD 0xffff           // Record level marking an access log record.
+
+LogLevel g_log_level = LOG_LEVEL_INFO;
+
 static FILE *g_log_file = NULL;
-static LogLevel g_log_level = LOG_LEVEL_INFO;
+static FILE *g_access_file = NULL;
+static int g_log_echo = 1;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Header of a record in a thread's ring, followed by the message text.
+typedef struct {
+    uint32_t size;       // Total bytes including the header and padding.
+    uint16_t level;
+    uint16_t padding;    // Set for filler at the end of the ring.
+    uint32_t text_len;
+    uint32_t nsec;
+    int64_t sec;
+} LogRecord;
+
+// Single-producer/single-consumer byte ring owned by one thread. Only the
+// owning thread advances tail and only the writer thread advances head.
+typedef struct LogRing {
+    char *data;
+    atomic_size_t head;
+    char pad0[64];
+    atomic_size_t tail;
+    char pad1[64];
+    atomic_size_t dropped;     // Messages lost because the ring was full.
+    atomic_int orphaned;       // The owning thread has exited.
+    size_t scan;               // Writer's read position within a pass.
+    size_t limit;              // Tail snapshot for the current pass.
+    struct LogRing *next;
+} LogRing;
+
+static pthread_mutex_t ring_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *ring_list = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread LogRing *thread_ring = NULL;
+
+static pthread_t writer_thread;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static atomic_int writer_running = 0;
+static atomic_int writer_wake_requested = 0;
+
+// Formatted output waiting to be written. Guarded by log_mutex.
+static char batch[LOG_BATCH_SIZE];
+static size_t batch_len = 0;
+static char access_batch[LOG_BATCH_SIZE];
+static size_t access_batch_len = 0;
+
+// The writer formats a timestamp at most once per second.
+static time_t cached_second = -1;
+static char cached_time[20];
+
 static const char* log_level_str(LogLevel level) {
     switch(level) {
         case LOG_LEVEL_DEBUG: return "DEBUG";
@@ -19,6 +79,210 @@ static const char* log_level_str(LogLevel level) {
     }
 }
 
+static const char *format_time(time_t sec) {
+    if (sec != cached_second) {
+        struct tm local_time;
+        localtime_r(&sec, &local_time);
+        strftime(cached_time, sizeof(cached_time), "%Y-%m-%d %H:%M:%S", &local_time);
+        cached_second = sec;
+    }
+    return cached_time;
+}
+
+static void flush_batch(void) {
+    if (access_batch_len > 0) {
+        fwrite(access_batch, 1, access_batch_len, g_access_file);
+        fflush(g_access_file);
+        access_batch_len = 0;
+    }
+    if (batch_len == 0) return;
+    if (g_log_file && g_log_file != stdout) {
+        fwrite(batch, 1, batch_len, g_log_file);
+        fflush(g_log_file);
+    }
+    if (g_log_echo || g_log_file == stdout) {
+        fwrite(batch, 1, batch_len, stdout);
+        fflush(stdout);
+    }
+    batch_len = 0;
+}
+
+// Appends one formatted line to the batch, flushing it first if it is full.
+static void append_line(time_t sec, LogLevel level, const char *text, size_t text_len) {
+    // "[YYYY-MM-DD HH:MM:SS] LEVEL: " is at most 31 bytes.
+    if (batch_len + text_len + 40 > LOG_BATCH_SIZE) flush_batch();
+    if (text_len + 40 > LOG_BATCH_SIZE) text_len = LOG_BATCH_SIZE - 40;
+    batch_len += snprintf(batch + batch_len, LOG_BATCH_SIZE - batch_len, "[%s] %s: ",
+                          format_time(sec), log_level_str(level));
+    memcpy(batch + batch_len, text, text_len);
+    batch_len += text_len;
+    batch[batch_len++] = '\n';
+}
+
+// Appends one access record as a JSON object, led by its timestamp.
+static void append_access_line(time_t sec, const char *text, size_t text_len) {
+    if (!g_access_file) return;
+    // "{"time":"YYYY-MM-DD HH:MM:SS"," and "}\n" are 33 bytes.
+    if (access_batch_len + text_len + 40 > LOG_BATCH_SIZE) flush_batch();
+    if (text_len + 40 > LOG_BATCH_SIZE) text_len = LOG_BATCH_SIZE - 40;
+    access_batch_len += snprintf(access_batch + access_batch_len, LOG_BATCH_SIZE - access_batch_len,
+                                 "{\"time\":\"%s\",", format_time(sec));
+    memcpy(access_batch + access_batch_len, text, text_len);
+    access_batch_len += text_len;
+    access_batch[access_batch_len++] = '}';
+    access_batch[access_batch_len++] = '\n';
+}
+
+static void append_record(time_t sec, unsigned int level, const char *text, size_t text_len) {
+    if (level == ACCESS_RECORD) append_access_line(sec, text, text_len);
+    else append_line(sec, (LogLevel)level, text, text_len);
+}
+
+static void orphan_ring(void *arg) {
+    atomic_store(&((LogRing *)arg)->orphaned, 1);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, orphan_ring);
+}
+
+// Returns the calling thread's ring, creating and registering it on first use.
+static LogRing *get_thread_ring(void) {
+    if (thread_ring) return thread_ring;
+    LogRing *ring = (LogRing *)calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+    ring->data = (char *)malloc(LOG_RING_SIZE);
+    if (!ring->data) {
+        free(ring);
+        return NULL;
+    }
+    pthread_once(&ring_key_once, create_ring_key);
+    pthread_setspecific(ring_key, ring);
+    pthread_mutex_lock(&ring_list_mutex);
+    ring->next = ring_list;
+    ring_list = ring;
+    pthread_mutex_unlock(&ring_list_mutex);
+    thread_ring = ring;
+    return ring;
+}
+
+static void wake_writer(void) {
+    if (atomic_exchange(&writer_wake_requested, 1)) return;
+    pthread_mutex_lock(&writer_mutex);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+// Copies a record into the ring without blocking. Returns -1 if it is full.
+static int ring_push(LogRing *ring, unsigned int level, const struct timespec *now,
+                     const char *text, size_t text_len) {
+    size_t size = (sizeof(LogRecord) + text_len + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t offset = tail & (LOG_RING_SIZE - 1);
+    size_t filler = (LOG_RING_SIZE - offset < size) ? LOG_RING_SIZE - offset : 0;
+    if (LOG_RING_SIZE - (tail - head) < filler + size) return -1;
+
+    if (filler) {
+        // Records are contiguous: skip the rest of the ring.
+        LogRecord *pad = (LogRecord *)(ring->data + offset);
+        pad->size = (uint32_t)filler;
+        pad->padding = 1;
+        offset = 0;
+    }
+    LogRecord *record = (LogRecord *)(ring->data + offset);
+    record->size = (uint32_t)size;
+    record->level = (uint16_t)level;
+    record->padding = 0;
+    record->text_len = (uint32_t)text_len;
+    record->sec = now->tv_sec;
+    record->nsec = (uint32_t)now->tv_nsec;
+    memcpy(record + 1, text, text_len);
+    atomic_store_explicit(&ring->tail, tail + filler + size, memory_order_release);
+
+    if (tail + filler + size - head > LOG_RING_SIZE / 2) wake_writer();
+    return 0;
+}
+
+// Skips filler at the ring's scan position. Returns the next record, or NULL.
+static LogRecord *ring_peek(LogRing *ring) {
+    while (ring->scan < ring->limit) {
+        LogRecord *record = (LogRecord *)(ring->data + (ring->scan & (LOG_RING_SIZE - 1)));
+        if (!record->padding) return record;
+        ring->scan += record->size;
+    }
+    return NULL;
+}
+
+// Writes out everything queued so far, merging the per-thread rings in
+// timestamp order. Frees rings whose threads have exited once drained.
+static void drain_rings(void) {
+    pthread_mutex_lock(&log_mutex);
+    pthread_mutex_lock(&ring_list_mutex);
+    for (LogRing *ring = ring_list; ring; ring = ring->next) {
+        ring->scan = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        ring->limit = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        size_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped > 0) {
+            char note[96];
+            int n = snprintf(note, sizeof(note), "Dropped %zu log messages (log buffer full)", dropped);
+            append_line(time(NULL), LOG_LEVEL_WARN, note, (size_t)n);
+        }
+    }
+    for (;;) {
+        LogRing *next_ring = NULL;
+        LogRecord *next = NULL;
+        for (LogRing *ring = ring_list; ring; ring = ring->next) {
+            LogRecord *record = ring_peek(ring);
+            if (record && (!next || record->sec < next->sec ||
+                           (record->sec == next->sec && record->nsec < next->nsec))) {
+                next = record;
+                next_ring = ring;
+            }
+        }
+        if (!next) break;
+        append_record((time_t)next->sec, next->level, (const char *)(next + 1), next->text_len);
+        next_ring->scan += next->size;
+    }
+    LogRing **link = &ring_list;
+    while (*link) {
+        LogRing *ring = *link;
+        atomic_store_explicit(&ring->head, ring->scan, memory_order_release);
+        if (atomic_load(&ring->orphaned) && ring->scan == atomic_load(&ring->tail)) {
+            *link = ring->next;
+            free(ring->data);
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    pthread_mutex_unlock(&ring_list_mutex);
+    flush_batch();
+    pthread_mutex_unlock(&log_mutex);
+}
+
+static void *log_writer(void *arg) {
+    (void)arg;
+    while (atomic_load(&writer_running)) {
+        pthread_mutex_lock(&writer_mutex);
+        if (!atomic_load(&writer_wake_requested) && atomic_load(&writer_running)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline);
+        }
+        atomic_store(&writer_wake_requested, 0);
+        pthread_mutex_unlock(&writer_mutex);
+        drain_rings();
+    }
+    drain_rings();
+    return NULL;
+}
+
 void init_logging(const char *log_file, LogLevel level) {
     pthread_mutex_lock(&log_mutex);
     g_log_level = level;
@@ -31,48 +295,83 @@ void init_logging(const char *log_file, LogLevel level) {
     } else {
         g_log_file = stdout;
     }
+    atomic_store(&writer_running, 1);
+    if (pthread_create(&writer_thread, NULL, log_writer, NULL) != 0) {
+        // Without the writer thread, messages are written synchronously.
+        atomic_store(&writer_running, 0);
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+int init_access_log(const char *access_file) {
+    pthread_mutex_lock(&log_mutex);
+    g_access_file = fopen(access_file, "a");
     pthread_mutex_unlock(&log_mutex);
+    return g_access_file ? 0 : -1;
+}
+
+void set_log_echo(int enabled) {
+    g_log_echo = enabled;
 }
 
 void close_logging() {
+    if (atomic_exchange(&writer_running, 0)) {
+        wake_writer();
+        pthread_join(writer_thread, NULL);
+    }
     pthread_mutex_lock(&log_mutex);
     if (g_log_file && g_log_file != stdout) {
         fclose(g_log_file);
     }
     g_log_file = NULL;
+    if (g_access_file) {
+        fclose(g_access_file);
+    }
+    g_access_file = NULL;
     pthread_mutex_unlock(&log_mutex);
 }
 
-void log_message(LogLevel level, const char *format, ...) {
-    if (level < g_log_level)
-        return;
+// Queues a formatted record on the calling thread's ring, or writes it
+// directly if there is no writer thread.
+static void queue_record(unsigned int level, const char *format, va_list args) {
+    char text[LOG_MAX_MESSAGE];
+    int n = vsnprintf(text, sizeof(text), format, args);
+    if (n < 0) return;
+    size_t text_len = ((size_t)n < sizeof(text)) ? (size_t)n : sizeof(text) - 1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    time_t now = time(NULL);
-    struct tm *local_time = localtime(&now);
-    char time_buf[20];
-    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", local_time);
+    if (atomic_load_explicit(&writer_running, memory_order_acquire)) {
+        LogRing *ring = get_thread_ring();
+        if (ring) {
+            if (ring_push(ring, level, &now, text, text_len) < 0) {
+                atomic_fetch_add(&ring->dropped, 1);
+                wake_writer();
+            }
+            return;
+        }
+    }
 
+    // No writer thread (before init_logging() or after close_logging()):
+    // write the record directly.
     pthread_mutex_lock(&log_mutex);
+    append_record(now.tv_sec, level, text, text_len);
+    flush_batch();
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void log_write(LogLevel level, const char *format, ...) {
     va_list args;
     va_start(args, format);
+    queue_record(level, format, args);
+    va_end(args);
+}
 
-    // Log to the configured log file.
-    if (g_log_file) {
-        fprintf(g_log_file, "[%s] %s: ", time_buf, log_level_str(level));
-        va_list args_copy;
-        va_copy(args_copy, args);
-        vfprintf(g_log_file, format, args_copy);
-        va_end(args_copy);
-        fprintf(g_log_file, "\n");
-        fflush(g_log_file);
-    }
-
-    // Also print to the CLI (stdout).
-    fprintf(stdout, "[%s] %s: ", time_buf, log_level_str(level));
-    vfprintf(stdout, format, args);
-    fprintf(stdout, "\n");
-    fflush(stdout);
-
+void access_log_write(const char *format, ...) {
+    if (!g_access_file) return;
+    va_list args;
+    va_start(args, format);
+    queue_record(ACCESS_RECORD, format, args);
     va_end(args);
-    pthread_mutex_unlock(&log_mutex);
 }
@@ -1,8 +1,17 @@
 #include "logging.h"
 #include "proxy.h"
 #include "cache.h"
+#include "disk_cache.h"
+#include "conn_pool.h"
+#include "dns.h"
 #include "management_console.h"  
+#include "console.h"
 #include "thread_pool.h"
+#include "event_loop.h"
+#include "acceptor.h"
+#include "metrics.h"
+#include "http_handler.h"
+#include "overload.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -10,71 +19,271 @@
 
 #define PORT 8080
 #define NUM_THREADS 4
+#define DEFAULT_DISK_CACHE_BYTES (1ULL << 30)
+#define DEFAULT_LISTEN_BACKLOG 511
+#define DEFAULT_CONTROL_SOCKET "proxy.sock"
 
 // Global shutdown flag.
 volatile sig_atomic_t shutdown_requested = 0;
-// Global server socket variable.
-int server_sock = -1;
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t] [-S] [-T] [-R] [-C] [-q] [-b n] [-m size] [-o size] [-E policy] [-d dir] [-D size] [-P n] [-K secs] [-Q n] [-W ms] [-L rate[:burst]] [-N addr] [-M port] [-U path]\n", prog);
+    fprintf(stderr, "  -t       Serve each connection on its own pool worker instead of the event-driven (epoll) engine\n");
+    fprintf(stderr, "  -S       Relay CONNECT tunnels with the copy loop instead of splice()\n");
+    fprintf(stderr, "  -T       Once the cache is full, admit only responses requested more often than the eviction victim\n");
+    fprintf(stderr, "  -R       Give every core its own SO_REUSEPORT listener and accept thread or event loop\n");
+    fprintf(stderr, "  -C       Pin each accept thread or event loop to its own CPU\n");
+    fprintf(stderr, "  -q       Write log messages to proxy.log only, without echoing them to stdout\n");
+    fprintf(stderr, "  -b N     Listen backlog (default %d)\n", DEFAULT_LISTEN_BACKLOG);
+    fprintf(stderr, "  -m SIZE  Cache memory budget, e.g. 512M (default 64M)\n");
+    fprintf(stderr, "  -o SIZE  Largest response to cache, e.g. 8M (default 4M)\n");
+    fprintf(stderr, "  -E NAME  Cache eviction policy: lfu, gdsf, gdsf-hits or gdsf-bytes (default lfu)\n");
+    fprintf(stderr, "  -d DIR   Enable the disk cache tier in DIR (emptied on startup)\n");
+    fprintf(stderr, "  -D SIZE  Disk cache budget (default 1G)\n");
+    fprintf(stderr, "  -P N     Idle keep-alive connections kept per origin (default 8, 0 disables)\n");
+    fprintf(stderr, "  -K SECS  Idle timeout of keep-alive client connections (default 5, or off with -t; 0 disables)\n");
+    fprintf(stderr, "  -Q N     With -t, connections that may wait for a worker before new ones get a 503 (default %d)\n",
+            DEFAULT_TASK_QUEUE_SIZE);
+    fprintf(stderr, "  -W MS    With -t, answer connections that waited longer than this for a worker with a 503 (default: no limit)\n");
+    fprintf(stderr, "  -L R[:B] Allow each client IP R new connections per second, in bursts of up to B (default R)\n");
+    fprintf(stderr, "  -N ADDR  Nameserver to query, as address[:port] (default: from /etc/resolv.conf)\n");
+    fprintf(stderr, "  -M PORT  Serve Prometheus metrics on 127.0.0.1:PORT/metrics\n");
+    fprintf(stderr, "  -U PATH  Control socket for admin commands (default %s)\n", DEFAULT_CONTROL_SOCKET);
+}
+
+// Parses a byte count with an optional K, M or G suffix. Returns 0 if invalid.
+static size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        default: break;
+    }
+    return (*end == '\0') ? (size_t)value : 0;
+}
 
 void handle_signal(int sig) {
     (void)sig; // Unused parameter.
     shutdown_requested = 1;
-    // Close the server socket to break out of the blocking accept().
-    if (server_sock != -1) {
-        close(server_sock);
-        server_sock = -1;
-    }
 }
 
 int main(int argc, char *argv[]) {
-    (void)argc;
-    (void)argv;
+    int event_mode = 1;
+    int reuse_port = 0;
+    int pin_cpus = 0;
+    int backlog = DEFAULT_LISTEN_BACKLOG;
+    int metrics_port = 0;
+    int queue_size = 0;
+    int keep_alive_secs = -1;
+    size_t cache_bytes = 0;
+    size_t max_object = 0;
+    const char *disk_dir = NULL;
+    const char *nameserver = NULL;
+    const char *control_path = DEFAULT_CONTROL_SOCKET;
+    size_t disk_bytes = DEFAULT_DISK_CACHE_BYTES;
+    int opt;
+    while ((opt = getopt(argc, argv, "etSTRCqb:m:o:d:D:P:K:Q:W:L:N:M:U:E:h")) != -1) {
+        switch (opt) {
+            case 'e':
+                // The event-driven engine is the default; kept for old command lines.
+                event_mode = 1;
+                break;
+            case 't':
+                event_mode = 0;
+                break;
+            case 'S':
+                set_tunnel_splice(0);
+                break;
+            case 'T':
+                set_cache_admission(1);
+                break;
+            case 'R':
+                reuse_port = 1;
+                break;
+            case 'C':
+                pin_cpus = 1;
+                break;
+            case 'q':
+                set_log_echo(0);
+                break;
+            case 'd':
+                disk_dir = optarg;
+                break;
+            case 'N':
+                nameserver = optarg;
+                break;
+            case 'U':
+                control_path = optarg;
+                break;
+            case 'E':
+                if (set_cache_policy(optarg) < 0) {
+                    fprintf(stderr, "Unknown eviction policy: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'L': {
+                char *end;
+                double rate = strtod(optarg, &end);
+                long burst = (long)rate;
+                if (*end == ':') burst = strtol(end + 1, &end, 10);
+                if (*end != '\0' || !(rate > 0) || burst < 0 || burst > 1000000) {
+                    fprintf(stderr, "Invalid value for -L: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                set_client_rate_limit(rate, (int)burst);
+                break;
+            }
+            case 'b':
+            case 'M':
+            case 'P':
+            case 'K':
+            case 'Q':
+            case 'W': {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value < 0 || ((opt == 'b' || opt == 'M' || opt == 'Q') && value == 0) ||
+                    (opt == 'M' && value > 65535) || ((opt == 'Q' || opt == 'W') && value > 1000000)) {
+                    fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'b') backlog = (int)value;
+                else if (opt == 'M') metrics_port = (int)value;
+                else if (opt == 'P') set_conn_pool_limits((int)value, 0);
+                else if (opt == 'Q') queue_size = (int)value;
+                else if (opt == 'W') set_queue_wait_limit((int)value);
+                else keep_alive_secs = (int)value;
+                break;
+            }
+            case 'm':
+            case 'o':
+            case 'D':
+                if (parse_size(optarg) == 0) {
+                    fprintf(stderr, "Invalid size for -%c: %s\n", opt, optarg);
+                    return EXIT_FAILURE;
+                }
+                if (opt == 'm') cache_bytes = parse_size(optarg);
+                else if (opt == 'o') max_object = parse_size(optarg);
+                else disk_bytes = parse_size(optarg);
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
     // Register signal handlers for graceful shutdown.
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
+    // A client that disconnects mid-response must not kill the process
+    // (sendfile() has no MSG_NOSIGNAL equivalent).
+    signal(SIGPIPE, SIG_IGN);
 
     // Initialize logging (logs go to "proxy.log", with DEBUG and above).
     init_logging("proxy.log", LOG_LEVEL_DEBUG);
+    // Every finished request is also written to the access log, with its phase timings.
+    if (init_access_log("access.log") < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to open access.log, continuing without an access log");
+    }
 
     // Initialize cache.
+    set_cache_limits(cache_bytes, max_object);
     init_cache();
+    if (disk_dir && init_disk_cache(disk_dir, disk_bytes) < 0) {
+        log_message(LOG_LEVEL_WARN, "Continuing without the disk cache tier");
+    }
+
+    // Initialize the DNS resolver and its cache.
+    if (init_dns_resolver(nameserver) < 0) {
+        close_logging();
+        return EXIT_FAILURE;
+    }
 
-    // Start the admin (management) console thread.
-    start_admin_console_thread();
+    // Compile the block list and reload it whenever the file changes.
+    start_block_list_watcher("block_list.txt");
+
+    // Serve admin commands on the control socket.
+    if (start_admin_console_thread(control_path) < 0) {
+        log_message(LOG_LEVEL_WARN, "Continuing without the control socket");
+    }
+
+    // A threaded worker is tied up while its client connection sits idle, so
+    // client keep-alive is opt-in there, and one worker is always left free
+    // for new connections.
+    if (keep_alive_secs >= 0) set_client_keep_alive(keep_alive_secs, 0);
+    else if (!event_mode) set_client_keep_alive(0, 0);
+    if (!event_mode) set_idle_worker_limit(NUM_THREADS - 1);
 
     // Initialize the thread pool with a fixed number of worker threads.
-    ThreadPool *pool = thread_pool_init(NUM_THREADS);
+    // In event-driven mode it only runs blocking offload work such as DNS.
+    ThreadPool *pool = thread_pool_init(NUM_THREADS, queue_size);
     if (!pool) {
         log_message(LOG_LEVEL_ERROR, "Failed to initialize thread pool");
         exit(EXIT_FAILURE);
     }
 
-    // Create the server socket.
-    server_sock = create_server_socket(PORT);
-    if (server_sock < 0) {
-        log_message(LOG_LEVEL_ERROR, "Failed to create server socket");
+    // Serve metrics on the admin port if requested.
+    if (metrics_port && start_metrics_server(metrics_port, pool) < 0) {
+        log_message(LOG_LEVEL_WARN, "Continuing without the metrics endpoint");
+    }
+
+    // One event loop per core. The threaded engine has a single accept
+    // thread, unless every core gets its own SO_REUSEPORT listener.
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_listeners = (event_mode || reuse_port) && cores > 0 ? (int)cores : 1;
+    int *listen_socks = (int *)malloc(num_listeners * sizeof(int));
+    if (!listen_socks) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for server sockets");
         exit(EXIT_FAILURE);
     }
+
+    // Create the server socket(s). Without SO_REUSEPORT they all share one.
+    for (int i = 0; i < num_listeners; i++) {
+        listen_socks[i] = (i == 0 || reuse_port) ? create_server_socket(PORT, backlog, reuse_port) : listen_socks[0];
+        if (listen_socks[i] < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to create server socket");
+            exit(EXIT_FAILURE);
+        }
+    }
     log_message(LOG_LEVEL_INFO, "Proxy server listening on port %d", PORT);
 
-    // Accept incoming client connections and enqueue them to the thread pool.
-    while (!shutdown_requested) {
-        int client_sock = accept_client(server_sock);
-        if (client_sock < 0) {
-            // If shutdown_requested is set, break the loop.
-            if (shutdown_requested) break;
-            log_message(LOG_LEVEL_ERROR, "Error accepting client connection");
-            continue;
+    if (event_mode) {
+        // The loops accept and serve connections themselves.
+        if (event_loop_start(listen_socks, num_listeners, pool, pin_cpus) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to start event loops");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        // The accept threads hand connections to the thread pool.
+        if (acceptors_start(listen_socks, num_listeners, pool, pin_cpus) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to start accept threads");
+            exit(EXIT_FAILURE);
         }
-        thread_pool_enqueue(pool, client_sock);
+    }
+    while (!shutdown_requested) {
+        sleep(1);
     }
 
     log_message(LOG_LEVEL_INFO, "Shutdown signal received. Cleaning up...");
 
-    // Cleanup resources.
+    // Cleanup resources. The event loops are stopped before the pool is drained,
+    // since pending DNS lookups still report back to their loop.
+    acceptors_stop();
+    event_loop_stop();
     thread_pool_destroy(pool);
+    event_loop_destroy();
+    stop_metrics_server();
+    free_conn_pool();
+    free_dns_resolver();
     free_cache();
+    free_disk_cache();
     stop_admin_console_thread();
+    stop_block_list_watcher();
+    for (int i = 0; i < num_listeners; i++) {
+        if (i == 0 || reuse_port) close(listen_socks[i]);
+    }
+    free(listen_socks);
     close_logging();
 
     return 0;
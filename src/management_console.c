@@ -1,66 +1,378 @@
 #include "management_console.h"
 #include "console.h"   // For block_url() and unblock_url()
 #include "cache.h"     // Added to use remove_cache_by_url()
+#include "disk_cache.h"
 #include "logging.h"
 #include "proxy.h"     // For the global shutdown_requested flag.
+#include "slab.h"
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define ADMIN_MAX_CLIENTS 16
+#define ADMIN_MAX_LINE 4096  // Longest command; a client sending more is disconnected.
+
+// A connected control client and its partly received command.
+typedef struct {
+    int fd;
+    char line[ADMIN_MAX_LINE];
+    size_t length;
+} AdminClient;
+
+// Growable response text.
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Reply;
 
 static pthread_t admin_thread;
-static volatile int admin_thread_running = 0;
+static int admin_thread_running = 0;
+static int admin_sock = -1;
+static int admin_wake[2] = { -1, -1 };  // Written to stop the thread.
+static char *admin_socket_path = NULL;
+
+static void reply_append(Reply *reply, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(reply->data + reply->length, reply->capacity - reply->length, format, args);
+        va_end(args);
+        if (n < 0) return;
+        if ((size_t)n < reply->capacity - reply->length) {
+            reply->length += n;
+            return;
+        }
+        size_t capacity = reply->capacity * 2 + n;
+        char *data = realloc(reply->data, capacity);
+        if (!data) return;
+        reply->data = data;
+        reply->capacity = capacity;
+    }
+}
+
+// Appends a string as a quoted JSON string.
+static void reply_append_string(Reply *reply, const char *text) {
+    reply_append(reply, "\"");
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') reply_append(reply, "\\%c", *p);
+        else if (*p < 0x20) reply_append(reply, "\\u%04x", *p);
+        else reply_append(reply, "%c", *p);
+    }
+    reply_append(reply, "\"");
+}
+
+static void reply_error(Reply *reply, const char *error) {
+    reply_append(reply, "{\"ok\":false,\"error\":");
+    reply_append_string(reply, error);
+    reply_append(reply, "}");
+}
+
+// Separates list items: the first one is not preceded by a comma.
+typedef struct {
+    Reply *reply;
+    const char *prefix;
+    size_t prefix_length;
+    int count;
+    time_t now;
+} ListState;
+
+static void list_pattern(const char *pattern, int from_file, void *arg) {
+    ListState *state = (ListState *)arg;
+    reply_append(state->reply, "%s{\"pattern\":", state->count++ ? "," : "");
+    reply_append_string(state->reply, pattern);
+    reply_append(state->reply, ",\"source\":\"%s\"}", from_file ? "file" : "console");
+}
+
+static void count_pattern(const char *pattern, int from_file, void *arg) {
+    (void)pattern;
+    (void)from_file;
+    (*(int *)arg)++;
+}
+
+static void dump_memory_entry(const CacheEntry *entry, int frequency, void *arg) {
+    ListState *state = (ListState *)arg;
+    if (strncmp(entry->url, state->prefix, state->prefix_length) != 0) return;
+    long long expires_in = (long long)atomic_load(&entry->expires_at) - (long long)state->now;
+    reply_append(state->reply, "%s{\"tier\":\"memory\",\"url\":", state->count++ ? "," : "");
+    reply_append_string(state->reply, entry->url);
+    reply_append(state->reply, ",\"bytes\":%zu,\"status\":%d,\"frequency\":%d,\"expires_in\":%lld,"
+                 "\"revalidatable\":%s,\"fetch_seconds\":%.3f}",
+                 entry->response.length, entry->status, frequency, expires_in,
+                 cache_entry_can_revalidate(entry) ? "true" : "false", entry->time_taken);
+}
+
+static void dump_disk_entry(const char *url, size_t length, int status, time_t expires_at, void *arg) {
+    ListState *state = (ListState *)arg;
+    if (strncmp(url, state->prefix, state->prefix_length) != 0) return;
+    reply_append(state->reply, "%s{\"tier\":\"disk\",\"url\":", state->count++ ? "," : "");
+    reply_append_string(state->reply, url);
+    reply_append(state->reply, ",\"bytes\":%zu,\"status\":%d,\"expires_in\":%lld}",
+                 length, status, (long long)(expires_at - state->now));
+}
+
+// Occupancy of the slab size classes in use, and the share of their memory
+// that sits in free slots.
+static void append_slab_stats(Reply *reply) {
+    SlabStats stats[SLAB_CLASS_COUNT];
+    int count = get_slab_stats(stats, SLAB_CLASS_COUNT);
+    size_t reserved = 0, used = 0;
+    int listed = 0;
+    reply_append(reply, "\"slabs\":{\"classes\":[");
+    for (int i = 0; i < count; i++) {
+        if (stats[i].slabs == 0) continue;
+        reserved += stats[i].slabs * SLAB_SIZE;
+        used += stats[i].in_use * stats[i].object_size;
+        reply_append(reply, "%s{\"object_bytes\":%zu,\"slabs\":%zu,\"objects\":%zu,\"in_use\":%zu}",
+                     listed++ ? "," : "", stats[i].object_size, stats[i].slabs, stats[i].objects, stats[i].in_use);
+    }
+    reply_append(reply, "],\"reserved_bytes\":%zu,\"used_bytes\":%zu,\"fragmentation\":%.3f}",
+                 reserved, used, reserved ? 1.0 - (double)used / reserved : 0.0);
+}
+
+// Runs one command and appends its JSON response (without the newline).
+static void run_command(char *command, Reply *reply) {
+    char *arg = strchr(command, ' ');
+    if (arg) {
+        *arg++ = '\0';
+        while (*arg == ' ') arg++;
+    } else {
+        arg = command + strlen(command);
+    }
+
+    if (strcmp(command, "block") == 0 || strcmp(command, "unblock") == 0 || strcmp(command, "purge") == 0) {
+        if (*arg == '\0') {
+            reply_error(reply, "missing argument");
+            return;
+        }
+        if (command[0] == 'b') {
+            if (block_url(arg) < 0) {
+                reply_error(reply, "out of memory");
+                return;
+            }
+            // Remove any cache entries for this newly blocked URL.
+            remove_cache_by_url(arg);
+        } else if (command[0] == 'u') {
+            if (unblock_url(arg) < 0) {
+                reply_error(reply, "not on the block list (patterns from the file are removed by editing it)");
+                return;
+            }
+        } else {
+            remove_cache_by_url(arg);
+        }
+        log_message(LOG_LEVEL_INFO, "Admin command executed: %s %s", command, arg);
+        reply_append(reply, "{\"ok\":true}");
+    } else if (strcmp(command, "list") == 0) {
+        ListState state = { reply, NULL, 0, 0, 0 };
+        reply_append(reply, "{\"ok\":true,\"blocked\":[");
+        for_each_blocked_url(list_pattern, &state);
+        reply_append(reply, "]}");
+    } else if (strcmp(command, "stats") == 0) {
+        CacheStats memory;
+        DiskCacheStats disk;
+        int patterns = 0;
+        get_cache_stats(&memory);
+        get_disk_cache_stats(&disk);
+        for_each_blocked_url(count_pattern, &patterns);
+        reply_append(reply, "{\"ok\":true,\"memory\":{\"entries\":%zu,\"bytes\":%zu,\"max_bytes\":%zu,"
+                     "\"max_object_bytes\":%zu,\"shards\":%d,\"policy\":\"%s\",\"admission\":%s},",
+                     memory.entries, memory.bytes, memory.max_bytes, memory.max_object_size, memory.shards,
+                     memory.policy, memory.admission ? "true" : "false");
+        reply_append(reply, "\"disk\":{\"enabled\":%s,\"entries\":%zu,\"bytes\":%zu,\"max_bytes\":%zu},"
+                     "\"blocked_patterns\":%d,",
+                     disk.enabled ? "true" : "false", disk.entries, disk.bytes, disk.max_bytes, patterns);
+        append_slab_stats(reply);
+        reply_append(reply, "}");
+    } else if (strcmp(command, "dump") == 0) {
+        ListState state = { reply, arg, strlen(arg), 0, time(NULL) };
+        reply_append(reply, "{\"ok\":true,\"entries\":[");
+        cache_for_each(dump_memory_entry, &state);
+        disk_cache_for_each(dump_disk_entry, &state);
+        reply_append(reply, "]}");
+    } else if (strcmp(command, "quit") == 0) {
+        log_message(LOG_LEVEL_INFO, "Admin command executed: quit");
+        shutdown_requested = 1;
+        reply_append(reply, "{\"ok\":true}");
+    } else {
+        log_message(LOG_LEVEL_WARN, "Unknown admin command: %s", command);
+        reply_error(reply, "unknown command");
+    }
+}
+
+static int send_all(int sock, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Reads what the client sent and answers every complete command in it, in
+ * one write. Returns -1 once the client should be disconnected.
+ */
+static int serve_client(AdminClient *client) {
+    ssize_t n = recv(client->fd, client->line + client->length, sizeof(client->line) - client->length, 0);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n <= 0) return -1;
+    client->length += n;
+
+    Reply reply = { NULL, 0, 0 };
+    reply.capacity = 1024;
+    reply.data = (char *)malloc(reply.capacity);
+    if (!reply.data) return -1;
+    size_t start = 0;
+    for (size_t i = 0; i < client->length; i++) {
+        if (client->line[i] != '\n') continue;
+        client->line[i] = '\0';
+        if (i > start && client->line[i - 1] == '\r') client->line[i - 1] = '\0';
+        if (client->line[start] != '\0') {
+            run_command(client->line + start, &reply);
+            reply_append(&reply, "\n");
+        }
+        start = i + 1;
+    }
+    memmove(client->line, client->line + start, client->length - start);
+    client->length -= start;
+
+    int rc = 0;
+    if (client->length == sizeof(client->line)) {
+        reply_error(&reply, "command too long");
+        reply_append(&reply, "\n");
+        rc = -1;
+    }
+    if (reply.length > 0 && send_all(client->fd, reply.data, reply.length) < 0) rc = -1;
+    free(reply.data);
+    return rc;
+}
 
 static void *admin_console_thread_func(void *arg) {
     (void)arg;
-    while (admin_thread_running) {
-        FILE *fp = fopen("admin_cmd.txt", "r");
-        if (fp) {
-            char command[1024];
-            if (fgets(command, sizeof(command), fp) != NULL) {
-                // Remove newline character.
-                command[strcspn(command, "\n")] = '\0';
-                if (strncmp(command, "block ", 6) == 0) {
-                    const char *url = command + 6;
-                    block_url(url);
-                    // Remove any cache entries for this newly blocked URL.
-                    remove_cache_by_url(url);
-                    log_message(LOG_LEVEL_INFO, "Admin command executed: block %s", url);
-                } else if (strncmp(command, "unblock ", 8) == 0) {
-                    const char *url = command + 8;
-                    unblock_url(url);
-                    log_message(LOG_LEVEL_INFO, "Admin command executed: unblock %s", url);
-                } else if (strcmp(command, "list") == 0) {
-                    log_message(LOG_LEVEL_INFO, "Admin command executed: list");
-                    /* Listing currently is a placeholder.
-                       In a more advanced implementation you might expose the current block list via an API. */
-                } else if (strcmp(command, "quit") == 0) {
-                    log_message(LOG_LEVEL_INFO, "Admin command executed: quit");
-                    shutdown_requested = 1;
-                } else {
-                    log_message(LOG_LEVEL_WARN, "Unknown admin command: %s", command);
-                }
+    AdminClient *clients[ADMIN_MAX_CLIENTS] = { NULL };
+    int client_count = 0;
+    for (;;) {
+        struct pollfd pfds[2 + ADMIN_MAX_CLIENTS];
+        pfds[0].fd = admin_wake[0];
+        pfds[0].events = POLLIN;
+        pfds[1].fd = admin_sock;
+        pfds[1].events = client_count < ADMIN_MAX_CLIENTS ? POLLIN : 0;
+        for (int i = 0; i < client_count; i++) {
+            pfds[2 + i].fd = clients[i]->fd;
+            pfds[2 + i].events = POLLIN;
+        }
+        if (poll(pfds, 2 + client_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "poll failed in admin console");
+            break;
+        }
+        if (pfds[0].revents) break;
+
+        // Serve clients first: accepting below shifts the array.
+        for (int i = client_count - 1; i >= 0; i--) {
+            if (!pfds[2 + i].revents || serve_client(clients[i]) == 0) continue;
+            close(clients[i]->fd);
+            free(clients[i]);
+            clients[i] = clients[--client_count];
+        }
+        if (pfds[1].revents & POLLIN) {
+            int fd = accept(admin_sock, NULL, NULL);
+            AdminClient *client = fd >= 0 ? (AdminClient *)calloc(1, sizeof(AdminClient)) : NULL;
+            if (client) {
+                // A client that stops reading must not stall the console.
+                struct timeval timeout = { 1, 0 };
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+                client->fd = fd;
+                clients[client_count++] = client;
+            } else if (fd >= 0) {
+                close(fd);
             }
-            fclose(fp);
-            remove("admin_cmd.txt");
         }
-        sleep(1);
+    }
+    for (int i = 0; i < client_count; i++) {
+        close(clients[i]->fd);
+        free(clients[i]);
     }
     return NULL;
 }
 
-void start_admin_console_thread(void) {
-    admin_thread_running = 1;
-    if (pthread_create(&admin_thread, NULL, admin_console_thread_func, NULL) != 0) {
+int start_admin_console_thread(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        log_message(LOG_LEVEL_ERROR, "Control socket path is too long: %s", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    admin_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (admin_sock < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to create control socket");
+        return -1;
+    }
+    // Replace a socket left behind by a previous run.
+    struct stat st;
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(socket_path);
+    // Commands can shut the proxy down: only its own user may connect. The
+    // socket is created with owner-only permissions, so there is no window
+    // in which another user could connect before a chmod().
+    mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+    int bound = bind(admin_sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (bound < 0 || listen(admin_sock, 16) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to listen on control socket %s", socket_path);
+        close(admin_sock);
+        admin_sock = -1;
+        return -1;
+    }
+    admin_socket_path = strdup(socket_path);
+
+    if (pipe(admin_wake) < 0 || pthread_create(&admin_thread, NULL, admin_console_thread_func, NULL) != 0) {
         log_message(LOG_LEVEL_ERROR, "Failed to start admin console thread");
-    } else {
-        log_message(LOG_LEVEL_INFO, "Admin console thread started");
+        if (admin_wake[0] >= 0) {
+            close(admin_wake[0]);
+            close(admin_wake[1]);
+            admin_wake[0] = admin_wake[1] = -1;
+        }
+        close(admin_sock);
+        admin_sock = -1;
+        unlink(socket_path);
+        free(admin_socket_path);
+        admin_socket_path = NULL;
+        return -1;
     }
+    admin_thread_running = 1;
+    log_message(LOG_LEVEL_INFO, "Admin console listening on %s", socket_path);
+    return 0;
 }
 
 void stop_admin_console_thread(void) {
-    admin_thread_running = 0;
+    if (!admin_thread_running) return;
+    if (write(admin_wake[1], "x", 1) < 0) {
+        log_message(LOG_LEVEL_WARN, "Failed to wake the admin console thread");
+    }
     pthread_join(admin_thread, NULL);
+    close(admin_wake[0]);
+    close(admin_wake[1]);
+    admin_wake[0] = admin_wake[1] = -1;
+    close(admin_sock);
+    admin_sock = -1;
+    if (admin_socket_path) unlink(admin_socket_path);
+    free(admin_socket_path);
+    admin_socket_path = NULL;
+    admin_thread_running = 0;
     log_message(LOG_LEVEL_INFO, "Admin console thread stopped");
 }
@@ -0,0 +1,472 @@
+#include "metrics.h"
+#include "logging.h"
+#include "slab.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define MAX_LOGGED_URL 1024  // Longer URLs are truncated in the access log.
+
+// Latency buckets, in microseconds: one each for 0-3, then four sub-buckets
+// per power of two up to 2^32 us (about 71 minutes), then an overflow bucket.
+#define HISTOGRAM_SUB_BUCKETS 4
+#define HISTOGRAM_MAX_MAGNITUDE 32
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAX_MAGNITUDE - 1) + 1)
+#define HISTOGRAM_EXPORT_FROM 4  // First exported bucket bound: 2^4 us.
+
+typedef struct {
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t sum_us;
+} Histogram;
+
+// One thread's metrics. Only the owning thread writes them, so updates are
+// plain relaxed loads and stores; scrapes read them concurrently.
+typedef struct MetricsShard {
+    atomic_uint_fast64_t counters[METRIC_COUNT];
+    Histogram latency[REQUEST_KIND_COUNT];
+    Histogram phases[PHASE_COUNT];
+    struct MetricsShard *next;
+} MetricsShard;
+
+// Shards are kept after their thread exits, so counters never go backwards.
+static pthread_mutex_t shard_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static MetricsShard *shard_list = NULL;
+static __thread MetricsShard *thread_shard = NULL;
+
+static const char *kind_names[REQUEST_KIND_COUNT] = { "hit", "miss", "connect" };
+static const char *phase_names[PHASE_COUNT] = {
+    "queue", "parse", "block", "cache", "dns", "connect", "ttfb", "transfer"
+};
+
+static pthread_t server_thread;
+static int server_running = 0;
+static int server_sock = -1;
+static int wake_pipe[2] = { -1, -1 };
+static ThreadPool *queue_pool = NULL;
+
+static MetricsShard *get_thread_shard(void) {
+    if (thread_shard) return thread_shard;
+    MetricsShard *shard = (MetricsShard *)calloc(1, sizeof(MetricsShard));
+    if (!shard) return NULL;
+    pthread_mutex_lock(&shard_list_mutex);
+    shard->next = shard_list;
+    shard_list = shard;
+    pthread_mutex_unlock(&shard_list_mutex);
+    thread_shard = shard;
+    return shard;
+}
+
+// Single-writer increment: no locked read-modify-write needed.
+static inline void shard_add(atomic_uint_fast64_t *value, uint64_t delta) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+void metrics_add(MetricId id, int64_t delta) {
+    MetricsShard *shard = get_thread_shard();
+    if (shard) shard_add(&shard->counters[id], (uint64_t)delta);
+}
+
+uint64_t metrics_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static int bucket_index(uint64_t us) {
+    if (us < HISTOGRAM_SUB_BUCKETS) return (int)us;
+    int magnitude = 63 - __builtin_clzll(us);
+    if (magnitude >= HISTOGRAM_MAX_MAGNITUDE) return HISTOGRAM_BUCKETS - 1;
+    return HISTOGRAM_SUB_BUCKETS * (magnitude - 1) + (int)((us >> (magnitude - 2)) & 3);
+}
+
+// Exclusive upper bound of a bucket, in microseconds.
+static uint64_t bucket_bound(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) return (uint64_t)index + 1;
+    int magnitude = index / HISTOGRAM_SUB_BUCKETS + 1;
+    int sub = index % HISTOGRAM_SUB_BUCKETS;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (magnitude - 2);
+}
+
+static void histogram_record(Histogram *histogram, uint64_t us) {
+    shard_add(&histogram->buckets[bucket_index(us)], 1);
+    shard_add(&histogram->sum_us, us);
+}
+
+void metrics_record_request(RequestKind kind, uint64_t started_us) {
+    MetricsShard *shard = get_thread_shard();
+    if (!shard) return;
+    uint64_t now = metrics_now_us();
+    histogram_record(&shard->latency[kind], now > started_us ? now - started_us : 0);
+}
+
+void request_timing_start(RequestTiming *timing, uint64_t started_us) {
+    memset(timing, 0, sizeof(*timing));
+    timing->started_us = timing->mark_us = started_us;
+    timing->result = "none";
+}
+
+void request_timing_mark(RequestTiming *timing, RequestPhase phase) {
+    uint64_t now = metrics_now_us();
+    if (now > timing->mark_us) timing->phase_us[phase] += now - timing->mark_us;
+    timing->mark_us = now;
+    timing->phases_seen |= 1u << phase;
+}
+
+// Copies a string into a JSON string body, escaping quotes, backslashes and
+// control characters. Truncates to fit.
+static void json_escape(char *out, size_t size, const char *in) {
+    size_t n = 0;
+    for (; *in && n + 7 < size; in++) {
+        unsigned char c = (unsigned char)*in;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char)c;
+        } else if (c < 0x20) {
+            n += snprintf(out + n, size - n, "\\u%04x", c);
+        } else {
+            out[n++] = (char)c;
+        }
+    }
+    out[n] = '\0';
+}
+
+void request_timing_finish(const RequestTiming *timing, const char *client, const char *method,
+                           const char *url) {
+    MetricsShard *shard = get_thread_shard();
+    if (shard) {
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            // Only phases the request went through, so a histogram shows
+            // how long that step takes when it happens.
+            if (timing->phases_seen & (1u << i)) histogram_record(&shard->phases[i], timing->phase_us[i]);
+        }
+    }
+    uint64_t now = metrics_now_us();
+    char escaped_url[2 * MAX_LOGGED_URL];
+    char escaped_method[64];
+    json_escape(escaped_url, sizeof(escaped_url), url);
+    json_escape(escaped_method, sizeof(escaped_method), method);
+    const uint64_t *p = timing->phase_us;
+    access_log_write("\"client\":\"%s\",\"method\":\"%s\",\"url\":\"%s\",\"result\":\"%s\","
+                     "\"status\":%d,\"bytes\":%llu,\"complete\":%s,\"total_us\":%llu,"
+                     "\"queue_us\":%llu,\"parse_us\":%llu,\"block_us\":%llu,\"cache_us\":%llu,"
+                     "\"dns_us\":%llu,\"connect_us\":%llu,\"ttfb_us\":%llu,\"transfer_us\":%llu",
+                     client, escaped_method, escaped_url, timing->result, timing->status, timing->bytes,
+                     timing->complete ? "true" : "false",
+                     (unsigned long long)(now > timing->started_us ? now - timing->started_us : 0),
+                     (unsigned long long)p[PHASE_QUEUE], (unsigned long long)p[PHASE_PARSE],
+                     (unsigned long long)p[PHASE_BLOCK], (unsigned long long)p[PHASE_CACHE],
+                     (unsigned long long)p[PHASE_DNS], (unsigned long long)p[PHASE_CONNECT],
+                     (unsigned long long)p[PHASE_TTFB], (unsigned long long)p[PHASE_TRANSFER]);
+}
+
+// Growable text buffer for a scrape.
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} TextBuffer;
+
+static void text_append(TextBuffer *text, const char *format, ...) {
+    for (;;) {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(text->data + text->length, text->capacity - text->length, format, args);
+        va_end(args);
+        if (n < 0) return;
+        if ((size_t)n < text->capacity - text->length) {
+            text->length += n;
+            return;
+        }
+        size_t capacity = text->capacity * 2 + n;
+        char *data = realloc(text->data, capacity);
+        if (!data) return;
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+static void append_counter(TextBuffer *text, const char *name, const char *type, const char *help,
+                           const uint64_t *totals, MetricId id) {
+    text_append(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    if (strcmp(type, "gauge") == 0) text_append(text, "%s %lld\n", name, (long long)(int64_t)totals[id]);
+    else text_append(text, "%s %llu\n", name, (unsigned long long)totals[id]);
+}
+
+// Smallest bucket bound below which the given fraction of samples fall.
+static double quantile_seconds(const uint64_t *buckets, uint64_t count, double quantile) {
+    uint64_t rank = (uint64_t)(quantile * count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) return bucket_bound(i) / 1e6;
+    }
+    return bucket_bound(HISTOGRAM_BUCKETS - 1) / 1e6;
+}
+
+// Writes one labelled histogram series, with a bucket per power of two;
+// each exported bucket covers whole sub-buckets.
+static void append_histogram(TextBuffer *text, const char *name, const char *label, const char *value,
+                             const uint64_t *buckets, uint64_t sum_us) {
+    uint64_t cumulative = 0;
+    int next = 0;
+    for (int magnitude = HISTOGRAM_EXPORT_FROM; magnitude <= HISTOGRAM_MAX_MAGNITUDE; magnitude++) {
+        int end = HISTOGRAM_SUB_BUCKETS * (magnitude - 1);
+        while (next < end) cumulative += buckets[next++];
+        text_append(text, "%s_bucket{%s=\"%s\",le=\"%.6f\"} %llu\n", name, label, value,
+                    (double)((uint64_t)1 << magnitude) / 1e6, (unsigned long long)cumulative);
+    }
+    while (next < HISTOGRAM_BUCKETS) cumulative += buckets[next++];
+    text_append(text, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value,
+                (unsigned long long)cumulative);
+    text_append(text, "%s_sum{%s=\"%s\"} %.6f\n", name, label, value, sum_us / 1e6);
+    text_append(text, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long)cumulative);
+}
+
+// Adds a shard's histogram into running totals.
+static void sum_histogram(const Histogram *histogram, uint64_t *buckets, uint64_t *sum_us) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        buckets[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+    }
+    *sum_us += atomic_load_explicit(&histogram->sum_us, memory_order_relaxed);
+}
+
+static void format_metrics(TextBuffer *text) {
+    uint64_t totals[METRIC_COUNT] = { 0 };
+    uint64_t buckets[REQUEST_KIND_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t sums[REQUEST_KIND_COUNT] = { 0 };
+    uint64_t phase_buckets[PHASE_COUNT][HISTOGRAM_BUCKETS];
+    uint64_t phase_sums[PHASE_COUNT] = { 0 };
+    memset(buckets, 0, sizeof(buckets));
+    memset(phase_buckets, 0, sizeof(phase_buckets));
+
+    pthread_mutex_lock(&shard_list_mutex);
+    for (MetricsShard *shard = shard_list; shard; shard = shard->next) {
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            totals[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int k = 0; k < REQUEST_KIND_COUNT; k++) {
+            sum_histogram(&shard->latency[k], buckets[k], &sums[k]);
+        }
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            sum_histogram(&shard->phases[p], phase_buckets[p], &phase_sums[p]);
+        }
+    }
+    pthread_mutex_unlock(&shard_list_mutex);
+
+    append_counter(text, "proxy_requests_total", "counter", "Requests read from clients.", totals, METRIC_REQUESTS);
+    text_append(text, "# HELP proxy_cache_hits_total GET requests served from the cache.\n"
+                      "# TYPE proxy_cache_hits_total counter\n");
+    text_append(text, "proxy_cache_hits_total{tier=\"memory\"} %llu\n",
+                (unsigned long long)totals[METRIC_CACHE_HITS_MEMORY]);
+    text_append(text, "proxy_cache_hits_total{tier=\"disk\"} %llu\n",
+                (unsigned long long)totals[METRIC_CACHE_HITS_DISK]);
+    text_append(text, "proxy_cache_hits_total{tier=\"revalidated\"} %llu\n",
+                (unsigned long long)totals[METRIC_CACHE_REVALIDATED]);
+    append_counter(text, "proxy_cache_misses_total", "counter", "GET requests fetched from the origin.",
+                   totals, METRIC_CACHE_MISSES);
+    append_counter(text, "proxy_cache_evictions_total", "counter", "Entries evicted from the memory cache.",
+                   totals, METRIC_CACHE_EVICTIONS);
+    append_counter(text, "proxy_cache_admission_rejections_total", "counter",
+                   "Responses not cached because the admission filter expected fewer hits than the eviction victim's.",
+                   totals, METRIC_CACHE_REJECTED);
+    append_counter(text, "proxy_coalesced_requests_total", "counter",
+                   "Misses served by sharing a concurrent fetch of the same URL.", totals, METRIC_COALESCED);
+    append_counter(text, "proxy_blocked_requests_total", "counter", "Requests refused by the block list.",
+                   totals, METRIC_BLOCKED);
+    text_append(text, "# HELP proxy_shed_connections_total Connections refused with a 503 to shed load.\n"
+                      "# TYPE proxy_shed_connections_total counter\n");
+    text_append(text, "proxy_shed_connections_total{reason=\"queue_full\"} %llu\n",
+                (unsigned long long)totals[METRIC_SHED_QUEUE_FULL]);
+    text_append(text, "proxy_shed_connections_total{reason=\"queue_wait\"} %llu\n",
+                (unsigned long long)totals[METRIC_SHED_QUEUE_WAIT]);
+    text_append(text, "proxy_shed_connections_total{reason=\"rate_limit\"} %llu\n",
+                (unsigned long long)totals[METRIC_SHED_RATE_LIMIT]);
+    append_counter(text, "proxy_bytes_received_total", "counter", "Bytes read from origin servers.",
+                   totals, METRIC_BYTES_RECEIVED);
+    append_counter(text, "proxy_bytes_sent_total", "counter", "Response bytes written to clients.",
+                   totals, METRIC_BYTES_SENT);
+    append_counter(text, "proxy_active_tunnels", "gauge", "Open CONNECT tunnels.", totals, METRIC_ACTIVE_TUNNELS);
+    if (queue_pool) {
+        text_append(text, "# HELP proxy_queue_depth Tasks waiting in the thread pool queue.\n"
+                          "# TYPE proxy_queue_depth gauge\nproxy_queue_depth %zu\n",
+                    thread_pool_queue_depth(queue_pool));
+    }
+    SlabStats slabs[SLAB_CLASS_COUNT];
+    int classes = get_slab_stats(slabs, SLAB_CLASS_COUNT);
+    size_t slab_reserved = 0, slab_used = 0;
+    for (int i = 0; i < classes; i++) {
+        slab_reserved += slabs[i].slabs * SLAB_SIZE;
+        slab_used += slabs[i].in_use * slabs[i].object_size;
+    }
+    text_append(text, "# HELP proxy_slab_bytes Memory held by the slab allocator, and the part of it allocated.\n"
+                      "# TYPE proxy_slab_bytes gauge\n"
+                      "proxy_slab_bytes{state=\"reserved\"} %zu\nproxy_slab_bytes{state=\"used\"} %zu\n",
+                slab_reserved, slab_used);
+
+    text_append(text, "# HELP proxy_request_duration_seconds Time to serve a request, by how it was served.\n"
+                      "# TYPE proxy_request_duration_seconds histogram\n");
+    for (int k = 0; k < REQUEST_KIND_COUNT; k++) {
+        append_histogram(text, "proxy_request_duration_seconds", "kind", kind_names[k], buckets[k], sums[k]);
+    }
+    text_append(text, "# HELP proxy_request_phase_seconds Time requests spent in each phase they went through.\n"
+                      "# TYPE proxy_request_phase_seconds histogram\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        append_histogram(text, "proxy_request_phase_seconds", "phase", phase_names[p],
+                         phase_buckets[p], phase_sums[p]);
+    }
+
+    // Quantiles from the full-resolution buckets, for tail latency.
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    text_append(text, "# HELP proxy_request_duration_quantile_seconds Request latency quantiles (bucket upper bounds).\n"
+                      "# TYPE proxy_request_duration_quantile_seconds gauge\n");
+    for (int k = 0; k < REQUEST_KIND_COUNT; k++) {
+        uint64_t count = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) count += buckets[k][i];
+        if (count == 0) continue;
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            text_append(text, "proxy_request_duration_quantile_seconds{kind=\"%s\",quantile=\"%g\"} %.6f\n",
+                        kind_names[k], quantiles[q], quantile_seconds(buckets[k], count, quantiles[q]));
+        }
+    }
+}
+
+static int send_all(int sock, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(sock, data, length, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
+
+// Answers one scrape. Only "GET /metrics" is served.
+static void serve_scrape(int client_sock) {
+    // A stalled client must not block the next scrape for long.
+    struct timeval timeout = { 1, 0 };
+    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[2048];
+    size_t length = 0;
+    while (length < sizeof(request) - 1) {
+        ssize_t n = recv(client_sock, request + length, sizeof(request) - 1 - length, 0);
+        if (n <= 0) break;
+        length += n;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    request[length] = '\0';
+
+    char header[256];
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0) {
+        static const char not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(client_sock, not_found, sizeof(not_found) - 1);
+        return;
+    }
+    TextBuffer text = { NULL, 0, 0 };
+    text.capacity = 16384;
+    text.data = (char *)malloc(text.capacity);
+    if (!text.data) return;
+    format_metrics(&text);
+    int header_length = snprintf(header, sizeof(header),
+                                 "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", text.length);
+    if (send_all(client_sock, header, header_length) == 0) {
+        send_all(client_sock, text.data, text.length);
+    }
+    free(text.data);
+}
+
+static void *metrics_server(void *arg) {
+    (void)arg;
+    for (;;) {
+        struct pollfd pfds[2] = {
+            { .fd = server_sock, .events = POLLIN },
+            { .fd = wake_pipe[0], .events = POLLIN },
+        };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_message(LOG_LEVEL_ERROR, "poll failed in metrics server");
+            break;
+        }
+        if (pfds[1].revents) break;
+        if (!(pfds[0].revents & POLLIN)) continue;
+        int client_sock = accept(server_sock, NULL, NULL);
+        if (client_sock < 0) continue;
+        serve_scrape(client_sock);
+        close(client_sock);
+    }
+    return NULL;
+}
+
+int start_metrics_server(int port, ThreadPool *pool) {
+    queue_pool = pool;
+    server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_sock < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to create metrics socket");
+        return -1;
+    }
+    int opt = 1;
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(server_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_sock, 16) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to listen for metrics scrapes on port %d", port);
+        close(server_sock);
+        server_sock = -1;
+        return -1;
+    }
+    if (pipe(wake_pipe) < 0 || pthread_create(&server_thread, NULL, metrics_server, NULL) != 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to start the metrics server");
+        if (wake_pipe[0] >= 0) {
+            close(wake_pipe[0]);
+            close(wake_pipe[1]);
+            wake_pipe[0] = wake_pipe[1] = -1;
+        }
+        close(server_sock);
+        server_sock = -1;
+        return -1;
+    }
+    server_running = 1;
+    log_message(LOG_LEVEL_INFO, "Serving metrics on http://127.0.0.1:%d/metrics", port);
+    return 0;
+}
+
+void stop_metrics_server(void) {
+    if (server_running) {
+        if (write(wake_pipe[1], "x", 1) < 0) {
+            log_message(LOG_LEVEL_WARN, "Failed to wake the metrics server");
+        }
+        pthread_join(server_thread, NULL);
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        wake_pipe[0] = wake_pipe[1] = -1;
+        close(server_sock);
+        server_sock = -1;
+        server_running = 0;
+    }
+    pthread_mutex_lock(&shard_list_mutex);
+    while (shard_list) {
+        MetricsShard *next = shard_list->next;
+        free(shard_list);
+        shard_list = next;
+    }
+    pthread_mutex_unlock(&shard_list_mutex);
+}
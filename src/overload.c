@@ -0,0 +1,112 @@
+#include "overload.h"
+#include "logging.h"
+#include "metrics.h"  // For metrics_now_us()
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define RATE_SETS 1024  // Sets in the bucket table; must be a power of two.
+#define RATE_WAYS 4     // Buckets per set.
+#define SHED_DRAIN_READS 16
+
+typedef struct {
+    uint32_t addr;
+    int used;
+    double tokens;
+    uint64_t refill_us;   // When tokens was last brought up to date.
+} RateBucket;
+
+// A client address maps to one set and may take any of its buckets, so a few
+// busy clients that hash alike do not keep resetting each other.
+typedef struct {
+    pthread_mutex_t lock;
+    RateBucket buckets[RATE_WAYS];
+} RateSet;
+
+static RateSet rate_sets[RATE_SETS];
+static pthread_once_t rate_sets_once = PTHREAD_ONCE_INIT;
+static double rate_per_second = 0;
+static double rate_burst = 1;
+static uint64_t queue_wait_limit_us = 0;
+
+static void init_rate_sets(void) {
+    for (int i = 0; i < RATE_SETS; i++) {
+        pthread_mutex_init(&rate_sets[i].lock, NULL);
+    }
+}
+
+void set_queue_wait_limit(int wait_ms) {
+    queue_wait_limit_us = wait_ms > 0 ? (uint64_t)wait_ms * 1000 : 0;
+}
+
+int queue_wait_exceeded(uint64_t enqueued_us) {
+    return queue_wait_limit_us && enqueued_us && metrics_now_us() - enqueued_us > queue_wait_limit_us;
+}
+
+void set_client_rate_limit(double rate, int burst) {
+    rate_per_second = rate > 0 ? rate : 0;
+    rate_burst = burst > 0 ? burst : 1;
+    pthread_once(&rate_sets_once, init_rate_sets);
+}
+
+int client_rate_check(uint32_t addr) {
+    return rate_per_second > 0 ? client_rate_check_at(addr, metrics_now_us()) : 0;
+}
+
+int client_rate_check_at(uint32_t addr, uint64_t now) {
+    if (rate_per_second <= 0) return 0;
+    RateSet *set = &rate_sets[(uint32_t)(addr * 2654435761u) >> 22 & (RATE_SETS - 1)];
+    pthread_mutex_lock(&set->lock);
+    RateBucket *bucket = NULL;
+    RateBucket *oldest = &set->buckets[0];
+    for (int i = 0; i < RATE_WAYS; i++) {
+        RateBucket *candidate = &set->buckets[i];
+        if (candidate->used && candidate->addr == addr) {
+            bucket = candidate;
+            break;
+        }
+        // Prefer a free bucket, then the one whose client was seen longest ago.
+        if (oldest->used && (!candidate->used || candidate->refill_us < oldest->refill_us)) oldest = candidate;
+    }
+    if (!bucket) {
+        bucket = oldest;
+        bucket->addr = addr;
+        bucket->used = 1;
+        bucket->tokens = rate_burst;
+        bucket->refill_us = now;
+    }
+    bucket->tokens += (now - bucket->refill_us) / 1e6 * rate_per_second;
+    if (bucket->tokens > rate_burst) bucket->tokens = rate_burst;
+    bucket->refill_us = now;
+    int retry_after = 0;
+    if (bucket->tokens >= 1) {
+        bucket->tokens -= 1;
+    } else {
+        // Whole seconds until a token is back, rounded up.
+        uint64_t wait_us = (uint64_t)((1 - bucket->tokens) / rate_per_second * 1e6);
+        retry_after = (int)((wait_us + 999999) / 1000000);
+        if (retry_after < 1) retry_after = 1;
+    }
+    pthread_mutex_unlock(&set->lock);
+    return retry_after;
+}
+
+void shed_connection(int sock, int retry_after) {
+    char response[128];
+    int length = snprintf(response, sizeof(response),
+                          "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\n"
+                          "Connection: close\r\n\r\n", retry_after);
+    // A fresh connection's send buffer is empty, so this never has to wait.
+    if (send(sock, response, length, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        log_message(LOG_LEVEL_DEBUG, "Failed to send 503 on socket %d", sock);
+    }
+    // Closing with unread request bytes would reset the connection and could
+    // discard the 503 before the client reads it.
+    shutdown(sock, SHUT_WR);
+    char scratch[4096];
+    for (int i = 0; i < SHED_DRAIN_READS; i++) {
+        if (recv(sock, scratch, sizeof(scratch), MSG_DONTWAIT) <= 0) break;
+    }
+    close(sock);
+}
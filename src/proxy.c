@@ -2,17 +2,37 @@
 #include "logging.h"
 #include "http_handler.h"
 #include "cache.h"
+#include "disk_cache.h"
+#include "http_response.h"
+#include "singleflight.h"
+#include "conn_pool.h"
 #include "console.h"  // For is_url_blocked() and remove_cache_by_url()
+#include "metrics.h"
+#include "overload.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/time.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 
-// Forward declaration for connect_to_server (implemented in http_handler.c).
-int connect_to_server(const char *host, int port);
+static atomic_int idle_workers;   // Workers waiting for the next request on a connection.
+static int idle_worker_limit = 0;
+
+void set_idle_worker_limit(int limit) {
+    idle_worker_limit = limit > 0 ? limit : 0;
+}
+
+// Reserves a slot for waiting on an idle connection. Returns 0 if every
+// slot is taken.
+static int claim_idle_worker(void) {
+    if (atomic_fetch_add(&idle_workers, 1) < idle_worker_limit) return 1;
+    atomic_fetch_sub(&idle_workers, 1);
+    return 0;
+}
 
 // Local helper function: Write all bytes.
 static ssize_t write_all(int sock, const void *buffer, size_t length) {
@@ -28,122 +48,522 @@ static ssize_t write_all(int sock, const void *buffer, size_t length) {
     return total_written;
 }
 
-void handle_client_connection(int client_sock) {
-    log_message(LOG_LEVEL_INFO, "Handling client on socket %d", client_sock);
+// Local helper function: Write a response stored in chunks, several chunks per call.
+static int write_chunks(int sock, const ChunkList *response) {
+    ChunkCursor cursor = { 0 };
+    size_t remaining = response->length;
+    while (remaining > 0) {
+        struct iovec iov[16];
+        int count = chunk_cursor_iov(&cursor, response, iov, 16);
+        ssize_t written = writev(sock, iov, count);
+        if (written <= 0) {
+            return -1;
+        }
+        chunk_cursor_advance(&cursor, response, written);
+        remaining -= written;
+    }
+    return 0;
+}
+
+// An origin response being accumulated for the cache while it is relayed.
+// Accumulation stops once the response outgrows the memory cache's object
+// limit; it is then spilled to the disk tier if enabled and storable. When
+// leading a flight the bytes still go into 'body', whose chunks the flight
+// shares with its readers.
+typedef struct {
+    const char *url;
+    int cacheable;            // Cleared if the response cannot be stored.
+    int filling;              // Still accumulating into 'body'.
+    ChunkList body;           // Handed to the cache as is once complete.
+    DiskCacheFill *disk_fill;
+    time_t disk_expires;
+    Flight *flight;           // Set while leading a coalesced fetch.
+} ResponseFill;
 
-    HttpRequest req;
-    if (parse_http_request(client_sock, &req) < 0) {
-        log_message(LOG_LEVEL_ERROR, "Failed to parse HTTP request on socket %d", client_sock);
-        close(client_sock);
+// Moves a response that outgrew memory to the disk tier, seeded with the bytes buffered so far.
+static void fill_spill_to_disk(ResponseFill *fill) {
+    HttpResponseInfo info;
+    if (!disk_cache_enabled() || !fill->body.head ||
+        parse_http_response_head(fill->body.head->data, fill->body.head->length, &info) != 1 ||
+        !response_is_storable(&info)) {
         return;
     }
+    fill->disk_expires = response_expiry(&info, time(NULL));
+    if (fill->disk_expires > time(NULL) || info.etag[0] || info.last_modified[0]) {
+        fill->disk_fill = disk_cache_begin_fill(fill->url, &fill->body);
+    }
+}
+
+static void fill_append(ResponseFill *fill, const char *data, size_t len) {
+    if (fill->disk_fill && disk_cache_fill_write(fill->disk_fill, data, len) < 0) {
+        fill->disk_fill = NULL;  // Aborted by the disk tier.
+    }
+    if (fill->filling && fill->body.length + len > cache_max_object_size()) {
+        if (fill->cacheable) {
+            fill_spill_to_disk(fill);
+            if (fill->disk_fill && disk_cache_fill_write(fill->disk_fill, data, len) < 0) {
+                fill->disk_fill = NULL;
+            }
+        }
+        if (!fill->disk_fill) {
+            log_message(LOG_LEVEL_DEBUG, "Response for %s exceeds the cache object limit, not caching", fill->url);
+        }
+        fill->filling = 0;
+    }
+    if (!fill->filling && !fill->flight) {
+        chunk_list_free(&fill->body);
+        return;
+    }
+    // Chunks are only ever added, so growing never copies what is stored.
+    if (chunk_list_append(&fill->body, data, len) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed during response accumulation");
+        chunk_list_free(&fill->body);
+        fill->filling = 0;
+        if (fill->flight) flight_finish(fill->flight, 0);
+        fill->flight = NULL;
+        return;
+    }
+    if (fill->flight) {
+        flight_publish(fill->flight, &fill->body);
+        // Once not caching, published chunks are left to the readers; the
+        // last one takes the next bytes.
+        while (!fill->filling && fill->body.head != fill->body.tail) chunk_list_drop_head(&fill->body);
+    }
+}
+
+// Stores a completed response in the cache tiers, frees the fill and ends
+// the flight, after inserting so that later requests find the response in
+// the cache.
+static void fill_finish(ResponseFill *fill, double time_taken, int complete) {
+    if (fill->filling && fill->cacheable) {
+        insert_cache(fill->url, &fill->body, time_taken);
+    }
+    if (fill->disk_fill && fill->cacheable) {
+        disk_cache_commit_fill(fill->disk_fill, time_taken, fill->disk_expires);
+    } else if (fill->disk_fill) {
+        disk_cache_abort_fill(fill->disk_fill);
+    }
+    chunk_list_free(&fill->body);
+    if (fill->flight) flight_finish(fill->flight, complete);
+}
 
+// Sends a disk hit to the client, then moves it back into memory and closes
+// it. Returns 1 if the client connection can be reused.
+static int send_disk_hit(int client_sock, DiskCacheHit *hit, const char *url, RequestTiming *timing) {
+    timing->status = hit->status;
+    int reusable = hit->keep_alive;
+    if (disk_cache_send(client_sock, hit) < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to send cached response to client");
+        reusable = 0;
+    } else {
+        metrics_add(METRIC_BYTES_SENT, hit->length);
+        metrics_record_request(REQUEST_HIT, timing->started_us);
+        request_timing_mark(timing, PHASE_TRANSFER);
+        timing->bytes = hit->length;
+        timing->complete = 1;
+    }
+    disk_cache_promote(url, hit);
+    close(hit->fd);
+    return reusable;
+}
+
+/**
+ * Sends the request to the origin, followed by its body read from the
+ * client, and reads the first bytes of the response into 'buffer', feeding
+ * them to the tracker. A pooled connection that turns out to have been closed
+ * by the origin is retried once on a fresh one.
+ * Marks the DNS, connect and time-to-first-byte phases.
+ *
+ * @return The origin socket, or -1 on failure.
+ */
+static int open_origin(const HttpRequest *req, const char *request, size_t request_length,
+                       int client_sock, RequestBuffer *body, ResponseTracker *tracker,
+                       char *buffer, size_t size, size_t *length, RequestTiming *timing) {
+    int has_body = request_has_body(req);
+    for (;;) {
+        // A body is consumed as it is sent and could not be sent again, so
+        // it goes over a fresh connection that needs no retry.
+        int reused = 0;
+        int server_sock = has_body ? connect_to_server(req->host, req->port, timing)
+                                   : conn_pool_acquire(req->host, req->port, &reused, timing);
+        if (server_sock < 0) {
+            log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", req->host, req->port);
+            return -1;
+        }
+        ssize_t bytes = -1;
+        if (write_all(server_sock, request, request_length) >= 0 &&
+            (!has_body || forward_request_body(client_sock, body, server_sock) == 0)) {
+            bytes = read(server_sock, buffer, size);
+        }
+        request_timing_mark(timing, PHASE_TTFB);
+        if (bytes > 0) {
+            *length = bytes;
+            response_tracker_feed(tracker, buffer, bytes);
+            return server_sock;
+        }
+        close(server_sock);
+        if (!reused) {
+            log_message(LOG_LEVEL_ERROR, "No response from server %s:%d", req->host, req->port);
+            return -1;
+        }
+        log_message(LOG_LEVEL_DEBUG, "Pooled connection to %s:%d was closed, retrying", req->host, req->port);
+    }
+}
+
+/**
+ * Relays a response that another request is fetching, as its bytes arrive.
+ * Returns 1 once the response has been relayed (or the client went away), or
+ * 0 if the shared fetch failed before anything was sent, in which case the
+ * caller fetches on its own. 'reusable' is set if the complete, delimited
+ * response reached the client.
+ */
+static int follow_flight(int client_sock, FlightReader *reader, const char *url, int *reusable,
+                         RequestTiming *timing) {
+    char buffer[4096];
+    ssize_t bytes;
+    int client_gone = 0;
+    ResponseTracker tracker;
+    response_tracker_init(&tracker, 0);
+    while ((bytes = flight_read(reader, buffer, sizeof(buffer), 1)) > 0) {
+        if (tracker.total == 0) request_timing_mark(timing, PHASE_TTFB);
+        response_tracker_feed(&tracker, buffer, bytes);
+        if (write_all(client_sock, buffer, bytes) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to relay data to client");
+            client_gone = 1;
+            break;
+        }
+        metrics_add(METRIC_BYTES_SENT, bytes);
+        timing->bytes += bytes;
+    }
+    int relayed = client_gone || bytes == 0 || flight_reader_offset(reader) > 0;
+    *reusable = !client_gone && bytes == 0 && response_tracker_reusable(&tracker);
+    if (relayed) {
+        request_timing_mark(timing, PHASE_TRANSFER);
+        timing->status = tracker.head_done ? tracker.info.status : 0;
+        timing->complete = !client_gone && bytes == 0;
+    }
+    if (bytes < 0 && !client_gone) {
+        log_message(LOG_LEVEL_WARN, "Shared fetch of %s failed%s", url, relayed ? "" : ", fetching directly");
+    }
+    flight_leave(reader);
+    return relayed;
+}
+
+/**
+ * Serves one request on a client connection, forwarding its body from
+ * 'body' to the origin. Requests with a body are never served from or
+ * stored in the cache.
+ * Returns 1 if the response was delimited and fully sent, so the connection
+ * can carry another request, or 0 if it must be closed.
+ */
+static int serve_request(int client_sock, const HttpRequest *req, RequestBuffer *body, RequestTiming *timing) {
     // Check if the requested host is blocked.
-    if (is_url_blocked(req.host)) {
+    int blocked = is_url_blocked(req->host);
+    request_timing_mark(timing, PHASE_BLOCK);
+    if (blocked) {
         // Remove any cached entry for this host.
-        remove_cache_by_url(req.host);
+        remove_cache_by_url(req->host);
         const char *block_response = "HTTP/1.1 403 Forbidden\r\nContent-Length: 13\r\n\r\nAccess Denied";
+        log_message(LOG_LEVEL_INFO, "Blocked URL: %s", req->host);
+        metrics_add(METRIC_BLOCKED, 1);
+        timing->result = "blocked";
+        timing->status = 403;
         if (write_all(client_sock, block_response, strlen(block_response)) < 0) {
             log_message(LOG_LEVEL_ERROR, "Failed to send blocked response to client");
+            return 0;
         }
-        log_message(LOG_LEVEL_INFO, "Blocked URL: %s", req.host);
-        close(client_sock);
-        return;
+        request_timing_mark(timing, PHASE_TRANSFER);
+        timing->bytes = strlen(block_response);
+        timing->complete = 1;
+        return 1;
     }
 
-    // For GET requests (non-CONNECT), attempt to serve from cache.
-    if (strcmp(req.method, "CONNECT") != 0 && strcmp(req.method, "GET") == 0) {
-        CacheEntry cached;
-        if (lookup_cache(req.url, &cached)) {
-            log_message(LOG_LEVEL_INFO, "Serving cached content for %s", req.url);
-            if (write_all(client_sock, cached.response, cached.response_length) < 0) {
-                log_message(LOG_LEVEL_ERROR, "Failed to send cached response to client");
+    // For GET requests (non-CONNECT), attempt to serve from cache. A stale
+    // entry with a validator, in memory or on disk, is kept to revalidate
+    // with the origin.
+    CacheEntry *stale = NULL;
+    DiskCacheHit disk_hit;
+    int disk_stale = 0;
+    int cacheable = strcmp(req->method, "GET") == 0 && !request_has_body(req);
+    if (cacheable) {
+        CacheEntry *cached;
+        if (lookup_cache(req->url, &cached)) {
+            if (cache_entry_is_fresh(cached)) {
+                request_timing_mark(timing, PHASE_CACHE);
+                log_message(LOG_LEVEL_INFO, "Serving cached content for %s", req->url);
+                metrics_add(METRIC_CACHE_HITS_MEMORY, 1);
+                timing->result = "hit";
+                timing->status = cached->status;
+                int reusable = cached->keep_alive;
+                if (write_chunks(client_sock, &cached->response) < 0) {
+                    log_message(LOG_LEVEL_ERROR, "Failed to send cached response to client");
+                    reusable = 0;
+                } else {
+                    metrics_add(METRIC_BYTES_SENT, cached->response.length);
+                    metrics_record_request(REQUEST_HIT, timing->started_us);
+                    request_timing_mark(timing, PHASE_TRANSFER);
+                    timing->bytes = cached->response.length;
+                    timing->complete = 1;
+                }
+                release_cache_entry(cached);
+                return reusable;
+            }
+            if (cache_entry_can_revalidate(cached)) {
+                stale = cached;
+            } else {
+                release_cache_entry(cached);
             }
-            free(cached.url);
-            free(cached.response);
-            close(client_sock);
-            return;
+        }
+
+        // Fall back to the disk tier, sending straight from the file.
+        int disk_found = !stale && disk_cache_open(req->url, &disk_hit);
+        request_timing_mark(timing, PHASE_CACHE);
+        if (disk_found && disk_hit.stale) {
+            disk_stale = 1;
+        } else if (disk_found) {
+            log_message(LOG_LEVEL_INFO, "Serving cached content from disk for %s", req->url);
+            metrics_add(METRIC_CACHE_HITS_DISK, 1);
+            timing->result = "disk_hit";
+            return send_disk_hit(client_sock, &disk_hit, req->url, timing);
+        }
+    }
+
+    // Coalesce concurrent misses: the first request fetches, the rest share its response.
+    Flight *flight = NULL;
+    timing->result = cacheable ? "miss" : "pass";
+    if (!stale && !disk_stale && cacheable) {
+        metrics_add(METRIC_CACHE_MISSES, 1);
+        FlightReader *reader;
+        flight = flight_join(req->url, &reader);
+        if (reader) {
+            flight = NULL;
+            int reusable;
+            timing->result = "coalesced";
+            if (follow_flight(client_sock, reader, req->url, &reusable, timing)) {
+                metrics_add(METRIC_COALESCED, 1);
+                if (reusable) metrics_record_request(REQUEST_MISS, timing->started_us);
+                return reusable;
+            }
+            timing->result = "miss";
         }
     }
 
     // Dispatch based on the request method.
-    if (strcmp(req.method, "CONNECT") == 0) {
-        // HTTPS: establish a tunnel.
-        handle_https(client_sock, &req);
+    if (strcmp(req->method, "CONNECT") == 0) {
+        // HTTPS: establish a tunnel, which takes over the connection.
+        handle_https(client_sock, req, timing);
+        return 0;
+    }
+
+    // HTTP: forward the request as HTTP/1.1 over a pooled connection and capture
+    // the response, made conditional when revalidating a stale entry.
+    uint64_t fetch_started = metrics_now_us();
+
+    char forward_buffer[4096];
+    const char *etag = stale ? stale->etag : disk_stale && disk_hit.etag[0] ? disk_hit.etag : NULL;
+    const char *last_modified = stale ? stale->last_modified
+                                      : disk_stale && disk_hit.last_modified[0] ? disk_hit.last_modified : NULL;
+    int forward_length = format_origin_request(forward_buffer, sizeof(forward_buffer), req, etag, last_modified);
+    ResponseTracker tracker;
+    response_tracker_init(&tracker, strcmp(req->method, "HEAD") == 0);
+    char buffer[16384];
+    size_t pending = 0;  // Bytes read into buffer but not yet relayed.
+    int server_sock = -1;
+    if (forward_length < 0) {
+        log_message(LOG_LEVEL_ERROR, "Failed to send request to server");
     } else {
-        // HTTP: forward the request and capture the response.
-        struct timeval start, end;
-        gettimeofday(&start, NULL);
+        server_sock = open_origin(req, forward_buffer, forward_length, client_sock, body, &tracker,
+                                  buffer, sizeof(buffer), &pending, timing);
+    }
+    if (server_sock < 0) {
+        release_cache_entry(stale);
+        if (disk_stale) close(disk_hit.fd);
+        if (flight) flight_finish(flight, 0);
+        return 0;
+    }
 
-        int server_sock = connect_to_server(req.host, req.port);
-        if (server_sock < 0) {
-            log_message(LOG_LEVEL_ERROR, "Unable to connect to server %s:%d", req.host, req.port);
-            close(client_sock);
-            return;
-        }
-
-        // Forward the HTTP request to the destination server.
-        char forward_buffer[4096];
-        snprintf(forward_buffer, sizeof(forward_buffer),
-                 "%s %s HTTP/1.0\r\nHost: %s\r\n\r\n",
-                 req.method, req.url, req.host);
-        if (write_all(server_sock, forward_buffer, strlen(forward_buffer)) < 0) {
-            log_message(LOG_LEVEL_ERROR, "Failed to send request to server");
-            close(server_sock);
-            close(client_sock);
-            return;
-        }
-
-        // Relay the response from the server back to the client while accumulating for caching.
-        char buffer[4096];
-        int bytes;
-        int total_length = 0;
-        int capacity = 4096;
-        char *response_buffer = (char *)malloc(capacity);
-        if (!response_buffer) {
-            log_message(LOG_LEVEL_ERROR, "Memory allocation failed for response buffer");
-            close(server_sock);
-            close(client_sock);
-            return;
+    if (stale || disk_stale) {
+        // Hold the answer back until its header shows whether it is a 304.
+        while (!tracker.head_done && pending < sizeof(buffer)) {
+            ssize_t bytes = read(server_sock, buffer + pending, sizeof(buffer) - pending);
+            if (bytes <= 0) break;
+            response_tracker_feed(&tracker, buffer + pending, bytes);
+            pending += bytes;
         }
-
-        while ((bytes = read(server_sock, buffer, sizeof(buffer))) > 0) {
-            if (write_all(client_sock, buffer, bytes) < 0) {
-                log_message(LOG_LEVEL_ERROR, "Failed to relay data to client");
-                break;
+        if (tracker.head_done && tracker.info.status == 304) {
+            if (response_tracker_reusable(&tracker)) {
+                conn_pool_release(req->host, req->port, server_sock);
+            } else {
+                close(server_sock);
             }
-            if (total_length + bytes > capacity) {
-                capacity = (total_length + bytes) * 2;
-                char *new_buffer = realloc(response_buffer, capacity);
-                if (!new_buffer) {
-                    log_message(LOG_LEVEL_ERROR, "Memory allocation failed during response accumulation");
-                    free(response_buffer);
-                    close(server_sock);
-                    close(client_sock);
-                    return;
-                }
-                response_buffer = new_buffer;
+            log_message(LOG_LEVEL_INFO, "Serving revalidated cached content for %s", req->url);
+            metrics_add(METRIC_CACHE_REVALIDATED, 1);
+            timing->result = "revalidated";
+            if (disk_stale) {
+                disk_cache_refresh(req->url, &disk_hit, &tracker.info);
+                return send_disk_hit(client_sock, &disk_hit, req->url, timing);
             }
-            memcpy(response_buffer + total_length, buffer, bytes);
-            total_length += bytes;
+            refresh_cache_entry(stale, &tracker.info);
+            timing->status = stale->status;
+            int reusable = stale->keep_alive;
+            if (write_chunks(client_sock, &stale->response) < 0) {
+                log_message(LOG_LEVEL_ERROR, "Failed to send cached response to client");
+                reusable = 0;
+            } else {
+                metrics_add(METRIC_BYTES_SENT, stale->response.length);
+                metrics_record_request(REQUEST_HIT, timing->started_us);
+                request_timing_mark(timing, PHASE_TRANSFER);
+                timing->bytes = stale->response.length;
+                timing->complete = 1;
+            }
+            release_cache_entry(stale);
+            return reusable;
+        }
+        release_cache_entry(stale);
+        if (disk_stale) {
+            // The new response replaces the stale copy.
+            close(disk_hit.fd);
+            disk_cache_remove(req->url);
         }
+        metrics_add(METRIC_CACHE_MISSES, 1);
+    }
+
+    // Relay the response from the server back to the client while accumulating for caching.
+    // Relaying to the client carries on even once the response stops being accumulated.
+    ResponseFill fill;
+    memset(&fill, 0, sizeof(fill));
+    fill.url = req->url;
+    fill.cacheable = cacheable && !req->no_store;
+    fill.filling = fill.cacheable;
+    fill.flight = flight;
+
+    // The response ends at its framed length, or when the origin closes if it
+    // has none. When leading a flight the fetch carries on for the other
+    // readers even if this client goes away.
+    ssize_t bytes = (ssize_t)pending;
+    int client_gone = 0;
+    for (;;) {
+        if (bytes == 0) {
+            if (tracker.done) break;
+            bytes = read(server_sock, buffer, sizeof(buffer));
+            if (bytes <= 0) break;
+            response_tracker_feed(&tracker, buffer, bytes);
+        }
+        metrics_add(METRIC_BYTES_RECEIVED, bytes);
+        if (!client_gone && write_all(client_sock, buffer, bytes) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to relay data to client");
+            client_gone = 1;
+            if (!fill.flight) break;
+        }
+        if (!client_gone) {
+            metrics_add(METRIC_BYTES_SENT, bytes);
+            timing->bytes += bytes;
+        }
+        fill_append(&fill, buffer, bytes);
+        bytes = 0;
+    }
+    int complete = tracker.done || (bytes == 0 && tracker.framing == FRAMING_CLOSE);
+    int reusable = tracker.done && bytes == 0 && response_tracker_reusable(&tracker);
+    // An origin that ignored the body would read it as the next request, so
+    // a connection that carried one is not pooled.
+    if (reusable && !request_has_body(req)) {
+        conn_pool_release(req->host, req->port, server_sock);
+    } else {
         close(server_sock);
+    }
 
-        gettimeofday(&end, NULL);
-        double time_taken = (end.tv_sec - start.tv_sec) + ((end.tv_usec - start.tv_usec) / 1000000.0);
-        log_message(LOG_LEVEL_INFO, "HTTP request to %s completed in %.3f seconds", req.url, time_taken);
+    request_timing_mark(timing, PHASE_TRANSFER);
+    timing->status = tracker.head_done ? tracker.info.status : 0;
+    timing->complete = complete && !client_gone;
+    double time_taken = (metrics_now_us() - fetch_started) / 1e6;
+    log_message(LOG_LEVEL_INFO, "HTTP request to %s completed in %.3f seconds", req->url, time_taken);
+
+    // Cache the response if this is a complete GET response the cache can hold.
+    if (!complete) fill.cacheable = 0;
+    if (req->authorization && !response_allows_authorized_storing(&tracker.info)) fill.cacheable = 0;
+    fill_finish(&fill, time_taken, complete);
+    if (complete && !client_gone) metrics_record_request(REQUEST_MISS, timing->started_us);
+    return reusable && !client_gone;
+}
+
+void handle_client_connection(int client_sock, uint64_t enqueued_us) {
+    log_message(LOG_LEVEL_INFO, "Handling client on socket %d", client_sock);
+    if (queue_wait_exceeded(enqueued_us)) {
+        // The client has likely given up already; refuse it cheaply rather
+        // than spend a worker on it while newer connections wait.
+        log_message(LOG_LEVEL_WARN, "Socket %d waited %llu ms in the queue, refusing it", client_sock,
+                    (unsigned long long)((metrics_now_us() - enqueued_us) / 1000));
+        metrics_add(METRIC_SHED_QUEUE_WAIT, 1);
+        shed_connection(client_sock, DEFAULT_RETRY_AFTER);
+        return;
+    }
+    char client[INET_ADDRSTRLEN + 8] = "-";
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    if (getpeername(client_sock, (struct sockaddr *)&client_addr, &addr_len) == 0) {
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        snprintf(client, sizeof(client), "%s:%d", client_ip, ntohs(client_addr.sin_port));
+    }
 
-        // Cache the response if this is a GET request.
-        if (strcmp(req.method, "GET") == 0) {
-            insert_cache(req.url, response_buffer, total_length, time_taken);
+    // Serve requests until the client closes the connection, stays idle past
+    // the keep-alive timeout, or a response cannot be delimited. Pipelined
+    // requests already buffered are served in order; waiting for one that
+    // has not arrived takes an idle slot, and the connection is closed if
+    // none is free.
+    RequestBuffer buffer;
+    request_buffer_init(&buffer);
+    int served = 0;
+    for (;;) {
+        HttpRequest req;
+        RequestTiming timing;
+        uint64_t first_byte_us = 0;
+        if (served == 0) {
+            // The first request's clock starts when the connection was queued;
+            // later ones start at their first byte.
+            request_timing_start(&timing, enqueued_us);
+            request_timing_mark(&timing, PHASE_QUEUE);
         }
-        free(response_buffer);
+        int idle = served > 0 && buffer.length == 0;
+        if (idle && !claim_idle_worker()) {
+            log_message(LOG_LEVEL_DEBUG, "No idle slot for socket %d, closing it", client_sock);
+            break;
+        }
+        int rc = read_http_request(client_sock, &buffer, &req, served > 0 ? client_idle_timeout() : -1,
+                                   &first_byte_us);
+        if (idle) atomic_fetch_sub(&idle_workers, 1);
+        if (rc < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to parse HTTP request on socket %d", client_sock);
+        }
+        if (rc < 0 && buffer.error_status) {
+            size_t length;
+            const char *response = request_error_response(buffer.error_status, &length);
+            if (write_all(client_sock, response, length) < 0) {
+                log_message(LOG_LEVEL_ERROR, "Failed to send error response to client");
+            }
+            if (served > 0) request_timing_start(&timing, first_byte_us);
+            timing.status = buffer.error_status;
+            timing.result = "rejected";
+            timing.bytes = length;
+            timing.complete = 1;
+            request_timing_mark(&timing, PHASE_TRANSFER);
+            request_timing_finish(&timing, client, req.method, req.url);
+        }
+        if (rc <= 0) break;
+        if (served > 0) request_timing_start(&timing, first_byte_us);
+        request_timing_mark(&timing, PHASE_PARSE);
+        metrics_add(METRIC_REQUESTS, 1);
+        served++;
+        // The connection closes if the request was answered without forwarding its body.
+        int reusable = serve_request(client_sock, &req, &buffer, &timing) && !buffer.body.active;
+        request_timing_finish(&timing, client, req.method, req.url);
+        if (!client_keep_alive(&req, reusable, served)) break;
     }
     close(client_sock);
     log_message(LOG_LEVEL_INFO, "Closed connection on socket %d", client_sock);
 }
 
-int create_server_socket(int port) {
+int create_server_socket(int port, int backlog, int reuse_port) {
     int server_sock;
     struct sockaddr_in server_addr;
 
@@ -157,6 +577,19 @@ int create_server_socket(int port) {
     if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
         log_message(LOG_LEVEL_WARN, "Failed to set socket options");
     }
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            log_message(LOG_LEVEL_ERROR, "Failed to set SO_REUSEPORT");
+            close(server_sock);
+            return -1;
+        }
+#else
+        log_message(LOG_LEVEL_ERROR, "SO_REUSEPORT is not supported on this platform");
+        close(server_sock);
+        return -1;
+#endif
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -169,26 +602,12 @@ int create_server_socket(int port) {
         return -1;
     }
 
-    if (listen(server_sock, 10) < 0) {
+    if (listen(server_sock, backlog) < 0) {
         log_message(LOG_LEVEL_ERROR, "Failed to listen on socket");
         close(server_sock);
         return -1;
     }
 
-    log_message(LOG_LEVEL_INFO, "Server socket created, listening on port %d", port);
+    log_message(LOG_LEVEL_INFO, "Server socket created, listening on port %d (backlog %d)", port, backlog);
     return server_sock;
 }
-
-int accept_client(int server_sock) {
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_len);
-    if (client_sock < 0) {
-        log_message(LOG_LEVEL_ERROR, "Failed to accept client connection");
-        return -1;
-    }
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    log_message(LOG_LEVEL_INFO, "Accepted connection from %s:%d", client_ip, ntohs(client_addr.sin_port));
-    return client_sock;
-}
@@ -0,0 +1,331 @@
+#include "singleflight.h"
+#include "cache.h"  // For hash_url()
+#include "chunk_list.h"
+#include "logging.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_TRIM_THRESHOLD (256UL * 1024)   // Buffered bytes before consumed data is discarded.
+#define FLIGHT_MAX_LAG (16UL * 1024 * 1024)    // Readers further behind than this are cut off.
+#define FLIGHT_NOTIFY_BATCH 16                  // Distinct notify targets called after unlocking.
+#define FLIGHT_INITIAL_CHUNKS 16
+
+typedef enum {
+    FLIGHT_RUNNING,
+    FLIGHT_DONE,
+    FLIGHT_FAILED
+} FlightState;
+
+// A chunk of the leader's response, as far as it has been published.
+typedef struct {
+    Chunk *chunk;         // Referenced; the leader keeps appending to the last one.
+    size_t length;        // Bytes of the chunk readers may see.
+} FlightChunk;
+
+struct FlightReader {
+    Flight *flight;
+    size_t offset;        // Absolute response offset of the next byte to read.
+    size_t index;         // Chunk holding that byte, counted from the start of the response.
+    size_t chunk_offset;  // Offset of that byte within the chunk.
+    int cut_off;          // Fell more than FLIGHT_MAX_LAG behind the leader.
+    void (*notify)(void *arg);
+    void *notify_arg;
+    FlightReader *next;
+};
+
+// Each flight has its own lock, so fetches of different URLs never contend;
+// table_mutex only guards the table and is taken before a flight's lock.
+struct Flight {
+    char *url;
+    uint64_t hash;
+    int refs;             // Leader, readers and the table entry.
+    int in_table;         // Guarded by table_mutex.
+    FlightState state;
+    FlightChunk *chunks;  // Buffered chunks, holding bytes [base, length).
+    size_t count;
+    size_t capacity;
+    size_t dropped;       // Chunks released from in front of chunks[0].
+    size_t base;
+    size_t length;        // Bytes published so far.
+    FlightReader *readers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Flight *hash_next;
+};
+
+typedef struct {
+    void (*notify)(void *arg);
+    void *arg;
+} NotifyTarget;
+
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+static Flight *flight_table[FLIGHT_BUCKETS];
+
+// Takes a flight out of the table. Returns 1 if this call removed it, in
+// which case the caller owns the table's reference.
+static int table_remove(Flight *flight) {
+    pthread_mutex_lock(&table_mutex);
+    int removed = flight->in_table;
+    if (removed) {
+        Flight **link = &flight_table[flight->hash % FLIGHT_BUCKETS];
+        while (*link && *link != flight) link = &(*link)->hash_next;
+        if (*link) *link = flight->hash_next;
+        flight->in_table = 0;
+    }
+    pthread_mutex_unlock(&table_mutex);
+    return removed;
+}
+
+// Drops 'count' references and unlocks the flight, freeing it with the last one.
+static void flight_unref_unlock(Flight *flight, int count) {
+    flight->refs -= count;
+    int last = flight->refs == 0;
+    pthread_mutex_unlock(&flight->lock);
+    if (!last) return;
+    pthread_cond_destroy(&flight->cond);
+    pthread_mutex_destroy(&flight->lock);
+    for (size_t i = 0; i < flight->count; i++) {
+        chunk_unref(flight->chunks[i].chunk);
+    }
+    free(flight->chunks);
+    free(flight->url);
+    free(flight);
+}
+
+// Wakes blocked readers and collects the notify callbacks of polling ones,
+// once per distinct target, to be run by notify_all() after unlocking: a
+// callback (an eventfd write) should not stretch the critical section. If
+// there are more targets than fit, the rest are called here under the lock.
+static int wake_readers(Flight *flight, NotifyTarget *targets) {
+    pthread_cond_broadcast(&flight->cond);
+    int count = 0;
+    for (FlightReader *reader = flight->readers; reader; reader = reader->next) {
+        if (!reader->notify) continue;
+        int seen = 0;
+        for (int i = 0; i < count && !seen; i++) {
+            seen = targets[i].notify == reader->notify && targets[i].arg == reader->notify_arg;
+        }
+        if (seen) continue;
+        if (count < FLIGHT_NOTIFY_BATCH) {
+            targets[count].notify = reader->notify;
+            targets[count].arg = reader->notify_arg;
+            count++;
+        } else {
+            reader->notify(reader->notify_arg);
+        }
+    }
+    return count;
+}
+
+static void notify_all(const NotifyTarget *targets, int count) {
+    for (int i = 0; i < count; i++) {
+        targets[i].notify(targets[i].arg);
+    }
+}
+
+// Frees chunks every reader has consumed, cutting off readers that lag too far behind.
+static void trim_buffer(Flight *flight) {
+    size_t end = flight->length;
+    size_t min_offset = end;
+    for (FlightReader *reader = flight->readers; reader; reader = reader->next) {
+        if (!reader->cut_off && end - reader->offset > FLIGHT_MAX_LAG) {
+            log_message(LOG_LEVEL_WARN, "Reader of %s fell too far behind the shared fetch", flight->url);
+            reader->cut_off = 1;
+        }
+        if (!reader->cut_off && reader->offset < min_offset) min_offset = reader->offset;
+    }
+    // The last chunk is kept: the next publish carries on from it.
+    size_t drop = 0;
+    while (drop + 1 < flight->count && flight->base + flight->chunks[drop].length <= min_offset) {
+        flight->base += flight->chunks[drop].length;
+        chunk_unref(flight->chunks[drop].chunk);
+        drop++;
+    }
+    if (drop == 0) return;
+    memmove(flight->chunks, flight->chunks + drop, (flight->count - drop) * sizeof(FlightChunk));
+    flight->count -= drop;
+    flight->dropped += drop;
+    // A reader at the end of a released chunk moves to the new first one.
+    for (FlightReader *reader = flight->readers; reader; reader = reader->next) {
+        if (!reader->cut_off && reader->index < flight->dropped) {
+            reader->index = flight->dropped;
+            reader->chunk_offset = 0;
+        }
+    }
+}
+
+// Adds the chunks appended to the leader's list since the last publish,
+// taking a reference to each. Returns -1 if the table could not grow.
+static int add_new_chunks(Flight *flight, const ChunkList *list) {
+    Chunk *chunk = list->head;
+    if (flight->count > 0) {
+        // The last chunk may have grown, and any new ones follow it.
+        FlightChunk *last = &flight->chunks[flight->count - 1];
+        flight->length += last->chunk->length - last->length;
+        last->length = last->chunk->length;
+        chunk = last->chunk->next;
+    }
+    for (; chunk; chunk = chunk->next) {
+        if (flight->count == flight->capacity) {
+            size_t capacity = flight->capacity ? flight->capacity * 2 : FLIGHT_INITIAL_CHUNKS;
+            FlightChunk *chunks = (FlightChunk *)realloc(flight->chunks, capacity * sizeof(FlightChunk));
+            if (!chunks) return -1;
+            flight->chunks = chunks;
+            flight->capacity = capacity;
+        }
+        chunk_ref(chunk);
+        flight->chunks[flight->count].chunk = chunk;
+        flight->chunks[flight->count].length = chunk->length;
+        flight->count++;
+        flight->length += chunk->length;
+    }
+    return 0;
+}
+
+Flight *flight_join(const char *url, FlightReader **reader) {
+    uint64_t hash = hash_url(url);
+    *reader = NULL;
+    pthread_mutex_lock(&table_mutex);
+    Flight *flight = flight_table[hash % FLIGHT_BUCKETS];
+    while (flight && !(flight->hash == hash && strcmp(flight->url, url) == 0)) {
+        flight = flight->hash_next;
+    }
+    if (flight) {
+        // The table's reference keeps the flight alive while table_mutex is held.
+        pthread_mutex_lock(&flight->lock);
+        pthread_mutex_unlock(&table_mutex);
+        // Late readers can only attach while the start of the response is still buffered.
+        FlightReader *r = flight->base > 0 ? NULL : (FlightReader *)calloc(1, sizeof(FlightReader));
+        if (!r) {
+            pthread_mutex_unlock(&flight->lock);
+            return NULL;
+        }
+        r->flight = flight;
+        r->next = flight->readers;
+        flight->readers = r;
+        flight->refs++;
+        pthread_mutex_unlock(&flight->lock);
+        log_message(LOG_LEVEL_INFO, "Joined in-progress fetch for URL: %s", url);
+        *reader = r;
+        return flight;
+    }
+
+    flight = (Flight *)calloc(1, sizeof(Flight));
+    if (flight) flight->url = strdup(url);
+    if (!flight || !flight->url) {
+        pthread_mutex_unlock(&table_mutex);
+        free(flight);
+        return NULL;
+    }
+    flight->hash = hash;
+    flight->refs = 2;  // The leader and the table entry.
+    flight->in_table = 1;
+    flight->state = FLIGHT_RUNNING;
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->cond, NULL);
+    flight->hash_next = flight_table[hash % FLIGHT_BUCKETS];
+    flight_table[hash % FLIGHT_BUCKETS] = flight;
+    pthread_mutex_unlock(&table_mutex);
+    return flight;
+}
+
+void flight_publish(Flight *flight, const ChunkList *list) {
+    NotifyTarget targets[FLIGHT_NOTIFY_BATCH];
+    pthread_mutex_lock(&flight->lock);
+    // Bytes already published never move, so readers copy straight out of the
+    // leader's chunks.
+    int failed = add_new_chunks(flight, list) < 0;
+    // The start of the response is kept (up to the cache object limit) so that
+    // late readers can replay it; past that, consumed chunks are released.
+    if (flight->length > cache_max_object_size() &&
+        (!flight->readers || flight->length - flight->base >= FLIGHT_TRIM_THRESHOLD)) {
+        trim_buffer(flight);
+    }
+    if (failed) {
+        log_message(LOG_LEVEL_ERROR, "Memory allocation failed for shared fetch of %s", flight->url);
+        flight->state = FLIGHT_FAILED;
+    }
+    int count = wake_readers(flight, targets);
+    pthread_mutex_unlock(&flight->lock);
+    notify_all(targets, count);
+    // The leader still holds a reference, so this never frees the flight.
+    if (failed && table_remove(flight)) {
+        pthread_mutex_lock(&flight->lock);
+        flight_unref_unlock(flight, 1);
+    }
+}
+
+void flight_finish(Flight *flight, int success) {
+    NotifyTarget targets[FLIGHT_NOTIFY_BATCH];
+    int table_ref = table_remove(flight);
+    pthread_mutex_lock(&flight->lock);
+    if (flight->state == FLIGHT_RUNNING) {
+        flight->state = success ? FLIGHT_DONE : FLIGHT_FAILED;
+    }
+    int count = wake_readers(flight, targets);
+    flight_unref_unlock(flight, 1 + table_ref);
+    notify_all(targets, count);
+}
+
+void flight_set_notify(FlightReader *reader, void (*notify)(void *arg), void *arg) {
+    pthread_mutex_lock(&reader->flight->lock);
+    reader->notify = notify;
+    reader->notify_arg = arg;
+    pthread_mutex_unlock(&reader->flight->lock);
+}
+
+ssize_t flight_read(FlightReader *reader, char *buffer, size_t size, int wait) {
+    Flight *flight = reader->flight;
+    pthread_mutex_lock(&flight->lock);
+    for (;;) {
+        if (reader->cut_off || flight->state == FLIGHT_FAILED) {
+            pthread_mutex_unlock(&flight->lock);
+            return -1;
+        }
+        if (reader->offset < flight->length) {
+            size_t copied = 0;
+            while (copied < size && reader->offset < flight->length) {
+                const FlightChunk *entry = &flight->chunks[reader->index - flight->dropped];
+                if (reader->chunk_offset == entry->length) {
+                    reader->index++;
+                    reader->chunk_offset = 0;
+                    continue;
+                }
+                size_t n = entry->length - reader->chunk_offset;
+                if (n > size - copied) n = size - copied;
+                memcpy(buffer + copied, entry->chunk->data + reader->chunk_offset, n);
+                reader->chunk_offset += n;
+                reader->offset += n;
+                copied += n;
+            }
+            pthread_mutex_unlock(&flight->lock);
+            return (ssize_t)copied;
+        }
+        if (flight->state == FLIGHT_DONE) {
+            pthread_mutex_unlock(&flight->lock);
+            return 0;
+        }
+        if (!wait) {
+            pthread_mutex_unlock(&flight->lock);
+            return FLIGHT_AGAIN;
+        }
+        pthread_cond_wait(&flight->cond, &flight->lock);
+    }
+}
+
+size_t flight_reader_offset(const FlightReader *reader) {
+    return reader->offset;
+}
+
+void flight_leave(FlightReader *reader) {
+    Flight *flight = reader->flight;
+    pthread_mutex_lock(&flight->lock);
+    FlightReader **link = &flight->readers;
+    while (*link && *link != reader) link = &(*link)->next;
+    if (*link) *link = reader->next;
+    flight_unref_unlock(flight, 1);
+    free(reader);
+}
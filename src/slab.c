@@ -0,0 +1,165 @@
+#include "slab.h"
+#include "logging.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define SLAB_HEADER 64   // Bytes reserved for the Slab header; objects follow.
+
+// Each class is at most half again as large as the one below, so rounding a
+// request up wastes no more than a third of the object.
+static const size_t class_sizes[] = {
+    64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, SLAB_MAX_OBJECT
+};
+#define SLAB_CLASSES (int)(sizeof(class_sizes) / sizeof(class_sizes[0]))
+_Static_assert(SLAB_CLASSES == SLAB_CLASS_COUNT, "SLAB_CLASS_COUNT does not match the size class table");
+
+typedef struct SlabClass SlabClass;
+
+// Header at the start of every slab. Objects are found by masking their
+// address down to the slab alignment.
+typedef struct Slab {
+    SlabClass *owner;
+    struct Slab *prev;        // In the owner's list of slabs with free objects.
+    struct Slab *next;
+    void *free_list;          // Freed objects, linked through their first word.
+    size_t carved;            // Objects handed out from the untouched end so far.
+    size_t in_use;
+} Slab;
+
+_Static_assert(sizeof(Slab) <= SLAB_HEADER, "the slab header must fit in SLAB_HEADER");
+
+struct SlabClass {
+    pthread_mutex_t lock;
+    size_t object_size;
+    size_t per_slab;          // Objects that fit in a slab after its header.
+    Slab *partial;            // Slabs with at least one free object.
+    Slab *spare;              // An empty slab kept for reuse.
+    size_t slabs;
+    size_t in_use;
+};
+
+static SlabClass classes[SLAB_CLASSES];
+static pthread_once_t classes_once = PTHREAD_ONCE_INIT;
+
+static void init_classes(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_init(&classes[i].lock, NULL);
+        classes[i].object_size = class_sizes[i];
+        classes[i].per_slab = (SLAB_SIZE - SLAB_HEADER) / class_sizes[i];
+    }
+}
+
+static SlabClass *class_for(size_t size) {
+    pthread_once(&classes_once, init_classes);
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        if (size <= class_sizes[i]) return &classes[i];
+    }
+    return NULL;
+}
+
+static void partial_push(SlabClass *cls, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = cls->partial;
+    if (cls->partial) cls->partial->prev = slab;
+    cls->partial = slab;
+}
+
+static void partial_remove(SlabClass *cls, Slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else cls->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+// Takes the spare slab or allocates a new one. Must hold the class lock.
+static Slab *take_slab(SlabClass *cls) {
+    Slab *slab = cls->spare;
+    if (slab) {
+        cls->spare = NULL;
+        return slab;
+    }
+    void *memory;
+    if (posix_memalign(&memory, SLAB_SIZE, SLAB_SIZE) != 0) return NULL;
+    slab = (Slab *)memory;
+    slab->owner = cls;
+    slab->free_list = NULL;
+    slab->carved = 0;
+    slab->in_use = 0;
+    cls->slabs++;
+    return slab;
+}
+
+void *slab_alloc(size_t size) {
+    SlabClass *cls = class_for(size);
+    if (!cls) return NULL;
+    pthread_mutex_lock(&cls->lock);
+    Slab *slab = cls->partial;
+    if (!slab) {
+        slab = take_slab(cls);
+        if (!slab) {
+            pthread_mutex_unlock(&cls->lock);
+            log_message(LOG_LEVEL_ERROR, "Failed to allocate a slab for %zu byte objects", cls->object_size);
+            return NULL;
+        }
+        partial_push(cls, slab);
+    }
+    void *object = slab->free_list;
+    if (object) {
+        slab->free_list = *(void **)object;
+    } else {
+        object = (char *)slab + SLAB_HEADER + slab->carved++ * cls->object_size;
+    }
+    slab->in_use++;
+    cls->in_use++;
+    if (slab->in_use == cls->per_slab) partial_remove(cls, slab);
+    pthread_mutex_unlock(&cls->lock);
+    return object;
+}
+
+void slab_free(void *object) {
+    if (!object) return;
+    Slab *slab = (Slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+    SlabClass *cls = slab->owner;
+    pthread_mutex_lock(&cls->lock);
+    int was_full = slab->in_use == cls->per_slab;
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+    cls->in_use--;
+    if (slab->in_use == 0) {
+        // Keep one empty slab to absorb churn; give the rest back.
+        if (!was_full) partial_remove(cls, slab);
+        if (!cls->spare) {
+            slab->free_list = NULL;
+            slab->carved = 0;
+            cls->spare = slab;
+        } else {
+            cls->slabs--;
+            free(slab);
+        }
+    } else if (was_full) {
+        partial_push(cls, slab);
+    }
+    pthread_mutex_unlock(&cls->lock);
+}
+
+size_t slab_object_size(size_t size) {
+    SlabClass *cls = class_for(size);
+    return cls ? cls->object_size : size;
+}
+
+int get_slab_stats(SlabStats *stats, int max) {
+    pthread_once(&classes_once, init_classes);
+    int count = 0;
+    for (int i = 0; i < SLAB_CLASSES && count < max; i++) {
+        SlabClass *cls = &classes[i];
+        pthread_mutex_lock(&cls->lock);
+        stats[count].object_size = cls->object_size;
+        stats[count].slabs = cls->slabs;
+        stats[count].objects = cls->slabs * cls->per_slab;
+        stats[count].in_use = cls->in_use;
+        pthread_mutex_unlock(&cls->lock);
+        count++;
+    }
+    return count;
+}
@@ -1,147 +1,305 @@
+#define _GNU_SOURCE  // For pthread_setaffinity_np()
 #include "thread_pool.h"
 #include "logging.h"
+#include "metrics.h"  // For metrics_now_us()
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
 
-// Structure for a task in the work queue.
-typedef struct task_t {
+#ifdef __linux__
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define IDLE_SPINS 64          // Empty polls before a worker parks.
+#define CACHE_LINE 64
+
+// A slot in the task queue. Slots either carry a client socket (fn == NULL)
+// or a generic job to run.
+typedef struct {
+    atomic_size_t sequence;   // Which lap of the ring the slot is ready for.
     int client_sock;
-    struct task_t *next;
+    uint64_t enqueued_us;     // When a client socket was queued, for its queue wait.
+    void (*fn)(void *arg);
+    void *arg;
 } task_t;
 
 // Definition of the thread pool structure.
 struct thread_pool {
     pthread_t *threads;       // Array of worker threads.
     int num_threads;          // Number of worker threads.
-    task_t *task_queue_head;  // Head of the task queue.
-    task_t *task_queue_tail;  // Tail of the task queue.
-    pthread_mutex_t queue_mutex;  // Mutex to protect access to the queue.
-    pthread_cond_t queue_cond;      // Condition variable for task availability.
-    int shutdown;             // Flag indicating whether the pool is shutting down.
+    // Bounded MPMC ring (Vyukov): producers claim slots at the tail and
+    // consumers at the head with a CAS; each slot's sequence number tells
+    // whether it is free or filled for the current lap, so neither side
+    // takes a lock. The positions are padded onto their own cache lines.
+    task_t *tasks;
+    size_t capacity;          // Slots in the ring; a power of two.
+    size_t max_clients;       // Client sockets that may wait at once.
+    char pad0[CACHE_LINE];
+    atomic_size_t enqueue_pos;
+    char pad1[CACHE_LINE];
+    atomic_size_t dequeue_pos;
+    char pad2[CACHE_LINE];
+    // Idle workers sleep on a futex word that is bumped on every wakeup.
+    atomic_uint wake_seq;
+    atomic_int sleepers;      // Workers parked (or about to park).
+    atomic_int shutdown;      // Flag indicating whether the pool is shutting down.
+#ifndef __linux__
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+#endif
 };
 
 // Forward declaration of the worker thread function.
 static void *thread_worker(void *arg);
 
 // External function that handles a client connection. You must implement this function in your proxy module.
-extern void handle_client_connection(int client_sock);
+extern void handle_client_connection(int client_sock, uint64_t enqueued_us);
+
+// Sleeps until wake_seq moves on from 'seen'.
+static void park(ThreadPool *pool, unsigned int seen) {
+#ifdef __linux__
+    syscall(SYS_futex, &pool->wake_seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&pool->park_mutex);
+    while (atomic_load(&pool->wake_seq) == seen) {
+        pthread_cond_wait(&pool->park_cond, &pool->park_mutex);
+    }
+    pthread_mutex_unlock(&pool->park_mutex);
+#endif
+}
 
-ThreadPool *thread_pool_init(int num_threads) {
-    ThreadPool *pool = (ThreadPool *)malloc(sizeof(ThreadPool));
+// Wakes up to 'count' parked workers.
+static void unpark(ThreadPool *pool, int count) {
+    atomic_fetch_add(&pool->wake_seq, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &pool->wake_seq, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&pool->park_mutex);
+    if (count == 1) pthread_cond_signal(&pool->park_cond);
+    else pthread_cond_broadcast(&pool->park_cond);
+    pthread_mutex_unlock(&pool->park_mutex);
+#endif
+}
+
+ThreadPool *thread_pool_init(int num_threads, int queue_size) {
+    ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
     if (!pool) {
         log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for thread pool");
         return NULL;
     }
     pool->num_threads = num_threads;
-    pool->shutdown = 0;
-    pool->task_queue_head = NULL;
-    pool->task_queue_tail = NULL;
-    pthread_mutex_init(&pool->queue_mutex, NULL);
-    pthread_cond_init(&pool->queue_cond, NULL);
-    
+    pool->max_clients = queue_size > 0 ? (size_t)queue_size : DEFAULT_TASK_QUEUE_SIZE;
+    // The ring is rounded up to a power of two so positions can be masked.
+    pool->capacity = 1;
+    while (pool->capacity < pool->max_clients) pool->capacity <<= 1;
+    pool->tasks = (task_t *)calloc(pool->capacity, sizeof(task_t));
+    if (!pool->tasks) {
+        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for thread pool queue");
+        free(pool);
+        return NULL;
+    }
+    for (size_t i = 0; i < pool->capacity; i++) {
+        atomic_init(&pool->tasks[i].sequence, i);
+    }
+    atomic_init(&pool->enqueue_pos, 0);
+    atomic_init(&pool->dequeue_pos, 0);
+    atomic_init(&pool->wake_seq, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->shutdown, 0);
+#ifndef __linux__
+    pthread_mutex_init(&pool->park_mutex, NULL);
+    pthread_cond_init(&pool->park_cond, NULL);
+#endif
+
     pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
     if (!pool->threads) {
         log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for thread pool threads");
+        free(pool->tasks);
         free(pool);
         return NULL;
     }
-    
+
     for (int i = 0; i < num_threads; i++) {
         if (pthread_create(&pool->threads[i], NULL, thread_worker, pool) != 0) {
             log_message(LOG_LEVEL_ERROR, "Failed to create worker thread %d", i);
-            pool->shutdown = 1;
-            pthread_cond_broadcast(&pool->queue_cond);
+            atomic_store(&pool->shutdown, 1);
+            unpark(pool, INT_MAX);
             for (int j = 0; j < i; j++) {
                 pthread_join(pool->threads[j], NULL);
             }
             free(pool->threads);
+            free(pool->tasks);
             free(pool);
             return NULL;
         }
     }
-    log_message(LOG_LEVEL_INFO, "Thread pool initialized with %d threads", num_threads);
+    log_message(LOG_LEVEL_INFO, "Thread pool initialized with %d threads (queue of %zu tasks)",
+                num_threads, pool->max_clients);
     return pool;
 }
 
-int thread_pool_enqueue(ThreadPool *pool, int client_sock) {
+// Claims the next free slot, fills it and wakes a worker if any is parked.
+// Fails without blocking when the queue is full. Client sockets are also
+// refused once max_clients tasks are waiting; jobs may use the whole ring.
+static int enqueue_task(ThreadPool *pool, int client_sock, void (*fn)(void *), void *arg) {
     if (pool == NULL) return -1;
-    
-    task_t *new_task = (task_t *)malloc(sizeof(task_t));
-    if (!new_task) {
-        log_message(LOG_LEVEL_ERROR, "Failed to allocate memory for new task");
-        return -1;
+    if (!fn && thread_pool_queue_depth(pool) >= pool->max_clients) return -1;
+
+    task_t *task;
+    size_t pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        task = &pool->tasks[pos & (pool->capacity - 1)];
+        size_t sequence = atomic_load_explicit(&task->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            if (fn) log_message(LOG_LEVEL_WARN, "Thread pool queue is full (%zu tasks)", pool->capacity);
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+        }
     }
-    new_task->client_sock = client_sock;
-    new_task->next = NULL;
-    
-    pthread_mutex_lock(&pool->queue_mutex);
-    if (pool->task_queue_tail == NULL) {
-        pool->task_queue_head = new_task;
-        pool->task_queue_tail = new_task;
-    } else {
-        pool->task_queue_tail->next = new_task;
-        pool->task_queue_tail = new_task;
+    task->client_sock = client_sock;
+    task->enqueued_us = fn ? 0 : metrics_now_us();
+    task->fn = fn;
+    task->arg = arg;
+    atomic_store_explicit(&task->sequence, pos + 1, memory_order_release);
+
+    // Pairs with the fence in thread_worker: either the worker sees this task
+    // when it re-checks the queue, or this sees the worker as a sleeper.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) > 0) {
+        unpark(pool, 1);
     }
-    pthread_cond_signal(&pool->queue_cond);
-    pthread_mutex_unlock(&pool->queue_mutex);
-    
     return 0;
 }
 
+// Takes the oldest task off the queue. Returns 0 if it is empty.
+static int dequeue_task(ThreadPool *pool, task_t *out) {
+    size_t pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        task_t *task = &pool->tasks[pos & (pool->capacity - 1)];
+        size_t sequence = atomic_load_explicit(&task->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                out->client_sock = task->client_sock;
+                out->enqueued_us = task->enqueued_us;
+                out->fn = task->fn;
+                out->arg = task->arg;
+                // Hand the slot back to producers for the next lap.
+                atomic_store_explicit(&task->sequence, pos + pool->capacity, memory_order_release);
+                return 1;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+int thread_pool_enqueue(ThreadPool *pool, int client_sock) {
+    return enqueue_task(pool, client_sock, NULL, NULL);
+}
+
+int thread_pool_submit(ThreadPool *pool, void (*fn)(void *arg), void *arg) {
+    if (fn == NULL) return -1;
+    return enqueue_task(pool, -1, fn, arg);
+}
+
+size_t thread_pool_queue_depth(ThreadPool *pool) {
+    size_t enqueued = atomic_load_explicit(&pool->enqueue_pos, memory_order_relaxed);
+    size_t dequeued = atomic_load_explicit(&pool->dequeue_pos, memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
 void thread_pool_destroy(ThreadPool *pool) {
     if (pool == NULL) return;
-    
-    pthread_mutex_lock(&pool->queue_mutex);
-    pool->shutdown = 1;
-    pthread_cond_broadcast(&pool->queue_cond);
-    pthread_mutex_unlock(&pool->queue_mutex);
-    
+
+    atomic_store(&pool->shutdown, 1);
+    unpark(pool, INT_MAX);
+
     for (int i = 0; i < pool->num_threads; i++) {
         pthread_join(pool->threads[i], NULL);
     }
-    
-    // Free remaining tasks.
-    while (pool->task_queue_head) {
-        task_t *task = pool->task_queue_head;
-        pool->task_queue_head = task->next;
-        free(task);
-    }
-    
-    pthread_mutex_destroy(&pool->queue_mutex);
-    pthread_cond_destroy(&pool->queue_cond);
+
+#ifndef __linux__
+    pthread_mutex_destroy(&pool->park_mutex);
+    pthread_cond_destroy(&pool->park_cond);
+#endif
     free(pool->threads);
+    free(pool->tasks);
     free(pool);
-    
+
     log_message(LOG_LEVEL_INFO, "Thread pool destroyed");
 }
 
 static void *thread_worker(void *arg) {
     ThreadPool *pool = (ThreadPool *)arg;
+    int idle = 0;
     while (1) {
-        pthread_mutex_lock(&pool->queue_mutex);
-        // Wait until there is a task or the pool is shutting down.
-        while (pool->task_queue_head == NULL && !pool->shutdown) {
-            pthread_cond_wait(&pool->queue_cond, &pool->queue_mutex);
-        }
-        if (pool->shutdown && pool->task_queue_head == NULL) {
-            pthread_mutex_unlock(&pool->queue_mutex);
-            break;
-        }
-        // Dequeue a task.
-        task_t *task = pool->task_queue_head;
-        if (task) {
-            pool->task_queue_head = task->next;
-            if (pool->task_queue_head == NULL) {
-                pool->task_queue_tail = NULL;
+        task_t task;
+        if (!dequeue_task(pool, &task)) {
+            // Exit only once the queue is drained.
+            if (atomic_load(&pool->shutdown)) break;
+            if (++idle < IDLE_SPINS) continue;
+            // Announce the intent to sleep, then re-check the queue so that a
+            // task enqueued in between is not missed.
+            unsigned int seen = atomic_load(&pool->wake_seq);
+            atomic_fetch_add(&pool->sleepers, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            int got = dequeue_task(pool, &task);
+            if (!got && !atomic_load(&pool->shutdown)) {
+                park(pool, seen);
             }
+            atomic_fetch_sub(&pool->sleepers, 1);
+            if (!got) continue;
         }
-        pthread_mutex_unlock(&pool->queue_mutex);
-        
-        if (task) {
+        idle = 0;
+
+        if (task.fn) {
+            // Run a generic job (e.g. a DNS lookup offloaded by an event loop).
+            task.fn(task.arg);
+        } else {
             // Process the task by handling the client connection.
-            handle_client_connection(task->client_sock);
-            free(task);
+            handle_client_connection(task.client_sock, task.enqueued_us);
         }
     }
     return NULL;
 }
+
+int pin_thread_to_cpu(int index) {
+#ifdef __linux__
+    // Count only the CPUs this process may run on, so pinning works inside
+    // cpusets and containers where they are not numbered from 0.
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return -1;
+    int available = CPU_COUNT(&allowed);
+    if (available == 0) return -1;
+    int target = index % available;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) return -1;
+        return cpu;
+    }
+    return -1;
+#else
+    (void)index;
+    return -1;
+#endif
+}
@@ -0,0 +1,90 @@
+// Cache lock contention benchmark: threads hammer lookup_cache() with a
+// share of insert_cache() calls, first on a single-shard cache and then on
+// the sharded one, and report throughput for each.
+//
+// Usage: bench_cache [threads] [operations per thread]
+#include "cache.h"
+#include "logging.h"
+#include "metrics.h"
+#include "proxy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define BENCH_URLS 4096
+#define BENCH_INSERT_EVERY 20  // One insert per this many operations.
+#define BENCH_BUDGET (64 << 20)
+
+static const char RESPONSE[] = "HTTP/1.1 200 OK\r\nCache-Control: max-age=3600\r\nContent-Length: 5\r\n\r\nhello";
+static long operations = 200000;
+
+static void url_for(int index, char *url, size_t size) {
+    snprintf(url, size, "http://bench.example/object/%d", index);
+}
+
+static void insert_url(const char *url) {
+    ChunkList response = { 0 };
+    chunk_list_append(&response, RESPONSE, sizeof(RESPONSE) - 1);
+    insert_cache(url, &response, 0.01);
+}
+
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    char url[64];
+    for (long i = 0; i < operations; i++) {
+        url_for(rand_r(&seed) % BENCH_URLS, url, sizeof(url));
+        if (i % BENCH_INSERT_EVERY == 0) {
+            insert_url(url);
+            continue;
+        }
+        CacheEntry *entry;
+        if (lookup_cache(url, &entry)) release_cache_entry(entry);
+    }
+    return NULL;
+}
+
+// Runs the workload on a cache whose largest object is max_object bytes,
+// which decides how many shards the budget is split into.
+static void run(const char *label, size_t max_object, int threads) {
+    set_cache_limits(BENCH_BUDGET, max_object);
+    init_cache();
+    char url[64];
+    for (int i = 0; i < BENCH_URLS; i++) {
+        url_for(i, url, sizeof(url));
+        insert_url(url);
+    }
+    CacheStats stats;
+    get_cache_stats(&stats);
+
+    pthread_t *ids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if (!ids) {
+        fprintf(stderr, "Failed to allocate threads\n");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t started = metrics_now_us();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, worker, (void *)(size_t)(i + 1));
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    double seconds = (metrics_now_us() - started) / 1e6;
+    free(ids);
+    free_cache();
+
+    printf("%-10s %2d shard(s) %3d threads: %10.0f ops/s\n", label, stats.shards, threads,
+           threads * operations / seconds);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2) operations = atol(argv[2]);
+    if (threads < 1 || operations < 1) {
+        fprintf(stderr, "Usage: %s [threads] [operations per thread]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    g_log_level = LOG_LEVEL_ERROR;
+    run("unsharded", BENCH_BUDGET, threads);
+    run("sharded", 1 << 20, threads);
+    return 0;
+}
@@ -0,0 +1,17 @@
+// Linked into every test and benchmark in place of main.c.
+#include "test.h"
+#include "proxy.h"
+#include <stdlib.h>
+
+volatile sig_atomic_t shutdown_requested = 0;  // Defined by main.c in the proxy.
+
+int failures = 0;
+
+int test_report(const char *name) {
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("%s tests passed\n", name);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/**
+ * Shared by the tests: a failed CHECK() reports its location and message and
+ * counts the failure, and the test carries on with its next check.
+ */
+extern int failures;
+
+#define CHECK(cond, ...)                                                   \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            failures++;                                                    \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);          \
+            fprintf(stderr, __VA_ARGS__);                                  \
+            fputc('\n', stderr);                                           \
+        }                                                                  \
+    } while (0)
+
+/**
+ * Prints the outcome of the test named 'name'.
+ *
+ * @return The process exit status: EXIT_FAILURE if any check failed.
+ */
+int test_report(const char *name);
+
+#endif // TEST_H
@@ -0,0 +1,90 @@
+// Per-client rate limit tests: token buckets are driven with a fixed clock
+// through burst exhaustion, refill, the burst cap and the Retry-After value.
+#include "overload.h"
+#include "logging.h"
+#include "proxy.h"
+#include "test.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SECOND 1000000ULL
+#define START (1000 * SECOND)  // Clock origin; buckets only see times after it.
+
+// Each test uses its own client address, so buckets do not carry over.
+static uint32_t client(int index) {
+    return (uint32_t)(0x0a000000u + index);
+}
+
+// Takes 'count' connections at 'now' and returns how many were allowed.
+static int take(uint32_t addr, uint64_t now, int count) {
+    int allowed = 0;
+    for (int i = 0; i < count; i++) {
+        if (client_rate_check_at(addr, now) == 0) allowed++;
+    }
+    return allowed;
+}
+
+static void test_disabled(void) {
+    set_client_rate_limit(0, 0);
+    CHECK(take(client(1), START, 1000) == 1000, "a disabled limit refused connections");
+    CHECK(client_rate_check(client(1)) == 0, "a disabled limit refused a connection");
+}
+
+static void test_burst(void) {
+    set_client_rate_limit(2, 5);
+    uint32_t addr = client(2);
+    CHECK(take(addr, START, 5) == 5, "a full bucket should allow the whole burst");
+    int retry = client_rate_check_at(addr, START);
+    CHECK(retry == 1, "empty bucket at 2/s: Retry-After %d, expected 1", retry);
+    CHECK(take(addr, START, 10) == 0, "an empty bucket allowed a connection");
+
+    // Other clients have their own buckets.
+    CHECK(take(client(3), START, 5) == 5, "one client's burst used up another's bucket");
+}
+
+static void test_refill(void) {
+    set_client_rate_limit(2, 5);
+    uint32_t addr = client(4);
+    CHECK(take(addr, START, 5) == 5, "burst not allowed");
+    // Half a second at 2/s refills one token, and only one.
+    CHECK(take(addr, START + SECOND / 2, 1) == 1, "no token after half a second");
+    CHECK(take(addr, START + SECOND / 2, 1) == 0, "more than one token after half a second");
+    // A quarter second later half a token is back: still refused.
+    CHECK(take(addr, START + 3 * SECOND / 4, 1) == 0, "a half token allowed a connection");
+    CHECK(take(addr, START + SECOND, 1) == 1, "no token once the half token was topped up");
+
+    // A long idle spell refills up to the burst size, no further.
+    CHECK(take(addr, START + 100 * SECOND, 20) == 5, "refill should stop at the burst size");
+}
+
+static void test_retry_after(void) {
+    // At 0.5/s an empty bucket needs exactly 2 s for a token.
+    set_client_rate_limit(0.5, 1);
+    uint32_t addr = client(5);
+    CHECK(take(addr, START, 1) == 1, "first connection refused");
+    int retry = client_rate_check_at(addr, START);
+    CHECK(retry == 2, "empty bucket at 0.5/s: Retry-After %d, expected 2", retry);
+    // 1.5 s later a quarter token is missing: half a second, rounded up.
+    retry = client_rate_check_at(addr, START + 3 * SECOND / 2);
+    CHECK(retry == 1, "a quarter token short at 0.5/s: Retry-After %d, expected 1", retry);
+    CHECK(take(addr, START + 2 * SECOND, 1) == 1, "no token after the advertised Retry-After");
+
+    // At 0.1/s a client that is told to wait 10 s gets in after 10 s.
+    set_client_rate_limit(0.1, 1);
+    addr = client(6);
+    CHECK(take(addr, START, 1) == 1, "first connection refused");
+    retry = client_rate_check_at(addr, START);
+    CHECK(retry == 10, "empty bucket at 0.1/s: Retry-After %d, expected 10", retry);
+    CHECK(take(addr, START + (uint64_t)retry * SECOND - 1, 1) == 0, "a token came back early");
+    CHECK(take(addr, START + (uint64_t)retry * SECOND, 1) == 1, "no token after the advertised Retry-After");
+}
+
+int main(void) {
+    g_log_level = LOG_LEVEL_ERROR;
+    test_disabled();
+    test_burst();
+    test_refill();
+    test_retry_after();
+    return test_report("overload");
+}
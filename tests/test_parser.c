@@ -0,0 +1,260 @@
+// Request header parser tests: the SSE2 line scanner and the plain loop must
+// agree on where lines end and which bytes are rejected, wherever a CR, LF or
+// invalid byte falls relative to a 16-byte block, and however the header is
+// split across feeds. Request framing headers are checked as well.
+#include "http_parser.h"
+#include "http_handler.h"
+#include "logging.h"
+#include "proxy.h"
+#include "test.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_HEADER 8192
+#define MAX_PAD 48  // Three 16-byte blocks of offsets.
+
+static const size_t STEPS[] = { 0, 1, 2, 3, 7, 15, 16, 17, 31 };  // 0 feeds everything at once.
+#define STEP_COUNT (sizeof(STEPS) / sizeof(STEPS[0]))
+
+// Feeds 'data' to a fresh parser 'step' more bytes at a time, as reads would
+// deliver it, until the header is complete or rejected.
+static int feed(HttpRequestParser *parser, const char *data, size_t length, size_t step, int vector) {
+    http_parser_set_vector_scan(vector);
+    http_parser_init(parser);
+    size_t available = step ? 0 : length;
+    for (;;) {
+        if (step) available = available + step < length ? available + step : length;
+        int rc = http_parser_feed(parser, data, available, MAX_HEADER);
+        if (rc != 0 || available == length) return rc;
+    }
+}
+
+static int same_slice(const HttpSlice *a, const HttpSlice *b) {
+    return a->data == b->data && a->length == b->length;
+}
+
+static int same_result(const HttpRequestParser *a, const HttpRequestParser *b) {
+    if (a->header_count != b->header_count || !same_slice(&a->method, &b->method) ||
+        !same_slice(&a->target, &b->target) || !same_slice(&a->version, &b->version)) {
+        return 0;
+    }
+    for (int i = 0; i < a->header_count; i++) {
+        if (!same_slice(&a->headers[i].name, &b->headers[i].name) ||
+            !same_slice(&a->headers[i].value, &b->headers[i].value)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parses a header with both scanners at every feed step and checks they agree
+// with each other and with the expected return value. The bytes are copied to
+// a buffer of exactly their length, so a read past the end shows up under ASan.
+static void check_both(const char *label, const char *text, size_t length, int expected) {
+    char *data = (char *)malloc(length);
+    if (!data) {
+        fprintf(stderr, "Failed to allocate test buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(data, text, length);
+    static HttpRequestParser scalar, vector;
+    for (size_t s = 0; s < STEP_COUNT; s++) {
+        int scalar_rc = feed(&scalar, data, length, STEPS[s], 0);
+        int vector_rc = feed(&vector, data, length, STEPS[s], 1);
+        CHECK(scalar_rc == expected, "%s, step %zu: scalar returned %d, expected %d", label, STEPS[s],
+              scalar_rc, expected);
+        CHECK(vector_rc == scalar_rc, "%s, step %zu: SSE2 returned %d, scalar %d", label, STEPS[s],
+              vector_rc, scalar_rc);
+        if (expected > 0 && vector_rc == scalar_rc) {
+            CHECK(same_result(&vector, &scalar), "%s, step %zu: SSE2 and scalar split the header differently",
+                  label, STEPS[s]);
+        }
+    }
+    free(data);
+}
+
+// A request whose line ends land on every offset within a 16-byte block as
+// 'pad' grows, each ending with 'eol'.
+static size_t build_request(char *out, size_t size, int pad, const char *eol) {
+    char filler[MAX_PAD + 1];
+    memset(filler, 'a', pad);
+    filler[pad] = '\0';
+    int n = snprintf(out, size,
+                     "GET http://example.com/%s HTTP/1.1%s"
+                     "Host: example.com%s"
+                     "X-Pad: %s%s"
+                     "Accept:\t*/*%s"
+                     "%s",
+                     filler, eol, eol, filler, eol, eol, eol);
+    return (size_t)n;
+}
+
+static void test_line_ends(void) {
+    char request[1024];
+    char label[64];
+    for (int pad = 0; pad < MAX_PAD; pad++) {
+        size_t length = build_request(request, sizeof(request), pad, "\r\n");
+        snprintf(label, sizeof(label), "CRLF, pad %d", pad);
+        check_both(label, request, length, (int)length);
+
+        length = build_request(request, sizeof(request), pad, "\n");
+        snprintf(label, sizeof(label), "bare LF, pad %d", pad);
+        check_both(label, request, length, (int)length);
+    }
+
+    // The parsed fields point at the right bytes.
+    size_t length = build_request(request, sizeof(request), 13, "\r\n");
+    HttpRequestParser parser;
+    http_parser_set_vector_scan(1);
+    http_parser_init(&parser);
+    CHECK(http_parser_feed(&parser, request, length, MAX_HEADER) == (int)length, "complete header not found");
+    CHECK(parser.header_count == 3, "expected 3 headers, got %d", parser.header_count);
+    const HttpSlice *accept = http_parser_header(&parser, "accept");
+    CHECK(accept && accept->length == 3 && memcmp(accept->data, "*/*", 3) == 0, "Accept value not trimmed");
+}
+
+// A CR whose LF has not arrived yet must wait for it, not be taken for a bare CR.
+static void test_split_crlf(void) {
+    char request[1024];
+    for (int pad = 0; pad < MAX_PAD; pad++) {
+        size_t length = build_request(request, sizeof(request), pad, "\r\n");
+        for (int vector = 0; vector <= 1; vector++) {
+            http_parser_set_vector_scan(vector);
+            HttpRequestParser parser;
+            http_parser_init(&parser);
+            int rc = 0;
+            for (size_t i = 0; i < length && rc == 0; i++) {
+                if (request[i] != '\r') continue;
+                rc = http_parser_feed(&parser, request, i + 1, MAX_HEADER);
+                CHECK(rc == 0, "pad %d, %s: feed ending on a CR at %zu returned %d", pad,
+                      vector ? "SSE2" : "scalar", i, rc);
+            }
+            rc = http_parser_feed(&parser, request, length, MAX_HEADER);
+            CHECK(rc == (int)length, "pad %d, %s: returned %d after the CRs, expected %zu", pad,
+                  vector ? "SSE2" : "scalar", rc, length);
+        }
+    }
+}
+
+// Bytes a header may not contain are rejected at any offset.
+static void test_invalid_bytes(void) {
+    static const char bad[] = { '\r', 0x01, 0x1f, 0x7f, 0x00 };
+    char request[1024];
+    char label[64];
+    size_t length = build_request(request, sizeof(request), MAX_PAD - 1, "\r\n");
+    // Positions inside the X-Pad value, which spans several blocks.
+    const char *value = strstr(request, "X-Pad: ") + 7;
+    size_t first = value - request;
+    for (size_t b = 0; b < sizeof(bad); b++) {
+        for (size_t at = first; at < first + MAX_PAD - 1; at++) {
+            char saved = request[at];
+            request[at] = bad[b];
+            snprintf(label, sizeof(label), "byte 0x%02x at %zu", (unsigned char)bad[b], at);
+            check_both(label, request, length, -1);
+            request[at] = saved;
+        }
+    }
+    // A tab is allowed anywhere in a value.
+    for (size_t at = first + 1; at < first + MAX_PAD - 2; at++) {
+        char saved = request[at];
+        request[at] = '\t';
+        snprintf(label, sizeof(label), "tab at %zu", at);
+        check_both(label, request, length, (int)length);
+        request[at] = saved;
+    }
+}
+
+// Parses a complete request header through parse_http_request_head().
+static int parse_head(const char *text, HttpRequest *request, RequestBuffer *buffer) {
+    request_buffer_init(buffer);
+    buffer->length = strlen(text);
+    memcpy(buffer->data, text, buffer->length);
+    return parse_http_request_head(buffer, request);
+}
+
+// An empty Content-Length or two that disagree would let the proxy and the
+// origin frame the body differently, so both are rejected with 400.
+static void test_content_length(void) {
+    static RequestBuffer buffer;
+    HttpRequest request;
+    const char *prefix = "POST http://example.com/ HTTP/1.1\r\nHost: example.com\r\n";
+    static const struct {
+        const char *headers;
+        int accepted;
+        long long length;
+    } cases[] = {
+        { "Content-Length: 5\r\n", 1, 5 },
+        { "Content-Length: 0\r\n", 1, 0 },
+        { "Content-Length: 5\r\nContent-Length: 5\r\n", 1, 5 },
+        { "Content-Length:\r\n", 0, 0 },
+        { "Content-Length:   \r\n", 0, 0 },
+        { "Content-Length: 5\r\nContent-Length: 6\r\n", 0, 0 },
+        { "Content-Length: 5\r\nContent-Length:\r\n", 0, 0 },
+        { "Content-Length: 5x\r\n", 0, 0 },
+        { "Content-Length: -1\r\n", 0, 0 },
+    };
+    char text[512];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        snprintf(text, sizeof(text), "%s%s\r\n", prefix, cases[i].headers);
+        int rc = parse_head(text, &request, &buffer);
+        if (cases[i].accepted) {
+            CHECK(rc == (int)strlen(text), "case %zu: returned %d, expected the header length", i, rc);
+            CHECK(request.body_length == cases[i].length, "case %zu: body length %lld, expected %lld", i,
+                  request.body_length, cases[i].length);
+            CHECK(buffer.error_status == 0, "case %zu: accepted with error status %d", i, buffer.error_status);
+        } else {
+            CHECK(rc == -1, "case %zu: returned %d, expected -1", i, rc);
+            CHECK(buffer.error_status == 400, "case %zu: error status %d, expected 400", i, buffer.error_status);
+        }
+    }
+}
+
+// A body is taken from the buffer up to its end, in pieces of any size; a
+// pipelined request after it stays buffered.
+static void test_request_body(void) {
+    static RequestBuffer buffer;
+    HttpRequest request;
+    static const char *bodies[] = {
+        "Content-Length: 11\r\n\r\nhello world",
+        "Transfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n6;x=y\r\n world\r\n0\r\nTrailer: t\r\n\r\n",
+    };
+    const char *next = "GET http://example.com/next HTTP/1.1\r\n\r\n";
+    char text[512];
+    for (size_t i = 0; i < sizeof(bodies) / sizeof(bodies[0]); i++) {
+        for (size_t step = 1; step <= 64; step *= 4) {
+            snprintf(text, sizeof(text), "POST http://example.com/ HTTP/1.1\r\n%s%s", bodies[i], next);
+            int head_length = parse_head(text, &request, &buffer);
+            CHECK(head_length > 0 && request_has_body(&request), "body %zu: header not accepted", i);
+            if (head_length <= 0) continue;
+            consume_request(&buffer, head_length, &request);
+            size_t body_bytes = 0;
+            ssize_t n;
+            while (buffer.body.active && (n = request_body_span(&buffer, step)) > 0) {
+                request_buffer_drop(&buffer, n);
+                body_bytes += n;
+            }
+            size_t expected = strlen(text) - head_length - strlen(next);
+            CHECK(!buffer.body.active && body_bytes == expected, "body %zu, step %zu: took %zu bytes, expected %zu",
+                  i, step, body_bytes, expected);
+            CHECK(buffer.length == strlen(next) && memcmp(buffer.data, next, buffer.length) == 0,
+                  "body %zu, step %zu: the pipelined request was not left buffered", i, step);
+        }
+    }
+
+    // Only a body that is just chunked can be forwarded as it is.
+    CHECK(parse_head("POST http://example.com/ HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n", &request,
+                     &buffer) == -1 && buffer.error_status == 501, "an unsupported transfer coding was accepted");
+    CHECK(parse_head("GET http://example.com/ HTTP/1.1\r\n\r\n", &request, &buffer) > 0 &&
+          !request_has_body(&request), "a request without framing headers has a body");
+}
+
+int main(void) {
+    g_log_level = (LogLevel)(LOG_LEVEL_ERROR + 1);  // Rejections are expected; silence them.
+    test_line_ends();
+    test_split_crlf();
+    test_invalid_bytes();
+    test_content_length();
+    test_request_body();
+    return test_report("parser");
+}
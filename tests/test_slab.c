@@ -0,0 +1,144 @@
+// Slab allocator tests: size class selection at the class boundaries, reuse
+// of freed objects, returning empty slabs, and the get_slab_stats() counters.
+#include "slab.h"
+#include "logging.h"
+#include "proxy.h"
+#include "test.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RELEASE_SIZE 4096  // Class used to fill several slabs.
+#define RELEASE_SLABS 3
+
+// Returns the stats of the class serving 'size' bytes.
+static SlabStats stats_for(size_t size) {
+    SlabStats stats[SLAB_CLASS_COUNT];
+    int count = get_slab_stats(stats, SLAB_CLASS_COUNT);
+    size_t object_size = slab_object_size(size);
+    for (int i = 0; i < count; i++) {
+        if (stats[i].object_size == object_size) return stats[i];
+    }
+    fprintf(stderr, "No size class for %zu bytes\n", size);
+    exit(EXIT_FAILURE);
+}
+
+static void test_class_selection(void) {
+    SlabStats stats[SLAB_CLASS_COUNT];
+    int count = get_slab_stats(stats, SLAB_CLASS_COUNT);
+    CHECK(count == SLAB_CLASS_COUNT, "expected %d classes, got %d", SLAB_CLASS_COUNT, count);
+    CHECK(slab_object_size(0) == stats[0].object_size, "0 bytes not in the smallest class");
+    CHECK(slab_object_size(1) == stats[0].object_size, "1 byte not in the smallest class");
+    for (int i = 0; i < count; i++) {
+        size_t size = stats[i].object_size;
+        CHECK(slab_object_size(size) == size, "%zu bytes should fit their own class", size);
+        if (i + 1 < count) {
+            CHECK(slab_object_size(size + 1) == stats[i + 1].object_size,
+                  "%zu bytes should move up to the %zu byte class", size + 1, stats[i + 1].object_size);
+            CHECK(size < stats[i + 1].object_size, "classes not in increasing order at %d", i);
+        }
+    }
+    CHECK(stats[count - 1].object_size == SLAB_MAX_OBJECT, "largest class is %zu bytes",
+          stats[count - 1].object_size);
+    CHECK(slab_alloc(SLAB_MAX_OBJECT + 1) == NULL, "an object above SLAB_MAX_OBJECT was allocated");
+    CHECK(slab_object_size(SLAB_MAX_OBJECT + 1) == SLAB_MAX_OBJECT + 1,
+          "oversized objects should report their own size");
+
+    // The largest object fits inside its slab, and objects are disjoint.
+    char *a = (char *)slab_alloc(SLAB_MAX_OBJECT);
+    char *b = (char *)slab_alloc(SLAB_MAX_OBJECT);
+    CHECK(a && b, "failed to allocate the largest objects");
+    if (a && b) {
+        CHECK(a + SLAB_MAX_OBJECT <= b || b + SLAB_MAX_OBJECT <= a, "objects overlap");
+        uintptr_t slab = (uintptr_t)a & ~(uintptr_t)(SLAB_SIZE - 1);
+        CHECK((uintptr_t)a + SLAB_MAX_OBJECT <= slab + SLAB_SIZE, "object runs past the end of its slab");
+        memset(a, 0xaa, SLAB_MAX_OBJECT);
+        memset(b, 0x55, SLAB_MAX_OBJECT);
+        CHECK((unsigned char)a[SLAB_MAX_OBJECT - 1] == 0xaa, "writing one object changed another");
+    }
+    slab_free(a);
+    slab_free(b);
+    slab_free(NULL);
+}
+
+static void test_reuse(void) {
+    void *first = slab_alloc(100);
+    void *second = slab_alloc(100);
+    CHECK(first && second && first != second, "two live objects must differ");
+    slab_free(first);
+    void *again = slab_alloc(97);  // Same class as 100 bytes.
+    CHECK(again == first, "a freed object should be handed out again before new memory");
+    slab_free(again);
+    slab_free(second);
+
+    // Objects of another class never come from this class's free list.
+    void *small = slab_alloc(64);
+    slab_free(small);
+    void *large = slab_alloc(65);
+    CHECK(large != small, "a 96 byte object reused a 64 byte slot");
+    slab_free(large);
+}
+
+static void test_release_and_stats(void) {
+    SlabStats before = stats_for(RELEASE_SIZE);
+    CHECK(before.in_use == 0, "class in use before the test");
+    // The first object opens a slab, which tells how many objects one holds.
+    void *probe = slab_alloc(RELEASE_SIZE);
+    SlabStats first = stats_for(RELEASE_SIZE);
+    CHECK(first.slabs == 1 && first.in_use == 1, "first object: %zu slabs, %zu in use", first.slabs, first.in_use);
+    size_t per_slab = first.objects;
+    CHECK(per_slab >= SLAB_SIZE / slab_object_size(RELEASE_SIZE) - 1 && per_slab < SLAB_SIZE / RELEASE_SIZE,
+          "%zu objects of %d bytes per slab", per_slab, RELEASE_SIZE);
+    size_t count = per_slab * RELEASE_SLABS;
+    void **objects = (void **)malloc(count * sizeof(void *));
+    if (!objects) {
+        fprintf(stderr, "Failed to allocate test array\n");
+        exit(EXIT_FAILURE);
+    }
+    objects[0] = probe;
+    for (size_t i = 1; i < count; i++) {
+        objects[i] = slab_alloc(RELEASE_SIZE);
+        CHECK(objects[i] != NULL, "allocation %zu failed", i);
+    }
+    SlabStats full = stats_for(RELEASE_SIZE);
+    CHECK(full.slabs == RELEASE_SLABS, "%zu objects took %zu slabs, expected %d", count, full.slabs, RELEASE_SLABS);
+    CHECK(full.in_use == count, "in_use is %zu, expected %zu", full.in_use, count);
+    CHECK(full.objects == full.slabs * per_slab, "objects is %zu for %zu slabs of %zu", full.objects, full.slabs,
+          per_slab);
+
+    // One more object opens a new slab.
+    void *extra = slab_alloc(RELEASE_SIZE);
+    CHECK(stats_for(RELEASE_SIZE).slabs == RELEASE_SLABS + 1, "a full class did not grow by one slab");
+    slab_free(extra);
+    CHECK(stats_for(RELEASE_SIZE).slabs == RELEASE_SLABS + 1, "the emptied slab should be kept as the spare");
+
+    // Emptying every slab gives them back, apart from the one spare.
+    for (size_t i = 0; i < count; i++) {
+        slab_free(objects[i]);
+    }
+    SlabStats empty = stats_for(RELEASE_SIZE);
+    CHECK(empty.in_use == 0, "in_use is %zu after freeing everything", empty.in_use);
+    CHECK(empty.slabs == 1, "%zu slabs held after freeing everything, expected the spare only", empty.slabs);
+    CHECK(empty.objects == per_slab, "objects is %zu with one slab of %zu", empty.objects, per_slab);
+
+    // The spare is used before a new slab is allocated.
+    void *one = slab_alloc(RELEASE_SIZE);
+    SlabStats reused = stats_for(RELEASE_SIZE);
+    CHECK(reused.slabs == 1 && reused.in_use == 1, "spare not reused: %zu slabs, %zu in use", reused.slabs,
+          reused.in_use);
+    slab_free(one);
+    free(objects);
+
+    // A short stats buffer is filled without overrunning it.
+    SlabStats two[2];
+    CHECK(get_slab_stats(two, 2) == 2, "get_slab_stats ignored its limit");
+}
+
+int main(void) {
+    g_log_level = LOG_LEVEL_ERROR;
+    test_class_selection();
+    test_reuse();
+    test_release_and_stats();
+    return test_report("slab");
+}